@@ -8,6 +8,7 @@
 #include <kst/RegExp.hpp>
 #include <stdexcept>
 #include <stdlib.h>
+#include <math.h>
 #include <map>
 #include <memory>
 
@@ -218,6 +219,14 @@ bool CodeGenerator::isConstant(Expr* expr)
     return false;
 }
 
+//result of code that inference can't see into (native functions, methods of builtin types)
+static TypeInfo anyType()
+{
+    TypeInfo rv;
+    rv.ts = tsAny;
+    return rv;
+}
+
 void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
 {
     switch(e->et)
@@ -240,6 +249,7 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                 SymInfo* sym = si->getSymbol(e->e1->getSymbol());
                 if(sym)
                 {
+                    size_t w = sym->tinfo.weight();
                     for(auto& it : sym->tinfo)
                     {
                         if(it.vt == vtArray || it.vt == vtSet)
@@ -250,8 +260,12 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                             break;
                         }
                     }
+                    if(sym->tinfo.weight() != w)
+                    {
+                        typeChanged(sym->tinfo);
+                    }
                     found = true;
-                    info.merge(sym->tinfo);
+                    info.merge(readType(sym->tinfo));
                 }
             } else if(e->e1->et == etProp || e->e1->et == etPropOpt)
             {
@@ -264,6 +278,7 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                         SymInfo* sym = it.symRef.asClass()->getSymbols()->findSymbol(e->e1->e2->val);
                         if(sym)
                         {
+                            size_t w = sym->tinfo.weight();
                             for(auto& sit : sym->tinfo)
                             {
                                 if(sit.vt == vtArray || sit.vt == vtSet)
@@ -274,8 +289,12 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                                     break;
                                 }
                             }
+                            if(sym->tinfo.weight() != w)
+                            {
+                                typeChanged(sym->tinfo);
+                            }
                             found = true;
-                            info.merge(sym->tinfo);
+                            info.merge(readType(sym->tinfo));
                         }
                     }
                 }
@@ -317,7 +336,7 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                 SymInfo* sym = si->getSymbol(e->e1->getSymbol());
                 if(sym)
                 {
-                    sym->tinfo.merge(info);
+                    mergeType(sym->tinfo, info);
                 }
             } else if(e->e1->et == etProp || e->e1->et == etPropOpt)
             {
@@ -343,15 +362,15 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                             {
                                 if(!cp->setMethod->locals.empty())
                                 {
-                                    cp->setMethod->locals[0]->tinfo.merge(info);
+                                    mergeType(cp->setMethod->locals[0]->tinfo, info);
                                 }
                             } else if(cp->setIdx != SymInfo::invalidIndexValue)
                             {
-                                it.symRef.asClass()->members[cp->setIdx]->tinfo.merge(info);
+                                mergeType(it.symRef.asClass()->members[cp->setIdx]->tinfo, info);
                             }
                         } else
                         {
-                            sym->tinfo.merge(info);
+                            mergeType(sym->tinfo, info);
                         }
                     }
                 }
@@ -400,7 +419,7 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                     SymInfo* sym2 = si->getSymbol(e->e2->getSymbol());
                     if(sym2 && sym2->st == sytClass)
                     {
-                        sym1->tinfo.merge(TypeInfo((ClassInfo*) sym2));
+                        mergeType(sym1->tinfo, TypeInfo((ClassInfo*) sym2));
                     }
                 }
             }
@@ -460,7 +479,7 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
             SymInfo* sym = si->getSymbol(e->getSymbol());
             if(sym)
             {
-                info.merge(sym->tinfo);
+                info.merge(readType(sym->tinfo));
             }
         }
             break;
@@ -474,7 +493,7 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
             SymInfo* sym = index < si->currentScope->locals.size() ? si->currentScope->locals[index] : nullptr;
             if(sym)
             {
-                info.merge(sym->tinfo);
+                info.merge(readType(sym->tinfo));
             }
         }
             break;
@@ -482,10 +501,12 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
         {
             TypeInfo tmp;
             getExprType(e->e1, tmp);
+            bool typed = false;
             for(auto& it : tmp)
             {
-                if(it.vt == vtFunc)
+                if(it.vt == vtFunc && it.symRef)
                 {
+                    typed = true;
                     if(e->lst)
                     {
                         size_t idx = 0;
@@ -495,27 +516,33 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                             {
                                 break;
                             }
-                            getExprType(ait.get(), it.symRef.asFunc()->locals[idx]->tinfo);
+                            TypeInfo atmp;
+                            getExprType(ait.get(), atmp);
+                            mergeType(it.symRef.asFunc()->locals[idx]->tinfo, atmp);
                             ++idx;
                         }
                     }
                     if(it.symRef.asFunc()->rvtype.ts == tsUnknown && it.symRef.asFunc()->def &&
                        !it.symRef.asFunc()->inTypeFill)
                     {
-                        auto& fds = it.symRef.asFunc()->def->as<FuncDeclStatement>();
-                        ScopeSym* saveScope = si->currentScope;
-                        si->currentScope = it.symRef.asFunc();
-                        it.symRef.asFunc()->inTypeFill = true;
-                        fillTypes(fds.body);
-                        it.symRef.asFunc()->inTypeFill = false;
-                        si->currentScope = saveScope;
-                        //fillTypes(it->funcInfo->def);
+                        if(typeTracking)
+                        {
+                            //analyzed later, rvtype change will requeue this unit
+                            if(!typeVisits.count(it.symRef.asFunc()))
+                            {
+                                queueTypeUnit(it.symRef.asFunc());
+                            }
+                        } else
+                        {
+                            fillFuncTypes(it.symRef.asFunc());
+                        }
                     }
-                    info.merge(it.symRef.asFunc()->rvtype);
+                    info.merge(readType(it.symRef.asFunc()->rvtype));
                 } else if(it.vt == vtClass)
                 {
                     if(it.symRef.asClass())
                     {
+                        typed = true;
                         info.merge(it.symRef.asClass());
                     }
                 } else if(it.vt == vtObject)
@@ -525,7 +552,32 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                         size_t midx = it.symRef.asClass()->specialMethods[csmCall];
                         if(midx)
                         {
-                            info.merge(si->globals[midx].func->rvtype);
+                            typed = true;
+                            info.merge(readType(si->globals[midx].func->rvtype));
+                        }
+                    }
+                }
+            }
+            if(!typed)
+            {
+                info.merge(anyType());
+                //method of builtin container can store anything in it
+                if((e->e1->et == etProp || e->e1->et == etPropOpt) && e->e1->e1->et == etVar)
+                {
+                    SymInfo* sym = si->getSymbol(e->e1->e1->getSymbol());
+                    if(sym && sym->tinfo.ts != tsAny)
+                    {
+                        size_t w = sym->tinfo.weight();
+                        for(auto& it : sym->tinfo)
+                        {
+                            if(it.isContainer())
+                            {
+                                it.addToArr(anyType());
+                            }
+                        }
+                        if(sym->tinfo.weight() != w)
+                        {
+                            typeChanged(sym->tinfo);
                         }
                     }
                 }
@@ -537,9 +589,17 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
         {
             TypeInfo tmp;
             getExprType(e->e1, tmp);
+            if(tmp.ts == tsAny)
+            {
+                info.merge(anyType());
+                break;
+            }
             for(auto& it : tmp)
             {
-                if(it.vt == vtObject && it.symRef)
+                if(it.vt != vtObject)
+                {
+                    info.merge(anyType());
+                } else if(it.symRef)
                 {
                     if(e->e2->et == etString)
                     {
@@ -552,14 +612,14 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                                 auto* cp = (ClassPropertyInfo*) sym;
                                 if(cp->getMethod)
                                 {
-                                    info.merge(cp->getMethod->rvtype);
+                                    info.merge(readType(cp->getMethod->rvtype));
                                 } else if(cp->getIdx != SymInfo::invalidIndexValue)
                                 {
-                                    info.merge(it.symRef.asClass()->members[cp->getIdx]->tinfo);
+                                    info.merge(readType(it.symRef.asClass()->members[cp->getIdx]->tinfo));
                                 }
                             } else
                             {
-                                info.merge(sym->tinfo);
+                                info.merge(readType(sym->tinfo));
                             }
                         } else
                         {
@@ -567,7 +627,7 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                             if(midx)
                             {
                                 MethodInfo* mi = si->globals[midx].method;
-                                info.merge(mi->rvtype);
+                                info.merge(readType(mi->rvtype));
                             }
                         }
                     } else if(e->e2->et == etVar)
@@ -575,7 +635,7 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                         ClassInfo* ci = it.symRef.asClass();
                         for(auto& m:ci->members)
                         {
-                            info.merge(m->tinfo);
+                            info.merge(readType(m->tinfo));
                         }
                     }
                 }
@@ -590,18 +650,26 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
             {
                 break;
             }
+            if(tmp.ts == tsAny)
+            {
+                info.merge(anyType());
+                break;
+            }
             for(auto& ti:tmp)
             {
                 if(ti.vt == vtMap)
                 {
-                    info.merge(tmp.arr);
+                    info.merge(ti.arr);
                 } else if(ti.vt == vtObject && ti.symRef)
                 {
                     size_t midx = ti.symRef.asClass()->specialMethods[csmGetKey];
                     if(midx)
                     {
-                        info.merge(si->globals[midx].func->rvtype);
+                        info.merge(readType(si->globals[midx].func->rvtype));
                     }
+                } else
+                {
+                    info.merge(anyType());
                 }
             }
         }
@@ -614,18 +682,26 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
             {
                 break;
             }
+            if(tmp.ts == tsAny)
+            {
+                info.merge(anyType());
+                break;
+            }
             for(auto ti:tmp)
             {
                 if(ti.vt == vtArray)
                 {
-                    info.merge(tmp.arr);
+                    info.merge(ti.arr);
                 } else if(ti.vt == vtObject && ti.symRef)
                 {
                     size_t midx = ti.symRef.asClass()->specialMethods[csmGetIndex];
                     if(midx)
                     {
-                        info.merge(si->globals[midx].func->rvtype);
+                        info.merge(readType(si->globals[midx].func->rvtype));
                     }
+                } else
+                {
+                    info.merge(anyType());
                 }
             }
         }
@@ -660,10 +736,10 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
                 info = tmp1;
             } else
             {
-                if(tmp1.ts == tsUnknown)
+                if(tmp1.ts == tsUnknown || tmp2.ts == tsAny)
                 {
                     info = tmp2;
-                } else if(tmp2.ts == tsUnknown)
+                } else if(tmp2.ts == tsUnknown || tmp1.ts == tsAny)
                 {
                     info = tmp1;
                 } else
@@ -675,8 +751,6 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
             }
             break;
         }
-        case etGetAttr:
-            break;
         case etGetType:
         {
             info.merge(vtClass);
@@ -691,10 +765,12 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
             }
             break;
         }
+        case etGetAttr:
         case etLiteral:
         case etSeqOps:
         case etMapOp:
         case etGrepOp:
+            info.merge(anyType());
             break;
             //case etSumOp:break;
         case etRegExp:
@@ -703,7 +779,201 @@ void CodeGenerator::getExprType(Expr* e, TypeInfo& info)
     }
 }
 
-void CodeGenerator::fillTypes(StmtList* sl)
+const TypeInfo& CodeGenerator::readType(const TypeInfo& ti)
+{
+    if(typeTracking)
+    {
+        typeReaders[&ti].insert(typeUnit);
+    }
+    return ti;
+}
+
+void CodeGenerator::mergeType(TypeInfo& dst, const TypeInfo& src)
+{
+    if(typeTracking)
+    {
+        typeWrites[typeUnit].insert(&dst);
+    }
+    size_t w = dst.weight();
+    dst.merge(src);
+    if(dst.weight() != w)
+    {
+        typeChanged(dst);
+    }
+}
+
+void CodeGenerator::typeChanged(TypeInfo& ti)
+{
+    if(!typeTracking)
+    {
+        return;
+    }
+    typeWrites[typeUnit].insert(&ti);
+    auto it = typeReaders.find(&ti);
+    if(it == typeReaders.end())
+    {
+        return;
+    }
+    for(FuncInfo* unit : it->second)
+    {
+        queueTypeUnit(unit);
+    }
+}
+
+void CodeGenerator::queueTypeUnit(FuncInfo* unit)
+{
+    if(typeQueued.insert(unit).second)
+    {
+        typeWorklist.push_back(unit);
+    }
+}
+
+void CodeGenerator::fillFuncTypes(FuncInfo* fi)
+{
+    if(!fi->def || fi->inTypeFill)
+    {
+        return;
+    }
+    auto& fds = fi->def->as<FuncDeclStatement>();
+    ScopeSym* saveScope = si->currentScope;
+    FuncInfo* saveUnit = typeUnit;
+    si->currentScope = fi;
+    typeUnit = fi;
+    if(typeTracking)
+    {
+        ++typeVisits[fi];
+    }
+    fi->inTypeFill = true;
+    fillTypes(fds.body);
+    fi->inTypeFill = false;
+    typeUnit = saveUnit;
+    si->currentScope = saveScope;
+}
+
+void CodeGenerator::inferTypes(StmtList* sl)
+{
+    ScopeSym* topScope = si->currentScope;
+    typeTracking = true;
+    typeFillNested = true;
+    typeUnit = nullptr;
+    ++typeVisits[nullptr];
+    fillTypes(sl);
+    typeFillNested = false;
+    while(!typeWorklist.empty())
+    {
+        FuncInfo* unit = typeWorklist.front();
+        typeWorklist.pop_front();
+        typeQueued.erase(unit);
+        if(typeVisits[unit] >= maxTypeVisits)
+        {
+            widenTypeUnit(unit);
+            continue;
+        }
+        if(unit)
+        {
+            fillFuncTypes(unit);
+        } else
+        {
+            ++typeVisits[nullptr];
+            si->currentScope = topScope;
+            fillTypes(sl);
+        }
+    }
+    for(auto& it : typeVisits)
+    {
+        typePasses += it.second;
+    }
+    si->currentScope = topScope;
+    typeFillNested = true;
+    typeTracking = false;
+    typeReaders.clear();
+    typeVisits.clear();
+    typeWrites.clear();
+}
+
+void CodeGenerator::widenTypeUnit(FuncInfo* unit)
+{
+    std::set<TypeInfo*> slots = typeWrites[unit];
+    if(unit)
+    {
+        for(auto sym : unit->locals)
+        {
+            slots.insert(&sym->tinfo);
+        }
+        slots.insert(&unit->rvtype);
+    }
+    for(auto ti : slots)
+    {
+        if(ti->ts != tsAny)
+        {
+            *ti = TypeInfo();
+            ti->ts = tsAny;
+            typeChanged(*ti);
+        }
+    }
+}
+
+static bool isNumOpType(int ot)
+{
+    switch(ot)
+    {
+        case otAdd:
+        case otSub:
+        case otMul:
+        case otDiv:
+        case otMod:
+        case otJumpIfLess:
+        case otJumpIfGreater:
+        case otJumpIfLessEq:
+        case otJumpIfGreaterEq:
+        case otJumpIfEqual:
+        case otJumpIfNotEqual:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isNumType(const TypeInfo& info)
+{
+    return info.ts == tsDefined && (info.vt == vtInt || info.vt == vtDouble);
+}
+
+void CodeGenerator::addNumOpSite(OpBase* op, Expr* expr)
+{
+    if(isNumOpType(op->ot))
+    {
+        numOpSites.push_back(NumOpSite{op, expr->e1, expr->e2, si->currentScope});
+    }
+}
+
+size_t CodeGenerator::specializeNumOps()
+{
+    ScopeSym* saveScope = si->currentScope;
+    size_t rv = 0;
+    for(auto& site : numOpSites)
+    {
+        si->currentScope = site.scope;
+        TypeInfo lt, rt;
+        getExprType(site.left, lt);
+        getExprType(site.right, rt);
+        if(!isNumType(lt) || !isNumType(rt))
+        {
+            continue;
+        }
+        if(specializeNumOp(site.op, lt.vt == vtDouble || rt.vt == vtDouble))
+        {
+            ++rv;
+        }
+    }
+    si->currentScope = saveScope;
+    numOpsTotal += numOpSites.size();
+    numOpsSpecialized += rv;
+    numOpSites.clear();
+    return rv;
+}
+
+void CodeGenerator::collectRefTargets(StmtList* sl)
 {
     if(!sl)
     {
@@ -711,425 +981,682 @@ void CodeGenerator::fillTypes(StmtList* sl)
     }
     for(auto& it : sl->values)
     {
-        fillTypes(it.get());
+        std::vector<Expr*> subExpr;
+        std::vector<StmtList*> subStmt;
+        it->getChildData(subExpr, subStmt);
+        for(auto ex : subExpr)
+        {
+            collectRefTargets(ex);
+        }
+        for(auto sub : subStmt)
+        {
+            collectRefTargets(sub);
+        }
     }
 }
 
-void CodeGenerator::fillTypes(Statement* stptr)
+void CodeGenerator::collectRefTargets(Expr* ex)
 {
-    if(!stptr)
+    if(!ex)
     {
         return;
     }
-    Statement& st = *stptr;
-    switch(st.st)
+    if((ex->et == etRef || ex->et == etWeakRef) && ex->e1 && ex->e1->et == etVar)
     {
-        case stNone:
-            break;
-        case stExpr:
+        refTargets.insert(ex->e1->val.c_str());
+    }
+    collectRefTargets(ex->e1);
+    collectRefTargets(ex->e2);
+    collectRefTargets(ex->e3);
+    if(ex->lst)
+    {
+        for(auto& it : ex->lst->values)
         {
-            auto& est = st.as<ExprStatement>();
-            TypeInfo tmp;
-            getExprType(est.expr.get(), tmp);
-            /*if(est.expr->et==etAssign)
+            collectRefTargets(it.get());
+        }
+    }
+    if(ex->func)
+    {
+        std::vector<Expr*> subExpr;
+        std::vector<StmtList*> subStmt;
+        ex->func->getChildData(subExpr, subStmt);
+        for(auto sub : subExpr)
         {
-          Expr* e=est.expr;
-          if(e->e1->et==etVar)
-          {
-            SymInfo* sym=si->getSymbol(e->e1->getSymbol());
-            if(sym)
-            {
-              if(sym->tinfo.ts==tsUnknown)
-              {
-                getExprType(est.expr->e2,sym->tinfo);
-              }else
-              {
-                TypeInfo tmp;
-                getExprType(est.expr->e2,tmp);
-                if(sym->tinfo.ts==tsOneOf)
+            collectRefTargets(sub);
+        }
+        collectRefTargets(ex->func->body);
+    }
+}
+
+void CodeGenerator::collectLoopWrites(StmtList* sl, LoopInfo& li)
+{
+    if(!sl)
+    {
+        return;
+    }
+    for(auto& it : sl->values)
+    {
+        Statement& st = *it;
+        switch(st.st)
+        {
+            case stExpr:
+            case stIf:
+            case stWhile:
+            case stReturn:
+            case stReturnIf:
+            case stThrow:
+            case stBreak:
+            case stNext:
+            case stRedo:
+                break;
+            case stListAssign:
+                for(auto& lv : st.as<ListAssignStatement>().lst1->values)
                 {
-                  if(!sym->tinfo.haveInArr(tmp))
-                  {
-                    sym->tinfo.arr.push_back(tmp);
-                  }
-                }else if(!sym->tinfo.isSame(tmp))
+                    if(lv->et == etVar)
+                    {
+                        li.writes.insert(lv->val.c_str());
+                    }
+                }
+                break;
+            case stForLoop:
+                for(auto& nm : st.as<ForLoopStatement>().vars->values)
                 {
-                  TypeInfo tmp2=sym->tinfo;
-                  sym->tinfo.ts=tsOneOf;
-                  sym->tinfo.arr.push_back(tmp2);
-                  sym->tinfo.arr.push_back(tmp);
+                    li.writes.insert(nm.val.c_str());
                 }
-              }
-            }
-          }else if(e->e1->et==etProp)
-          {
-            TypeInfo tmp;
-            getExprType(e->e1->e1,tmp);
-            if(tmp.ts==tsDefined && tmp.vt==vtObject)
-            {
-              SymInfo* sym=tmp.classInfo->getSymbols()->findSymbol(e->e1->e2->val);
-              if(sym)
-              {
-                getExprType(e->e2,sym->tinfo);
-              }
-            }
-          }
-        }*/
-        }
-            break;
-        case stListAssign:
-        {
-            auto& las = st.as<ListAssignStatement>();
-            if(las.lst2->values.size() == 1)
-            {
-                for(auto it = las.lst1->values.begin(), end = las.lst1->values.end(); it != end; ++it)
+                break;
+            case stVarList:
+                for(auto& nm : st.as<VarListStatement>().vars->values)
                 {
-                    Expr aex(etAssign, it->get(), las.lst2->values.front().get());
-                    TypeInfo tmp;
-                    getExprType(&aex, tmp);
-                    aex.e1 = nullptr;
-                    aex.e2 = nullptr;
+                    li.writes.insert(nm.val.c_str());
                 }
-            } else
+                break;
+            case stTryCatch:
             {
-                for(auto it1 = las.lst1->values.begin(), end1 = las.lst1->values.end(), it2 = las.lst2->values.begin(), end2 = las.lst2->values.end();
-                    it1 != end1 && it2 != end2; ++it1, ++it2)
+                auto& tc = st.as<TryCatchStatement>();
+                if(tc.var.val)
                 {
-                    Expr aex(etAssign, it1->get(), it2->get());
-                    TypeInfo tmp;
-                    getExprType(&aex, tmp);
-                    aex.e1 = nullptr;
-                    aex.e2 = nullptr;
+                    li.writes.insert(tc.var.val.c_str());
                 }
             }
+                break;
+            default:
+                //yield, switch, declarations
+                li.calls = true;
+                break;
         }
-            break;
-        case stFuncDecl:
+        std::vector<Expr*> subExpr;
+        std::vector<StmtList*> subStmt;
+        st.getChildData(subExpr, subStmt);
+        for(auto ex : subExpr)
         {
-            auto& fds = st.as<FuncDeclStatement>();
-            Name fname = fds.name;
-            if(fds.isOnFunc)
-            {
-                fname = "on " + fname.val;
-            }
-            FuncInfo* fi = si->enterFunc(fname);
-            if(si->currentClass)
-            {
-                SymInfo* sym = fi->getSymbols()->findSymbol(selfName);
-                if(sym)
-                {
-                    sym->tinfo.merge(TypeInfo(si->currentClass));
-                }
-            }
-            fi->inTypeFill = true;
-            fi->tinfo.merge(fi);
-            fillTypes(fds.body);
-            fi->inTypeFill = false;
-            si->returnScope();
+            collectLoopWrites(ex, li);
         }
-            break;
-        case stIf:
+        for(auto sub : subStmt)
         {
-            auto& is = st.as<IfStatement>();
-            TypeInfo tmp;
-            getExprType(is.cond, tmp);
-            fillTypes(is.thenList);
-            fillTypes(is.elseList);
-            fillTypes(is.elsifList);
+            collectLoopWrites(sub, li);
         }
+    }
+}
+
+void CodeGenerator::collectLoopWrites(Expr* ex, LoopInfo& li)
+{
+    if(!ex)
+    {
+        return;
+    }
+    switch(ex->et)
+    {
+        case etAssign:
+        case etSPlus:
+        case etSMinus:
+        case etSMul:
+        case etSDiv:
+        case etSMod:
+        case etPreInc:
+        case etPostInc:
+        case etPreDec:
+        case etPostDec:
+            if(ex->e1->et == etVar)
+            {
+                li.writes.insert(ex->e1->val.c_str());
+            }
             break;
-        case stWhile:
+        case etSeqOps:
         {
-            auto& ws = st.as<WhileStatement>();
-            TypeInfo tmp;
-            getExprType(ws.cond, tmp);
-            fillTypes(ws.body);
+            Expr* varExpr = ex->e1->et == etVar ? ex->e1 : ex->e1->e1;
+            li.writes.insert(varExpr->val.c_str());
+            li.calls = true;
         }
             break;
-        case stYield:
-        case stReturn:
-        case stReturnIf:
+        case etMatch:
+            li.writesAll = true;
+            li.calls = true;
+            break;
+        case etCall:
+        case etProp:
+        case etPropOpt:
+        case etFunc:
+        case etCor:
+        case etGetAttr:
+        case etMapOp:
+        case etGrepOp:
+        case etLiteral:
+            li.calls = true;
+            break;
+        default:
+            break;
+    }
+    collectLoopWrites(ex->e1, li);
+    collectLoopWrites(ex->e2, li);
+    collectLoopWrites(ex->e3, li);
+    if(ex->lst)
+    {
+        for(auto& it : ex->lst->values)
         {
-            auto& rs = st.as<ReturnStatement>();
-            auto* fi = (FuncInfo*) si->currentScope;
-            if(rs.expr)
-            {
-                getExprType(rs.expr.get(), fi->rvtype);
-            } else
-            {
-                fi->rvtype.merge(vtNil);
-            }
+            collectLoopWrites(it.get(), li);
         }
-            break;
-        case stForLoop:
+    }
+    if(ex->func)
+    {
+        std::vector<Expr*> subExpr;
+        std::vector<StmtList*> subStmt;
+        ex->func->getChildData(subExpr, subStmt);
+        for(auto sub : subExpr)
         {
-            auto& fst = st.as<ForLoopStatement>();
-            SymInfo* sym = si->getSymbol(fst.vars->values.back());
-            TypeInfo tmp;
-            getExprType(fst.expr, tmp);
-            if(sym)
+            collectLoopWrites(sub, li);
+        }
+        collectLoopWrites(ex->func->body, li);
+    }
+}
+
+//divisor that cannot make division throw or overflow
+static bool isSafeDivisor(const Value& v)
+{
+    return (v.vt == vtInt && v.iValue != 0 && v.iValue != -1) || (v.vt == vtDouble && v.dValue != 0);
+}
+
+bool CodeGenerator::isInvariantExpr(Expr* ex, const LoopInfo& li, bool& hasVar, bool& hasGlobal)
+{
+    switch(ex->et)
+    {
+        case etInt:
+        case etDouble:
+            return true;
+        case etVar:
+        {
+            if(li.writes.count(ex->val.c_str()) || refTargets.count(ex->val.c_str()))
             {
-                for(TypeInfo::iterator it = tmp.begin(), end = tmp.end(); it != end; ++it)
-                {
-                    if(it->isContainer())
-                    {
-                        sym->tinfo.merge(tmp.arr);
-                    } else if(it->vt == vtRange)
-                    {
-                        sym->tinfo.merge(vtInt);
-                    } else if(it->vt == vtFunc)
-                    {
-                        sym->tinfo.merge(it->symRef.asFunc()->rvtype);
-                    }
-                }
+                return false;
             }
-            if(fst.vars->values.size() == 2)
+            SymInfo* sym = si->getSymbol(ex->getSymbol());
+            if(!sym)
             {
-                SymInfo* sym1 = si->getSymbol(fst.vars->values.front());
-                if(sym1 && tmp.ts == tsDefined)
+                return false;
+            }
+            switch(sym->st)
+            {
+                case sytConstant:
                 {
-                    if(tmp.vt == vtArray)
+                    const Value& v = si->globals[sym->index];
+                    return v.vt == vtInt || v.vt == vtDouble;
+                }
+                case sytLocalVar:
+                    hasVar = true;
+                    return true;
+                case sytGlobalVar:
+                    //any call can modify global variable
+                    if(li.calls)
                     {
-                        sym1->tinfo.merge(vtInt);
+                        return false;
                     }
-                }
+                    hasVar = true;
+                    hasGlobal = true;
+                    return true;
+                default:
+                    return false;
             }
-            fillTypes(fst.body);
         }
-            break;
-        case stClass:
+        case etPlus:
+        case etMinus:
+        case etMul:
+            return isInvariantExpr(ex->e1, li, hasVar, hasGlobal) && isInvariantExpr(ex->e2, li, hasVar, hasGlobal);
+        case etNeg:
+            return isInvariantExpr(ex->e1, li, hasVar, hasGlobal);
+        case etDiv:
+        case etMod:
         {
-            auto& cds = st.as<ClassDefStatement>();
-            ClassInfo* ci = si->enterClass(cds.name);
-            if(!ci)
+            //hoisted code runs even if loop body doesn't, it must not throw
+            Value v;
+            if(!getFoldedValue(ex->e2, v) || !isSafeDivisor(v))
             {
-                ci = si->registerClass(cds.name);
+                return false;
             }
-            ci->tinfo.ts = tsDefined;
-            ci->tinfo.vt = vtClass;
-            ci->tinfo.symRef = ci;
-            fillTypes(cds.body);
-            si->returnScope();
-            //todo args
+            return isInvariantExpr(ex->e1, li, hasVar, hasGlobal);
         }
-            break;
-        case stClassMemberDef:
+        default:
+            return false;
+    }
+}
+
+void CodeGenerator::findInvariants(StmtList* sl, size_t loopIdx)
+{
+    if(!sl)
+    {
+        return;
+    }
+    for(auto& it : sl->values)
+    {
+        Statement& st = *it;
+        switch(st.st)
         {
-            auto& cmd = st.as<ClassMemberDef>();
-            if(cmd.value)
+            case stExpr:
+            case stListAssign:
+            case stIf:
+            case stWhile:
+            case stReturn:
+            case stReturnIf:
+            case stYield:
+            case stForLoop:
+            case stThrow:
+            case stSwitch:
+            case stTryCatch:
+                break;
+            default:
+                continue;
+        }
+        //sites must survive folding done later by generateStmt
+        foldStatement(st);
+        std::vector<Expr*> subExpr;
+        std::vector<StmtList*> subStmt;
+        st.getChildData(subExpr, subStmt);
+        if(st.st != stTryCatch)
+        {
+            for(auto ex : subExpr)
             {
-                SymInfo* sym = si->currentClass->symMap.findSymbol(cmd.name.val);
-                if(!sym)
-                {
-                    sym = si->registerMember(cmd.name);
-                }
-                getExprType(cmd.value, sym->tinfo);
+                findInvariants(ex, loopIdx);
             }
         }
-            break;
-        case stClassAttrDef:
+        for(auto sub : subStmt)
         {
-            //todo
+            findInvariants(sub, loopIdx);
         }
+    }
+}
+
+void CodeGenerator::findInvariants(Expr* ex, size_t loopIdx)
+{
+    if(!ex)
+    {
+        return;
+    }
+    switch(ex->et)
+    {
+        case etFunc:
+        case etSeqOps:
+        case etMapOp:
+        case etGrepOp:
+        case etLiteral:
+            return;
+        default:
             break;
-        case stVarList:
+    }
+    if(invExprs.count(ex))
+    {
+        //already taken by outer loop
+        return;
+    }
+    bool hasVar = false, hasGlobal = false;
+    if(!isSimple(ex) && isInvariantExpr(ex, loops[loopIdx], hasVar, hasGlobal) && hasVar)
+    {
+        invExprs[ex] = invSites.size();
+        OpArg slot(atLocal, si->acquireTemp());
+        invSites.push_back(InvariantSite{loopIdx, ex, slot, nullptr, nullptr, hasGlobal, false});
+        return;
+    }
+    findInvariants(ex->e1, loopIdx);
+    findInvariants(ex->e2, loopIdx);
+    findInvariants(ex->e3, loopIdx);
+    if(ex->lst)
+    {
+        for(auto& it : ex->lst->values)
         {
+            findInvariants(it.get(), loopIdx);
+        }
+    }
+}
 
+OpBase* CodeGenerator::enterLoopInvariants(OpPair& op, Expr* cond, StmtList* body, NameList* vars)
+{
+    LoopInfo li;
+    li.cond = cond;
+    li.body = body;
+    li.scope = si->currentScope;
+    li.firstSite = invSites.size();
+    if(vars)
+    {
+        for(auto& nm : vars->values)
+        {
+            li.writes.insert(nm.val.c_str());
         }
-            break;
-        case stNamespace:
+    }
+    collectLoopWrites(cond, li);
+    collectLoopWrites(body, li);
+    if(li.writesAll)
+    {
+        return nullptr;
+    }
+    size_t loopIdx = loops.size();
+    loops.push_back(std::move(li));
+    //target of for loop is evaluated once before the loop
+    if(!vars)
+    {
+        foldConstants(cond);
+        findInvariants(cond, loopIdx);
+    }
+    findInvariants(body, loopIdx);
+    if(invSites.size() == loops.back().firstSite)
+    {
+        loops.pop_back();
+        return nullptr;
+    }
+    auto* preheader = new OpJump(nullptr, 0);
+    op += preheader;
+    loops.back().preheader = preheader;
+    return preheader;
+}
+
+void CodeGenerator::leaveLoopInvariants(OpPair& op, OpBase* preheader)
+{
+    if(!preheader)
+    {
+        return;
+    }
+    size_t loopIdx = loops.size();
+    while(loops[--loopIdx].preheader != preheader)
+    {
+    }
+    for(size_t i = loops[loopIdx].firstSite; i < invSites.size(); ++i)
+    {
+        InvariantSite& site = invSites[i];
+        if(site.loop != loopIdx)
         {
-            auto& ns = st.as<NamespaceStatement>();
-            int cnt = 0;
-            if(ns.ns)
-            {
-                for(auto& nsVal:ns.ns->values)
-                {
-                    si->enterNamespace(nsVal);
-                    ++cnt;
-                }
-            } else
-            {
-                si->enterNamespace(ns.name);
-                ++cnt;
-            }
-            fillTypes(ns.body);
-            for(int i = 0; i < cnt; ++i)
-            {
-                si->returnScope();
-            }
+            continue;
         }
-            break;
-        case stTryCatch:
+        op += new OpAssign(site.slot, nil, atNul);
+        si->releaseTemp(site.slot.idx);
+        invExprs.erase(site.expr);
+    }
+}
+
+bool CodeGenerator::genInvariant(OpPair& op, Expr* expr, OpArg& rv)
+{
+    auto it = invExprs.find(expr);
+    if(it == invExprs.end() || invSites[it->second].generated)
+    {
+        return false;
+    }
+    size_t idx = it->second;
+    invSites[idx].generated = true;
+    ExprContext iec(si, invSites[idx].slot);
+    OpPair iop = generateExpr(expr, iec);
+    invSites[idx].first = *iop.first;
+    invSites[idx].last = iop.skipNext || !iop.efixes.empty() ? nullptr : iop.last;
+    op += iop;
+    rv = invSites[idx].slot;
+    return true;
+}
+
+//values of these types never call user code
+static bool isPlainType(const TypeInfo& ti)
+{
+    if(ti.ts == tsOneOf)
+    {
+        for(auto& t : ti.arr)
         {
-            auto& tcs = st.as<TryCatchStatement>();
-            fillTypes(tcs.tryBody);
-            if(tcs.exList)
+            if(!isPlainType(t))
             {
-                SymInfo* sym = si->getSymbol(tcs.var);
-                if(sym)
-                {
-                    for(auto& it : tcs.exList->values)
-                    {
-                        getExprType(it.get(), sym->tinfo);
-                    }
-                }
+                return false;
             }
         }
-            break;
-        case stThrow:
-        case stBreak:
-        case stNext:
-        case stRedo:
-            break;
-        case stSwitch:
+        return true;
+    }
+    if(ti.ts != tsDefined)
+    {
+        return false;
+    }
+    switch(ti.vt)
+    {
+        case vtNil:
+        case vtBool:
+        case vtInt:
+        case vtDouble:
+        case vtString:
+        case vtRange:
+        case vtArray:
+        case vtMap:
+        case vtSet:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool CodeGenerator::isOverloadFree(StmtList* sl)
+{
+    if(!sl)
+    {
+        return true;
+    }
+    for(auto& it : sl->values)
+    {
+        std::vector<Expr*> subExpr;
+        std::vector<StmtList*> subStmt;
+        it->getChildData(subExpr, subStmt);
+        for(auto ex : subExpr)
         {
-            auto& ss = st.as<SwitchStatement>();
-            if(ss.casesList)
+            if(!isOverloadFree(ex))
             {
-                for(auto& it : *ss.casesList)
-                {
-                    fillTypes(it.caseBody);
-                }
+                return false;
             }
         }
-            break;
-        case stEnum:
+        for(auto sub : subStmt)
         {
-            auto& es = st.as<EnumStatement>();
-            SymInfo* sym = si->getSymbol(es.name);
-            if(sym)
-            {
-                sym->tinfo.merge(vtMap);
-                sym->tinfo.addToArr(vtString);
-            }
-            if(es.items)
+            if(!isOverloadFree(sub))
             {
-                for(auto& item : es.items->values)
-                {
-                    Expr& e = *item;
-                    if(e.et == etVar)
-                    {
-                        SymInfo* esym = si->getSymbol(e.getSymbol());
-                        if(esym)
-                        {
-                            esym->tinfo.merge(vtInt);
-                        }
-                    } else if(e.et == etAssign)
-                    {
-                        SymInfo* esym = si->getSymbol(e.e1->getSymbol());
-                        if(esym)
-                        {
-                            getExprType(e.e2, esym->tinfo);
-                        }
-                    }
-                }
+                return false;
             }
         }
-            break;
-        case stProp:
+    }
+    return true;
+}
+
+bool CodeGenerator::isOverloadFree(Expr* ex)
+{
+    if(!ex)
+    {
+        return true;
+    }
+    TypeInfo ti;
+    getExprType(ex, ti);
+    if(!isPlainType(ti))
+    {
+        return false;
+    }
+    if(!isOverloadFree(ex->e1) || !isOverloadFree(ex->e2) || !isOverloadFree(ex->e3))
+    {
+        return false;
+    }
+    if(ex->lst)
+    {
+        for(auto& it : ex->lst->values)
         {
-            auto& ps = st.as<PropStatement>();
-            if(ps.getFunc)
-            {
-                si->enterMethod(ps.getFunc->name);
-                fillTypes(ps.getFunc->body);
-                si->returnScope();
-            }
-            if(ps.setFunc)
+            if(!isOverloadFree(it.get()))
             {
-                si->enterMethod(ps.setFunc->name);
-                fillTypes(ps.setFunc->body);
-                si->returnScope();
+                return false;
             }
         }
-            break;
-        case stAttr:
-        {
+    }
+    return true;
+}
 
-        }
-            break;
-        case stUse:
+bool CodeGenerator::isNumericTree(Expr* ex)
+{
+    switch(ex->et)
+    {
+        case etInt:
+        case etDouble:
+            return true;
+        case etVar:
         {
-
+            TypeInfo ti;
+            getExprType(ex, ti);
+            return isNumType(ti);
         }
-            break;
-        case stLiter:
-        {
+        case etNeg:
+            return isNumericTree(ex->e1);
+        default:
+            return isNumericTree(ex->e1) && isNumericTree(ex->e2);
+    }
+}
 
+bool CodeGenerator::isCapturedLocal(Expr* ex)
+{
+    switch(ex->et)
+    {
+        case etInt:
+        case etDouble:
+            return false;
+        case etVar:
+        {
+            SymInfo* sym = si->getSymbol(ex->getSymbol());
+            if(!sym || sym->st != sytLocalVar)
+            {
+                return false;
+            }
+            for(size_t i = 0; i < si->globalsCount; ++i)
+            {
+                const Value& v = si->globals[i];
+                if((v.vt != vtFunc && v.vt != vtMethod) || v.func->parent != si->currentScope)
+                {
+                    continue;
+                }
+                for(auto& cv : v.func->closedVars)
+                {
+                    if(cv.at == atLocal && cv.idx == sym->index)
+                    {
+                        return true;
+                    }
+                }
+            }
+            return false;
         }
-            break;
+        case etNeg:
+            return isCapturedLocal(ex->e1);
+        default:
+            return isCapturedLocal(ex->e1) || isCapturedLocal(ex->e2);
     }
 }
 
-void CodeGenerator::generate(StmtList* sl)
+static bool isHoistableOp(int ot)
 {
-#ifdef DEBUG
-    std::string str;
-    if(sl)
+    return ot == otAdd || ot == otSub || ot == otMul || ot == otDiv || ot == otMod || ot == otNeg;
+}
+
+bool CodeGenerator::hoistInvariant(InvariantSite& site)
+{
+    LoopInfo& li = loops[site.loop];
+    if(!site.first || !site.last || !isNumericTree(site.expr))
     {
-        sl->dump(str);
+        return false;
     }
-    DPRINT("dump:\n%s", str.c_str());
-#endif
-    fillNames(sl);
-    OpPair op = generateStmtList(sl);
-    op += nullptr;
-    if(initOps.first.get())
+    //calls and overloaded operators can modify globals and locals captured by closures
+    bool callFree = !li.calls && isOverloadFree(li.cond) && isOverloadFree(li.body);
+    if(!callFree && (site.globalLeaves || isCapturedLocal(site.expr)))
     {
-        OpPair tmp = op;
-        op = initOps;
-        op += tmp;
+        return false;
     }
-    /*
-  if(!op.skipNext)
-  {
-    if(op.last)op.last->next=0;
-  }else
-  {
-    op.skipNext=false;
-  }
-  for(FixVector::iterator it=op.efixes.begin(),end=op.efixes.end();it!=end;++it)
-  {
-    **it=0;
-  }*/
-    vm->setEntry(op.first.release());
-}
-
-void CodeGenerator::generateMacro(const Name& name, FuncParamList* args, StmtList* sl)
-{
-    si->enterNamespace(vm->mkZString("MACRO"));
-    nil = OpArg(atGlobal, si->nilIdx);
-    selfName = vm->mkZString("self");
-    FuncInfo* fi = si->registerFunc(name, args ? args->size() : 0);
-    ScopeGuard sg(si);
-    OpPair fp(FileLocation(), vm);
-    if(args)
+    std::unordered_set<OpBase*> chain;
+    for(OpBase* op = site.first;; op = op->next)
     {
-        for(auto& arg : args->values)
+        if(!op || !isHoistableOp(op->ot) || !chain.insert(op).second)
         {
-            si->registerArg(*arg);
+            return false;
+        }
+        if(op == site.last)
+        {
+            break;
         }
     }
-    fp += generateStmtList(sl);
-    if(!fp.isLastReturn())
+    OpBase* after = site.last->next;
+    std::vector<OpBase**> fixes;
+    std::unordered_set<OpBase*> seen;
+    OpsVector stack{li.preheader}, branches;
+    seen.insert(li.preheader);
+    while(!stack.empty())
     {
-        fp += new OpReturn();
+        OpBase* op = stack.back();
+        stack.pop_back();
+        branches.clear();
+        op->getBranches(branches);
+        for(auto br : branches)
+        {
+            if(br == site.first)
+            {
+                if(op->ot < otJumpIfInited || op->ot > otCondJump || ((OpJumpBase*) op)->elseOp != br)
+                {
+                    return false;
+                }
+                fixes.push_back(&((OpJumpBase*) op)->elseOp);
+            }
+        }
+        if(op->next == site.first && !chain.count(op))
+        {
+            fixes.push_back(&op->next);
+        }
+        branches.push_back(op->next);
+        for(auto br : branches)
+        {
+            if(br && seen.insert(br).second)
+            {
+                stack.push_back(br);
+            }
+        }
     }
-    fi->entry = fp.first.release();
-    si->returnScope();
+    for(auto fix : fixes)
+    {
+        *fix = after;
+    }
+    site.last->next = li.preheader->next;
+    li.preheader->next = site.first;
+    return true;
 }
 
-void CodeGenerator::checkDuplicate(const Name& nm, const char* type)
+size_t CodeGenerator::hoistInvariants()
 {
-    SymInfo* sym = si->currentScope->getSymbols()->findSymbol(nm);
-    if(sym)
+    ScopeSym* saveScope = si->currentScope;
+    size_t rv = 0;
+    for(auto& site : invSites)
     {
-        ZTHROW(CGException, nm.pos, "Duplicate %{} %{}, previously defined at %{}", type, nm, sym->name.pos);
+        if(!site.first)
+        {
+            continue;
+        }
+        ++invariantsTotal;
+        si->currentScope = loops[site.loop].scope;
+        if(hoistInvariant(site))
+        {
+            ++rv;
+        }
     }
+    si->currentScope = saveScope;
+    invariantsHoisted += rv;
+    invSites.clear();
+    invExprs.clear();
+    loops.clear();
+    return rv;
 }
 
-void CodeGenerator::fillNames(StmtList* sl, bool deep)
+void CodeGenerator::fillTypes(StmtList* sl)
 {
     if(!sl)
     {
@@ -1137,391 +1664,1586 @@ void CodeGenerator::fillNames(StmtList* sl, bool deep)
     }
     for(auto& it : sl->values)
     {
-        Statement& st = *it;
-        switch(st.st)
+        fillTypes(it.get());
+    }
+}
+
+void CodeGenerator::fillTypes(Statement* stptr)
+{
+    if(!stptr)
+    {
+        return;
+    }
+    Statement& st = *stptr;
+    switch(st.st)
+    {
+        case stNone:
+            break;
+        case stExpr:
         {
-            case stExpr:
+            auto& est = st.as<ExprStatement>();
+            TypeInfo tmp;
+            getExprType(est.expr.get(), tmp);
+            /*if(est.expr->et==etAssign)
+        {
+          Expr* e=est.expr;
+          if(e->e1->et==etVar)
+          {
+            SymInfo* sym=si->getSymbol(e->e1->getSymbol());
+            if(sym)
             {
-                auto& est = st.as<ExprStatement>();
-                if(est.expr->et == etAssign && est.expr->e1->et == etVar)
+              if(sym->tinfo.ts==tsUnknown)
+              {
+                getExprType(est.expr->e2,sym->tinfo);
+              }else
+              {
+                TypeInfo tmp;
+                getExprType(est.expr->e2,tmp);
+                if(sym->tinfo.ts==tsOneOf)
+                {
+                  if(!sym->tinfo.haveInArr(tmp))
+                  {
+                    sym->tinfo.arr.push_back(tmp);
+                  }
+                }else if(!sym->tinfo.isSame(tmp))
+                {
+                  TypeInfo tmp2=sym->tinfo;
+                  sym->tinfo.ts=tsOneOf;
+                  sym->tinfo.arr.push_back(tmp2);
+                  sym->tinfo.arr.push_back(tmp);
+                }
+              }
+            }
+          }else if(e->e1->et==etProp)
+          {
+            TypeInfo tmp;
+            getExprType(e->e1->e1,tmp);
+            if(tmp.ts==tsDefined && tmp.vt==vtObject)
+            {
+              SymInfo* sym=tmp.classInfo->getSymbols()->findSymbol(e->e1->e2->val);
+              if(sym)
+              {
+                getExprType(e->e2,sym->tinfo);
+              }
+            }
+          }
+        }*/
+        }
+            break;
+        case stListAssign:
+        {
+            auto& las = st.as<ListAssignStatement>();
+            if(las.lst2->values.size() == 1)
+            {
+                for(auto it = las.lst1->values.begin(), end = las.lst1->values.end(); it != end; ++it)
+                {
+                    Expr aex(etAssign, it->get(), las.lst2->values.front().get());
+                    TypeInfo tmp;
+                    getExprType(&aex, tmp);
+                    aex.e1 = nullptr;
+                    aex.e2 = nullptr;
+                }
+            } else
+            {
+                for(auto it1 = las.lst1->values.begin(), end1 = las.lst1->values.end(), it2 = las.lst2->values.begin(), end2 = las.lst2->values.end();
+                    it1 != end1 && it2 != end2; ++it1, ++it2)
+                {
+                    Expr aex(etAssign, it1->get(), it2->get());
+                    TypeInfo tmp;
+                    getExprType(&aex, tmp);
+                    aex.e1 = nullptr;
+                    aex.e2 = nullptr;
+                }
+            }
+        }
+            break;
+        case stFuncDecl:
+        {
+            if(!typeFillNested)
+            {
+                //nested functions are separate units of worklist inference
+                break;
+            }
+            auto& fds = st.as<FuncDeclStatement>();
+            Name fname = fds.name;
+            if(fds.isOnFunc)
+            {
+                fname = "on " + fname.val;
+            }
+            FuncInfo* fi = si->enterFunc(fname);
+            if(si->currentClass)
+            {
+                SymInfo* sym = fi->getSymbols()->findSymbol(selfName);
+                if(sym)
+                {
+                    mergeType(sym->tinfo, TypeInfo(si->currentClass));
+                }
+            }
+            FuncInfo* saveUnit = typeUnit;
+            typeUnit = fi;
+            if(typeTracking)
+            {
+                ++typeVisits[fi];
+            }
+            fi->inTypeFill = true;
+            mergeType(fi->tinfo, TypeInfo(fi));
+            fillTypes(fds.body);
+            fi->inTypeFill = false;
+            typeUnit = saveUnit;
+            si->returnScope();
+        }
+            break;
+        case stIf:
+        {
+            auto& is = st.as<IfStatement>();
+            TypeInfo tmp;
+            getExprType(is.cond, tmp);
+            fillTypes(is.thenList);
+            fillTypes(is.elseList);
+            fillTypes(is.elsifList);
+        }
+            break;
+        case stWhile:
+        {
+            auto& ws = st.as<WhileStatement>();
+            TypeInfo tmp;
+            getExprType(ws.cond, tmp);
+            fillTypes(ws.body);
+        }
+            break;
+        case stYield:
+        case stReturn:
+        case stReturnIf:
+        {
+            auto& rs = st.as<ReturnStatement>();
+            auto* fi = (FuncInfo*) si->currentScope;
+            TypeInfo tmp(vtNil);
+            if(rs.expr)
+            {
+                tmp = TypeInfo();
+                getExprType(rs.expr.get(), tmp);
+            }
+            mergeType(fi->rvtype, tmp);
+        }
+            break;
+        case stForLoop:
+        {
+            auto& fst = st.as<ForLoopStatement>();
+            SymInfo* sym = si->getSymbol(fst.vars->values.back());
+            TypeInfo tmp;
+            getExprType(fst.expr, tmp);
+            if(sym)
+            {
+                TypeInfo vtmp;
+                for(TypeInfo::iterator it = tmp.begin(), end = tmp.end(); it != end; ++it)
+                {
+                    if(it->isContainer())
+                    {
+                        vtmp.merge(tmp.arr);
+                    } else if(it->vt == vtRange)
+                    {
+                        vtmp.merge(vtInt);
+                    } else if(it->vt == vtFunc)
+                    {
+                        vtmp.merge(readType(it->symRef.asFunc()->rvtype));
+                    }
+                }
+                mergeType(sym->tinfo, vtmp);
+            }
+            if(fst.vars->values.size() == 2)
+            {
+                SymInfo* sym1 = si->getSymbol(fst.vars->values.front());
+                if(sym1 && tmp.ts == tsDefined)
+                {
+                    if(tmp.vt == vtArray)
+                    {
+                        mergeType(sym1->tinfo, TypeInfo(vtInt));
+                    }
+                }
+            }
+            fillTypes(fst.body);
+        }
+            break;
+        case stClass:
+        {
+            auto& cds = st.as<ClassDefStatement>();
+            ClassInfo* ci = si->enterClass(cds.name);
+            if(!ci)
+            {
+                ci = si->registerClass(cds.name);
+            }
+            ci->tinfo.ts = tsDefined;
+            ci->tinfo.vt = vtClass;
+            ci->tinfo.symRef = ci;
+            fillTypes(cds.body);
+            si->returnScope();
+            //todo args
+        }
+            break;
+        case stClassMemberDef:
+        {
+            auto& cmd = st.as<ClassMemberDef>();
+            if(cmd.value)
+            {
+                SymInfo* sym = si->currentClass->symMap.findSymbol(cmd.name.val);
+                if(!sym)
+                {
+                    sym = si->registerMember(cmd.name);
+                }
+                TypeInfo tmp;
+                getExprType(cmd.value, tmp);
+                mergeType(sym->tinfo, tmp);
+            }
+        }
+            break;
+        case stClassAttrDef:
+        {
+            //todo
+        }
+            break;
+        case stVarList:
+        {
+
+        }
+            break;
+        case stNamespace:
+        {
+            auto& ns = st.as<NamespaceStatement>();
+            int cnt = 0;
+            if(ns.ns)
+            {
+                for(auto& nsVal:ns.ns->values)
+                {
+                    si->enterNamespace(nsVal);
+                    ++cnt;
+                }
+            } else
+            {
+                si->enterNamespace(ns.name);
+                ++cnt;
+            }
+            fillTypes(ns.body);
+            for(int i = 0; i < cnt; ++i)
+            {
+                si->returnScope();
+            }
+        }
+            break;
+        case stTryCatch:
+        {
+            auto& tcs = st.as<TryCatchStatement>();
+            fillTypes(tcs.tryBody);
+            if(tcs.exList)
+            {
+                SymInfo* sym = si->getSymbol(tcs.var);
+                if(sym)
+                {
+                    TypeInfo tmp;
+                    for(auto& it : tcs.exList->values)
+                    {
+                        getExprType(it.get(), tmp);
+                    }
+                    mergeType(sym->tinfo, tmp);
+                }
+            }
+        }
+            break;
+        case stThrow:
+        case stBreak:
+        case stNext:
+        case stRedo:
+            break;
+        case stSwitch:
+        {
+            auto& ss = st.as<SwitchStatement>();
+            if(ss.casesList)
+            {
+                for(auto& it : *ss.casesList)
+                {
+                    fillTypes(it.caseBody);
+                }
+            }
+        }
+            break;
+        case stEnum:
+        {
+            auto& es = st.as<EnumStatement>();
+            SymInfo* sym = si->getSymbol(es.name);
+            if(sym)
+            {
+                size_t w = sym->tinfo.weight();
+                sym->tinfo.merge(vtMap);
+                sym->tinfo.addToArr(vtString);
+                if(sym->tinfo.weight() != w)
+                {
+                    typeChanged(sym->tinfo);
+                }
+            }
+            if(es.items)
+            {
+                for(auto& item : es.items->values)
+                {
+                    Expr& e = *item;
+                    if(e.et == etVar)
+                    {
+                        SymInfo* esym = si->getSymbol(e.getSymbol());
+                        if(esym)
+                        {
+                            mergeType(esym->tinfo, TypeInfo(vtInt));
+                        }
+                    } else if(e.et == etAssign)
+                    {
+                        SymInfo* esym = si->getSymbol(e.e1->getSymbol());
+                        if(esym)
+                        {
+                            TypeInfo tmp;
+                            getExprType(e.e2, tmp);
+                            mergeType(esym->tinfo, tmp);
+                        }
+                    }
+                }
+            }
+        }
+            break;
+        case stProp:
+        {
+            auto& ps = st.as<PropStatement>();
+            if(ps.getFunc)
+            {
+                si->enterMethod(ps.getFunc->name);
+                fillTypes(ps.getFunc->body);
+                si->returnScope();
+            }
+            if(ps.setFunc)
+            {
+                si->enterMethod(ps.setFunc->name);
+                fillTypes(ps.setFunc->body);
+                si->returnScope();
+            }
+        }
+            break;
+        case stAttr:
+        {
+
+        }
+            break;
+        case stUse:
+        {
+
+        }
+            break;
+        case stLiter:
+        {
+
+        }
+            break;
+    }
+}
+
+void CodeGenerator::generate(StmtList* sl)
+{
+#ifdef DEBUG
+    std::string str;
+    if(sl)
+    {
+        sl->dump(str);
+    }
+    DPRINT("dump:\n%s", str.c_str());
+#endif
+    fillNames(sl);
+    collectRefTargets(sl);
+    OpPair op = generateStmtList(sl);
+    op += nullptr;
+    if(initOps.first.get())
+    {
+        OpPair tmp = op;
+        op = initOps;
+        op += tmp;
+    }
+    /*
+  if(!op.skipNext)
+  {
+    if(op.last)op.last->next=0;
+  }else
+  {
+    op.skipNext=false;
+  }
+  for(FixVector::iterator it=op.efixes.begin(),end=op.efixes.end();it!=end;++it)
+  {
+    **it=0;
+  }*/
+    vm->setEntry(op.first.release());
+}
+
+void CodeGenerator::generateMacro(const Name& name, FuncParamList* args, StmtList* sl)
+{
+    si->enterNamespace(vm->mkZString("MACRO"));
+    nil = OpArg(atGlobal, si->nilIdx);
+    selfName = vm->mkZString("self");
+    FuncInfo* fi = si->registerFunc(name, args ? args->size() : 0);
+    ScopeGuard sg(si);
+    OpPair fp(FileLocation(), vm);
+    if(args)
+    {
+        for(auto& arg : args->values)
+        {
+            si->registerArg(*arg);
+        }
+    }
+    fp += generateStmtList(sl);
+    if(!fp.isLastReturn())
+    {
+        fp += new OpReturn();
+    }
+    fi->entry = fp.first.release();
+    si->returnScope();
+}
+
+void CodeGenerator::checkDuplicate(const Name& nm, const char* type)
+{
+    SymInfo* sym = si->currentScope->getSymbols()->findSymbol(nm);
+    if(sym)
+    {
+        ZTHROW(CGException, nm.pos, "Duplicate %{} %{}, previously defined at %{}", type, nm, sym->name.pos);
+    }
+}
+
+void CodeGenerator::fillNames(StmtList* sl, bool deep)
+{
+    if(!sl)
+    {
+        return;
+    }
+    for(auto& it : sl->values)
+    {
+        Statement& st = *it;
+        switch(st.st)
+        {
+            case stExpr:
+            {
+                auto& est = st.as<ExprStatement>();
+                if(est.expr->et == etAssign && est.expr->e1->et == etVar)
+                {
+                    const Name& nm = est.expr->e1->getSymbol().name;
+                    SymInfo* prev = si->currentScope->getSymbols()->findSymbol(nm);
+                    //repeated assignment must not replace symbol, its global slot is still referenced by info
+                    if(!prev || prev->st != sytGlobalVar)
+                    {
+                        si->registerScopedGlobal(new SymInfo(nm, sytGlobalVar));
+                    }
+                }
+            }
+                break;
+            case stFuncDecl:
+            {
+                auto& f = st.as<FuncDeclStatement>();
+                checkDuplicate(f.name, "func");
+                FuncInfo* fi = si->registerFunc(f.name, f.argsCount());
+                fi->tinfo = TypeInfo(fi);
+                fi->def = &st;
+                fi->end = f.end;
+                if(deep)
+                {
+                    fillNames(f.body, deep);
+                }
+                si->returnScope();
+            }
+                break;
+            case stNamespace:
+            {
+                auto& ns = st.as<NamespaceStatement>();
+                ScopeSym* nsPtr = nullptr;
+                if(ns.ns)
+                {
+                    for(auto& nsItem : ns.ns->values)
+                    {
+                        if(!si->enterNamespace(nsItem))
+                        {
+                            throw CGException("not a namespace", ns.pos);
+                        }
+                        si->currentScope->end = ns.end;
+                    }
+                } else
+                {
+                    char nsName[64];
+                    int l = snprintf(nsName, sizeof(nsName), "anonymous-ns-%p", &ns);
+                    ns.name = Name(vm->mkZString(nsName, static_cast<size_t>(l)), ns.pos);
+                    si->enterNamespace(ns.name);
+                    nsPtr = si->currentScope;
+                    si->currentScope->end = ns.end;
+                }
+                fillNames(ns.body, deep);
+                if(ns.ns)
+                {
+                    for(auto& nsItem:ns.ns->values)
+                    {
+                        (void) nsItem;
+                        si->returnScope();
+                    }
+                } else
+                {
+                    si->returnScope();
+                    si->currentScope->usedNs.push_back(nsPtr);
+                }
+            }
+                break;
+            case stClass:
+            {
+                auto& c = st.as<ClassDefStatement>();
+                checkDuplicate(c.name, "class");
+                //currentClass=&c;
+                /*if(c.parent)
+        {
+          SymInfo* sym=si->getSymbol(c.parent->name);
+          if(!sym)
+          {
+            throw UndefinedSymbolException(c.parent->name);
+          }
+          if(sym->st!=sytClass)
+          {
+            ZTHROW(CGException,c.parent->name.name.pos,"Symbol %{} is not class",c.parent->name.toString());
+          }
+        }*/
+                ClassInfo* ci = si->registerClass(c.name);
+                ci->tinfo = TypeInfo(ci, vtClass);
+                ci->def = &st;
+                ci->end = c.end;
+                if(deep)
+                {
+                    fillNames(c.body, deep);
+                }
+                si->returnScope();
+                //currentClass=0;
+            }
+                break;
+            case stAttr:
+            {
+                auto& a = st.as<AttrDeclStatement>();
+                checkDuplicate(a.name, "attr");
+                si->registerAttr(a.name);
+            }
+                break;
+            case stLiter:
+            {
+                auto& lst = st.as<LiterStatement>();
+                checkDuplicate(lst.name, "liter");
+                ScopeSym* curScope = si->currentScope;
+                LiterInfo* li = si->registerLiter(lst.name, lst.args->size());
+                for(auto& arg:*lst.args)
+                {
+                    ScopeSym::LiterList* curLst;
+                    ScopeSym::LiterList** ll = curScope->literMap.getPtr(arg->marker.val.get());
+                    if(!ll)
+                    {
+                        curLst = new ScopeSym::LiterList();
+                        curScope->literMap.insert(arg->marker.val.get(), curLst);
+                    } else
+                    {
+                        curLst = *ll;
+                    }
+                    curLst->push_back(li);
+                    if(!arg->optional)
+                    {
+                        break;
+                    }
+                }
+                for(auto& arg:*lst.args)
+                {
+                    li->markers.push_back(*arg);
+                    si->registerArg(arg->name);
+                }
+
+                si->returnScope();
+            }
+                break;
+            case stClassMemberDef:
+            {
+                auto& cmd = st.as<ClassMemberDef>();
+                si->registerMember(cmd.name);
+            }
+                break;
+            case stEnum:
+            {
+                auto& est = st.as<EnumStatement>();
+                si->registerScopedGlobal(new SymInfo(est.name, sytConstant));
+                if(est.items)
+                {
+                    for(auto& exprPtr:est.items->values)
+                    {
+                        Expr& ex = *exprPtr;
+                        Name nm = ex.et == etVar ? ex.getSymbol().name : ex.e1->getSymbol().name;
+                        si->registerScopedGlobal(new SymInfo(nm, sytConstant));
+                    }
+                }
+            }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void CodeGenerator::fillClassNames(StmtList* sl)
+{
+    if(!sl)
+    {
+        return;
+    }
+    for(auto& it : sl->values)
+    {
+        Statement& st = *it;
+        switch(st.st)
+        {
+            case stFuncDecl:
+            {
+                auto& f = st.as<FuncDeclStatement>();
+                Name fname = f.name;
+                bool isCtor = false;
+                if(f.isOnFunc)
+                {
+                    ClassSpecialMethod csm = si->getCsm(f.name.val);
+                    isCtor = csm == csmConstructor;
+                    fname = "on " + f.name.val;
+                }
+                size_t argsCount = f.argsCount();
+                if(isCtor)
+                {
+                    argsCount = currentClass->args ? currentClass->args->size() : 0;
+                }
+                si->registerMethod(fname, argsCount, !isCtor)->end = f.end;
+                si->returnScope();
+            }
+                break;
+            case stClassMemberDef:
+            {
+                auto& m = st.as<ClassMemberDef>();
+                si->registerMember(m.name);
+            }
+                break;
+            case stProp:
+            {
+                auto& pst = st.as<PropStatement>();
+                ClassPropertyInfo* p = si->registerProperty(pst.name);
+                if(pst.getFunc)
+                {
+                    p->getMethod = si->registerMethod(pst.getFunc->name, 0);
+                    si->returnScope();
+                } else if(pst.getName.val)
+                {
+                    SymInfo* sym = si->getSymbol(pst.getName);
+                    if(!sym)
+                    {
+                        throw UndefinedSymbolException(pst.getName);
+                    }
+                    if(sym->st == sytClassMember)
+                    {
+                        p->getIdx = sym->index;
+                    } else if(sym->st == sytMethod)
+                    {
+                        p->getMethod = (MethodInfo*) sym;
+                        if(p->getMethod->argsCount != 0)
+                        {
+                            throw CGException("Property get method shouldn't have arguments", pst.name.pos);
+                        }
+                    } else
+                    {
+                        ZTHROW(CGException, pst.name.pos, "Incompatible symbol for property getter role: %{}",
+                               pst.name);
+                    }
+                }
+                if(pst.setFunc)
+                {
+                    p->setMethod = si->registerMethod(pst.setFunc->name, 1);
+                    si->returnScope();
+                } else if(pst.setName.val)
+                {
+                    SymInfo* sym = si->getSymbol(pst.setName);
+                    if(!sym)
+                    {
+                        throw UndefinedSymbolException(pst.name);
+                    }
+                    if(sym->st == sytClassMember)
+                    {
+                        p->setIdx = sym->index;
+                    } else if(sym->st == sytMethod)
+                    {
+                        p->setMethod = (MethodInfo*) sym;
+                        if(p->setMethod->argsCount != 1)
+                        {
+                            throw CGException("Property set method must have exactly 1 argument", pst.name.pos);
+                        }
+                    } else
+                    {
+                        ZTHROW(CGException, pst.name.pos, "Incompatible symbol for property setter role:%{}", pst.name);
+                    }
+                }
+            }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+CodeGenerator::OpPair CodeGenerator::generateStmtList(StmtList* sl)
+{
+    OpPair op(FileLocation(), vm);
+    if(sl == nullptr)
+    {
+        return op;
+    }
+    for(auto& it : sl->values)
+    {
+        if(interruptedFlow)
+        {
+            warnings.push_back(CGWarning("not reachable", it->pos));
+            break;
+        }
+        generateStmt(op, *it);
+    }
+    interruptedFlow = false;
+    return op;
+}
+
+
+bool CodeGenerator::isIntConst(Expr* ex, int64_t& value)
+{
+    if(!ex)
+    {
+        return false;
+    }
+    if(ex->et == etInt)
+    {
+        value = ZString::parseInt(ex->val.c_str());
+        return true;
+    }
+    if(ex->et == etNeg && ex->e1->et == etInt)
+    {
+        value = -ZString::parseInt(ex->val.c_str());;
+        return true;
+    }
+    if(ex->et == etVar)
+    {
+        SymInfo* ptr = si->getSymbol(ex->getSymbol());
+        if(!ptr)
+        {
+            return false;
+        }
+        if(ptr->st == sytConstant && si->globals[ptr->index].vt == vtInt)
+        {
+            value = si->globals[ptr->index].iValue;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CodeGenerator::isIntRange(Expr* ex, int64_t& start, int64_t& end, int64_t& step)
+{
+    if(ex->et != etRange)
+    {
+        return false;
+    }
+    step = 1;
+    if(!isIntConst(ex->e1, start))
+    {
+        return false;
+    }
+    if(!isIntConst(ex->e2, end))
+    {
+        return false;
+    }
+    if(ex->e3 && !isIntConst(ex->e3, step))
+    {
+        return false;
+    }
+    if(!ex->rangeIncl)
+    {
+        --end;
+    }
+    return true;
+}
+
+struct ZHashCasesGuard {
+    ZHash<OpBase*>* hash;
+    ZorroVM* vm;
+
+    ZHashCasesGuard(ZHash<OpBase*>* argHash, ZorroVM* argVm) : hash(argHash), vm(argVm)
+    {
+    }
+
+    ~ZHashCasesGuard()
+    {
+        if(hash)
+        {
+            ZHash<OpBase*>::Iterator it(*hash);
+            ZString* str;
+            OpBase** op;
+            while(it.getNext(str, op))
+            {
+                if(str->unref())
                 {
-                    si->registerScopedGlobal(new SymInfo(est.expr->e1->getSymbol().name, sytGlobalVar));
+                    str->clear(vm);
+                    vm->freeZString(str);
                 }
             }
+            delete hash;
+        }
+    }
+
+    ZHash<OpBase*>* operator->()
+    {
+        return hash;
+    }
+
+    ZHash<OpBase*>* release()
+    {
+        ZHash<OpBase*>* rv = hash;
+        hash = nullptr;
+        return rv;
+    }
+};
+
+
+//declarations are registered by fillNames and must be generated even in dead code
+static bool hasDeclarations(StmtList* sl)
+{
+    if(!sl)
+    {
+        return false;
+    }
+    for(auto& it : sl->values)
+    {
+        switch(it->st)
+        {
+            case stExpr:
+            case stListAssign:
+            case stReturn:
+            case stReturnIf:
+            case stYield:
+            case stThrow:
+            case stBreak:
+            case stNext:
+            case stRedo:
+            case stVarList:
                 break;
-            case stFuncDecl:
-            {
-                auto& f = st.as<FuncDeclStatement>();
-                checkDuplicate(f.name, "func");
-                FuncInfo* fi = si->registerFunc(f.name, f.argsCount());
-                fi->tinfo = TypeInfo(fi);
-                fi->def = &st;
-                fi->end = f.end;
-                if(deep)
-                {
-                    fillNames(f.body, deep);
+            case stIf:
+            case stWhile:
+            case stForLoop:
+            case stSwitch:
+            case stTryCatch:
+            {
+                std::vector<Expr*> subExpr;
+                std::vector<StmtList*> subStmt;
+                it->getChildData(subExpr, subStmt);
+                for(auto sub : subStmt)
+                {
+                    if(hasDeclarations(sub))
+                    {
+                        return true;
+                    }
                 }
-                si->returnScope();
             }
                 break;
-            case stNamespace:
+            default:
+                return true;
+        }
+    }
+    return false;
+}
+
+void CodeGenerator::foldStatement(Statement& st)
+{
+    switch(st.st)
+    {
+        case stExpr:
+        case stListAssign:
+        case stIf:
+        case stWhile:
+        case stReturn:
+        case stReturnIf:
+        case stYield:
+        case stForLoop:
+        case stThrow:
+        case stSwitch:
+        {
+            std::vector<Expr*> subExpr;
+            std::vector<StmtList*> subStmt;
+            st.getChildData(subExpr, subStmt);
+            //left side of list assign goes first
+            size_t lvalues = st.st == stListAssign ? st.as<ListAssignStatement>().lst1->values.size() : 0;
+            for(auto ex : subExpr)
             {
-                auto& ns = st.as<NamespaceStatement>();
-                ScopeSym* nsPtr = nullptr;
-                if(ns.ns)
+                if(ex)
                 {
-                    for(auto& nsItem : ns.ns->values)
+                    if(lvalues)
                     {
-                        if(!si->enterNamespace(nsItem))
-                        {
-                            throw CGException("not a namespace", ns.pos);
-                        }
-                        si->currentScope->end = ns.end;
+                        foldLvalue(ex);
+                    } else
+                    {
+                        foldConstants(ex);
                     }
-                } else
+                }
+                if(lvalues)
                 {
-                    char nsName[64];
-                    int l = snprintf(nsName, sizeof(nsName), "anonymous-ns-%p", &ns);
-                    ns.name = Name(vm->mkZString(nsName, static_cast<size_t>(l)), ns.pos);
-                    si->enterNamespace(ns.name);
-                    nsPtr = si->currentScope;
-                    si->currentScope->end = ns.end;
+                    --lvalues;
                 }
-                fillNames(ns.body, deep);
-                if(ns.ns)
+            }
+        }
+            break;
+        default:
+            break;
+    }
+}
+
+//sequence op without initial value only passes elements on, so its consumer can take them one by one
+static bool isPlainSeqOps(Expr* expr)
+{
+    return expr->et == etSeqOps && expr->e1->et == etVar;
+}
+
+//chain of sequence ops from outer to inner one, inner ones are plain, result is the source of inner one
+static Expr* getSeqChain(Expr* expr, std::vector<Expr*>& chain)
+{
+    chain.push_back(expr);
+    Expr* src = expr->e2;
+    while(isPlainSeqOps(src))
+    {
+        chain.push_back(src);
+        src = src->e2;
+    }
+    return src;
+}
+
+OpArg CodeGenerator::getSeqVar(Expr* seq)
+{
+    Expr* varExpr = seq->e1->et == etVar ? seq->e1 : seq->e1->e1;
+    return getArgType(varExpr, true);
+}
+
+OpArg CodeGenerator::genSeqStages(OpPair& body, const std::vector<Expr*>& chain, OpBase* step, bool& skips)
+{
+    OpArg prev;
+    for(size_t i = chain.size(); i-- > 0;)
+    {
+        Expr* seq = chain[i];
+        OpArg var = getSeqVar(seq);
+        if(i + 1 < chain.size() && !(var == prev))
+        {
+            body += new OpAssign(var, prev, atNul);
+        }
+        for(auto& opExpr : seq->lst->values)
+        {
+            switch(opExpr->et)
+            {
+                case etMapOp:
                 {
-                    for(auto& nsItem:ns.ns->values)
+                    ExprContext ec(si, var);
+                    body += generateExpr(opExpr->e1, ec);
+                }
+                    break;
+                case etGrepOp:
+                {
+                    ExprContext ec(si);
+                    body += generateExpr(opExpr->e1, ec.setIf());
+                    for(auto& jump : ec.jumps)
                     {
-                        (void) nsItem;
-                        si->returnScope();
+                        jump->elseOp = step;
                     }
-                } else
-                {
-                    si->returnScope();
-                    si->currentScope->usedNs.push_back(nsPtr);
+                    skips = true;
                 }
+                    break;
+                default:
+                    abort();
+                    break;
             }
-                break;
-            case stClass:
-            {
-                auto& c = st.as<ClassDefStatement>();
-                checkDuplicate(c.name, "class");
-                //currentClass=&c;
-                /*if(c.parent)
+        }
+        prev = var;
+    }
+    return prev;
+}
+
+static void collectVarNames(Expr* ex, std::unordered_set<std::string>& names)
+{
+    if(!ex)
+    {
+        return;
+    }
+    if(ex->et == etVar)
+    {
+        names.insert(ex->val.c_str());
+    }
+    collectVarNames(ex->e1, names);
+    collectVarNames(ex->e2, names);
+    collectVarNames(ex->e3, names);
+    if(ex->lst)
+    {
+        for(auto& it : ex->lst->values)
         {
-          SymInfo* sym=si->getSymbol(c.parent->name);
-          if(!sym)
-          {
-            throw UndefinedSymbolException(c.parent->name);
-          }
-          if(sym->st!=sytClass)
-          {
-            ZTHROW(CGException,c.parent->name.name.pos,"Symbol %{} is not class",c.parent->name.toString());
-          }
-        }*/
-                ClassInfo* ci = si->registerClass(c.name);
-                ci->tinfo = TypeInfo(ci, vtClass);
-                ci->def = &st;
-                ci->end = c.end;
-                if(deep)
+            collectVarNames(it.get(), names);
+        }
+    }
+}
+
+bool CodeGenerator::isFusableBody(StmtList* sl, const std::unordered_set<std::string>& srcNames)
+{
+    if(!sl)
+    {
+        return true;
+    }
+    for(auto& it : sl->values)
+    {
+        Statement& st = *it;
+        switch(st.st)
+        {
+            case stYield:
+                //other coroutines run while this one is suspended
+                return false;
+            case stListAssign:
+                for(auto& lv : st.as<ListAssignStatement>().lst1->values)
                 {
-                    fillNames(c.body, deep);
+                    if(lv->et != etVar || srcNames.count(lv->val.c_str()))
+                    {
+                        return false;
+                    }
                 }
-                si->returnScope();
-                //currentClass=0;
-            }
-                break;
-            case stAttr:
-            {
-                auto& a = st.as<AttrDeclStatement>();
-                checkDuplicate(a.name, "attr");
-                si->registerAttr(a.name);
-            }
                 break;
-            case stLiter:
-            {
-                auto& lst = st.as<LiterStatement>();
-                checkDuplicate(lst.name, "liter");
-                ScopeSym* curScope = si->currentScope;
-                LiterInfo* li = si->registerLiter(lst.name, lst.args->size());
-                for(auto& arg:*lst.args)
+            case stForLoop:
+                for(auto& nm : st.as<ForLoopStatement>().vars->values)
                 {
-                    ScopeSym::LiterList* curLst;
-                    ScopeSym::LiterList** ll = curScope->literMap.getPtr(arg->marker.val.get());
-                    if(!ll)
-                    {
-                        curLst = new ScopeSym::LiterList();
-                        curScope->literMap.insert(arg->marker.val.get(), curLst);
-                    } else
+                    if(srcNames.count(nm.val.c_str()))
                     {
-                        curLst = *ll;
+                        return false;
                     }
-                    curLst->push_back(li);
-                    if(!arg->optional)
+                }
+                break;
+            case stVarList:
+                for(auto& nm : st.as<VarListStatement>().vars->values)
+                {
+                    if(srcNames.count(nm.val.c_str()))
                     {
-                        break;
+                        return false;
                     }
                 }
-                for(auto& arg:*lst.args)
+                break;
+            case stTryCatch:
+            {
+                auto& tc = st.as<TryCatchStatement>();
+                if(tc.var.val && srcNames.count(tc.var.val.c_str()))
                 {
-                    li->markers.push_back(*arg);
-                    si->registerArg(arg->name);
+                    return false;
                 }
+            }
+                break;
+            default:
+                break;
+        }
+        std::vector<Expr*> subExpr;
+        std::vector<StmtList*> subStmt;
+        st.getChildData(subExpr, subStmt);
+        for(auto ex : subExpr)
+        {
+            if(!isFusableBody(ex, srcNames))
+            {
+                return false;
+            }
+        }
+        for(auto sub : subStmt)
+        {
+            if(!isFusableBody(sub, srcNames))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
 
-                si->returnScope();
+bool CodeGenerator::isFusableBody(Expr* ex, const std::unordered_set<std::string>& srcNames)
+{
+    if(!ex)
+    {
+        return true;
+    }
+    switch(ex->et)
+    {
+        case etVar:
+            if(srcNames.count(ex->val.c_str()))
+            {
+                return false;
             }
-                break;
-            case stClassMemberDef:
+            break;
+        case etCall:
+        {
+            //only natives of global namespace, they don't run script code or switch coroutines
+            if(ex->e1->et != etVar)
             {
-                auto& cmd = st.as<ClassMemberDef>();
-                si->registerMember(cmd.name);
+                return false;
             }
-                break;
-            case stEnum:
+            SymInfo* sym = si->getSymbol(ex->e1->getSymbol());
+            if(!sym || sym->st != sytFunction || !((FuncInfo*) sym)->cfunc ||
+               ((FuncInfo*) sym)->parent != &si->global)
             {
-                auto& est = st.as<EnumStatement>();
-                si->registerScopedGlobal(new SymInfo(est.name, sytConstant));
-                if(est.items)
+                return false;
+            }
+            //function passed to native can be called back
+            if(ex->lst)
+            {
+                for(auto& it : ex->lst->values)
                 {
-                    for(auto& exprPtr:est.items->values)
+                    if(it->et == etFunc)
                     {
-                        Expr& ex = *exprPtr;
-                        Name nm = ex.et == etVar ? ex.getSymbol().name : ex.e1->getSymbol().name;
-                        si->registerScopedGlobal(new SymInfo(nm, sytConstant));
+                        return false;
+                    }
+                    if(it->et == etVar)
+                    {
+                        SymInfo* arg = si->getSymbol(it->getSymbol());
+                        if(arg && (arg->st == sytFunction || arg->st == sytMethod))
+                        {
+                            return false;
+                        }
                     }
                 }
             }
-                break;
+        }
+            break;
+        case etProp:
+        case etPropOpt:
+        case etGetAttr:
+        case etLiteral:
+        case etCor:
+        case etMatch:
+        case etSeqOps:
+        case etFunc:
+            return false;
+        default:
+            break;
+    }
+    if(!isFusableBody(ex->e1, srcNames) || !isFusableBody(ex->e2, srcNames) || !isFusableBody(ex->e3, srcNames))
+    {
+        return false;
+    }
+    if(ex->lst)
+    {
+        for(auto& it : ex->lst->values)
+        {
+            if(!isFusableBody(it.get(), srcNames))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool isVarNamed(Expr* ex, const char* nm)
+{
+    return ex && ex->et == etVar && !ex->ns && !ex->global && !strcmp(ex->val.c_str(), nm);
+}
+
+//value that can't be referenced from anywhere else
+static bool isFreshValue(Expr* ex)
+{
+    switch(ex->et)
+    {
+        case etInt:
+        case etDouble:
+        case etString:
+        case etNil:
+        case etTrue:
+        case etFalse:
+        case etRange:
+        case etArray:
+        case etMap:
+        case etSet:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+  Local escapes if it is captured by nested function or, unless reads are allowed,
+  if its value is copied anywhere: assigned from non fresh value, passed, returned or referenced.
+  Element access, in place ops and iteration don't copy it.
+*/
+static bool localEscapes(StmtList* sl, const char* nm, bool inFunc, bool reads);
+
+static bool localEscapes(Expr* ex, const char* nm, bool inFunc, bool reads)
+{
+    if(!ex)
+    {
+        return false;
+    }
+    if(ex->et == etVar)
+    {
+        return isVarNamed(ex, nm) && (inFunc || !reads);
+    }
+    bool inPlace = !inFunc && !reads;
+    if(inPlace && isVarNamed(ex->e1, nm))
+    {
+        switch(ex->et)
+        {
+            case etAssign:
+                if(!isFreshValue(ex->e2))
+                {
+                    return true;
+                }
+                return localEscapes(ex->e2, nm, inFunc, reads);
+            case etSPlus:
+            case etSMinus:
+            case etSMul:
+            case etSDiv:
+            case etSMod:
+            case etPreInc:
+            case etPostInc:
+            case etPreDec:
+            case etPostDec:
+            case etIndex:
+            case etKey:
+            case etCount:
+                return localEscapes(ex->e2, nm, inFunc, reads) || localEscapes(ex->e3, nm, inFunc, reads);
             default:
                 break;
         }
     }
+    bool srcOfSeq = inPlace && ex->et == etSeqOps && isVarNamed(ex->e2, nm);
+    if(localEscapes(ex->e1, nm, inFunc, reads) || (!srcOfSeq && localEscapes(ex->e2, nm, inFunc, reads)) ||
+       localEscapes(ex->e3, nm, inFunc, reads))
+    {
+        return true;
+    }
+    if(ex->lst)
+    {
+        for(auto& it : ex->lst->values)
+        {
+            if(localEscapes(it.get(), nm, inFunc, reads))
+            {
+                return true;
+            }
+        }
+    }
+    if(ex->func)
+    {
+        std::vector<Expr*> subExpr;
+        std::vector<StmtList*> subStmt;
+        ex->func->getChildData(subExpr, subStmt);
+        for(auto sub : subExpr)
+        {
+            if(localEscapes(sub, nm, true, reads))
+            {
+                return true;
+            }
+        }
+        return localEscapes(ex->func->body, nm, true, reads);
+    }
+    return false;
 }
 
-void CodeGenerator::fillClassNames(StmtList* sl)
+static bool localEscapes(StmtList* sl, const char* nm, bool inFunc, bool reads)
 {
     if(!sl)
     {
-        return;
+        return false;
     }
     for(auto& it : sl->values)
     {
         Statement& st = *it;
-        switch(st.st)
+        bool nested = inFunc || st.st == stFuncDecl || st.st == stClass || st.st == stNamespace;
+        Expr* skip = nullptr;
+        if(st.st == stForLoop)
         {
-            case stFuncDecl:
+            auto& fst = st.as<ForLoopStatement>();
+            for(auto& v : fst.vars->values)
             {
-                auto& f = st.as<FuncDeclStatement>();
-                Name fname = f.name;
-                bool isCtor = false;
-                if(f.isOnFunc)
-                {
-                    ClassSpecialMethod csm = si->getCsm(f.name.val);
-                    isCtor = csm == csmConstructor;
-                    fname = "on " + f.name.val;
-                }
-                size_t argsCount = f.argsCount();
-                if(isCtor)
+                if(!strcmp(v.val.c_str(), nm) && (nested || !reads))
                 {
-                    argsCount = currentClass->args ? currentClass->args->size() : 0;
+                    return true;
                 }
-                si->registerMethod(fname, argsCount, !isCtor)->end = f.end;
-                si->returnScope();
             }
-                break;
-            case stClassMemberDef:
+            if(!nested && isVarNamed(fst.expr, nm))
             {
-                auto& m = st.as<ClassMemberDef>();
-                si->registerMember(m.name);
+                skip = fst.expr;
             }
-                break;
-            case stProp:
+        } else if(st.st == stListAssign)
+        {
+            for(auto& lv : st.as<ListAssignStatement>().lst1->values)
             {
-                auto& pst = st.as<PropStatement>();
-                ClassPropertyInfo* p = si->registerProperty(pst.name);
-                if(pst.getFunc)
-                {
-                    p->getMethod = si->registerMethod(pst.getFunc->name, 0);
-                    si->returnScope();
-                } else if(pst.getName.val)
+                if(isVarNamed(lv.get(), nm) && (nested || !reads))
                 {
-                    SymInfo* sym = si->getSymbol(pst.getName);
-                    if(!sym)
-                    {
-                        throw UndefinedSymbolException(pst.getName);
-                    }
-                    if(sym->st == sytClassMember)
-                    {
-                        p->getIdx = sym->index;
-                    } else if(sym->st == sytMethod)
-                    {
-                        p->getMethod = (MethodInfo*) sym;
-                        if(p->getMethod->argsCount != 0)
-                        {
-                            throw CGException("Property get method shouldn't have arguments", pst.name.pos);
-                        }
-                    } else
-                    {
-                        ZTHROW(CGException, pst.name.pos, "Incompatible symbol for property getter role: %{}",
-                               pst.name);
-                    }
+                    return true;
                 }
-                if(pst.setFunc)
-                {
-                    p->setMethod = si->registerMethod(pst.setFunc->name, 1);
-                    si->returnScope();
-                } else if(pst.setName.val)
+            }
+        }
+        std::vector<Expr*> subExpr;
+        std::vector<StmtList*> subStmt;
+        st.getChildData(subExpr, subStmt);
+        for(auto ex : subExpr)
+        {
+            if(ex != skip && localEscapes(ex, nm, nested, reads))
+            {
+                return true;
+            }
+        }
+        for(auto sub : subStmt)
+        {
+            if(localEscapes(sub, nm, nested, reads))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//variables the body assigns directly
+static void collectWrittenVars(StmtList* sl, std::vector<Symbol>& vars);
+
+static void collectWrittenVars(Expr* ex, std::vector<Symbol>& vars)
+{
+    if(!ex)
+    {
+        return;
+    }
+    switch(ex->et)
+    {
+        case etAssign:
+        case etSPlus:
+        case etSMinus:
+        case etSMul:
+        case etSDiv:
+        case etSMod:
+        case etPreInc:
+        case etPostInc:
+        case etPreDec:
+        case etPostDec:
+            if(ex->e1->et == etVar)
+            {
+                vars.push_back(ex->e1->getSymbol());
+            }
+            break;
+        default:
+            break;
+    }
+    collectWrittenVars(ex->e1, vars);
+    collectWrittenVars(ex->e2, vars);
+    collectWrittenVars(ex->e3, vars);
+    if(ex->lst)
+    {
+        for(auto& it : ex->lst->values)
+        {
+            collectWrittenVars(it.get(), vars);
+        }
+    }
+}
+
+static void collectWrittenVars(StmtList* sl, std::vector<Symbol>& vars)
+{
+    if(!sl)
+    {
+        return;
+    }
+    for(auto& it : sl->values)
+    {
+        Statement& st = *it;
+        if(st.st == stForLoop)
+        {
+            for(auto& v : st.as<ForLoopStatement>().vars->values)
+            {
+                vars.push_back(Symbol(v, nullptr, false));
+            }
+        } else if(st.st == stListAssign)
+        {
+            for(auto& lv : st.as<ListAssignStatement>().lst1->values)
+            {
+                if(lv->et == etVar)
                 {
-                    SymInfo* sym = si->getSymbol(pst.setName);
-                    if(!sym)
-                    {
-                        throw UndefinedSymbolException(pst.name);
-                    }
-                    if(sym->st == sytClassMember)
-                    {
-                        p->setIdx = sym->index;
-                    } else if(sym->st == sytMethod)
-                    {
-                        p->setMethod = (MethodInfo*) sym;
-                        if(p->setMethod->argsCount != 1)
-                        {
-                            throw CGException("Property set method must have exactly 1 argument", pst.name.pos);
-                        }
-                    } else
-                    {
-                        ZTHROW(CGException, pst.name.pos, "Incompatible symbol for property setter role:%{}", pst.name);
-                    }
+                    vars.push_back(lv->getSymbol());
                 }
             }
-                break;
-            default:
-                break;
+        } else if(st.st == stTryCatch)
+        {
+            auto& tc = st.as<TryCatchStatement>();
+            if(tc.var.val)
+            {
+                vars.push_back(Symbol(tc.var, nullptr, false));
+            }
+        }
+        std::vector<Expr*> subExpr;
+        std::vector<StmtList*> subStmt;
+        st.getChildData(subExpr, subStmt);
+        for(auto ex : subExpr)
+        {
+            collectWrittenVars(ex, vars);
+        }
+        for(auto sub : subStmt)
+        {
+            collectWrittenVars(sub, vars);
         }
     }
 }
 
-CodeGenerator::OpPair CodeGenerator::generateStmtList(StmtList* sl)
+StmtList* CodeGenerator::getScopeBody()
 {
-    OpPair op(FileLocation(), vm);
-    if(sl == nullptr)
-    {
-        return op;
-    }
-    for(auto& it : sl->values)
+    ScopeSym* scope = si->currentScope;
+    if(scope->st != sytFunction && scope->st != sytMethod)
     {
-        if(interruptedFlow)
-        {
-            warnings.push_back(CGWarning("not reachable", it->pos));
-            break;
-        }
-        generateStmt(op, *it);
+        return nullptr;
     }
-    interruptedFlow = false;
-    return op;
+    FuncInfo* fi = (FuncInfo*) scope;
+    return fi->def ? fi->def->as<FuncDeclStatement>().body : nullptr;
 }
 
-
-bool CodeGenerator::isIntConst(Expr* ex, int64_t& value)
+bool CodeGenerator::isPrivateLocal(const Symbol& var, bool reads)
 {
-    if(!ex)
+    StmtList* fbody = getScopeBody();
+    SymInfo* sym = si->getSymbol(var);
+    if(!fbody || !sym || sym->st != sytLocalVar || sym->index < ((FuncInfo*) si->currentScope)->argsCount)
     {
         return false;
     }
-    if(ex->et == etInt)
-    {
-        value = ZString::parseInt(ex->val.c_str());
-        return true;
-    }
-    if(ex->et == etNeg && ex->e1->et == etInt)
-    {
-        value = -ZString::parseInt(ex->val.c_str());;
-        return true;
-    }
-    if(ex->et == etVar)
-    {
-        SymInfo* ptr = si->getSymbol(ex->getSymbol());
-        if(!ptr)
-        {
-            return false;
-        }
-        if(ptr->st == sytConstant && si->globals[ptr->index].vt == vtInt)
-        {
-            value = si->globals[ptr->index].iValue;
-            return true;
-        }
-    }
-    return false;
+    return !localEscapes(fbody, sym->name.val.c_str(), false, reads);
 }
 
-bool CodeGenerator::isIntRange(Expr* ex, int64_t& start, int64_t& end, int64_t& step)
+bool CodeGenerator::canFuseForLoop(ForLoopStatement& fst)
 {
-    if(ex->et != etRange)
+    std::vector<Expr*> chain;
+    Expr* srcExpr = getSeqChain(fst.expr, chain);
+    //result of other expressions can be shared with anything the body touches
+    if(srcExpr->et != etVar && srcExpr->et != etRange && srcExpr->et != etArray && srcExpr->et != etMap &&
+       srcExpr->et != etSet)
     {
         return false;
     }
-    step = 1;
-    if(!isIntConst(ex->e1, start))
+    //stages of collecting loop ran before the body, so the body must not change anything they read
+    std::unordered_set<std::string> srcNames;
+    collectVarNames(fst.expr, srcNames);
+    if(!isFusableBody(fst.body, srcNames))
     {
         return false;
     }
-    if(!isIntConst(ex->e2, end))
+    //copy of the source could be changed by the body under another name
+    if(srcExpr->et == etVar && !isPrivateLocal(srcExpr->getSymbol(), false))
     {
         return false;
     }
-    if(ex->e3 && !isIntConst(ex->e3, step))
+    std::unordered_set<std::string> none;
+    bool stagesCall = false;
+    for(auto seq : chain)
     {
-        return false;
+        for(auto& opExpr : seq->lst->values)
+        {
+            if(!isFusableBody(opExpr->e1, none))
+            {
+                stagesCall = true;
+            }
+        }
     }
-    if(!ex->rangeIncl)
+    if(!stagesCall)
     {
-        --end;
+        return true;
+    }
+    //script code called by stages can read anything but locals it can't see
+    std::vector<Symbol> written;
+    collectWrittenVars(fst.body, written);
+    for(auto& v : fst.vars->values)
+    {
+        written.push_back(Symbol(v, nullptr, false));
+    }
+    for(auto& var : written)
+    {
+        if(!isPrivateLocal(var, true))
+        {
+            return false;
+        }
     }
     return true;
 }
 
-struct ZHashCasesGuard {
-    ZHash<OpBase*>* hash;
-    ZorroVM* vm;
+/*
+  for over plain sequence ops, elements go to loop variable as soon as they pass the chain,
+  break stops the chain and nothing is collected.
+*/
+void CodeGenerator::genFusedForLoop(OpPair& op, ForLoopStatement& fst)
+{
+    std::vector<Expr*> chain;
+    Expr* srcExpr = getSeqChain(fst.expr, chain);
+    ExprContext ec(si);
+    OpArg src = genArgExpr(op, srcExpr, ec);
+    Expr v1(etVar, fst.vars->values.front());
+    OpArg var = getArgType(&v1, true);
+    OpArg seqVar = getSeqVar(chain.back());
 
-    ZHashCasesGuard(ZHash<OpBase*>* argHash, ZorroVM* argVm) : hash(argHash), vm(argVm)
+    OpBase* preheader = enterLoopInvariants(op, fst.expr, fst.body, fst.vars);
+    OpArg temp(atLocal, si->acquireTemp());
+    auto* forInit = new OpForInit(seqVar, src, temp);
+    auto* forCor = new OpForCheckCoroutine(temp);
+    forCor->pos = fst.pos;
+    forInit->corOp = forCor;
+    op += forInit;
+    auto* forStep = new OpForStep(seqVar, temp);
+    forStep->corOp = forCor;
+    op += forStep;
+    OpPair body(fst.pos, vm);
+    bool skips = false;
+    OpArg last = genSeqStages(body, chain, forStep, skips);
+    if(!(last == var))
     {
+        body += new OpAssign(var, last, atNul);
     }
-
-    ~ZHashCasesGuard()
+    si->enterBlock(fst.name);
+    OpPair stmts = generateStmtList(fst.body);
+    OpBase* stmtsFirst = *stmts.first;
+    BlockInfo* blk = si->currentScope->currentBlock;
+    body += stmts;
+    if(*body.first)
     {
-        if(hash)
+        forInit->next = *body.first;
+        forCor->next = *body.first;
+        op += body;
+        if(op.cannotBeFixed() && blk->nexts.empty() && !skips)
         {
-            ZHash<OpBase*>::Iterator it(*hash);
-            ZString* str;
-            OpBase** op;
-            while(it.getNext(str, op))
-            {
-                if(str->unref())
-                {
-                    str->clear(vm);
-                    vm->freeZString(str);
-                }
-            }
-            delete hash;
+            delete forStep;
+            forStep = nullptr;
+        } else
+        {
+            op.fixLast(forStep);
         }
+    } else
+    {
+        forInit->next = forStep;
+        forCor->next = forStep;
+        forStep->next = forStep;
     }
-
-    ZHash<OpBase*>* operator->()
+    op.setLast(forCor->endOp = forInit->endOp = new OpAssign(temp, nil, atNul));
+    if(forStep)
     {
-        return hash;
+        forStep->endOp = forCor->endOp;
     }
-
-    ZHash<OpBase*>* release()
+    for(auto& next : blk->nexts)
     {
-        ZHash<OpBase*>* rv = hash;
-        hash = nullptr;
-        return rv;
+        *next = forStep;
     }
-};
-
+    for(auto& it : blk->breaks)
+    {
+        *it = forInit->endOp;
+    }
+    for(auto& redo : blk->redos)
+    {
+        *redo = stmtsFirst;
+    }
+    si->leaveBlock();
+    si->releaseTemp(temp.idx);
+    leaveLoopInvariants(op, preheader);
+    if(src.isTemporal)
+    {
+        op += new OpAssign(src, nil, atNul);
+    }
+}
 
 void CodeGenerator::generateStmt(OpPair& op, Statement& st)
 {
+    foldStatement(st);
     switch(st.st)
     {
         case stNone:
@@ -1795,6 +3517,28 @@ void CodeGenerator::generateStmt(OpPair& op, Statement& st)
         case stIf:
         {
             auto& ifst = st.as<IfStatement>();
+            bool condValue;
+            if(isConstCondition(ifst.cond, condValue) && !hasDeclarations(condValue ? ifst.elsifList : ifst.thenList) &&
+               !hasDeclarations(condValue ? ifst.elseList : nullptr))
+            {
+                if(condValue)
+                {
+                    op += generateStmtList(ifst.thenList);
+                } else if(ifst.elsifList && !ifst.elsifList->values.empty())
+                {
+                    //first elsif becomes the if
+                    std::unique_ptr<Statement> first = std::move(ifst.elsifList->values.front());
+                    ifst.elsifList->values.pop_front();
+                    IfStatement& elsif = first->as<IfStatement>();
+                    std::swap(ifst.cond, elsif.cond);
+                    std::swap(ifst.thenList, elsif.thenList);
+                    generateStmt(op, st);
+                } else
+                {
+                    op += generateStmtList(ifst.elseList);
+                }
+                break;
+            }
             ExprContext::JVector jmp;
             {
                 ExprContext ec(si);
@@ -1807,6 +3551,7 @@ void CodeGenerator::generateStmt(OpPair& op, Statement& st)
                 for(auto& eit : ifst.elsifList->values)
                 {
                     IfStatement& elsif = (*eit).as<IfStatement>();
+                    foldConstants(elsif.cond);
                     ExprContext ec(si);
                     OpArg dst = ec.mkTmpDst();
                     OpPair elsifOp(elsif.cond->pos, vm);
@@ -1853,6 +3598,12 @@ void CodeGenerator::generateStmt(OpPair& op, Statement& st)
         case stWhile:
         {
             auto& wst = st.as<WhileStatement>();
+            bool condValue;
+            if(isConstCondition(wst.cond, condValue) && !condValue && !hasDeclarations(wst.body))
+            {
+                break;
+            }
+            OpBase* preheader = enterLoopInvariants(op, wst.cond, wst.body, nullptr);
             ExprContext::JVector jmp;
             OpPair cond(wst.pos, vm);
             {
@@ -1886,6 +3637,7 @@ void CodeGenerator::generateStmt(OpPair& op, Statement& st)
             {
                 op.addFix(it->elseOp);
             }
+            leaveLoopInvariants(op, preheader);
         }
             break;
         case stForLoop:
@@ -1897,6 +3649,11 @@ void CodeGenerator::generateStmt(OpPair& op, Statement& st)
                 throw SyntaxErrorException("Invalid number of variables in for loop", fst.pos);
             }
             op.pos = st.pos;
+            if(vCnt == 1 && isPlainSeqOps(fst.expr) && canFuseForLoop(fst))
+            {
+                genFusedForLoop(op, fst);
+                break;
+            }
             //op+=OpPair(st.pos,new OpPush(atGlobal,si->nilIdx));
             OpArg target;
             bool targetTemp = false;
@@ -1921,6 +3678,7 @@ void CodeGenerator::generateStmt(OpPair& op, Statement& st)
                 var2 = getArgType(&v2, true);
             }
 
+            OpBase* preheader = enterLoopInvariants(op, fst.expr, fst.body, fst.vars);
             OpArg temp(atLocal, si->acquireTemp());
             OpForInit* forInit = vCnt == 1 ? new OpForInit(var, target, temp) : new OpForInit2(var, var2, target, temp);
             auto* forCor = new OpForCheckCoroutine(temp);
@@ -1972,6 +3730,7 @@ void CodeGenerator::generateStmt(OpPair& op, Statement& st)
             }
             si->leaveBlock();
             si->releaseTemp(temp.idx);
+            leaveLoopInvariants(op, preheader);
             if(targetTemp)
             {
                 op += new OpAssign(target, nil, atNul);
@@ -2454,6 +4213,7 @@ void CodeGenerator::generateStmt(OpPair& op, Statement& st)
                         v = IntValue(val, true);
                     } else
                     {
+                        foldConstants(ex.e2);
                         if(!fillConstant(ex.e2, v))
                         {
                             ExprContext ec(si, OpArg(atGlobal, idx));
@@ -3116,31 +4876,10 @@ OpArg CodeGenerator::getArgType(Expr* expr, bool lvalue)
             size_t idx = si->registerRegExp();
             rv.idx = idx;
             RegExpVal* rxv = si->globals[idx].regexp;
-            kst::RegExp* rx = rxv->val;
-            const char* rxSrc = expr->val->getDataPtr();
-            const char* rxEnd = rxSrc + expr->val->getDataSize();
-            int cs = expr->val->getCharSize();
-            int res;
-            if(cs == 1)
-            {
-                res = rx->CompileEx(rxSrc, rxEnd, kst::OP_PERLSTYLE | kst::OP_OPTIMIZE, '`');
-            } else
-            {
-                auto* rxSrc2 = (uint16_t*) rxSrc;
-                auto* rxEnd2 = (uint16_t*) rxEnd;
-                res = rx->CompileEx(rxSrc2, rxEnd2, kst::OP_PERLSTYLE | kst::OP_OPTIMIZE, '`');
-            }
-            if(!res)
-            {
-                //expr->val.c_str()
-                throw CGException(FORMAT("Invalid regexp %{}(%{}).", expr->val.c_str(), rx->getLastError()), expr->pos);
-            }
-            rxv->marrSize = static_cast<size_t>(rx->getBracketsCount());
-            rxv->marr = new kst::SMatch[rxv->marrSize];
-            rxv->narrSize = static_cast<size_t>(rx->getNamedBracketsCount());
-            if(rxv->narrSize)
+            if(!vm->compileRegExp(rxv, expr->val.get()))
             {
-                rxv->narr = new kst::NamedMatch[rxv->narrSize];
+                throw CGException(FORMAT("Invalid regexp %{}(%{}).", expr->val.c_str(), rxv->val->getLastError()),
+                                  expr->pos);
             }
         }
             break;
@@ -3306,7 +5045,7 @@ CodeGenerator::OpPair CodeGenerator::genBinOp(Expr* expr, ExprContext& ec)
         if(isSimple(expr->e1))
         {
             left = getArgType(expr->e1, isSelfUpdate);
-        } else
+        } else if(isSelfUpdate || !genInvariant(op, expr->e1, left))
         {
             left = ecl.mkTmpDst();
             if(isSelfUpdate)
@@ -3323,6 +5062,10 @@ CodeGenerator::OpPair CodeGenerator::genBinOp(Expr* expr, ExprContext& ec)
     {
         op += (ec.lastBinOp = new OP(left, right, dst));
     }
+    if(!isSelfUpdate)
+    {
+        addNumOpSite(ec.lastBinOp, expr);
+    }
     if(ec.ifContext)
     {
         op += ec.addJump(new OpCondJump(dst));
@@ -3340,6 +5083,7 @@ CodeGenerator::OpPair CodeGenerator::genBoolOp(Expr* expr, ExprContext& ec)
     OpJumpBase* jmp;
     op += ec.addJump(jmp = new OP(left, right));
     jmp->fallback.pos = jmp->pos;
+    addNumOpSite(jmp, expr);
     if(!ec.ifContext)
     {
         if(ec.dst.at != atStack)
@@ -3416,93 +5160,501 @@ struct ArrayInitPair {
     size_t index;
     Expr* expr;
 
-    ArrayInitPair(size_t argIndex, Expr* argExpr) : index(argIndex), expr(argExpr)
+    ArrayInitPair(size_t argIndex, Expr* argExpr) : index(argIndex), expr(argExpr)
+    {
+    }
+};
+
+struct MapInitPair {
+    Expr* key;
+    Expr* item;
+
+    MapInitPair(Expr* argKey, Expr* argItem) : key(argKey), item(argItem)
+    {
+    }
+};
+
+bool CodeGenerator::fillConstant(Expr* ex, Value& val)
+{
+    switch(ex->et)
+    {
+        case etNil:
+            val = NilValue;
+            break;
+        case etTrue:
+            val = BoolValue(true);
+            break;
+        case etFalse:
+            val = BoolValue(false);
+            break;
+        case etInt:
+            val = IntValue(ZString::parseInt(ex->val.c_str()));
+            break;
+        case etDouble:
+            val = DoubleValue(ZString::parseDouble(ex->val.c_str()));
+            break;
+        case etString:
+            val = StringValue(ex->val, true);
+            break;
+        case etNeg:
+        {
+            if(!fillConstant(ex->e1, val))
+            {
+                return false;
+            }
+            if(val.vt == vtInt)
+            {
+                val.iValue = -val.iValue;
+            } else if(val.vt == vtDouble)
+            {
+                val.dValue = -val.dValue;
+            } else
+            {
+                throw CGException("Unary minus can only be appied to integer or double", ex->e1->pos);
+            }
+        }
+            break;
+        case etArray:
+        {
+            val = ArrayValue(vm->allocZArray());
+            ZArray& za = *val.arr;
+            for(auto& it : ex->lst->values)
+            {
+                Value arrVal;
+                if(fillConstant(it.get(), arrVal))
+                {
+                    za.pushAndRef(arrVal);
+                }
+                else {
+                    za.pushAndRef(NilValue);
+                }
+            }
+        }
+            break;
+        case etVar:
+        {
+            SymInfo* ptr = si->getSymbol(ex->getSymbol());
+            if(ptr && (ptr->st == sytConstant || ptr->st == sytClass || ptr->st == sytFunction))
+            {
+                val = si->globals[ptr->index];
+                return true;
+            }
+            return false;
+        }
+        default:
+            return false;
+    }
+    return true;
+}
+
+
+bool CodeGenerator::getFoldedValue(Expr* ex, Value& val)
+{
+    switch(ex->et)
+    {
+        case etInt:
+        case etDouble:
+        case etString:
+        case etTrue:
+        case etFalse:
+            return fillConstant(ex, val);
+        case etVar:
+        {
+            //constants computed at runtime are still nil here
+            SymInfo* ptr = si->getSymbol(ex->getSymbol());
+            if(!ptr || ptr->st != sytConstant)
+            {
+                return false;
+            }
+            const Value& gv = si->globals[ptr->index];
+            if(gv.vt != vtInt && gv.vt != vtDouble && gv.vt != vtString && gv.vt != vtBool)
+            {
+                return false;
+            }
+            val = gv;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static bool isFoldedTrue(const Value& val)
+{
+    switch(val.vt)
+    {
+        case vtBool:
+            return val.bValue;
+        case vtInt:
+            return val.iValue != 0;
+        case vtDouble:
+            return val.dValue != 0;
+        default:
+            return true;
+    }
+}
+
+static bool isNumber(const Value& val)
+{
+    return val.vt == vtInt || val.vt == vtDouble;
+}
+
+static double asDouble(const Value& val)
+{
+    return val.vt == vtInt ? static_cast<double>(val.iValue) : val.dValue;
+}
+
+void CodeGenerator::replaceWithConstant(Expr* ex, const Value& val)
+{
+    ZStringRef nval;
+    ExprType et;
+    switch(val.vt)
     {
+        case vtInt:
+        {
+            char buf[ZString::maxIntChars];
+            nval = vm->mkZString(buf, ZString::formatInt(val.iValue, buf));
+            et = etInt;
+        }
+            break;
+        case vtDouble:
+        {
+            char buf[ZString::maxDoubleChars];
+            nval = vm->mkZString(buf, ZString::formatDouble(val.dValue, -1, buf));
+            et = etDouble;
+        }
+            break;
+        case vtString:
+            nval = ZStringRef(vm, val.str);
+            et = etString;
+            break;
+        default:
+            et = val.bValue ? etTrue : etFalse;
+            break;
     }
-};
+    delete ex->e1;
+    delete ex->e2;
+    ex->e1 = nullptr;
+    ex->e2 = nullptr;
+    ex->et = et;
+    ex->val = nval;
+}
 
-struct MapInitPair {
-    Expr* key;
-    Expr* item;
+void CodeGenerator::replaceWithChild(Expr* ex, Expr*& child)
+{
+    Expr* ch = child;
+    child = nullptr;
+    std::swap(ex->et, ch->et);
+    std::swap(ex->e1, ch->e1);
+    std::swap(ex->e2, ch->e2);
+    std::swap(ex->e3, ch->e3);
+    std::swap(ex->lst, ch->lst);
+    std::swap(ex->func, ch->func);
+    std::swap(ex->ns, ch->ns);
+    std::swap(ex->val, ch->val);
+    std::swap(ex->pos, ch->pos);
+    std::swap(ex->end, ch->end);
+    std::swap(ex->global, ch->global);
+    std::swap(ex->rangeIncl, ch->rangeIncl);
+    std::swap(ex->inBrackets, ch->inBrackets);
+    std::swap(ex->exprFunc, ch->exprFunc);
+    //now holds the rest of the original node
+    delete ch;
+}
 
-    MapInitPair(Expr* argKey, Expr* argItem) : key(argKey), item(argItem)
+bool CodeGenerator::foldBinary(Expr* ex, const Value& l, const Value& r, Value& rv)
+{
+    switch(ex->et)
     {
+        case etPlus:
+        case etMinus:
+        case etMul:
+            if(l.vt == vtInt && r.vt == vtInt)
+            {
+                //wrap around like the vm does
+                uint64_t a = static_cast<uint64_t>(l.iValue), b = static_cast<uint64_t>(r.iValue);
+                rv = IntValue(static_cast<int64_t>(ex->et == etPlus ? a + b : ex->et == etMinus ? a - b : a * b));
+            } else if(isNumber(l) && isNumber(r))
+            {
+                double a = asDouble(l), b = asDouble(r);
+                rv = DoubleValue(ex->et == etPlus ? a + b : ex->et == etMinus ? a - b : a * b);
+            } else if(ex->et == etPlus && l.vt == vtString && r.vt == vtString)
+            {
+                rv = StringValue(ZString::concat(vm, l.str, r.str));
+            } else
+            {
+                return false;
+            }
+            return true;
+        case etDiv:
+        case etMod:
+            //division by zero is a runtime error
+            if(l.vt == vtInt && r.vt == vtInt)
+            {
+                if(r.iValue == 0 || (r.iValue == -1 && l.iValue == INT64_MIN))
+                {
+                    return false;
+                }
+                rv = IntValue(ex->et == etDiv ? l.iValue / r.iValue : l.iValue % r.iValue);
+            } else if(isNumber(l) && isNumber(r))
+            {
+                double a = asDouble(l), b = asDouble(r);
+                if(b == 0)
+                {
+                    return false;
+                }
+                rv = DoubleValue(ex->et == etDiv ? a / b : fmod(a, b));
+            } else
+            {
+                return false;
+            }
+            return true;
+        case etBitOr:
+        case etBitAnd:
+            if(l.vt != vtInt || r.vt != vtInt)
+            {
+                return false;
+            }
+            rv = IntValue(ex->et == etBitOr ? l.iValue | r.iValue : l.iValue & r.iValue);
+            return true;
+        case etLess:
+        case etGreater:
+        case etLessEq:
+        case etGreaterEq:
+        case etEqual:
+        case etNotEqual:
+        {
+            int cmp;
+            if(l.vt == vtInt && r.vt == vtInt)
+            {
+                cmp = l.iValue < r.iValue ? -1 : l.iValue > r.iValue ? 1 : 0;
+            } else if(isNumber(l) && isNumber(r))
+            {
+                double a = asDouble(l), b = asDouble(r);
+                if(a != a || b != b)
+                {
+                    //nan is unordered
+                    return false;
+                }
+                cmp = a < b ? -1 : a > b ? 1 : 0;
+            } else if(l.vt == vtString && r.vt == vtString)
+            {
+                cmp = l.str->compare(*r.str);
+            } else if(l.vt == vtBool && r.vt == vtBool && (ex->et == etEqual || ex->et == etNotEqual))
+            {
+                cmp = l.bValue == r.bValue ? 0 : 1;
+            } else
+            {
+                return false;
+            }
+            bool res;
+            switch(ex->et)
+            {
+                case etLess:
+                    res = cmp < 0;
+                    break;
+                case etGreater:
+                    res = cmp > 0;
+                    break;
+                case etLessEq:
+                    res = cmp <= 0;
+                    break;
+                case etGreaterEq:
+                    res = cmp >= 0;
+                    break;
+                case etEqual:
+                    res = cmp == 0;
+                    break;
+                default:
+                    res = cmp != 0;
+                    break;
+            }
+            rv = BoolValue(res);
+        }
+            return true;
+        default:
+            return false;
     }
-};
+}
 
-bool CodeGenerator::fillConstant(Expr* ex, Value& val)
+void CodeGenerator::foldConstants(Expr* ex)
 {
     switch(ex->et)
     {
-        case etNil:
-            val = NilValue;
-            break;
-        case etTrue:
-            val = BoolValue(true);
-            break;
-        case etFalse:
-            val = BoolValue(false);
-            break;
-        case etInt:
-            val = IntValue(ZString::parseInt(ex->val.c_str()));
-            break;
-        case etDouble:
-            val = DoubleValue(ZString::parseDouble(ex->val.c_str()));
-            break;
-        case etString:
-            val = StringValue(ex->val, true);
-            break;
         case etNeg:
+        case etNot:
         {
-            if(!fillConstant(ex->e1, val))
+            foldConstants(ex->e1);
+            Value v;
+            if(!getFoldedValue(ex->e1, v))
             {
-                return false;
+                return;
             }
-            if(val.vt == vtInt)
+            if(ex->et == etNot)
             {
-                val.iValue = -val.iValue;
-            } else if(val.vt == vtDouble)
+                replaceWithConstant(ex, BoolValue(!isFoldedTrue(v)));
+            } else if(v.vt == vtInt)
             {
-                val.dValue = -val.dValue;
-            } else
+                replaceWithConstant(ex, IntValue(static_cast<int64_t>(0 - static_cast<uint64_t>(v.iValue))));
+            } else if(v.vt == vtDouble)
             {
-                throw CGException("Unary minus can only be appied to integer or double", ex->e1->pos);
+                replaceWithConstant(ex, DoubleValue(-v.dValue));
             }
         }
             break;
-        case etArray:
+        case etPlus:
+        case etMinus:
+        case etMul:
+        case etDiv:
+        case etMod:
+        case etBitOr:
+        case etBitAnd:
+        case etLess:
+        case etGreater:
+        case etLessEq:
+        case etGreaterEq:
+        case etEqual:
+        case etNotEqual:
         {
-            val = ArrayValue(vm->allocZArray());
-            ZArray& za = *val.arr;
-            for(auto& it : ex->lst->values)
+            foldConstants(ex->e1);
+            foldConstants(ex->e2);
+            Value l, r, rv;
+            if(getFoldedValue(ex->e1, l) && getFoldedValue(ex->e2, r) && foldBinary(ex, l, r, rv))
             {
-                Value arrVal;
-                if(fillConstant(it.get(), arrVal))
-                {
-                    za.pushAndRef(arrVal);
-                }
-                else {
-                    za.pushAndRef(NilValue);
-                }
+                //rv may be a fresh string, keep it alive until replaced
+                ZStringRef keep(vm, rv.vt == vtString ? rv.str : nullptr);
+                replaceWithConstant(ex, rv);
             }
         }
             break;
-        case etVar:
+        case etAnd:
+        case etOr:
         {
-            SymInfo* ptr = si->getSymbol(ex->getSymbol());
-            if(ptr && (ptr->st == sytConstant || ptr->st == sytClass || ptr->st == sytFunction))
+            //left operand decides which operand is the result
+            foldConstants(ex->e1);
+            foldConstants(ex->e2);
+            Value l;
+            if(getFoldedValue(ex->e1, l))
             {
-                val = si->globals[ptr->index];
-                return true;
+                replaceWithChild(ex, isFoldedTrue(l) == (ex->et == etAnd) ? ex->e2 : ex->e1);
+            }
+        }
+            break;
+        case etTernary:
+        {
+            foldConstants(ex->e1);
+            foldConstants(ex->e2);
+            foldConstants(ex->e3);
+            Value c;
+            if(getFoldedValue(ex->e1, c))
+            {
+                replaceWithChild(ex, isFoldedTrue(c) ? ex->e2 : ex->e3);
+            }
+        }
+            break;
+        case etKey:
+        {
+            //lookup in enum map with constant key
+            foldConstants(ex->e1);
+            foldConstants(ex->e2);
+            Value key;
+            if(ex->e1->et != etVar || !getFoldedValue(ex->e2, key))
+            {
+                return;
+            }
+            SymInfo* ptr = si->getSymbol(ex->e1->getSymbol());
+            if(!ptr || ptr->st != sytConstant)
+            {
+                return;
+            }
+            const Value& mv = si->globals[ptr->index];
+            if(mv.vt != vtMap || !(mv.flags & ValFlagConst))
+            {
+                return;
+            }
+            ZMap::iterator it = mv.map->find(key);
+            if(it == mv.map->end())
+            {
+                return;
+            }
+            const Value& v = it->m_value;
+            if(v.vt == vtInt || v.vt == vtDouble || v.vt == vtString || v.vt == vtBool)
+            {
+                replaceWithConstant(ex, v);
             }
-            return false;
         }
+            break;
+        case etAssign:
+        case etSPlus:
+        case etSMinus:
+        case etSMul:
+        case etSDiv:
+        case etSMod:
+        case etPreInc:
+        case etPostInc:
+        case etPreDec:
+        case etPostDec:
+        case etRef:
+        case etWeakRef:
+            foldLvalue(ex->e1);
+            if(ex->e2)
+            {
+                foldConstants(ex->e2);
+            }
+            break;
+        case etFunc:
+        case etSeqOps:
+        case etMapOp:
+        case etGrepOp:
+        case etLiteral:
+            //own scope or evaluated differently
+            break;
         default:
-            return false;
+            if(ex->e1)
+            {
+                foldConstants(ex->e1);
+            }
+            if(ex->e2)
+            {
+                foldConstants(ex->e2);
+            }
+            if(ex->e3)
+            {
+                foldConstants(ex->e3);
+            }
+            if(ex->lst)
+            {
+                for(auto& it : ex->lst->values)
+                {
+                    foldConstants(it.get());
+                }
+            }
+            break;
     }
-    return true;
 }
 
+void CodeGenerator::foldLvalue(Expr* ex)
+{
+    if(ex->et != etKey)
+    {
+        foldConstants(ex);
+        return;
+    }
+    foldConstants(ex->e1);
+    foldConstants(ex->e2);
+}
+
+bool CodeGenerator::isConstCondition(Expr* cond, bool& value)
+{
+    foldConstants(cond);
+    Value v;
+    if(!getFoldedValue(cond, v))
+    {
+        return false;
+    }
+    value = isFoldedTrue(v);
+    return true;
+}
 
 OpArg CodeGenerator::genArgExpr(OpPair& op, Expr* expr, ExprContext& ec)
 {
@@ -3510,15 +5662,27 @@ OpArg CodeGenerator::genArgExpr(OpPair& op, Expr* expr, ExprContext& ec)
     {
         return getArgType(expr, ec.lvalue);
     }
-    if(expr->et == etFunc)
+    OpArg rv;
+    if(!ec.lvalue && genInvariant(op, expr, rv))
     {
-
+        return rv;
     }
     OpArg dst = ec.mkTmpDst();
     op += generateExpr(expr, ec);
     return dst == ec.dst ? dst.tmp() : ec.dst;
 }
 
+bool CodeGenerator::canFillInPlace(const ExprContext& ec)
+{
+    return !ec.ifContext && ec.dst.at == atLocal;
+}
+
+bool CodeGenerator::isInPlaceItem(Expr* item, const OpArg& dst)
+{
+    //anything that can run code or read dst must see it untouched
+    return isSimple(item) && !(item->et == etVar && getArgType(item) == dst);
+}
+
 CodeGenerator::OpPair CodeGenerator::fillDst(const FileLocation& pos, const OpArg& src, ExprContext& ec)
 {
     if(ec.ifContext)
@@ -3591,6 +5755,16 @@ struct NamedArgInfo {
 
 CodeGenerator::OpPair CodeGenerator::generateExpr(Expr* expr, ExprContext& ec)
 {
+    if(ec.dst.at != atNul && !ec.ifContext && !ec.lvalue)
+    {
+        OpPair op(expr->pos, vm);
+        OpArg rv;
+        if(genInvariant(op, expr, rv))
+        {
+            op += fillDst(expr->pos, rv, ec);
+            return op;
+        }
+    }
     switch(expr->et)
     {
         case etPlus:
@@ -3648,6 +5822,7 @@ CodeGenerator::OpPair CodeGenerator::generateExpr(Expr* expr, ExprContext& ec)
                 {
                     size_t cnt = rxv->val->getNamedBracketsCount();
                     mop->vars = new OpArg[cnt];
+                    mop->varsCount = static_cast<index_type>(cnt);
                     for(size_t i = 0; i < cnt; ++i)
                     {
                         Expr evar(etVar, vm->mkZString(rxv->val->getName(i)));
@@ -4298,7 +6473,12 @@ CodeGenerator::OpPair CodeGenerator::generateExpr(Expr* expr, ExprContext& ec)
             {
                 return fillDst(expr->pos, arr, ec);
             }
-            OpArg dst = init.empty() ? ec.dst : OpArg(atLocal, si->acquireTemp()).tmp();
+            bool inPlace = canFillInPlace(ec);
+            for(auto& it : init)
+            {
+                inPlace = inPlace && isInPlaceItem(it.expr, ec.dst);
+            }
+            OpArg dst = init.empty() ? ec.dst : inPlace ? OpArg(atLocal, ec.dst.idx) : OpArg(atLocal, si->acquireTemp()).tmp();
             OpPair op = OpPair(expr->pos, vm, new OpMakeArray(arr, dst));
             if(!init.empty())
             {
@@ -4308,9 +6488,12 @@ CodeGenerator::OpPair CodeGenerator::generateExpr(Expr* expr, ExprContext& ec)
                     OpArg item = genArgExpr(op, it.expr, ec2);
                     op += new OpInitArrayItem(dst, item, it.index);
                 }
-                //op+=new OpAssign(ec.dst,dst,atNul);
-                op += fillDst(expr->pos, dst, ec);
-                si->releaseTemp(dst.idx);
+                if(!inPlace)
+                {
+                    //op+=new OpAssign(ec.dst,dst,atNul);
+                    op += fillDst(expr->pos, dst, ec);
+                    si->releaseTemp(dst.idx);
+                }
             }
             return op;
         }
@@ -4356,7 +6539,12 @@ CodeGenerator::OpPair CodeGenerator::generateExpr(Expr* expr, ExprContext& ec)
             {
                 return fillDst(expr->pos, map, ec);
             }
-            OpArg dst = init.empty() ? ec.dst : OpArg(atLocal, si->acquireTemp()).tmp();
+            bool inPlace = canFillInPlace(ec);
+            for(auto& it : init)
+            {
+                inPlace = inPlace && isInPlaceItem(it.key, ec.dst) && isInPlaceItem(it.item, ec.dst);
+            }
+            OpArg dst = init.empty() ? ec.dst : inPlace ? OpArg(atLocal, ec.dst.idx) : OpArg(atLocal, si->acquireTemp()).tmp();
             OpPair op = OpPair(expr->pos, vm, new OpMakeMap(map, dst));
             if(!init.empty())
             {
@@ -4368,9 +6556,12 @@ CodeGenerator::OpPair CodeGenerator::generateExpr(Expr* expr, ExprContext& ec)
                     item = genArgExpr(op, it.item, ec2);
                     op += new OpInitMapItem(dst, key, item);
                 }
-                //op+=new OpAssign(ec.dst,dst,atNul);
-                op += fillDst(expr->pos, dst, ec);
-                si->releaseTemp(dst.idx);
+                if(!inPlace)
+                {
+                    //op+=new OpAssign(ec.dst,dst,atNul);
+                    op += fillDst(expr->pos, dst, ec);
+                    si->releaseTemp(dst.idx);
+                }
             }
             return op;
         }
@@ -4630,7 +6821,7 @@ CodeGenerator::OpPair CodeGenerator::generateExpr(Expr* expr, ExprContext& ec)
                 {
                     havePrec = true;
                 }
-                if(*fmt == 'l' || *fmt == 'r' || *fmt == 'z' || *fmt == 'x' || *fmt == 'X')
+                if(*fmt == 'l' || *fmt == 'r' || *fmt == 'z' || *fmt == 'x' || *fmt == 'X' || *fmt == 's')
                 {
                     flags = OpArg(atGlobal, si->getStringConst(si->getStringConstVal(fmt)));
                 }
@@ -4790,11 +6981,13 @@ CodeGenerator::OpPair CodeGenerator::generateExpr(Expr* expr, ExprContext& ec)
                 ExprContext ec4(si, dst);
                 op += generateExpr(expr->e1, ec4);
             }
-            Expr* varExpr = expr->e1->et == etVar ? expr->e1 : expr->e1->e1;
-            OpArg var = getArgType(varExpr, true);
+            //plain sequence ops used as source run in this loop instead of building their arrays
+            std::vector<Expr*> chain;
+            Expr* srcExpr = getSeqChain(expr, chain);
+            OpArg var = getSeqVar(chain.back());
             OpArg tmp = ec2.mkTmpDst();
             ExprContext ec3(si);
-            OpArg src = genArgExpr(op, expr->e2, ec3);
+            OpArg src = genArgExpr(op, srcExpr, ec3);
             auto* forInit = new OpForInit(var, src, tmp);
             auto* forCor = new OpForCheckCoroutine(tmp);
             forCor->pos = expr->pos;
@@ -4805,32 +6998,9 @@ CodeGenerator::OpPair CodeGenerator::generateExpr(Expr* expr, ExprContext& ec)
             op += forStep;
             //si->enterBlock(Name(),forStep);
             OpPair opBody(expr->pos, vm);
-            for(auto& opExpr : expr->lst->values)
-            {
-                switch(opExpr->et)
-                {
-                    case etMapOp:
-                    {
-                        ExprContext ec4(si, var);
-                        opBody += generateExpr(opExpr->e1, ec4);
-                    }
-                        break;
-                    case etGrepOp:
-                    {
-                        ExprContext ec4(si);
-                        opBody += generateExpr(opExpr->e1, ec4.setIf());
-                        for(auto& jump : ec4.jumps)
-                        {
-                            jump->elseOp = forStep;
-                        }
-                    }
-                        break;
-                    default:
-                        abort();
-                        break;
-                }
-            }
-            opBody += new OpSAdd(dst, var, atNul);
+            bool skips = false;
+            OpArg last = genSeqStages(opBody, chain, forStep, skips);
+            opBody += new OpSAdd(dst, last, atNul);
             forInit->next = *opBody.first;
             forCor->next = *opBody.first;
             op += opBody;
@@ -1,4 +1,8 @@
 #include <utility>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
 
 #ifndef __ZORRO_CODE_GENERATOR_HPP__
 #define __ZORRO_CODE_GENERATOR_HPP__
@@ -40,6 +44,39 @@ public:
 
     void generateMacro(const Name& name, FuncParamList* args, StmtList* sl);
 
+    /*
+      Worklist type inference, replaces repeated fillTypes passes.
+      Whole program is analyzed once, after that only units (functions or top level code)
+      that read a type changed since their last analysis are analyzed again.
+      Types only grow, and each unit is analyzed at most maxTypeVisits times,
+      so inference always terminates. Unit that hits the limit may have missed
+      some types, so all slots it writes are widened to tsAny.
+    */
+    void inferTypes(StmtList* sl);
+
+    size_t typePasses = 0;
+
+    /*
+      Switches arithmetic ops and comparisons with operands inferred as int or double
+      to specialized implementations. Must be called after fillTypes.
+      Returns number of specialized ops.
+    */
+    size_t specializeNumOps();
+
+    size_t numOpsTotal = 0;
+    size_t numOpsSpecialized = 0;
+
+    /*
+      Moves loop invariant arithmetic found while generating for/while loops
+      to loop preheaders. Hoisting is done only when inferred operand types
+      show that no overloaded operator can be called, so it must be called
+      after inferTypes. Returns number of hoisted expressions.
+    */
+    size_t hoistInvariants();
+
+    size_t invariantsTotal = 0;
+    size_t invariantsHoisted = 0;
+
     typedef std::vector<CGWarning> WarnVector;
 
     WarnVector warnings;
@@ -341,12 +378,105 @@ public:
 
     bool interruptedFlow;
 
+    /* arithmetic op or comparison jump that can be specialized once types are known */
+    struct NumOpSite {
+        OpBase* op;
+        Expr* left;
+        Expr* right;
+        ScopeSym* scope;
+    };
+    std::vector<NumOpSite> numOpSites;
+
+    void addNumOpSite(OpBase* op, Expr* expr);
+
+    /* for/while loop with invariant candidates, preheader is an empty jump placed before the loop */
+    struct LoopInfo {
+        std::unordered_set<std::string> writes;
+        bool calls = false;
+        //named regexp groups assign variables not visible in the tree
+        bool writesAll = false;
+        size_t firstSite = 0;
+        Expr* cond = nullptr;
+        StmtList* body = nullptr;
+        ScopeSym* scope = nullptr;
+        OpBase* preheader = nullptr;
+    };
+    std::vector<LoopInfo> loops;
+
+    /* invariant expression computed into its own slot; first/last are its ops inside the loop */
+    struct InvariantSite {
+        size_t loop;
+        Expr* expr;
+        OpArg slot;
+        OpBase* first;
+        OpBase* last;
+        bool globalLeaves;
+        bool generated;
+    };
+    std::vector<InvariantSite> invSites;
+    std::unordered_map<const Expr*, size_t> invExprs;
+    //names used as ref targets anywhere in the program, never treated as invariant
+    std::unordered_set<std::string> refTargets;
+
+    void collectRefTargets(StmtList* sl);
+
+    void collectRefTargets(Expr* ex);
+
+    void collectLoopWrites(StmtList* sl, LoopInfo& li);
+
+    void collectLoopWrites(Expr* ex, LoopInfo& li);
+
+    bool isInvariantExpr(Expr* ex, const LoopInfo& li, bool& hasVar, bool& hasGlobal);
+
+    void findInvariants(StmtList* sl, size_t loopIdx);
+
+    void findInvariants(Expr* ex, size_t loopIdx);
+
+    OpBase* enterLoopInvariants(OpPair& op, Expr* cond, StmtList* body, NameList* vars);
+
+    void leaveLoopInvariants(OpPair& op, OpBase* preheader);
+
+    bool genInvariant(OpPair& op, Expr* expr, OpArg& rv);
+
+    bool isOverloadFree(StmtList* sl);
+
+    bool isOverloadFree(Expr* ex);
+
+    bool isNumericTree(Expr* ex);
+
+    bool isCapturedLocal(Expr* ex);
+
+    bool hoistInvariant(InvariantSite& site);
+
     void fillNames(StmtList* sl, bool deep = false);
 
     void fillClassNames(StmtList* sl);
 
     void checkDuplicate(const Name& nm, const char* type);
 
+    /* worklist inference state, unit is a function or nullptr for top level code */
+    static const size_t maxTypeVisits = 16;
+    bool typeTracking = false;
+    bool typeFillNested = true;
+    FuncInfo* typeUnit = nullptr;
+    std::unordered_map<const TypeInfo*, std::set<FuncInfo*>> typeReaders;
+    std::unordered_map<FuncInfo*, size_t> typeVisits;
+    std::unordered_map<FuncInfo*, std::set<TypeInfo*>> typeWrites;
+    std::deque<FuncInfo*> typeWorklist;
+    std::set<FuncInfo*> typeQueued;
+
+    const TypeInfo& readType(const TypeInfo& ti);
+
+    void mergeType(TypeInfo& dst, const TypeInfo& src);
+
+    void typeChanged(TypeInfo& ti);
+
+    void queueTypeUnit(FuncInfo* unit);
+
+    void widenTypeUnit(FuncInfo* unit);
+
+    void fillFuncTypes(FuncInfo* fi);
+
     void getExprType(Expr* e, TypeInfo& info);
 
     void fillTypes(StmtList* sl);
@@ -359,12 +489,62 @@ public:
 
     OpPair generateStmtList(StmtList* sl);
 
+    OpArg getSeqVar(Expr* seq);
+
+    /*
+      Map and grep stages of fused chain of sequence ops, from inner op to outer one.
+      Element is passed through variables of ops, grep jumps to step, result is variable of outer op.
+    */
+    OpArg genSeqStages(OpPair& body, const std::vector<Expr*>& chain, OpBase* step, bool& skips);
+
+    /*
+      Fused loop iterates the live source and runs stages between iterations of the body,
+      so the body must not be able to change the source or anything stages read:
+      these vars are not mentioned and no script code is called.
+    */
+    bool isFusableBody(StmtList* sl, const std::unordered_set<std::string>& srcNames);
+
+    bool isFusableBody(Expr* ex, const std::unordered_set<std::string>& srcNames);
+
+    /* body of function being generated, nullptr for top level code */
+    StmtList* getScopeBody();
+
+    /* local of current function that is not an arg and is not captured or, unless reads are allowed, copied */
+    bool isPrivateLocal(const Symbol& var, bool reads);
+
+    bool canFuseForLoop(ForLoopStatement& fst);
+
+    void genFusedForLoop(OpPair& op, ForLoopStatement& fst);
+
     void generateStmt(OpPair& op, Statement& st);
 
     bool fillConstant(Expr* expr, Value& val);
 
+    /* constant folding, rewrites expression tree in place */
+    void foldConstants(Expr* expr);
+
+    /* folds everything but the key access itself */
+    void foldLvalue(Expr* expr);
+
+    void foldStatement(Statement& st);
+
+    bool getFoldedValue(Expr* expr, Value& val);
+
+    bool foldBinary(Expr* expr, const Value& l, const Value& r, Value& rv);
+
+    void replaceWithConstant(Expr* expr, const Value& val);
+
+    void replaceWithChild(Expr* expr, Expr*& child);
+
+    bool isConstCondition(Expr* cond, bool& value);
+
     OpPair fillDst(const FileLocation& pos, const OpArg& src, ExprContext& ec);
 
+    /* container literal can be built directly in local destination instead of temporal */
+    bool canFillInPlace(const ExprContext& ec);
+
+    bool isInPlaceItem(Expr* item, const OpArg& dst);
+
     OpArg genPropGetter(const FileLocation& pos, OpPair& op, ClassPropertyInfo* cp, ExprContext& ec);
 
     void genPropSetter(const FileLocation& pos, OpPair& op, ClassPropertyInfo* cp, OpArg src);
@@ -0,0 +1,658 @@
+#include "CodeIR.hpp"
+#include "ZorroVM.hpp"
+#include "ZVMOps.hpp"
+#include "Symbolic.hpp"
+#include <algorithm>
+
+namespace zorro {
+
+IRFunction::IRFunction(IRModule* argModule, FuncInfo* argFunc, OpsVector argRoots) :
+    module(argModule), func(argFunc), roots(std::move(argRoots))
+{
+}
+
+static bool isTerminator(OpBase* op)
+{
+    return op->ot == otReturn || op->ot == otThrow;
+}
+
+void IRFunction::collectOps(OpsVector& ops, OpIndexMap& opIndex, std::vector<size_t>& predsCount)
+{
+    OpsVector stack, branches;
+    auto visit = [&](OpBase* op)
+    {
+        auto it = opIndex.find(op);
+        if(it == opIndex.end())
+        {
+            opIndex.emplace(op, ops.size());
+            ops.push_back(op);
+            predsCount.push_back(1);
+            stack.push_back(op);
+        } else
+        {
+            ++predsCount[it->second];
+        }
+    };
+    for(auto op : roots)
+    {
+        if(op)
+        {
+            visit(op);
+        }
+    }
+    while(!stack.empty())
+    {
+        OpBase* op = stack.back();
+        stack.pop_back();
+        branches.clear();
+        op->getBranches(branches);
+        //jump at the end of derived destructor continues in parent destructor code
+        if(!module->crossJumps.count(op))
+        {
+            branches.push_back(op->next);
+        }
+        for(auto br : branches)
+        {
+            if(br)
+            {
+                visit(br);
+            }
+        }
+    }
+}
+
+void IRFunction::buildBlocks(const OpsVector& ops, const OpIndexMap& opIndex, const std::vector<size_t>& predsCount)
+{
+    size_t count = ops.size();
+    OpsVector branches;
+    //ops that start a block
+    std::vector<bool> leaders(count);
+    for(auto op : roots)
+    {
+        if(op)
+        {
+            leaders[opIndex.at(op)] = true;
+        }
+    }
+    for(size_t i = 0; i < count; ++i)
+    {
+        OpBase* op = ops[i];
+        branches.clear();
+        op->getBranches(branches);
+        bool ends = !branches.empty() || module->crossJumps.count(op) || isTerminator(op);
+        for(auto br : branches)
+        {
+            if(br)
+            {
+                leaders[opIndex.at(br)] = true;
+            }
+        }
+        if(ends && op->next && !module->crossJumps.count(op))
+        {
+            leaders[opIndex.at(op->next)] = true;
+        }
+        if(predsCount[i] != 1)
+        {
+            leaders[i] = true;
+        }
+    }
+
+    std::vector<IRBlock*> byLeader(count);
+    std::vector<std::unique_ptr<IRBlock>> unordered;
+    blockOf.reserve(count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(!leaders[i])
+        {
+            continue;
+        }
+        std::unique_ptr<IRBlock> blk(new IRBlock);
+        for(OpBase* cur = ops[i];;)
+        {
+            blk->instrs.push_back(IRInstr{cur, {}, {}});
+            blockOf[cur] = blk.get();
+            branches.clear();
+            cur->getBranches(branches);
+            if(!branches.empty() || module->crossJumps.count(cur) || isTerminator(cur) || !cur->next ||
+               leaders[opIndex.at(cur->next)])
+            {
+                break;
+            }
+            cur = cur->next;
+        }
+        byLeader[i] = blk.get();
+        unordered.push_back(std::move(blk));
+    }
+
+    std::unique_ptr<IRBlock> entry(new IRBlock);
+    for(auto op : roots)
+    {
+        if(op)
+        {
+            IRBlock* rb = byLeader[opIndex.at(op)];
+            if(std::find(entry->succs.begin(), entry->succs.end(), rb) == entry->succs.end())
+            {
+                entry->succs.push_back(rb);
+            }
+        }
+    }
+    for(auto& blk : unordered)
+    {
+        OpBase* last = blk->instrs.back().op;
+        branches.clear();
+        last->getBranches(branches);
+        if(!module->crossJumps.count(last))
+        {
+            branches.push_back(last->next);
+        }
+        for(auto br : branches)
+        {
+            if(!br)
+            {
+                continue;
+            }
+            IRBlock* sb = byLeader[opIndex.at(br)];
+            if(std::find(blk->succs.begin(), blk->succs.end(), sb) == blk->succs.end())
+            {
+                blk->succs.push_back(sb);
+            }
+        }
+    }
+
+    //reverse post order from the virtual entry
+    std::vector<IRBlock*> post;
+    std::unordered_set<IRBlock*> seen{entry.get()};
+    std::vector<std::pair<IRBlock*, size_t>> stack{{entry.get(), 0}};
+    while(!stack.empty())
+    {
+        auto& top = stack.back();
+        if(top.second < top.first->succs.size())
+        {
+            IRBlock* sb = top.first->succs[top.second++];
+            if(seen.insert(sb).second)
+            {
+                stack.emplace_back(sb, 0);
+            }
+        } else
+        {
+            post.push_back(top.first);
+            stack.pop_back();
+        }
+    }
+    std::reverse(post.begin(), post.end());
+    for(auto& blk : unordered)
+    {
+        blk.release();
+    }
+    entry.release();
+    blocks.clear();
+    for(auto blk : post)
+    {
+        blk->id = blocks.size();
+        blocks.emplace_back(blk);
+    }
+    for(auto& blk : blocks)
+    {
+        for(auto sb : blk->succs)
+        {
+            sb->preds.push_back(blk.get());
+        }
+    }
+}
+
+void IRFunction::computeDominators()
+{
+    IRBlock* entry = blocks[0].get();
+    entry->idom = entry;
+    bool changed = true;
+    while(changed)
+    {
+        changed = false;
+        for(size_t i = 1; i < blocks.size(); ++i)
+        {
+            IRBlock* blk = blocks[i].get();
+            IRBlock* newIdom = nullptr;
+            for(auto p : blk->preds)
+            {
+                if(!p->idom)
+                {
+                    continue;
+                }
+                if(!newIdom)
+                {
+                    newIdom = p;
+                    continue;
+                }
+                IRBlock* a = p;
+                IRBlock* b = newIdom;
+                while(a != b)
+                {
+                    while(a->id > b->id)
+                    {
+                        a = a->idom;
+                    }
+                    while(b->id > a->id)
+                    {
+                        b = b->idom;
+                    }
+                }
+                newIdom = a;
+            }
+            if(blk->idom != newIdom)
+            {
+                blk->idom = newIdom;
+                changed = true;
+            }
+        }
+    }
+    for(size_t i = 1; i < blocks.size(); ++i)
+    {
+        IRBlock* blk = blocks[i].get();
+        blk->idom->domChildren.push_back(blk);
+        if(blk->preds.size() < 2)
+        {
+            continue;
+        }
+        for(auto p : blk->preds)
+        {
+            for(IRBlock* runner = p; runner != blk->idom; runner = runner->idom)
+            {
+                if(std::find(runner->frontier.begin(), runner->frontier.end(), blk) == runner->frontier.end())
+                {
+                    runner->frontier.push_back(blk);
+                }
+            }
+        }
+    }
+}
+
+void IRFunction::buildSSA()
+{
+    ArgsVector args;
+    //slots read before written in some block need phis, others are block local
+    std::vector<bool> crossBlock;
+    std::vector<std::vector<IRBlock*>> defBlocks;
+    //id + 1 of the last block that defined the slot
+    std::vector<size_t> definedIn;
+    auto grow = [&](index_type slot)
+    {
+        if(slot >= slotsCount)
+        {
+            slotsCount = slot + 1;
+            crossBlock.resize(slotsCount);
+            defBlocks.resize(slotsCount);
+            definedIn.resize(slotsCount);
+        }
+    };
+    for(auto& blk : blocks)
+    {
+        size_t mark = blk->id + 1;
+        for(auto& ins : blk->instrs)
+        {
+            args.clear();
+            ins.op->getArgs(args);
+            for(auto arg : args)
+            {
+                if(arg->at == atLocal)
+                {
+                    grow(arg->idx);
+                    ins.uses.push_back(IRSlotRef{arg, 0});
+                    if(definedIn[arg->idx] != mark)
+                    {
+                        crossBlock[arg->idx] = true;
+                    }
+                }
+            }
+            args.clear();
+            ins.op->getDsts(args);
+            for(auto arg : args)
+            {
+                if(arg->at == atLocal)
+                {
+                    grow(arg->idx);
+                    ins.defs.push_back(IRSlotRef{arg, 0});
+                    if(definedIn[arg->idx] != mark)
+                    {
+                        definedIn[arg->idx] = mark;
+                        defBlocks[arg->idx].push_back(blk.get());
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<IRBlock*> work;
+    //slot + 1 for which block already has phi or was queued
+    std::vector<size_t> hasPhi(blocks.size()), queued(blocks.size());
+    for(index_type slot = 0; slot < slotsCount; ++slot)
+    {
+        if(!crossBlock[slot])
+        {
+            continue;
+        }
+        size_t mark = slot + 1;
+        work = defBlocks[slot];
+        for(auto blk : work)
+        {
+            queued[blk->id] = mark;
+        }
+        while(!work.empty())
+        {
+            IRBlock* blk = work.back();
+            work.pop_back();
+            for(auto df : blk->frontier)
+            {
+                if(hasPhi[df->id] == mark)
+                {
+                    continue;
+                }
+                hasPhi[df->id] = mark;
+                df->phis.push_back(IRPhi{slot, 0, std::vector<unsigned>(df->preds.size(), 0)});
+                if(queued[df->id] != mark)
+                {
+                    queued[df->id] = mark;
+                    work.push_back(df);
+                }
+            }
+        }
+    }
+
+    std::vector<std::vector<unsigned>> stacks(slotsCount, std::vector<unsigned>(1, 0));
+    std::vector<unsigned> counters(slotsCount, 0);
+    renameBlock(blocks[0].get(), stacks, counters);
+    versionsCount = 0;
+    for(auto c : counters)
+    {
+        versionsCount += c + 1;
+    }
+}
+
+void IRFunction::renameBlock(IRBlock* blk, std::vector<std::vector<unsigned>>& stacks,
+                             std::vector<unsigned>& counters)
+{
+    //dominator tree can be deep, walk it with explicit stack
+    struct Frame {
+        IRBlock* blk;
+        std::vector<index_type> pushed;
+        size_t child;
+    };
+    std::vector<Frame> frames;
+    frames.push_back(Frame{blk, {}, 0});
+    bool entered = false;
+    while(!frames.empty())
+    {
+        Frame& fr = frames.back();
+        if(!entered)
+        {
+            IRBlock* b = fr.blk;
+            for(auto& phi : b->phis)
+            {
+                phi.version = ++counters[phi.slot];
+                stacks[phi.slot].push_back(phi.version);
+                fr.pushed.push_back(phi.slot);
+            }
+            for(auto& ins : b->instrs)
+            {
+                for(auto& use : ins.uses)
+                {
+                    use.version = stacks[use.arg->idx].back();
+                }
+                for(auto& def : ins.defs)
+                {
+                    def.version = ++counters[def.arg->idx];
+                    stacks[def.arg->idx].push_back(def.version);
+                    fr.pushed.push_back(def.arg->idx);
+                }
+            }
+            for(auto sb : b->succs)
+            {
+                size_t predIdx = std::find(sb->preds.begin(), sb->preds.end(), b) - sb->preds.begin();
+                for(auto& phi : sb->phis)
+                {
+                    phi.args[predIdx] = stacks[phi.slot].back();
+                }
+            }
+        }
+        if(fr.child < fr.blk->domChildren.size())
+        {
+            IRBlock* child = fr.blk->domChildren[fr.child++];
+            frames.push_back(Frame{child, {}, 0});
+            entered = false;
+            continue;
+        }
+        for(auto slot : fr.pushed)
+        {
+            stacks[slot].pop_back();
+        }
+        frames.pop_back();
+        entered = true;
+    }
+}
+
+void IRFunction::build()
+{
+    blocks.clear();
+    blockOf.clear();
+    slotsCount = 0;
+    OpIndexMap opIndex;
+    std::vector<size_t> predsCount;
+    OpsVector ops;
+    collectOps(ops, opIndex, predsCount);
+    buildBlocks(ops, opIndex, predsCount);
+    computeDominators();
+    buildSSA();
+}
+
+void IRFunction::forEachOp(OpsVector& ops) const
+{
+    for(auto& blk : blocks)
+    {
+        for(auto& ins : blk->instrs)
+        {
+            ops.push_back(ins.op);
+        }
+    }
+}
+
+static void dumpSlot(std::string& out, index_type slot, unsigned version)
+{
+    char buf[48];
+    snprintf(buf, sizeof(buf), "l%u.%u", static_cast<unsigned>(slot), version);
+    out += buf;
+}
+
+static void dumpBlockRef(std::string& out, const IRBlock* blk)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "b%u", static_cast<unsigned>(blk->id));
+    out += buf;
+}
+
+void IRFunction::dump(std::string& out) const
+{
+    out += "func ";
+    if(func)
+    {
+        std::string name;
+        func->fullName(name);
+        out += name;
+        out += " ";
+        out += func->name.pos.backTrace();
+    } else
+    {
+        out += "<top level>";
+    }
+    out += "\n";
+    std::string opText;
+    for(auto& blk : blocks)
+    {
+        out += "  ";
+        dumpBlockRef(out, blk.get());
+        out += ":";
+        if(!blk->preds.empty())
+        {
+            out += " preds";
+            for(auto p : blk->preds)
+            {
+                out += " ";
+                dumpBlockRef(out, p);
+            }
+        }
+        if(blk->idom && blk->idom != blk.get())
+        {
+            out += " idom ";
+            dumpBlockRef(out, blk->idom);
+        }
+        out += "\n";
+        for(auto& phi : blk->phis)
+        {
+            out += "    ";
+            dumpSlot(out, phi.slot, phi.version);
+            out += " = phi";
+            for(size_t i = 0; i < phi.args.size(); ++i)
+            {
+                out += " ";
+                dumpBlockRef(out, blk->preds[i]);
+                out += ":";
+                dumpSlot(out, phi.slot, phi.args[i]);
+            }
+            out += "\n";
+        }
+        for(auto& ins : blk->instrs)
+        {
+            out += "    ";
+            ins.op->dump(opText);
+            out += opText;
+            if(!ins.uses.empty() || !ins.defs.empty())
+            {
+                out += "  ;";
+                for(auto& use : ins.uses)
+                {
+                    out += " ";
+                    dumpSlot(out, use.arg->idx, use.version);
+                }
+                if(!ins.defs.empty())
+                {
+                    out += " ->";
+                    for(auto& def : ins.defs)
+                    {
+                        out += " ";
+                        dumpSlot(out, def.arg->idx, def.version);
+                    }
+                }
+            }
+            out += "\n";
+        }
+        if(!blk->succs.empty())
+        {
+            out += "    ->";
+            for(auto sb : blk->succs)
+            {
+                out += " ";
+                dumpBlockRef(out, sb);
+            }
+            out += "\n";
+        }
+    }
+}
+
+IRModule::IRModule(ZorroVM* argVm) : vm(argVm)
+{
+}
+
+void IRModule::build()
+{
+    SymbolsInfo& si = vm->symbols;
+    if(funcs.empty())
+    {
+        for(size_t i = 0; i < si.globalsCount; ++i)
+        {
+            const Value& v = si.globals[i];
+            if(v.vt != vtFunc && v.vt != vtMethod)
+            {
+                continue;
+            }
+            FuncInfo* f = v.func;
+            if(!f->entry)
+            {
+                continue;
+            }
+            OpsVector roots;
+            roots.push_back(f->entry);
+            roots.insert(roots.end(), f->defValEntries.begin(), f->defValEntries.end());
+            roots.push_back(f->varArgEntry);
+            roots.push_back(f->namedArgEntry);
+            roots.push_back(f->varArgEntryLast);
+            if(f->st == sytMethod && ((MethodInfo*) f)->lastOp)
+            {
+                OpBase* lastOp = ((MethodInfo*) f)->lastOp;
+                roots.push_back(lastOp);
+                crossJumps.insert(lastOp);
+                pinned.insert(lastOp->next);
+            }
+            roots.erase(std::remove(roots.begin(), roots.end(), nullptr), roots.end());
+            pinned.insert(roots.begin(), roots.end());
+            funcs.emplace_back(new IRFunction(this, f, roots));
+        }
+        OpBase* globalEntry = vm->entry.get() ? vm->entry.get()->code : nullptr;
+        if(globalEntry)
+        {
+            pinned.insert(globalEntry);
+            funcs.emplace_back(new IRFunction(this, nullptr, OpsVector{globalEntry}));
+        }
+    }
+    OpsVector ops;
+    OpsSet current;
+    for(auto& f : funcs)
+    {
+        if(!f->changed)
+        {
+            continue;
+        }
+        ops.clear();
+        f->forEachOp(ops);
+        f->build();
+        f->changed = false;
+        if(ops.empty())
+        {
+            continue;
+        }
+        //ops of a function are not shared with other functions
+        current.clear();
+        for(auto& blk : f->blocks)
+        {
+            for(auto& ins : blk->instrs)
+            {
+                current.insert(ins.op);
+            }
+        }
+        for(auto op : ops)
+        {
+            if(!current.count(op))
+            {
+                detached.insert(op);
+            }
+        }
+    }
+}
+
+size_t IRModule::releaseDetached()
+{
+    size_t rv = detached.size();
+    for(auto op : detached)
+    {
+        delete op;
+    }
+    detached.clear();
+    return rv;
+}
+
+void IRModule::dump(std::string& out) const
+{
+    for(auto& f : funcs)
+    {
+        f->dump(out);
+    }
+}
+
+}
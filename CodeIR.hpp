@@ -0,0 +1,129 @@
+#ifndef __ZORRO_CODE_IR_HPP__
+#define __ZORRO_CODE_IR_HPP__
+
+#include "ZVMOpsDefs.hpp"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace zorro {
+
+class ZorroVM;
+
+struct FuncInfo;
+
+typedef std::unordered_set<OpBase*> OpsSet;
+
+/*
+  Local slot arg of an op together with its SSA version.
+  Version 0 is the value slot has on entry.
+*/
+struct IRSlotRef {
+    OpArg* arg;
+    unsigned version;
+};
+
+struct IRInstr {
+    OpBase* op;
+    std::vector<IRSlotRef> uses;
+    std::vector<IRSlotRef> defs;
+};
+
+struct IRPhi {
+    index_type slot;
+    unsigned version;
+    //one version per predecessor, in preds order
+    std::vector<unsigned> args;
+};
+
+/*
+  Straight line sequence of ops, only the last one can branch.
+  Block 0 of each function is a virtual entry without instructions,
+  its successors are the real entry points.
+*/
+struct IRBlock {
+    size_t id;
+    std::vector<IRInstr> instrs;
+    std::vector<IRPhi> phis;
+    std::vector<IRBlock*> preds;
+    std::vector<IRBlock*> succs;
+    IRBlock* idom = nullptr;
+    std::vector<IRBlock*> domChildren;
+    std::vector<IRBlock*> frontier;
+};
+
+class IRModule;
+
+/*
+  Control flow graph of one function (or top level code) in SSA form.
+  Only atLocal slots are renamed, globals, members and closed vars are memory.
+  Exception edges are approximated by the edge from enter try to the catch block.
+*/
+class IRFunction {
+public:
+    IRFunction(IRModule* argModule, FuncInfo* argFunc, OpsVector argRoots);
+
+    IRModule* module;
+    //nullptr for top level code
+    FuncInfo* func;
+    OpsVector roots;
+    //reverse post order, blocks[0] is the virtual entry
+    std::vector<std::unique_ptr<IRBlock>> blocks;
+    std::unordered_map<OpBase*, IRBlock*> blockOf;
+    size_t slotsCount = 0;
+    size_t versionsCount = 0;
+    //set by passes that modified ops of this function, module rebuilds only changed functions
+    bool changed = true;
+
+    void build();
+
+    void forEachOp(OpsVector& ops) const;
+
+    void dump(std::string& out) const;
+
+protected:
+    //position of op in collected ops
+    typedef std::unordered_map<OpBase*, size_t> OpIndexMap;
+
+    void collectOps(OpsVector& ops, OpIndexMap& opIndex, std::vector<size_t>& predsCount);
+
+    void buildBlocks(const OpsVector& ops, const OpIndexMap& opIndex, const std::vector<size_t>& predsCount);
+
+    void computeDominators();
+
+    void buildSSA();
+
+    void renameBlock(IRBlock* blk, std::vector<std::vector<unsigned>>& stacks, std::vector<unsigned>& counters);
+};
+
+/*
+  Mid level representation of the whole program, built from generated ops.
+  Ops are shared with the VM, passes change op graph directly
+  and functions marked as changed are rebuilt after each pass.
+*/
+class IRModule {
+public:
+    explicit IRModule(ZorroVM* argVm);
+
+    ZorroVM* vm;
+    std::vector<std::unique_ptr<IRFunction>> funcs;
+    //entry points of all functions, never removed or bypassed
+    OpsSet pinned;
+    //jumps from derived destructors into parent destructor code
+    OpsSet crossJumps;
+    //ops that were part of the program but are no longer reachable
+    OpsSet detached;
+
+    /* builds changed functions */
+    void build();
+
+    /* deletes detached ops, returns number of deleted ops */
+    size_t releaseDetached();
+
+    void dump(std::string& out) const;
+};
+
+}
+
+#endif
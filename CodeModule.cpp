@@ -0,0 +1,3130 @@
+#include "CodeModule.hpp"
+#include "ZorroVM.hpp"
+#include "ZVMOps.hpp"
+#include "ZVMSched.hpp"
+#include "InputBuffer.hpp"
+#include "OutputBuffer.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_set>
+
+#ifdef _WIN32
+#include <stdio.h>
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#endif
+
+namespace zorro {
+
+const char ModuleFormat::magic[4] = {'Z', 'O', 'R', 'C'};
+
+static bool isScope(SymbolType st)
+{
+    return st == sytGlobalScope || st == sytFunction || st == sytMethod || st == sytClass || st == sytNamespace;
+}
+
+/*
+  Symbol lists of scope, stored as vectors of symbol ids.
+  Only classes have children, methods and members.
+*/
+enum ScopeList {
+    slLocals,
+    slTempSymbols,
+    slFreeTemporals,
+    slUsedNs,
+    slChildren,
+    slMethods,
+    slMembers,
+    slCount
+};
+
+static size_t getScopeListsCount(ScopeSym* s)
+{
+    return s->st == sytClass ? slCount : slChildren;
+}
+
+static void getScopeList(ScopeSym* s, size_t idx, std::vector<SymInfo*>& out)
+{
+    out.clear();
+    switch(idx)
+    {
+        case slLocals:
+            out.assign(s->locals.begin(), s->locals.end());
+            break;
+        case slTempSymbols:
+            out.assign(s->tempSymbols.begin(), s->tempSymbols.end());
+            break;
+        case slFreeTemporals:
+            out.assign(s->freeTemporals.begin(), s->freeTemporals.end());
+            break;
+        case slUsedNs:
+            out.assign(s->usedNs.begin(), s->usedNs.end());
+            break;
+        case slChildren:
+            out.assign(((ClassInfo*) s)->children.begin(), ((ClassInfo*) s)->children.end());
+            break;
+        case slMethods:
+            out.assign(((ClassInfo*) s)->methodsTable.begin(), ((ClassInfo*) s)->methodsTable.end());
+            break;
+        case slMembers:
+            out.assign(((ClassInfo*) s)->members.begin(), ((ClassInfo*) s)->members.end());
+            break;
+        default:
+            break;
+    }
+}
+
+static void setScopeList(ScopeSym* s, size_t idx, const std::vector<SymInfo*>& in)
+{
+    switch(idx)
+    {
+        case slLocals:
+            s->locals = in;
+            break;
+        case slTempSymbols:
+            s->tempSymbols.assign(in.begin(), in.end());
+            break;
+        case slFreeTemporals:
+            s->freeTemporals.assign(in.begin(), in.end());
+            break;
+        case slUsedNs:
+            s->usedNs.clear();
+            for(auto sym : in)
+            {
+                s->usedNs.push_back(static_cast<ScopeSym*>(sym));
+            }
+            break;
+        case slChildren:
+            ((ClassInfo*) s)->children.clear();
+            for(auto sym : in)
+            {
+                ((ClassInfo*) s)->children.push_back(static_cast<ClassInfo*>(sym));
+            }
+            break;
+        case slMethods:
+            ((ClassInfo*) s)->methodsTable.clear();
+            for(auto sym : in)
+            {
+                ((ClassInfo*) s)->methodsTable.push_back(static_cast<MethodInfo*>(sym));
+            }
+            break;
+        case slMembers:
+            ((ClassInfo*) s)->members.clear();
+            for(auto sym : in)
+            {
+                ((ClassInfo*) s)->members.push_back(static_cast<ClassMember*>(sym));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static size_t getScopeMapsCount(ScopeSym* s)
+{
+    return s->st == sytGlobalScope ? 5 : 2;
+}
+
+static SymMap& getScopeMap(ScopeSym* s, size_t idx)
+{
+    switch(idx)
+    {
+        case 0:
+            return s->symMap;
+        case 1:
+            return s->attrMap;
+        case 2:
+            return ((GlobalScope*) s)->sc;
+        case 3:
+            return ((GlobalScope*) s)->ic;
+        default:
+            return ((GlobalScope*) s)->dc;
+    }
+}
+
+static void getTypeSymbols(const TypeInfo& ti, std::vector<SymInfo*>& out)
+{
+    out.push_back(ti.symRef.ref);
+    for(auto& t : ti.arr)
+    {
+        getTypeSymbols(t, out);
+    }
+}
+
+/* symbols referenced by sym, can contain nullptr */
+static void getLinkedSymbols(SymInfo* sym, std::vector<SymInfo*>& out)
+{
+    getTypeSymbols(sym->tinfo, out);
+    if(sym->st == sytClassMember)
+    {
+        out.push_back(((ClassMember*) sym)->owningClass);
+    } else if(sym->st == sytProperty)
+    {
+        out.push_back(((ClassPropertyInfo*) sym)->getMethod);
+        out.push_back(((ClassPropertyInfo*) sym)->setMethod);
+    }
+    if(!isScope(sym->st))
+    {
+        return;
+    }
+    ScopeSym* s = static_cast<ScopeSym*>(sym);
+    for(size_t i = 0, cnt = getScopeMapsCount(s); i < cnt; ++i)
+    {
+        SymMap::Iterator it(getScopeMap(s, i));
+        ZString* key;
+        SymInfo** val;
+        while(it.getNext(key, val))
+        {
+            out.push_back(*val);
+        }
+    }
+    std::vector<SymInfo*> lst;
+    for(size_t i = 0, cnt = getScopeListsCount(s); i < cnt; ++i)
+    {
+        getScopeList(s, i, lst);
+        out.insert(out.end(), lst.begin(), lst.end());
+    }
+    out.push_back(s->parent);
+    if(s->st == sytFunction || s->st == sytMethod)
+    {
+        getTypeSymbols(((FuncInfo*) s)->rvtype, out);
+    }
+    if(s->st == sytMethod)
+    {
+        out.push_back(((MethodInfo*) s)->owningClass);
+    }
+    if(s->st == sytClass)
+    {
+        out.push_back(((ClassInfo*) s)->parentClass.ref);
+    }
+}
+
+static SymInfo* getValueSymbol(const Value& v)
+{
+    switch(v.vt)
+    {
+        case vtCFunc:
+        case vtFunc:
+            return v.func;
+        case vtCMethod:
+        case vtMethod:
+            return v.method;
+        case vtClass:
+            return v.classInfo;
+        default:
+            return nullptr;
+    }
+}
+
+/*
+  Appends all symbols reachable from global scope, globals and info to syms.
+  Order depends only on the order symbols were registered in,
+  so host symbols get the same ids in compiler and in loader.
+*/
+static void collectSymbols(SymbolsInfo& si, std::vector<SymInfo*>& syms,
+                           std::unordered_map<SymInfo*, uint32_t>& ids)
+{
+    auto add = [&](SymInfo* sym)
+    {
+        if(sym && ids.emplace(sym, static_cast<uint32_t>(syms.size() + 1)).second)
+        {
+            syms.push_back(sym);
+        }
+    };
+    add(&si.global);
+    for(auto sym : si.info)
+    {
+        add(sym);
+    }
+    for(size_t i = 0; i < si.globalsCount; ++i)
+    {
+        add(getValueSymbol(si.globals[i]));
+    }
+    std::vector<SymInfo*> linked;
+    for(size_t i = 0; i < syms.size(); ++i)
+    {
+        linked.clear();
+        getLinkedSymbols(syms[i], linked);
+        for(auto sym : linked)
+        {
+            add(sym);
+        }
+    }
+}
+
+static uint64_t hashBytes(uint64_t h, const void* data, size_t size)
+{
+    const uint8_t* ptr = (const uint8_t*) data;
+    for(size_t i = 0; i < size; ++i)
+    {
+        h ^= ptr[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64_t hashNum(uint64_t h, uint64_t val)
+{
+    uint8_t buf[8];
+    for(int i = 0; i < 8; ++i)
+    {
+        buf[i] = static_cast<uint8_t>(val >> (i * 8));
+    }
+    return hashBytes(h, buf, sizeof(buf));
+}
+
+static uint64_t getFingerprint(SymbolsInfo& si, const std::vector<SymInfo*>& syms)
+{
+    uint64_t h = 14695981039346656037ull;
+    h = hashNum(h, syms.size());
+    h = hashNum(h, si.globalsCount);
+    h = hashNum(h, si.info.size());
+    for(auto sym : syms)
+    {
+        h = hashNum(h, sym->st);
+        h = hashNum(h, sym->index);
+        if(sym->name.val)
+        {
+            h = hashBytes(h, sym->name.val->getDataPtr(), sym->name.val->getDataSize());
+        }
+    }
+    return h;
+}
+
+static uint64_t getChecksum(const void* data, size_t size)
+{
+    return hashBytes(14695981039346656037ull, data, size);
+}
+
+/* count of items that follow, each item takes at least itemSize bytes */
+static uint32_t readCount(InputBuffer& ib, size_t itemSize)
+{
+    uint32_t rv = ib.get32();
+    if(rv > (ib.getLen() - ib.getPos()) / itemSize)
+    {
+        throw std::runtime_error("invalid count in module");
+    }
+    return rv;
+}
+
+static void writeArg(OutputBuffer& ob, const OpArg& arg)
+{
+    ob.set8(arg.at);
+    ob.set8(arg.isTemporal ? 1 : 0);
+    ob.set32(arg.idx);
+}
+
+static OpArg readArg(InputBuffer& ib)
+{
+    OpArg rv;
+    uint8_t at = ib.get8();
+    if(at > atStack)
+    {
+        throw std::runtime_error("invalid op arg in module");
+    }
+    rv.at = static_cast<OpArgType>(at);
+    rv.isTemporal = ib.get8() != 0;
+    rv.idx = ib.get32();
+    return rv;
+}
+
+static FileLocation readLoc(InputBuffer& ib, ModuleRefs& refs)
+{
+    FileLocation rv;
+    rv.fileRd = refs.getReader(ib.get32());
+    rv.line = ib.get32();
+    rv.col = ib.get32();
+    rv.offset = ib.get32();
+    return rv;
+}
+
+/*
+  Implementation of some ops is selected by constructor from its args,
+  and passes can change args after that.
+  Variant tells which args op must be constructed with to get the same implementation,
+  real args are assigned after construction.
+*/
+static int getOpVariants(int ot)
+{
+    switch(ot)
+    {
+        case otAssign:
+        case otAdd:
+        case otSAdd:
+        case otSub:
+        case otSSub:
+        case otMul:
+        case otSMul:
+        case otDiv:
+        case otSDiv:
+        case otMod:
+        case otSMod:
+        case otGetIndex:
+        case otMakeIndex:
+        case otGetKey:
+        case otMakeKey:
+        case otGetProp:
+        case otBitOr:
+        case otBitAnd:
+        case otSetArrayItem:
+        case otSetKey:
+        case otSetProp:
+            //temporal left, temporal right, dst on stack
+            return 9;
+        case otJumpIfLess:
+        case otJumpIfGreater:
+        case otJumpIfLessEq:
+        case otJumpIfGreaterEq:
+        case otJumpIfEqual:
+        case otJumpIfNotEqual:
+        case otJumpIfNot:
+        case otJumpIfIn:
+        case otJumpIfIs:
+            //temporal left, temporal right
+            return 5;
+        case otPostInc:
+        case otPostDec:
+            //same or different src and dst
+            return 3;
+        case otReturn:
+        case otYield:
+            //constructor without result
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+static void applyVariant(int variant, OpArg& left, OpArg& right, OpArg* dst)
+{
+    if(!variant)
+    {
+        return;
+    }
+    int bits = variant - 1;
+    left.isTemporal = (bits & 1) != 0;
+    right.isTemporal = (bits & 2) != 0;
+    if(dst)
+    {
+        if(bits & 4)
+        {
+            dst->at = atStack;
+        } else if(dst->at == atStack)
+        {
+            dst->at = atLocal;
+        }
+    }
+}
+
+static OpBase* newBinOp(int ot, const OpArg& l, const OpArg& r, const OpArg& d)
+{
+    switch(ot)
+    {
+        case otAssign:
+            return new OpAssign(l, r, d);
+        case otAdd:
+            return new OpAdd(l, r, d);
+        case otSAdd:
+            return new OpSAdd(l, r, d);
+        case otSub:
+            return new OpSub(l, r, d);
+        case otSSub:
+            return new OpSSub(l, r, d);
+        case otMul:
+            return new OpMul(l, r, d);
+        case otSMul:
+            return new OpSMul(l, r, d);
+        case otDiv:
+            return new OpDiv(l, r, d);
+        case otSDiv:
+            return new OpSDiv(l, r, d);
+        case otMod:
+            return new OpMod(l, r, d);
+        case otSMod:
+            return new OpSMod(l, r, d);
+        case otGetIndex:
+            return new OpGetIndex(l, r, d);
+        case otMakeIndex:
+            return new OpMakeIndex(l, r, d);
+        case otGetKey:
+            return new OpGetKey(l, r, d);
+        case otMakeKey:
+            return new OpMakeKey(l, r, d);
+        case otGetProp:
+            return new OpGetProp(l, r, d);
+        case otBitOr:
+            return new OpBitOr(l, r, d);
+        case otBitAnd:
+            return new OpBitAnd(l, r, d);
+        case otGetPropOpt:
+            return new OpGetPropOpt(l, r, d);
+        case otMatch:
+            return new OpMatch(l, r, d);
+        default:
+            return nullptr;
+    }
+}
+
+static OpBase* newTerOp(int ot, const OpArg& l, const OpArg& a, const OpArg& r, const OpArg& d)
+{
+    switch(ot)
+    {
+        case otSetArrayItem:
+            return new OpSetArrayItem(l, a, r, d);
+        case otSetKey:
+            return new OpSetKey(l, a, r, d);
+        case otSetProp:
+            return new OpSetProp(l, a, r, d);
+        default:
+            return nullptr;
+    }
+}
+
+static OpBase* newUnOp(int ot, const OpArg& s, const OpArg& d)
+{
+    switch(ot)
+    {
+        case otMakeRef:
+            return new OpMakeRef(s, d);
+        case otMakeWeakRef:
+            return new OpMakeWeakRef(s, d);
+        case otMakeCor:
+            return new OpMakeCor(s, d);
+        case otPreInc:
+            return new OpPreInc(s, d);
+        case otPostInc:
+            return new OpPostInc(s, d);
+        case otPreDec:
+            return new OpPreDec(s, d);
+        case otPostDec:
+            return new OpPostDec(s, d);
+        case otMakeArray:
+            return new OpMakeArray(s, d);
+        case otMakeMap:
+            return new OpMakeMap(s, d);
+        case otMakeSet:
+            return new OpMakeSet(s, d);
+        case otCount:
+            return new OpCount(s, d);
+        case otNeg:
+            return new OpNeg(s, d);
+        case otNot:
+            return new OpNot(s, d);
+        case otGetType:
+            return new OpGetType(s, d);
+        case otCopy:
+            return new OpCopy(s, d);
+        default:
+            return nullptr;
+    }
+}
+
+static OpJumpIfBinOp* newJumpIfOp(int ot, const OpArg& l, const OpArg& r)
+{
+    switch(ot)
+    {
+        case otJumpIfLess:
+            return new OpJumpIfLess(l, r);
+        case otJumpIfGreater:
+            return new OpJumpIfGreater(l, r);
+        case otJumpIfLessEq:
+            return new OpJumpIfLessEq(l, r);
+        case otJumpIfGreaterEq:
+            return new OpJumpIfGreaterEq(l, r);
+        case otJumpIfEqual:
+            return new OpJumpIfEqual(l, r);
+        case otJumpIfNotEqual:
+            return new OpJumpIfNotEqual(l, r);
+        case otJumpIfNot:
+            return new OpJumpIfNot(l, r);
+        case otJumpIfIn:
+            return new OpJumpIfIn(l, r);
+        case otJumpIfIs:
+            return new OpJumpIfIs(l, r);
+        default:
+            return nullptr;
+    }
+}
+
+/*
+  Creates op from fields written by ModuleWriter::writeOpFields.
+  Returns nullptr if variant or spec is not valid for this op.
+  spec 1 and 2 are int and double specializations of numeric ops.
+*/
+static OpBase* decodeOp(ZorroVM* vm, InputBuffer& ib, ModuleRefs& refs, int ot, int variant, int spec)
+{
+    if(variant >= getOpVariants(ot) || spec > 2)
+    {
+        return nullptr;
+    }
+    OpBase* rv = nullptr;
+    switch(ot)
+    {
+        case otPush:
+            rv = new OpPush(readArg(ib));
+            break;
+        case otAssign:
+        case otAdd:
+        case otSAdd:
+        case otSub:
+        case otSSub:
+        case otMul:
+        case otSMul:
+        case otDiv:
+        case otSDiv:
+        case otMod:
+        case otSMod:
+        case otGetIndex:
+        case otMakeIndex:
+        case otGetKey:
+        case otMakeKey:
+        case otGetProp:
+        case otBitOr:
+        case otBitAnd:
+        case otGetPropOpt:
+        case otMatch:
+        {
+            OpArg l = readArg(ib);
+            OpArg r = readArg(ib);
+            OpArg d = readArg(ib);
+            OpArg cl = l, cr = r, cd = d;
+            applyVariant(variant, cl, cr, &cd);
+            OpBinOp* op = (OpBinOp*) newBinOp(ot, cl, cr, cd);
+            if(spec && !specializeNumOp(op, spec == 2))
+            {
+                delete op;
+                return nullptr;
+            }
+            op->left = l;
+            op->right = r;
+            op->dst = d;
+            if(ot == otMatch)
+            {
+                OpMatch* m = (OpMatch*) op;
+                m->varsCount = readCount(ib, 6);
+                if(m->varsCount)
+                {
+                    m->vars = new OpArg[m->varsCount];
+                    for(index_type i = 0; i < m->varsCount; ++i)
+                    {
+                        m->vars[i] = readArg(ib);
+                    }
+                }
+            }
+            return op;
+        }
+        case otSetArrayItem:
+        case otSetKey:
+        case otSetProp:
+        {
+            OpArg l = readArg(ib);
+            OpArg a = readArg(ib);
+            OpArg r = readArg(ib);
+            OpArg d = readArg(ib);
+            OpArg cl = l, cr = r, cd = d;
+            applyVariant(variant, cl, cr, &cd);
+            OpTerOp* op = (OpTerOp*) newTerOp(ot, cl, a, cr, cd);
+            op->left = l;
+            op->right = r;
+            op->dst = d;
+            rv = op;
+        }
+            break;
+        case otMakeRef:
+        case otMakeWeakRef:
+        case otMakeCor:
+        case otPreInc:
+        case otPostInc:
+        case otPreDec:
+        case otPostDec:
+        case otMakeArray:
+        case otMakeMap:
+        case otMakeSet:
+        case otCount:
+        case otNeg:
+        case otNot:
+        case otGetType:
+        case otCopy:
+        {
+            OpArg s = readArg(ib);
+            OpArg d = readArg(ib);
+            OpArg cd = d;
+            if(variant == 1)
+            {
+                cd = s;
+            } else if(variant == 2)
+            {
+                cd = OpArg(atNul);
+            }
+            OpUnOp* op = (OpUnOp*) newUnOp(ot, s, cd);
+            op->dst = d;
+            rv = op;
+        }
+            break;
+        case otMakeMemberRef:
+        {
+            OpArg obj = readArg(ib);
+            OpArg prop = readArg(ib);
+            rv = new OpMakeMemberRef(obj, prop, readArg(ib));
+        }
+            break;
+        case otInitArrayItem:
+        {
+            OpArg arr = readArg(ib);
+            OpArg item = readArg(ib);
+            rv = new OpInitArrayItem(arr, item, static_cast<size_t>(ib.get64()));
+        }
+            break;
+        case otInitMapItem:
+        {
+            OpArg map = readArg(ib);
+            OpArg key = readArg(ib);
+            rv = new OpInitMapItem(map, key, readArg(ib));
+        }
+            break;
+        case otInitSetItem:
+        {
+            OpArg set = readArg(ib);
+            rv = new OpInitSetItem(set, readArg(ib));
+        }
+            break;
+        case otMakeRange:
+        {
+            OpArg start = readArg(ib);
+            OpArg end = readArg(ib);
+            OpArg step = readArg(ib);
+            OpArg dst = readArg(ib);
+            rv = new OpMakeRange(start, end, step, dst, ib.get8() != 0);
+        }
+            break;
+        case otForInit:
+        case otForInit2:
+        {
+            OpArg dst = readArg(ib);
+            OpArg target = readArg(ib);
+            OpArg temp = readArg(ib);
+            OpForInit* op;
+            if(ot == otForInit2)
+            {
+                op = new OpForInit2(dst, readArg(ib), target, temp);
+            } else
+            {
+                op = new OpForInit(dst, target, temp);
+            }
+            refs.fixOp(&op->endOp, ib.get32());
+            refs.fixOp(&op->corOp, ib.get32());
+            rv = op;
+        }
+            break;
+        case otForStep:
+        case otForStep2:
+        {
+            OpArg var = readArg(ib);
+            OpArg temp = readArg(ib);
+            OpForStep* op;
+            if(ot == otForStep2)
+            {
+                op = new OpForStep2(var, readArg(ib), temp);
+            } else
+            {
+                op = new OpForStep(var, temp);
+            }
+            refs.fixOp(&op->endOp, ib.get32());
+            refs.fixOp(&op->corOp, ib.get32());
+            rv = op;
+        }
+            break;
+        case otForCheckCoroutine:
+        {
+            OpForCheckCoroutine* op = new OpForCheckCoroutine(readArg(ib));
+            refs.fixOp(&op->endOp, ib.get32());
+            rv = op;
+        }
+            break;
+        case otJump:
+            rv = new OpJump(nullptr, static_cast<size_t>(ib.get64()));
+            break;
+        case otJumpIfInited:
+        case otCondJump:
+        {
+            OpArg src = readArg(ib);
+            OpCondJump* op = ot == otJumpIfInited ? new OpJumpIfInited(src, nullptr) : new OpCondJump(src);
+            refs.fixOp(&op->elseOp, ib.get32());
+            op->fallback.pos = readLoc(ib, refs);
+            rv = op;
+        }
+            break;
+        case otJumpIfLess:
+        case otJumpIfGreater:
+        case otJumpIfLessEq:
+        case otJumpIfGreaterEq:
+        case otJumpIfEqual:
+        case otJumpIfNotEqual:
+        case otJumpIfNot:
+        case otJumpIfIn:
+        case otJumpIfIs:
+        {
+            OpArg l = readArg(ib);
+            OpArg r = readArg(ib);
+            OpArg cl = l, cr = r;
+            applyVariant(variant, cl, cr, nullptr);
+            OpJumpIfBinOp* op = newJumpIfOp(ot, cl, cr);
+            if(spec && !specializeNumOp(op, spec == 2))
+            {
+                delete op;
+                return nullptr;
+            }
+            op->left = l;
+            op->right = r;
+            refs.fixOp(&op->elseOp, ib.get32());
+            op->fallback.pos = readLoc(ib, refs);
+            return op;
+        }
+        case otReturn:
+        {
+            OpArg res = readArg(ib);
+            bool refReturn = ib.get8() != 0;
+            OpReturn* op = variant ? new OpReturn() : new OpReturn(res, refReturn);
+            op->result = res;
+            op->refReturn = refReturn;
+            rv = op;
+        }
+            break;
+        case otCall:
+        case otNamedArgsCall:
+        {
+            index_type args = ib.get32();
+            OpArg func = readArg(ib);
+            OpArg dst = readArg(ib);
+            if(ot == otCall)
+            {
+                rv = new OpCall(args, func, dst);
+            } else
+            {
+                rv = new OpNamedArgsCall(args, func, dst);
+            }
+        }
+            break;
+        case otCallMethod:
+        {
+            index_type args = ib.get32();
+            OpArg self = readArg(ib);
+            index_type methodIdx = ib.get32();
+            OpArg dst = readArg(ib);
+            rv = new OpCallMethod(args, self, methodIdx, dst, ib.get8() != 0);
+        }
+            break;
+        case otInitDtor:
+            rv = new OpInitDtor(static_cast<size_t>(ib.get64()));
+            break;
+        case otFinalDestroy:
+            rv = new OpFinalDestroy();
+            break;
+        case otEnterTry:
+        {
+            index_type exCount = readCount(ib, 4);
+            ClassInfo** exList = nullptr;
+            if(exCount)
+            {
+                exList = new ClassInfo* [exCount];
+                for(index_type i = 0; i < exCount; ++i)
+                {
+                    exList[i] = static_cast<ClassInfo*>(refs.getSymbol(ib.get32()));
+                }
+            }
+            index_type idx = ib.get32();
+            OpEnterTry* op = new OpEnterTry(exList, exCount, idx, nullptr);
+            refs.fixOp(&op->catchOp, ib.get32());
+            rv = op;
+        }
+            break;
+        case otLeaveCatch:
+            rv = new OpLeaveCatch();
+            break;
+        case otThrow:
+            rv = new OpThrow(readArg(ib));
+            break;
+        case otMakeClosure:
+        {
+            OpArg src = readArg(ib);
+            OpArg dst = readArg(ib);
+            OpArg self = readArg(ib);
+            index_type closedCount = readCount(ib, 6);
+            OpArg* closedVars = new OpArg[closedCount];
+            for(index_type i = 0; i < closedCount; ++i)
+            {
+                closedVars[i] = readArg(ib);
+            }
+            auto* mc = new OpMakeClosure(src, dst, self, closedCount, closedVars);
+            mc->ownClosedVars = true;
+            mc->byValue = ib.get64();
+            rv = mc;
+        }
+            break;
+        case otMakeCoroutine:
+        {
+            OpArg src = readArg(ib);
+            rv = new OpMakeCoroutine(src, readArg(ib));
+        }
+            break;
+        case otYield:
+        {
+            OpArg res = readArg(ib);
+            bool refYield = ib.get8() != 0;
+            OpYield* op = variant ? new OpYield() : new OpYield(res, refYield);
+            op->result = res;
+            op->refYield = refYield;
+            rv = op;
+        }
+            break;
+        case otEndCoroutine:
+            rv = new OpEndCoroutine();
+            break;
+        case otMakeConst:
+            rv = new OpMakeConst(readArg(ib));
+            break;
+        case otRangeSwitch:
+        {
+            OpRangeSwitch* op = new OpRangeSwitch(readArg(ib));
+            op->minValue = static_cast<int64_t>(ib.get64());
+            op->maxValue = static_cast<int64_t>(ib.get64());
+            if(op->maxValue < op->minValue ||
+               static_cast<uint64_t>(op->maxValue) - static_cast<uint64_t>(op->minValue) >=
+               (ib.getLen() - ib.getPos()) / 4)
+            {
+                delete op;
+                throw std::runtime_error("invalid range switch in module");
+            }
+            size_t count = static_cast<size_t>(op->maxValue - op->minValue + 1);
+            op->cases = new OpBase* [count];
+            for(size_t i = 0; i < count; ++i)
+            {
+                refs.fixOp(op->cases + i, ib.get32());
+            }
+            refs.fixOp(&op->defaultCase, ib.get32());
+            rv = op;
+        }
+            break;
+        case otHashSwitch:
+        {
+            OpHashSwitch* op = new OpHashSwitch(readArg(ib), vm);
+            op->cases = new ZHash<OpBase*>;
+            uint32_t count = readCount(ib, 8);
+            std::vector<std::pair<ZString*, uint32_t>> cases;
+            for(uint32_t i = 0; i < count; ++i)
+            {
+                ZString* key = refs.getString(ib.get32());
+                uint32_t target = ib.get32();
+                cases.emplace_back(key, target);
+                op->cases->insert(key, nullptr);
+            }
+            //insert can move items, so pointers are taken after all keys are in place
+            for(auto& c : cases)
+            {
+                refs.fixOp(op->cases->getPtr(c.first), c.second);
+            }
+            refs.fixOp(&op->defaultCase, ib.get32());
+            rv = op;
+        }
+            break;
+        case otFormat:
+        {
+            int w = static_cast<int>(ib.get32());
+            int p = static_cast<int>(ib.get32());
+            OpArg src = readArg(ib);
+            OpArg dst = readArg(ib);
+            OpArg width = readArg(ib);
+            OpArg prec = readArg(ib);
+            OpArg flags = readArg(ib);
+            rv = new OpFormat(w, p, src, dst, width, prec, flags, readArg(ib));
+        }
+            break;
+        case otCombine:
+        {
+            size_t count = readCount(ib, 6);
+            OpArg* args = new OpArg[count];
+            for(size_t i = 0; i < count; ++i)
+            {
+                args[i] = readArg(ib);
+            }
+            rv = new OpCombine(args, count, readArg(ib));
+        }
+            break;
+        case otGetAttr:
+        {
+            OpArg obj = readArg(ib);
+            OpArg mem = readArg(ib);
+            OpArg att = readArg(ib);
+            rv = new OpGetAttr(obj, mem, att, readArg(ib));
+        }
+            break;
+        default:
+            throw std::runtime_error(FORMAT("unsupported op %{} in module", getOpName(ot)));
+    }
+    if(spec)
+    {
+        delete rv;
+        return nullptr;
+    }
+    return rv;
+}
+
+
+ModuleWriter::ModuleWriter(ZorroVM* argVm) : vm(argVm)
+{
+    SymbolsInfo& si = vm->symbols;
+    std::unordered_map<SymInfo*, uint32_t> ids;
+    collectSymbols(si, hostSyms, ids);
+    fingerprint = getFingerprint(si, hostSyms);
+    for(auto sym : hostSyms)
+    {
+        hostRefCounts.push_back(sym->refCount);
+        //native symbol replaced by compiled code must stay alive until module is written
+        if(sym != &si.global)
+        {
+            sym->ref();
+        }
+    }
+    hostGlobals.assign(si.globals, si.globals + si.globalsCount);
+}
+
+ModuleWriter::~ModuleWriter()
+{
+    for(auto sym : hostSyms)
+    {
+        if(sym != &vm->symbols.global && sym->unref())
+        {
+            delete sym;
+        }
+    }
+}
+
+ZString* ModuleWriter::getString(uint32_t id)
+{
+    return id ? strings[id - 1] : nullptr;
+}
+
+SymInfo* ModuleWriter::getSymbol(uint32_t id)
+{
+    return id ? syms[id - 1] : nullptr;
+}
+
+FileReader* ModuleWriter::getReader(uint32_t id)
+{
+    return id ? readers[id - 1] : nullptr;
+}
+
+void ModuleWriter::fixOp(OpBase** ptr, uint32_t)
+{
+    *ptr = nullptr;
+}
+
+uint32_t ModuleWriter::strId(ZString* str)
+{
+    if(!str)
+    {
+        return 0;
+    }
+    std::string key(str->getDataPtr(), str->getDataSize());
+    auto it = stringIds.find(key);
+    if(it != stringIds.end())
+    {
+        return it->second;
+    }
+    strings.push_back(str);
+    uint32_t rv = static_cast<uint32_t>(strings.size());
+    stringIds.emplace(std::move(key), rv);
+    return rv;
+}
+
+uint32_t ModuleWriter::readerId(FileReader* rd)
+{
+    if(!rd)
+    {
+        return 0;
+    }
+    auto it = readerIds.find(rd);
+    if(it != readerIds.end())
+    {
+        return it->second;
+    }
+    //parents are registered first, loader creates them in order
+    readerId(rd->getParent().fileRd);
+    readers.push_back(rd);
+    uint32_t rv = static_cast<uint32_t>(readers.size());
+    readerIds.emplace(rd, rv);
+    return rv;
+}
+
+uint32_t ModuleWriter::symId(SymInfo* sym)
+{
+    if(!sym)
+    {
+        return 0;
+    }
+    auto it = symIds.find(sym);
+    if(it == symIds.end())
+    {
+        throw std::runtime_error(FORMAT("symbol %{} cannot be stored in module", sym->name.val.c_str()));
+    }
+    return it->second;
+}
+
+uint32_t ModuleWriter::opId(OpBase* op)
+{
+    if(!op)
+    {
+        return 0;
+    }
+    auto it = opIds.find(op);
+    if(it == opIds.end())
+    {
+        throw std::runtime_error(FORMAT("op %{} at %{} is not reachable", getOpName(op->ot), op->pos.backTrace()));
+    }
+    return it->second;
+}
+
+void ModuleWriter::writeLoc(OutputBuffer& ob, const FileLocation& loc)
+{
+    ob.set32(readerId(loc.fileRd));
+    ob.set32(loc.line);
+    ob.set32(loc.col);
+    ob.set32(loc.offset);
+}
+
+void ModuleWriter::writeType(OutputBuffer& ob, const TypeInfo& ti)
+{
+    ob.set8(static_cast<uint8_t>(ti.ts));
+    ob.set8(ti.vt);
+    ob.set32(symId(ti.symRef.ref));
+    ob.set32(static_cast<uint32_t>(ti.arr.size()));
+    for(auto& t : ti.arr)
+    {
+        writeType(ob, t);
+    }
+}
+
+void ModuleWriter::writeValue(OutputBuffer& ob, const Value& v)
+{
+    ob.set8(v.vt);
+    ob.set8(v.flags);
+    ob.set8(v.atLvalue);
+    switch(v.vt)
+    {
+        case vtNil:
+            break;
+        case vtBool:
+            ob.set8(v.bValue ? 1 : 0);
+            break;
+        case vtInt:
+            ob.set64(static_cast<uint64_t>(v.iValue));
+            break;
+        case vtDouble:
+        {
+            uint64_t bits;
+            memcpy(&bits, &v.dValue, sizeof(bits));
+            ob.set64(bits);
+        }
+            break;
+        case vtString:
+            ob.set32(strId(v.str));
+            break;
+        case vtCFunc:
+        case vtFunc:
+        case vtCMethod:
+        case vtMethod:
+        case vtClass:
+            ob.set32(symId(getValueSymbol(v)));
+            break;
+        case vtArray:
+        case vtMap:
+        case vtSet:
+        case vtRange:
+        case vtRegExp:
+        case vtObject:
+        {
+            //containers can be shared, content is written with the first reference only
+            auto it = objIds.find(v.refBase);
+            if(it != objIds.end())
+            {
+                ob.set32(it->second);
+                break;
+            }
+            uint32_t id = static_cast<uint32_t>(objIds.size() + 1);
+            objIds.emplace(v.refBase, id);
+            ob.set32(id);
+            switch(v.vt)
+            {
+                case vtArray:
+                {
+                    ZArray& za = *v.arr;
+                    ob.set32(static_cast<uint32_t>(za.getCount()));
+                    for(size_t i = 0; i < za.getCount(); ++i)
+                    {
+                        writeValue(ob, za.getItem(i));
+                    }
+                }
+                    break;
+                case vtMap:
+                    ob.set32(static_cast<uint32_t>(v.map->size()));
+                    for(auto& kv : *v.map)
+                    {
+                        writeValue(ob, kv.m_key);
+                        writeValue(ob, kv.m_value);
+                    }
+                    break;
+                case vtSet:
+                    ob.set32(static_cast<uint32_t>(v.set->size()));
+                    for(auto& item : *v.set)
+                    {
+                        writeValue(ob, item);
+                    }
+                    break;
+                case vtRange:
+                    ob.set64(static_cast<uint64_t>(v.range->start));
+                    ob.set64(static_cast<uint64_t>(v.range->end));
+                    ob.set64(static_cast<uint64_t>(v.range->step));
+                    break;
+                case vtObject:
+                {
+                    ClassInfo* ci = v.obj->classInfo;
+                    ob.set32(symId(ci));
+                    ob.set32(static_cast<uint32_t>(ci->membersCount));
+                    for(size_t i = 0; i < ci->membersCount; ++i)
+                    {
+                        writeValue(ob, v.obj->members[i]);
+                    }
+                }
+                    break;
+                default:
+                    if(!v.regexp->src)
+                    {
+                        throw std::runtime_error("regexp without source cannot be stored in module");
+                    }
+                    ob.set32(strId(v.regexp->src));
+                    break;
+            }
+        }
+            break;
+        default:
+            throw std::runtime_error(FORMAT("value of type %{} cannot be stored in module", getValueTypeName(v.vt)));
+    }
+}
+
+void ModuleWriter::writeOpFields(OutputBuffer& ob, OpBase* op)
+{
+    switch(op->ot)
+    {
+        case otPush:
+            writeArg(ob, ((OpPush*) op)->src);
+            break;
+        case otAssign:
+        case otAdd:
+        case otSAdd:
+        case otSub:
+        case otSSub:
+        case otMul:
+        case otSMul:
+        case otDiv:
+        case otSDiv:
+        case otMod:
+        case otSMod:
+        case otGetIndex:
+        case otMakeIndex:
+        case otGetKey:
+        case otMakeKey:
+        case otGetProp:
+        case otBitOr:
+        case otBitAnd:
+        case otGetPropOpt:
+        case otMatch:
+        {
+            OpBinOp* bop = (OpBinOp*) op;
+            writeArg(ob, bop->left);
+            writeArg(ob, bop->right);
+            writeArg(ob, bop->dst);
+            if(op->ot == otMatch)
+            {
+                OpMatch* m = (OpMatch*) op;
+                ob.set32(m->vars ? m->varsCount : 0);
+                for(index_type i = 0; m->vars && i < m->varsCount; ++i)
+                {
+                    writeArg(ob, m->vars[i]);
+                }
+            }
+        }
+            break;
+        case otSetArrayItem:
+        case otSetKey:
+        case otSetProp:
+        {
+            OpTerOp* top = (OpTerOp*) op;
+            writeArg(ob, top->left);
+            writeArg(ob, top->arg);
+            writeArg(ob, top->right);
+            writeArg(ob, top->dst);
+        }
+            break;
+        case otMakeRef:
+        case otMakeWeakRef:
+        case otMakeCor:
+        case otPreInc:
+        case otPostInc:
+        case otPreDec:
+        case otPostDec:
+        case otMakeArray:
+        case otMakeMap:
+        case otMakeSet:
+        case otCount:
+        case otNeg:
+        case otNot:
+        case otGetType:
+        case otCopy:
+            writeArg(ob, ((OpUnOp*) op)->src);
+            writeArg(ob, ((OpUnOp*) op)->dst);
+            break;
+        case otMakeMemberRef:
+            writeArg(ob, ((OpMakeMemberRef*) op)->obj);
+            writeArg(ob, ((OpMakeMemberRef*) op)->prop);
+            writeArg(ob, ((OpMakeMemberRef*) op)->dst);
+            break;
+        case otInitArrayItem:
+            writeArg(ob, ((OpInitArrayItem*) op)->arr);
+            writeArg(ob, ((OpInitArrayItem*) op)->item);
+            ob.set64(((OpInitArrayItem*) op)->index);
+            break;
+        case otInitMapItem:
+            writeArg(ob, ((OpInitMapItem*) op)->map);
+            writeArg(ob, ((OpInitMapItem*) op)->key);
+            writeArg(ob, ((OpInitMapItem*) op)->item);
+            break;
+        case otInitSetItem:
+            writeArg(ob, ((OpInitSetItem*) op)->set);
+            writeArg(ob, ((OpInitSetItem*) op)->item);
+            break;
+        case otMakeRange:
+        {
+            OpMakeRange* mr = (OpMakeRange*) op;
+            writeArg(ob, mr->start);
+            writeArg(ob, mr->end);
+            writeArg(ob, mr->step);
+            writeArg(ob, mr->dst);
+            ob.set8(mr->inclusive ? 1 : 0);
+        }
+            break;
+        case otForInit:
+        case otForInit2:
+        {
+            OpForInit* fi = (OpForInit*) op;
+            writeArg(ob, fi->dst);
+            writeArg(ob, fi->target);
+            writeArg(ob, fi->temp);
+            if(op->ot == otForInit2)
+            {
+                writeArg(ob, ((OpForInit2*) op)->var2);
+            }
+            ob.set32(opId(fi->endOp));
+            ob.set32(opId(fi->corOp));
+        }
+            break;
+        case otForStep:
+        case otForStep2:
+        {
+            OpForStep* fs = (OpForStep*) op;
+            writeArg(ob, fs->var);
+            writeArg(ob, fs->temp);
+            if(op->ot == otForStep2)
+            {
+                writeArg(ob, ((OpForStep2*) op)->var2);
+            }
+            ob.set32(opId(fs->endOp));
+            ob.set32(opId(fs->corOp));
+        }
+            break;
+        case otForCheckCoroutine:
+            writeArg(ob, ((OpForCheckCoroutine*) op)->temp);
+            ob.set32(opId(((OpForCheckCoroutine*) op)->endOp));
+            break;
+        case otJump:
+            ob.set64(((OpJump*) op)->localSize);
+            break;
+        case otJumpIfInited:
+        case otCondJump:
+            writeArg(ob, ((OpCondJump*) op)->src);
+            ob.set32(opId(((OpCondJump*) op)->elseOp));
+            writeLoc(ob, ((OpCondJump*) op)->fallback.pos);
+            break;
+        case otJumpIfLess:
+        case otJumpIfGreater:
+        case otJumpIfLessEq:
+        case otJumpIfGreaterEq:
+        case otJumpIfEqual:
+        case otJumpIfNotEqual:
+        case otJumpIfNot:
+        case otJumpIfIn:
+        case otJumpIfIs:
+        {
+            OpJumpIfBinOp* jop = (OpJumpIfBinOp*) op;
+            writeArg(ob, jop->left);
+            writeArg(ob, jop->right);
+            ob.set32(opId(jop->elseOp));
+            writeLoc(ob, jop->fallback.pos);
+        }
+            break;
+        case otReturn:
+            writeArg(ob, ((OpReturn*) op)->result);
+            ob.set8(((OpReturn*) op)->refReturn ? 1 : 0);
+            break;
+        case otCall:
+        case otNamedArgsCall:
+            ob.set32(((OpCallBase*) op)->args);
+            writeArg(ob, ((OpCallBase*) op)->func);
+            writeArg(ob, ((OpCallBase*) op)->dst);
+            break;
+        case otCallMethod:
+        {
+            OpCallMethod* cm = (OpCallMethod*) op;
+            ob.set32(cm->args);
+            writeArg(ob, cm->self);
+            ob.set32(cm->methodIdx);
+            writeArg(ob, cm->dst);
+            ob.set8(cm->namedArgs ? 1 : 0);
+        }
+            break;
+        case otInitDtor:
+            ob.set64(((OpInitDtor*) op)->locals);
+            break;
+        case otFinalDestroy:
+        case otLeaveCatch:
+        case otEndCoroutine:
+            break;
+        case otEnterTry:
+        {
+            OpEnterTry* et = (OpEnterTry*) op;
+            ob.set32(et->exList ? et->exCount : 0);
+            for(index_type i = 0; et->exList && i < et->exCount; ++i)
+            {
+                ob.set32(symId(et->exList[i]));
+            }
+            ob.set32(et->idx);
+            ob.set32(opId(et->catchOp));
+        }
+            break;
+        case otThrow:
+            writeArg(ob, ((OpThrow*) op)->obj);
+            break;
+        case otMakeClosure:
+        {
+            OpMakeClosure* mc = (OpMakeClosure*) op;
+            writeArg(ob, mc->src);
+            writeArg(ob, mc->dst);
+            writeArg(ob, mc->self);
+            ob.set32(mc->closedCount);
+            for(index_type i = 0; i < mc->closedCount; ++i)
+            {
+                writeArg(ob, mc->closedVars[i]);
+            }
+            ob.set64(mc->byValue);
+        }
+            break;
+        case otMakeCoroutine:
+            writeArg(ob, ((OpMakeCoroutine*) op)->src);
+            writeArg(ob, ((OpMakeCoroutine*) op)->dst);
+            break;
+        case otYield:
+            writeArg(ob, ((OpYield*) op)->result);
+            ob.set8(((OpYield*) op)->refYield ? 1 : 0);
+            break;
+        case otMakeConst:
+            writeArg(ob, ((OpMakeConst*) op)->var);
+            break;
+        case otRangeSwitch:
+        {
+            OpRangeSwitch* rs = (OpRangeSwitch*) op;
+            writeArg(ob, rs->src);
+            ob.set64(static_cast<uint64_t>(rs->minValue));
+            ob.set64(static_cast<uint64_t>(rs->maxValue));
+            for(int64_t i = 0; i <= rs->maxValue - rs->minValue; ++i)
+            {
+                ob.set32(opId(rs->cases[i]));
+            }
+            ob.set32(opId(rs->defaultCase));
+        }
+            break;
+        case otHashSwitch:
+        {
+            OpHashSwitch* hs = (OpHashSwitch*) op;
+            writeArg(ob, hs->src);
+            ob.set32(hs->cases->getCount());
+            ZHash<OpBase*>::Iterator it(*hs->cases);
+            ZString* key;
+            OpBase** val;
+            while(it.getNext(key, val))
+            {
+                ob.set32(strId(key));
+                ob.set32(opId(*val));
+            }
+            ob.set32(opId(hs->defaultCase));
+        }
+            break;
+        case otFormat:
+        {
+            OpFormat* f = (OpFormat*) op;
+            ob.set32(static_cast<uint32_t>(f->w));
+            ob.set32(static_cast<uint32_t>(f->p));
+            writeArg(ob, f->src);
+            writeArg(ob, f->dst);
+            writeArg(ob, f->width);
+            writeArg(ob, f->prec);
+            writeArg(ob, f->flags);
+            writeArg(ob, f->extra);
+        }
+            break;
+        case otCombine:
+        {
+            OpCombine* c = (OpCombine*) op;
+            ob.set32(static_cast<uint32_t>(c->count));
+            for(size_t i = 0; i < c->count; ++i)
+            {
+                writeArg(ob, c->args[i]);
+            }
+            writeArg(ob, c->dst);
+        }
+            break;
+        case otGetAttr:
+        {
+            OpGetAttr* ga = (OpGetAttr*) op;
+            writeArg(ob, ga->obj);
+            writeArg(ob, ga->mem);
+            writeArg(ob, ga->att);
+            writeArg(ob, ga->dst);
+        }
+            break;
+        default:
+            throw std::runtime_error(FORMAT("op %{} cannot be stored in module", getOpName(op->ot)));
+    }
+}
+
+void ModuleWriter::writeOp(OutputBuffer& ob, OpBase* op)
+{
+    OutputBuffer fields;
+    writeOpFields(fields, op);
+    //find construction that gives the same implementation
+    int found = -1;
+    for(int variant = 0, variants = getOpVariants(op->ot); variant < variants && found < 0; ++variant)
+    {
+        for(int spec = 0; spec <= 2; ++spec)
+        {
+            InputBuffer ib(fields.getBuf(), fields.getPos());
+            OpBase* probe = decodeOp(vm, ib, *this, op->ot, variant, spec);
+            if(!probe)
+            {
+                continue;
+            }
+            bool match = probe->op == op->op;
+            delete probe;
+            if(match)
+            {
+                found = variant * 3 + spec;
+                break;
+            }
+        }
+    }
+    if(found < 0)
+    {
+        throw std::runtime_error(FORMAT("op %{} at %{} cannot be stored in module", getOpName(op->ot),
+                                        op->pos.backTrace()));
+    }
+    ob.set8(static_cast<uint8_t>(op->ot));
+    ob.set8(static_cast<uint8_t>(found / 3));
+    ob.set8(static_cast<uint8_t>(found % 3));
+    ob.copy(fields.getPos(), fields.getBuf());
+    writeLoc(ob, op->pos);
+    ob.set32(static_cast<uint32_t>(op->seq));
+    ob.set32(opId(op->next));
+}
+
+void ModuleWriter::writeScope(OutputBuffer& ob, ScopeSym* s)
+{
+    for(size_t i = 0, cnt = getScopeMapsCount(s); i < cnt; ++i)
+    {
+        SymMap& map = getScopeMap(s, i);
+        ob.set32(map.getCount());
+        SymMap::Iterator it(map);
+        ZString* key;
+        SymInfo** val;
+        while(it.getNext(key, val))
+        {
+            ob.set32(strId(key));
+            ob.set32(symId(*val));
+        }
+    }
+    std::vector<SymInfo*> lst;
+    for(size_t i = 0, cnt = getScopeListsCount(s); i < cnt; ++i)
+    {
+        getScopeList(s, i, lst);
+        ob.set32(static_cast<uint32_t>(lst.size()));
+        for(auto sym : lst)
+        {
+            ob.set32(symId(sym));
+        }
+    }
+    ob.set32(symId(s->parent));
+    writeLoc(ob, s->end);
+    ob.set32(static_cast<uint32_t>(s->closedVars.size()));
+    for(auto& arg : s->closedVars)
+    {
+        writeArg(ob, arg);
+    }
+    ob.set32(static_cast<uint32_t>(s->closedFuncs.size()));
+    for(auto& cf : s->closedFuncs)
+    {
+        writeArg(ob, cf.src);
+        writeArg(ob, cf.dst);
+    }
+    ob.set8(s->selfClosed ? 1 : 0);
+}
+
+static void writeAttrs(OutputBuffer& ob, const AttrInfo& attrs)
+{
+    ob.set32(static_cast<uint32_t>(attrs.attrs.size()));
+    for(auto& am : attrs.attrs)
+    {
+        ob.set32(am.original);
+        ob.set32(am.mapped);
+        ob.set8(am.canBeOverriden ? 1 : 0);
+    }
+}
+
+static void readAttrs(InputBuffer& ib, AttrInfo& attrs)
+{
+    uint32_t count = ib.get32();
+    attrs.attrs.clear();
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        index_type original = ib.get32();
+        index_type mapped = ib.get32();
+        attrs.attrs.emplace_back(original, mapped);
+        attrs.attrs.back().canBeOverriden = ib.get8() != 0;
+    }
+}
+
+void ModuleWriter::writeSymBody(OutputBuffer& ob, SymInfo* sym)
+{
+    ob.set32(sym->refCount);
+    writeType(ob, sym->tinfo);
+    if(isScope(sym->st))
+    {
+        writeScope(ob, static_cast<ScopeSym*>(sym));
+    }
+    switch(sym->st)
+    {
+        case sytFunction:
+        case sytMethod:
+        {
+            FuncInfo* fi = (FuncInfo*) sym;
+            if(fi->cfunc)
+            {
+                throw std::runtime_error(FORMAT("native function %{} cannot be stored in module", fi->name.val.c_str()));
+            }
+            ob.set32(opId(fi->entry));
+            ob.set32(static_cast<uint32_t>(fi->defValEntries.size()));
+            for(auto op : fi->defValEntries)
+            {
+                ob.set32(opId(op));
+            }
+            ob.set32(opId(fi->varArgEntry));
+            ob.set32(opId(fi->namedArgEntry));
+            ob.set32(opId(fi->varArgEntryLast));
+            ob.set32(fi->argsCount);
+            ob.set32(fi->localsCount);
+            writeType(ob, fi->rvtype);
+            ob.set8(fi->namedArgs ? 1 : 0);
+            if(sym->st == sytMethod)
+            {
+                MethodInfo* mi = (MethodInfo*) sym;
+                if(mi->cmethod)
+                {
+                    throw std::runtime_error(FORMAT("native method %{} cannot be stored in module", mi->name.val.c_str()));
+                }
+                ob.set32(symId(mi->owningClass));
+                ob.set32(opId(mi->lastOp));
+                ob.set64(mi->localIndex);
+                ob.set64(mi->overIndex);
+                ob.set8(mi->specialMethod ? 1 : 0);
+            }
+        }
+            break;
+        case sytClass:
+        {
+            ClassInfo* ci = (ClassInfo*) sym;
+            ob.set32(symId(ci->parentClass.ref));
+            for(auto idx : ci->specialMethods)
+            {
+                ob.set64(idx);
+            }
+            ob.set64(ci->membersCount);
+            writeAttrs(ob, ci->attrs);
+            ob.set8(ci->nativeClass ? 1 : 0);
+        }
+            break;
+        case sytClassMember:
+            writeAttrs(ob, ((ClassMember*) sym)->attrs);
+            ob.set32(symId(((ClassMember*) sym)->owningClass));
+            break;
+        case sytProperty:
+        {
+            ClassPropertyInfo* pi = (ClassPropertyInfo*) sym;
+            ob.set64(pi->getIdx);
+            ob.set32(symId(pi->getMethod));
+            ob.set64(pi->setIdx);
+            ob.set32(symId(pi->setMethod));
+        }
+            break;
+        default:
+            break;
+    }
+}
+
+void ModuleWriter::collectOps()
+{
+    OpsVector stack, branches;
+    auto visit = [&](OpBase* op)
+    {
+        if(op && opIds.emplace(op, static_cast<uint32_t>(ops.size() + 1)).second)
+        {
+            ops.push_back(op);
+            stack.push_back(op);
+        }
+    };
+    visit(vm->entry.get() ? vm->entry.get()->code : nullptr);
+    for(size_t i = hostSyms.size(); i < syms.size(); ++i)
+    {
+        SymInfo* sym = syms[i];
+        if(sym->st != sytFunction && sym->st != sytMethod)
+        {
+            continue;
+        }
+        FuncInfo* fi = (FuncInfo*) sym;
+        visit(fi->entry);
+        for(auto op : fi->defValEntries)
+        {
+            visit(op);
+        }
+        visit(fi->varArgEntry);
+        visit(fi->namedArgEntry);
+        visit(fi->varArgEntryLast);
+        if(sym->st == sytMethod)
+        {
+            visit(((MethodInfo*) sym)->lastOp);
+        }
+    }
+    while(!stack.empty())
+    {
+        OpBase* op = stack.back();
+        stack.pop_back();
+        branches.clear();
+        op->getBranches(branches);
+        branches.push_back(op->next);
+        for(auto br : branches)
+        {
+            visit(br);
+        }
+    }
+}
+
+void ModuleWriter::write(OutputBuffer& out)
+{
+    writeImage(out, ModuleFormat::mkModule);
+}
+
+void ModuleWriter::writeSnapshot(OutputBuffer& out)
+{
+    //native call frame is the only one above top level code
+    if(vm->ctx.coroutine || vm->ctx.callStack.size() > 2)
+    {
+        throw std::runtime_error("snapshot can only be taken from top level code");
+    }
+    if(!vm->ctx.nextOp)
+    {
+        throw std::runtime_error("snapshot is taken at the end of code, nothing to continue");
+    }
+    ZScheduler* s = vm->scheduler;
+    if(s && (!s->live.empty() || !s->timers.empty() || s->ioWaiters))
+    {
+        throw std::runtime_error("snapshot cannot be taken while tasks are running");
+    }
+    writeImage(out, ModuleFormat::mkSnapshot);
+}
+
+void ModuleWriter::writeImage(OutputBuffer& out, ModuleFormat::Kind kind)
+{
+    SymbolsInfo& si = vm->symbols;
+    symIds.clear();
+    syms = hostSyms;
+    for(size_t i = 0; i < syms.size(); ++i)
+    {
+        symIds.emplace(syms[i], static_cast<uint32_t>(i + 1));
+    }
+    collectSymbols(si, syms, symIds);
+    opIds.clear();
+    ops.clear();
+    stringIds.clear();
+    strings.clear();
+    readerIds.clear();
+    readers.clear();
+    objIds.clear();
+    collectOps();
+
+    for(size_t i = 0; i < hostGlobals.size(); ++i)
+    {
+        const Value& was = hostGlobals[i];
+        const Value& now = si.globals[i];
+        if(was.vt != now.vt || was.flags != now.flags || was.iValue != now.iValue)
+        {
+            throw std::runtime_error(FORMAT("native global %{} was modified by compiled code",
+                                            si.info[i] ? si.info[i]->name.val.c_str() : "?"));
+        }
+    }
+
+    size_t hostCount = hostSyms.size();
+    OutputBuffer ob(4096);
+    ob.set32(static_cast<uint32_t>(syms.size() - hostCount));
+    for(size_t i = hostCount; i < syms.size(); ++i)
+    {
+        SymInfo* sym = syms[i];
+        if(sym->st == sytGlobalScope || sym->extra)
+        {
+            throw std::runtime_error(FORMAT("symbol %{} cannot be stored in module", sym->name.val.c_str()));
+        }
+        ob.set8(static_cast<uint8_t>(sym->st));
+        ob.set32(strId(sym->name.val.get()));
+        writeLoc(ob, sym->name.pos);
+        ob.set8(sym->closed ? 1 : 0);
+        ob.set64(sym->index);
+    }
+    ob.set32(static_cast<uint32_t>(ops.size()));
+    for(auto op : ops)
+    {
+        writeOp(ob, op);
+    }
+    for(size_t i = hostCount; i < syms.size(); ++i)
+    {
+        writeSymBody(ob, syms[i]);
+    }
+
+    //compiled code can add symbols to native scopes
+    std::vector<ScopeSym*> hostScopes;
+    for(auto sym : hostSyms)
+    {
+        if(sym->st == sytGlobalScope || sym->st == sytNamespace || sym->st == sytClass)
+        {
+            hostScopes.push_back(static_cast<ScopeSym*>(sym));
+        }
+    }
+    ob.set32(static_cast<uint32_t>(hostScopes.size()));
+    for(auto s : hostScopes)
+    {
+        ob.set32(symId(s));
+        writeScope(ob, s);
+    }
+    std::vector<std::pair<uint32_t, int32_t>> deltas;
+    for(size_t i = 0; i < hostCount; ++i)
+    {
+        if(hostSyms[i] == &si.global)
+        {
+            continue;
+        }
+        int32_t delta = static_cast<int32_t>(hostSyms[i]->refCount - 1 - hostRefCounts[i]);
+        if(delta)
+        {
+            deltas.emplace_back(static_cast<uint32_t>(i + 1), delta);
+        }
+    }
+    ob.set32(static_cast<uint32_t>(deltas.size()));
+    for(auto& d : deltas)
+    {
+        ob.set32(d.first);
+        ob.set32(static_cast<uint32_t>(d.second));
+    }
+
+    ob.set32(static_cast<uint32_t>(si.globalsCount));
+    for(size_t i = hostGlobals.size(); i < si.globalsCount; ++i)
+    {
+        writeValue(ob, si.globals[i]);
+    }
+    ob.set32(static_cast<uint32_t>(si.freeGlobals.size()));
+    for(auto idx : si.freeGlobals)
+    {
+        ob.set64(idx);
+    }
+    ob.set32(static_cast<uint32_t>(si.info.size()));
+    for(auto sym : si.info)
+    {
+        ob.set32(symId(sym));
+    }
+    if(kind == ModuleFormat::mkSnapshot)
+    {
+        size_t temporals = si.getGlobalTemporals();
+        ob.set32(static_cast<uint32_t>(temporals));
+        for(size_t i = 0; i < temporals; ++i)
+        {
+            writeValue(ob, vm->ctx.dataStack.stack[i]);
+        }
+        ob.set32(opId(vm->ctx.nextOp));
+    }
+    ob.set32(opId(vm->entry.get() ? vm->entry.get()->code : nullptr));
+
+    OutputBuffer body(ob.getPos() + 4096);
+    body.set64(fingerprint);
+    body.set32(static_cast<uint32_t>(hostCount));
+    body.set32(static_cast<uint32_t>(strings.size()));
+    for(auto str : strings)
+    {
+        body.set32(str->getDataSize());
+        body.copy(str->getDataSize(), str->getDataPtr());
+    }
+    body.set32(static_cast<uint32_t>(readers.size()));
+    for(auto rd : readers)
+    {
+        FileRegistry::Entry* e = rd->getEntry();
+        std::string name = e ? e->name : std::string();
+        body.set32(static_cast<uint32_t>(name.length()));
+        body.copy(name.length(), name.c_str());
+        writeLoc(body, rd->getParent());
+    }
+    body.copy(ob.getPos(), ob.getBuf());
+
+    out.copy(sizeof(ModuleFormat::magic), ModuleFormat::magic);
+    out.set16(ModuleFormat::version);
+    out.set8(kind);
+    out.set64(body.getPos());
+    out.set64(getChecksum(body.getBuf(), body.getPos()));
+    out.copy(body.getPos(), body.getBuf());
+}
+
+void ModuleWriter::writeFile(const std::string& fileName)
+{
+    writeImageFile(fileName, ModuleFormat::mkModule);
+}
+
+void ModuleWriter::writeSnapshotFile(const std::string& fileName)
+{
+    writeImageFile(fileName, ModuleFormat::mkSnapshot);
+}
+
+void ModuleWriter::writeImageFile(const std::string& fileName, ModuleFormat::Kind kind)
+{
+    OutputBuffer ob(65536);
+    if(kind == ModuleFormat::mkSnapshot)
+    {
+        writeSnapshot(ob);
+    } else
+    {
+        write(ob);
+    }
+    FILE* f = fopen(fileName.c_str(), "wb");
+    if(!f)
+    {
+        throw std::runtime_error(FORMAT("failed to open %{} for writing", fileName));
+    }
+    size_t written = fwrite(ob.getBuf(), 1, ob.getPos(), f);
+    if(fclose(f) != 0 || written != ob.getPos())
+    {
+        throw std::runtime_error(FORMAT("failed to write %{}", fileName));
+    }
+}
+
+
+ModuleLoader::ModuleLoader(ZorroVM* argVm, FileRegistry* argFreg) : vm(argVm), freg(argFreg)
+{
+}
+
+bool ModuleLoader::isModule(const char* fileName)
+{
+    FILE* f = fopen(fileName, "rb");
+    if(!f)
+    {
+        return false;
+    }
+    char buf[sizeof(ModuleFormat::magic)];
+    bool rv = fread(buf, 1, sizeof(buf), f) == sizeof(buf) && memcmp(buf, ModuleFormat::magic, sizeof(buf)) == 0;
+    fclose(f);
+    return rv;
+}
+
+void ModuleLoader::load(const char* fileName)
+{
+#ifdef _WIN32
+    FILE* f = fopen(fileName, "rb");
+    if(!f)
+    {
+        throw std::runtime_error(FORMAT("failed to open module %{}", fileName));
+    }
+    fseek(f, 0, SEEK_END);
+    size_t size = static_cast<size_t>(ftell(f));
+    fseek(f, 0, SEEK_SET);
+    std::vector<char> data(size);
+    size_t rd = size ? fread(&data[0], 1, size, f) : 0;
+    fclose(f);
+    if(rd != size)
+    {
+        throw std::runtime_error(FORMAT("failed to read module %{}", fileName));
+    }
+    InputBuffer ib(size ? &data[0] : nullptr, size);
+    load(ib);
+#else
+    int fd = open(fileName, O_RDONLY);
+    if(fd < 0)
+    {
+        throw std::runtime_error(FORMAT("failed to open module %{}", fileName));
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        throw std::runtime_error(FORMAT("failed to read module %{}", fileName));
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        throw std::runtime_error(FORMAT("failed to map module %{}", fileName));
+    }
+    try
+    {
+        InputBuffer ib(data, size);
+        load(ib);
+    } catch(...)
+    {
+        munmap(data, size);
+        throw;
+    }
+    munmap(data, size);
+#endif
+}
+
+ZString* ModuleLoader::getString(uint32_t id)
+{
+    if(id > strings.size())
+    {
+        throw std::runtime_error("invalid string id in module");
+    }
+    return id ? strings[id - 1].get() : nullptr;
+}
+
+SymInfo* ModuleLoader::getSymbol(uint32_t id)
+{
+    if(id > syms.size())
+    {
+        throw std::runtime_error("invalid symbol id in module");
+    }
+    return id ? syms[id - 1] : nullptr;
+}
+
+FileReader* ModuleLoader::getReader(uint32_t id)
+{
+    if(id > readers.size())
+    {
+        throw std::runtime_error("invalid file id in module");
+    }
+    return id ? readers[id - 1] : nullptr;
+}
+
+void ModuleLoader::fixOp(OpBase** ptr, uint32_t id)
+{
+    *ptr = nullptr;
+    if(id)
+    {
+        opFixes.emplace_back(ptr, id);
+    }
+}
+
+ScopeSym* ModuleLoader::getScope(uint32_t id)
+{
+    SymInfo* sym = getSymbol(id);
+    if(sym && !isScope(sym->st))
+    {
+        throw std::runtime_error("invalid scope in module");
+    }
+    return static_cast<ScopeSym*>(sym);
+}
+
+ClassInfo* ModuleLoader::getClass(uint32_t id)
+{
+    SymInfo* sym = getSymbol(id);
+    if(sym && sym->st != sytClass)
+    {
+        throw std::runtime_error("invalid class in module");
+    }
+    return static_cast<ClassInfo*>(sym);
+}
+
+void ModuleLoader::readType(InputBuffer& ib, TypeInfo& ti)
+{
+    uint8_t ts = ib.get8();
+    if(ts > tsAny)
+    {
+        throw std::runtime_error("invalid type in module");
+    }
+    ti.ts = static_cast<TypeSpec>(ts);
+    ti.vt = static_cast<ValueType>(ib.get8());
+    ti.symRef.reset(getScope(ib.get32()));
+    ti.arr.resize(readCount(ib, 6));
+    for(auto& t : ti.arr)
+    {
+        readType(ib, t);
+    }
+}
+
+Value ModuleLoader::readValue(InputBuffer& ib)
+{
+    Value rv;
+    rv.vt = ib.get8();
+    rv.flags = ib.get8();
+    rv.atLvalue = ib.get8();
+    rv.iValue = 0;
+    switch(rv.vt)
+    {
+        case vtNil:
+            break;
+        case vtBool:
+            rv.bValue = ib.get8() != 0;
+            break;
+        case vtInt:
+            rv.iValue = static_cast<int64_t>(ib.get64());
+            break;
+        case vtDouble:
+        {
+            uint64_t bits = ib.get64();
+            memcpy(&rv.dValue, &bits, sizeof(bits));
+        }
+            break;
+        case vtString:
+            rv.str = getString(ib.get32());
+            if(!rv.str)
+            {
+                throw std::runtime_error("invalid string value in module");
+            }
+            rv.str->ref();
+            break;
+        case vtCFunc:
+        case vtFunc:
+        {
+            SymInfo* sym = getSymbol(ib.get32());
+            if(!sym || (sym->st != sytFunction && sym->st != sytMethod) ||
+               (rv.vt == vtCFunc) != (static_cast<FuncInfo*>(sym)->cfunc != nullptr))
+            {
+                throw std::runtime_error("invalid function value in module");
+            }
+            rv.func = static_cast<FuncInfo*>(sym);
+        }
+            break;
+        case vtCMethod:
+        case vtMethod:
+        {
+            SymInfo* sym = getSymbol(ib.get32());
+            if(!sym || sym->st != sytMethod ||
+               (rv.vt == vtCMethod) != (static_cast<MethodInfo*>(sym)->cmethod != nullptr))
+            {
+                throw std::runtime_error("invalid method value in module");
+            }
+            rv.method = static_cast<MethodInfo*>(sym);
+        }
+            break;
+        case vtClass:
+            rv.classInfo = getClass(ib.get32());
+            if(!rv.classInfo)
+            {
+                throw std::runtime_error("invalid class value in module");
+            }
+            break;
+        case vtArray:
+        case vtMap:
+        case vtSet:
+        case vtRange:
+        case vtRegExp:
+        case vtObject:
+        {
+            uint32_t id = ib.get32();
+            if(id && id <= objects.size())
+            {
+                if(objects[id - 1].vt != rv.vt)
+                {
+                    throw std::runtime_error("invalid object id in module");
+                }
+                rv.refBase = objects[id - 1].refBase;
+                rv.refBase->ref();
+                break;
+            }
+            if(id != objects.size() + 1)
+            {
+                throw std::runtime_error("invalid object id in module");
+            }
+            switch(rv.vt)
+            {
+                case vtArray:
+                    rv.arr = vm->allocZArray();
+                    break;
+                case vtMap:
+                    rv.map = vm->allocZMap();
+                    break;
+                case vtSet:
+                    rv.set = vm->allocZSet();
+                    break;
+                case vtRange:
+                    rv.range = vm->allocRange();
+                    break;
+                case vtObject:
+                    rv.obj = vm->allocObj();
+                    rv.obj->classInfo = nullptr;
+                    rv.obj->members = nullptr;
+                    break;
+                default:
+                    rv.regexp = vm->allocRegExp();
+                    break;
+            }
+            //registered before content is read, nested containers have greater ids
+            rv.refBase->ref();
+            objects.push_back(rv);
+            rv.refBase->ref();
+            switch(rv.vt)
+            {
+                case vtArray:
+                {
+                    uint32_t count = readCount(ib, 3);
+                    for(uint32_t i = 0; i < count; ++i)
+                    {
+                        Value item = readValue(ib);
+                        rv.arr->push(item);
+                        if(ZISREFTYPE(&item))
+                        {
+                            rv.arr->isSimpleContent = false;
+                        }
+                    }
+                }
+                    break;
+                case vtMap:
+                {
+                    uint32_t count = readCount(ib, 6);
+                    for(uint32_t i = 0; i < count; ++i)
+                    {
+                        Value key = readValue(ib);
+                        Value val;
+                        try
+                        {
+                            val = readValue(ib);
+                        } catch(...)
+                        {
+                            vm->unref(key);
+                            throw;
+                        }
+                        rv.map->insert(key, val);
+                        vm->unref(key);
+                        vm->unref(val);
+                    }
+                }
+                    break;
+                case vtSet:
+                {
+                    uint32_t count = readCount(ib, 3);
+                    for(uint32_t i = 0; i < count; ++i)
+                    {
+                        Value item = readValue(ib);
+                        rv.set->insert(item);
+                        vm->unref(item);
+                    }
+                }
+                    break;
+                case vtRange:
+                    rv.range->start = static_cast<int64_t>(ib.get64());
+                    rv.range->end = static_cast<int64_t>(ib.get64());
+                    rv.range->step = static_cast<int64_t>(ib.get64());
+                    break;
+                case vtObject:
+                {
+                    //refs of objects to their class are part of symbol ref count restored with symbol
+                    ClassInfo* ci = getClass(ib.get32());
+                    uint32_t count = readCount(ib, 3);
+                    if(!ci || ci->membersCount != count)
+                    {
+                        throw std::runtime_error("invalid object in module");
+                    }
+                    rv.obj->classInfo = ci;
+                    if(count)
+                    {
+                        rv.obj->members = vm->allocVArray(count);
+                        memset(rv.obj->members, 0, sizeof(Value) * count);
+                        for(uint32_t i = 0; i < count; ++i)
+                        {
+                            rv.obj->members[i] = readValue(ib);
+                        }
+                    }
+                }
+                    break;
+                default:
+                {
+                    ZString* src = getString(ib.get32());
+                    if(!src || !vm->compileRegExp(rv.regexp, src))
+                    {
+                        throw std::runtime_error("invalid regexp in module");
+                    }
+                }
+                    break;
+            }
+        }
+            break;
+        default:
+            throw std::runtime_error("invalid value type in module");
+    }
+    return rv;
+}
+
+void ModuleLoader::readScope(InputBuffer& ib, ScopeSym* s)
+{
+    if(!scopeIdx.emplace(s, scopes.size()).second)
+    {
+        throw std::runtime_error("invalid scope in module");
+    }
+    scopes.emplace_back();
+    ScopeData& sd = scopes.back();
+    sd.scope = s;
+    sd.maps.resize(getScopeMapsCount(s));
+    for(auto& map : sd.maps)
+    {
+        map.resize(readCount(ib, 8));
+        for(auto& item : map)
+        {
+            item.first = getString(ib.get32());
+            item.second = getSymbol(ib.get32());
+            if(!item.first)
+            {
+                throw std::runtime_error("invalid symbol name in module");
+            }
+        }
+    }
+    sd.lists.resize(getScopeListsCount(s));
+    for(size_t i = 0; i < sd.lists.size(); ++i)
+    {
+        sd.lists[i].resize(readCount(ib, 4));
+        for(auto& sym : sd.lists[i])
+        {
+            sym = getSymbol(ib.get32());
+            bool valid;
+            switch(i)
+            {
+                case slTempSymbols:
+                    valid = sym != nullptr;
+                    break;
+                case slUsedNs:
+                    valid = sym && isScope(sym->st);
+                    break;
+                case slChildren:
+                    valid = sym && sym->st == sytClass;
+                    break;
+                case slMethods:
+                    valid = sym && sym->st == sytMethod;
+                    break;
+                case slMembers:
+                    valid = !sym || sym->st == sytClassMember;
+                    break;
+                default:
+                    valid = true;
+                    break;
+            }
+            if(!valid)
+            {
+                throw std::runtime_error("invalid symbol list in module");
+            }
+        }
+    }
+    sd.parent = getScope(ib.get32());
+    sd.end = readLoc(ib, *this);
+    sd.closedVars.resize(readCount(ib, 6));
+    for(auto& arg : sd.closedVars)
+    {
+        arg = readArg(ib);
+    }
+    uint32_t closedFuncs = readCount(ib, 12);
+    for(uint32_t i = 0; i < closedFuncs; ++i)
+    {
+        sd.closedFuncs.emplace_back(0, 0);
+        sd.closedFuncs.back().src = readArg(ib);
+        sd.closedFuncs.back().dst = readArg(ib);
+    }
+    sd.selfClosed = ib.get8() != 0;
+}
+
+void ModuleLoader::readSymBody(InputBuffer& ib, SymInfo* sym)
+{
+    sym->refCount = ib.get32();
+    readType(ib, sym->tinfo);
+    if(isScope(sym->st))
+    {
+        readScope(ib, static_cast<ScopeSym*>(sym));
+    }
+    switch(sym->st)
+    {
+        case sytFunction:
+        case sytMethod:
+        {
+            FuncInfo* fi = (FuncInfo*) sym;
+            fixOp(&fi->entry, ib.get32());
+            fi->defValEntries.resize(readCount(ib, 4));
+            for(auto& op : fi->defValEntries)
+            {
+                fixOp(&op, ib.get32());
+            }
+            fixOp(&fi->varArgEntry, ib.get32());
+            fixOp(&fi->namedArgEntry, ib.get32());
+            fixOp(&fi->varArgEntryLast, ib.get32());
+            fi->argsCount = ib.get32();
+            fi->localsCount = ib.get32();
+            readType(ib, fi->rvtype);
+            fi->namedArgs = ib.get8() != 0;
+            if(sym->st == sytMethod)
+            {
+                MethodInfo* mi = (MethodInfo*) sym;
+                mi->owningClass = getClass(ib.get32());
+                fixOp(&mi->lastOp, ib.get32());
+                mi->localIndex = static_cast<size_t>(ib.get64());
+                mi->overIndex = static_cast<size_t>(ib.get64());
+                mi->specialMethod = ib.get8() != 0;
+            }
+        }
+            break;
+        case sytClass:
+        {
+            ClassInfo* ci = (ClassInfo*) sym;
+            ci->parentClass.reset(getClass(ib.get32()));
+            for(auto& idx : ci->specialMethods)
+            {
+                idx = static_cast<size_t>(ib.get64());
+            }
+            ci->membersCount = static_cast<size_t>(ib.get64());
+            readAttrs(ib, ci->attrs);
+            ci->nativeClass = ib.get8() != 0;
+        }
+            break;
+        case sytClassMember:
+            readAttrs(ib, ((ClassMember*) sym)->attrs);
+            ((ClassMember*) sym)->owningClass = getClass(ib.get32());
+            break;
+        case sytProperty:
+        {
+            ClassPropertyInfo* pi = (ClassPropertyInfo*) sym;
+            pi->getIdx = static_cast<size_t>(ib.get64());
+            pi->getMethod = static_cast<MethodInfo*>(getSymbol(ib.get32()));
+            pi->setIdx = static_cast<size_t>(ib.get64());
+            pi->setMethod = static_cast<MethodInfo*>(getSymbol(ib.get32()));
+            if((pi->getMethod && pi->getMethod->st != sytMethod) || (pi->setMethod && pi->setMethod->st != sytMethod))
+            {
+                throw std::runtime_error("invalid property in module");
+            }
+        }
+            break;
+        default:
+            break;
+    }
+}
+
+void ModuleLoader::load(InputBuffer& ib)
+{
+    try
+    {
+        read(ib);
+        checkSymbols();
+        std::unordered_map<OpBase*, FuncInfo*> owners;
+        for(size_t i = hostCount; i < syms.size(); ++i)
+        {
+            if(syms[i]->st != sytFunction && syms[i]->st != sytMethod)
+            {
+                continue;
+            }
+            FuncInfo* f = static_cast<FuncInfo*>(syms[i]);
+            std::vector<OpBase*> roots{f->entry, f->varArgEntry, f->namedArgEntry, f->varArgEntryLast};
+            roots.insert(roots.end(), f->defValEntries.begin(), f->defValEntries.end());
+            checkCode(f, roots, owners);
+        }
+        checkCode(nullptr, {entry, resumeOp}, owners);
+    } catch(...)
+    {
+        rollback();
+        throw;
+    }
+    commit();
+}
+
+void ModuleLoader::read(InputBuffer& ib)
+{
+    SymbolsInfo& si = vm->symbols;
+    if(memcmp(ib.skip(sizeof(ModuleFormat::magic)), ModuleFormat::magic, sizeof(ModuleFormat::magic)) != 0)
+    {
+        throw std::runtime_error("not a compiled module");
+    }
+    if(ib.get16() != ModuleFormat::version)
+    {
+        throw std::runtime_error("unsupported module version");
+    }
+    kind = static_cast<ModuleFormat::Kind>(ib.get8());
+    if(kind != ModuleFormat::mkModule && kind != ModuleFormat::mkSnapshot)
+    {
+        throw std::runtime_error("unsupported module kind");
+    }
+    uint64_t length = ib.get64();
+    uint64_t checksum = ib.get64();
+    if(length != ib.getLen() - ib.getPos() || getChecksum(ib.getBuf(), ib.getLen() - ib.getPos()) != checksum)
+    {
+        throw std::runtime_error("module is truncated or corrupted");
+    }
+    uint64_t fp = ib.get64();
+    uint32_t hostSyms = ib.get32();
+    std::unordered_map<SymInfo*, uint32_t> ids;
+    collectSymbols(si, syms, ids);
+    hostCount = syms.size();
+    if(hostSyms != hostCount || fp != getFingerprint(si, syms))
+    {
+        throw std::runtime_error("module was compiled against different natives");
+    }
+    size_t hostGlobals = si.globalsCount;
+
+    uint32_t count = readCount(ib, 4);
+    strings.reserve(count);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t len = ib.get32();
+        const char* ptr = ib.skip(len);
+        strings.emplace_back(vm, vm->allocZString(ptr, len));
+    }
+    count = readCount(ib, 20);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t len = ib.get32();
+        const char* ptr = ib.skip(len);
+        FileLocation parent = readLoc(ib, *this);
+        FileReader* rd = freg->newReader(freg->addEntry(std::string(ptr, len), "", 0));
+        rd->setParent(parent);
+        readers.push_back(rd);
+    }
+
+    count = readCount(ib, 30);
+    syms.reserve(hostCount + count);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        SymbolType st = static_cast<SymbolType>(ib.get8());
+        ZStringRef nmVal(vm, getString(ib.get32()));
+        Name nm(nmVal, readLoc(ib, *this));
+        SymInfo* sym;
+        switch(st)
+        {
+            case sytFunction:
+                sym = new FuncInfo(nm, nullptr, &si);
+                break;
+            case sytMethod:
+                sym = new MethodInfo(nm, nullptr, nullptr, &si);
+                break;
+            case sytClass:
+                sym = new ClassInfo(nm, nullptr, &si);
+                break;
+            case sytNamespace:
+                sym = new NsInfo(nm, nullptr, &si);
+                break;
+            case sytClassMember:
+                sym = new ClassMember(nm);
+                break;
+            case sytProperty:
+                sym = new ClassPropertyInfo(nm);
+                break;
+            case sytAttr:
+                sym = new AttrSym(nm);
+                break;
+            case sytConstant:
+            case sytGlobalVar:
+            case sytLocalVar:
+            case sytClosedVar:
+            case sytTemporal:
+                sym = new SymInfo(nm, st);
+                break;
+            default:
+                throw std::runtime_error("invalid symbol in module");
+        }
+        syms.push_back(sym);
+        sym->closed = ib.get8() != 0;
+        sym->index = static_cast<size_t>(ib.get64());
+    }
+
+    count = readCount(ib, 3);
+    ops.reserve(count);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        int ot = ib.get8();
+        int variant = ib.get8();
+        int spec = ib.get8();
+        OpBase* op = decodeOp(vm, ib, *this, ot, variant, spec);
+        if(!op)
+        {
+            throw std::runtime_error("invalid op in module");
+        }
+        ops.push_back(op);
+        op->pos = readLoc(ib, *this);
+        op->seq = static_cast<int>(ib.get32());
+        fixOp(&op->next, ib.get32());
+    }
+
+    for(size_t i = hostCount; i < syms.size(); ++i)
+    {
+        readSymBody(ib, syms[i]);
+    }
+    count = readCount(ib, 4);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t id = ib.get32();
+        ScopeSym* s = getScope(id);
+        if(!s || id > hostCount)
+        {
+            throw std::runtime_error("invalid scope in module");
+        }
+        readScope(ib, s);
+    }
+    count = readCount(ib, 8);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t id = ib.get32();
+        int32_t delta = static_cast<int32_t>(ib.get32());
+        if(!id || id > hostCount)
+        {
+            throw std::runtime_error("invalid symbol id in module");
+        }
+        refDeltas.emplace_back(getSymbol(id), delta);
+    }
+
+    globalsCount = ib.get32();
+    if(globalsCount < hostGlobals || globalsCount - hostGlobals > (ib.getLen() - ib.getPos()) / 3)
+    {
+        throw std::runtime_error("invalid globals count in module");
+    }
+    globals.reserve(globalsCount - hostGlobals);
+    for(size_t i = hostGlobals; i < globalsCount; ++i)
+    {
+        globals.push_back(readValue(ib));
+    }
+    freeGlobals.resize(readCount(ib, 8));
+    for(auto& idx : freeGlobals)
+    {
+        idx = static_cast<size_t>(ib.get64());
+        if(idx < hostGlobals || idx >= globalsCount)
+        {
+            throw std::runtime_error("invalid global index in module");
+        }
+    }
+    info.resize(readCount(ib, 4));
+    if(info.size() > globalsCount)
+    {
+        throw std::runtime_error("invalid globals count in module");
+    }
+    for(auto& sym : info)
+    {
+        sym = getSymbol(ib.get32());
+    }
+    if(kind == ModuleFormat::mkSnapshot)
+    {
+        stack.resize(readCount(ib, 3));
+        for(auto& v : stack)
+        {
+            v = readValue(ib);
+        }
+        fixOp(&resumeOp, ib.get32());
+    }
+    fixOp(&entry, ib.get32());
+    if(ib.getPos() != ib.getLen())
+    {
+        throw std::runtime_error("invalid module size");
+    }
+
+    for(auto& fix : opFixes)
+    {
+        if(fix.second > ops.size())
+        {
+            throw std::runtime_error("invalid op id in module");
+        }
+        *fix.first = ops[fix.second - 1];
+    }
+    opFixes.clear();
+}
+
+const std::vector<SymInfo*>& ModuleLoader::getList(ScopeSym* s, size_t idx)
+{
+    auto it = scopeIdx.find(s);
+    if(it != scopeIdx.end())
+    {
+        return scopes[it->second].lists[idx];
+    }
+    getScopeList(s, idx, listScratch);
+    return listScratch;
+}
+
+void ModuleLoader::checkSymbols()
+{
+    SymbolsInfo& si = vm->symbols;
+    size_t hostGlobals = si.globalsCount;
+    auto getGlobal = [&](size_t idx) -> const Value&
+    {
+        return idx < hostGlobals ? si.globals[idx] : globals[idx - hostGlobals];
+    };
+    auto isMethodGlobal = [&](size_t idx)
+    {
+        return idx < globalsCount && (getGlobal(idx).vt == vtMethod || getGlobal(idx).vt == vtCMethod);
+    };
+    for(size_t i = hostCount; i < syms.size(); ++i)
+    {
+        SymInfo* sym = syms[i];
+        bool valid = true;
+        switch(sym->st)
+        {
+            case sytConstant:
+            case sytGlobalVar:
+            case sytFunction:
+            case sytClass:
+            case sytAttr:
+                valid = sym->index == SymInfo::invalidIndexValue || sym->index < globalsCount;
+                break;
+            case sytMethod:
+            {
+                MethodInfo* mi = (MethodInfo*) sym;
+                size_t methods = mi->owningClass ? getList(mi->owningClass, slMethods).size() : 0;
+                valid = isMethodGlobal(mi->index) && mi->localIndex < methods &&
+                        (mi->overIndex == SymInfo::invalidIndexValue || mi->overIndex < methods);
+            }
+                break;
+            case sytClassMember:
+            {
+                ClassMember* cm = (ClassMember*) sym;
+                valid = cm->owningClass && cm->index < cm->owningClass->membersCount;
+            }
+                break;
+            default:
+                break;
+        }
+        if(sym->st == sytFunction || sym->st == sytMethod)
+        {
+            FuncInfo* fi = (FuncInfo*) sym;
+            //args and locals are symbols of function
+            valid = valid && static_cast<size_t>(fi->argsCount) + fi->localsCount <= scopes[scopeIdx[fi]].maps[0].size();
+        }
+        if(sym->st == sytClass)
+        {
+            ClassInfo* ci = (ClassInfo*) sym;
+            valid = ci->membersCount <= getList(ci, slMembers).size();
+            for(auto idx : ci->specialMethods)
+            {
+                valid = valid && (!idx || isMethodGlobal(idx));
+            }
+        }
+        if(!valid)
+        {
+            throw std::runtime_error(FORMAT("invalid symbol %{} in module", sym->name.val.c_str()));
+        }
+    }
+    //temporary symbols are deleted by their scope, they cannot be shared
+    std::unordered_set<SymInfo*> mapped, temps;
+    std::unordered_set<std::string> keys;
+    for(auto& sd : scopes)
+    {
+        for(size_t i = 0; i < sd.maps.size(); ++i)
+        {
+            //insert of existing key replaces symbol without changing reference counts
+            SymMap& dst = getScopeMap(sd.scope, i);
+            keys.clear();
+            for(auto& item : sd.maps[i])
+            {
+                SymInfo** old = dst.getPtr(item.first);
+                if((old && *old != item.second) ||
+                   !keys.emplace(item.first->getDataPtr(), item.first->getDataSize()).second)
+                {
+                    throw std::runtime_error(FORMAT("invalid symbol %{} in module", item.first->c_str(vm)));
+                }
+                mapped.insert(item.second);
+                if(sd.scope->st != sytClass || !item.second)
+                {
+                    continue;
+                }
+                //members and properties are looked up by name in objects of this class
+                ClassInfo* ci = (ClassInfo*) sd.scope;
+                SymInfo* sym = item.second;
+                bool valid = true;
+                if(sym->st == sytClassMember)
+                {
+                    valid = sym->index < ci->membersCount;
+                } else if(sym->st == sytProperty)
+                {
+                    ClassPropertyInfo* pi = (ClassPropertyInfo*) sym;
+                    valid = (pi->getIdx == SymInfo::invalidIndexValue || pi->getIdx < ci->membersCount) &&
+                            (pi->setIdx == SymInfo::invalidIndexValue || pi->setIdx < ci->membersCount);
+                } else if(sym->st == sytMethod)
+                {
+                    valid = isMethodGlobal(sym->index);
+                }
+                if(!valid)
+                {
+                    throw std::runtime_error(FORMAT("invalid member %{} in module", item.first->c_str(vm)));
+                }
+            }
+        }
+    }
+    for(auto& sd : scopes)
+    {
+        for(auto sym : sd.lists[slTempSymbols])
+        {
+            if(mapped.count(sym) || !temps.insert(sym).second)
+            {
+                throw std::runtime_error("invalid temporary symbol in module");
+            }
+        }
+    }
+    //symbols are released by reference counts when vm is destroyed,
+    //so counts must match references that loaded module adds: scope entries, temporary symbols and objects
+    std::unordered_map<SymInfo*, int64_t> refs;
+    std::vector<SymInfo*> old;
+    for(auto& sd : scopes)
+    {
+        for(size_t i = 0; i < sd.maps.size(); ++i)
+        {
+            SymMap& dst = getScopeMap(sd.scope, i);
+            for(auto& item : sd.maps[i])
+            {
+                if(item.second && !dst.getPtr(item.first))
+                {
+                    ++refs[item.second];
+                }
+            }
+        }
+        getScopeList(sd.scope, slTempSymbols, old);
+        for(auto sym : sd.lists[slTempSymbols])
+        {
+            if(std::find(old.begin(), old.end(), sym) == old.end())
+            {
+                ++refs[sym];
+            }
+        }
+    }
+    for(auto& obj : objects)
+    {
+        if(obj.vt == vtObject && obj.obj->classInfo && !obj.obj->classInfo->shared)
+        {
+            ++refs[obj.obj->classInfo];
+        }
+    }
+    for(auto& d : refDeltas)
+    {
+        refs[d.first] -= d.second;
+    }
+    for(size_t i = 0; i < syms.size(); ++i)
+    {
+        SymInfo* sym = syms[i];
+        int64_t have = i < hostCount ? 0 : sym->refCount;
+        if(sym != &si.global && refs[sym] != have)
+        {
+            throw std::runtime_error(FORMAT("invalid reference count of %{} in module",
+                                            sym->name.val ? sym->name.val.c_str() : "?"));
+        }
+    }
+}
+
+void ModuleLoader::checkArg(const OpArg& arg, FuncInfo* f, bool dst)
+{
+    bool valid;
+    switch(arg.at)
+    {
+        case atNul:
+            valid = true;
+            break;
+        case atGlobal:
+            valid = arg.idx < globalsCount;
+            break;
+        case atStack:
+            if(dst)
+            {
+                valid = true;
+                break;
+            }
+            //fallthrough
+        case atLocal:
+            if(f)
+            {
+                valid = arg.idx < static_cast<size_t>(f->argsCount) + f->localsCount;
+            } else
+            {
+                valid = arg.idx < getList(&vm->symbols.global, slFreeTemporals).size();
+            }
+            break;
+        case atMember:
+        {
+            ClassInfo* ci = f && f->st == sytMethod ? ((MethodInfo*) f)->owningClass : nullptr;
+            valid = ci && arg.idx < ci->membersCount;
+        }
+            break;
+        case atClosed:
+            valid = f && arg.idx < scopes[scopeIdx[f]].closedVars.size();
+            break;
+        default:
+            valid = false;
+            break;
+    }
+    if(!valid)
+    {
+        throw std::runtime_error(FORMAT("invalid op arg %{} in module", arg.toStr()));
+    }
+}
+
+void ModuleLoader::checkCode(FuncInfo* f, std::vector<OpBase*> roots,
+                             std::unordered_map<OpBase*, FuncInfo*>& owners)
+{
+    //ops of each function are released with it, so they cannot be reachable from other function
+    std::vector<OpBase*> stack;
+    auto visit = [&](OpBase* op)
+    {
+        if(!op)
+        {
+            return;
+        }
+        auto it = owners.emplace(op, f);
+        if(it.second)
+        {
+            stack.push_back(op);
+        } else if(it.first->second != f)
+        {
+            throw std::runtime_error("op is shared by functions in module");
+        }
+    };
+    for(auto op : roots)
+    {
+        visit(op);
+    }
+    OpBase* lastOp = f && f->st == sytMethod ? ((MethodInfo*) f)->lastOp : nullptr;
+    size_t frameSize = f ? static_cast<size_t>(f->argsCount) + f->localsCount : 0;
+    ArgsVector args, dsts;
+    OpsVector branches;
+    while(!stack.empty())
+    {
+        OpBase* op = stack.back();
+        stack.pop_back();
+        dsts.clear();
+        op->getDsts(dsts);
+        for(auto arg : dsts)
+        {
+            checkArg(*arg, f, true);
+        }
+        args.clear();
+        op->getArgs(args);
+        for(auto arg : args)
+        {
+            if(std::find(dsts.begin(), dsts.end(), arg) == dsts.end())
+            {
+                checkArg(*arg, f, false);
+            }
+        }
+        bool valid = true;
+        switch(op->ot)
+        {
+            case otCallMethod:
+            {
+                ClassInfo* ci = f && f->st == sytMethod ? ((MethodInfo*) f)->owningClass : nullptr;
+                valid = ci && ((OpCallMethod*) op)->methodIdx < getList(ci, slMethods).size();
+            }
+                break;
+            case otMakeClosure:
+            {
+                OpMakeClosure* mc = (OpMakeClosure*) op;
+                SymInfo* src = nullptr;
+                if(mc->src.at == atGlobal)
+                {
+                    size_t hostGlobals = vm->symbols.globalsCount;
+                    const Value& v = mc->src.idx < hostGlobals ? vm->symbols.globals[mc->src.idx] :
+                                     globals[mc->src.idx - hostGlobals];
+                    src = v.vt == vtFunc || v.vt == vtMethod ? v.func : nullptr;
+                }
+                auto it = src ? scopeIdx.find((ScopeSym*) src) : scopeIdx.end();
+                valid = it != scopeIdx.end() && scopes[it->second].closedVars.size() <= mc->closedCount;
+            }
+                break;
+            case otEnterTry:
+            {
+                OpEnterTry* et = (OpEnterTry*) op;
+                valid = et->idx < (f ? frameSize : getList(&vm->symbols.global, slFreeTemporals).size());
+                for(index_type i = 0; i < et->exCount; ++i)
+                {
+                    valid = valid && et->exList[i] && et->exList[i]->st == sytClass;
+                }
+            }
+                break;
+            case otJump:
+                valid = !f || ((OpJump*) op)->localSize <= frameSize;
+                break;
+            case otInitDtor:
+                valid = f && ((OpInitDtor*) op)->locals <= frameSize;
+                break;
+            default:
+                break;
+        }
+        if(!valid)
+        {
+            throw std::runtime_error(FORMAT("invalid op %{} in module", getOpName(op->ot)));
+        }
+        branches.clear();
+        op->getBranches(branches);
+        for(auto br : branches)
+        {
+            visit(br);
+        }
+        //jump at the end of derived destructor continues in parent destructor code
+        if(op != lastOp)
+        {
+            visit(op->next);
+        }
+    }
+}
+
+void ModuleLoader::commit()
+{
+    SymbolsInfo& si = vm->symbols;
+    for(auto& sd : scopes)
+    {
+        ScopeSym* s = sd.scope;
+        for(size_t i = 0; i < sd.maps.size(); ++i)
+        {
+            SymMap& map = getScopeMap(s, i);
+            for(auto& item : sd.maps[i])
+            {
+                //reference counts of symbols are restored as they were after compilation
+                map.ZHash<SymInfo*>::insert(item.first, item.second);
+            }
+        }
+        for(size_t i = 0; i < sd.lists.size(); ++i)
+        {
+            setScopeList(s, i, sd.lists[i]);
+        }
+        s->parent = sd.parent;
+        s->end = sd.end;
+        s->closedVars = std::move(sd.closedVars);
+        s->closedFuncs = std::move(sd.closedFuncs);
+        s->selfClosed = sd.selfClosed;
+    }
+    scopes.clear();
+    scopeIdx.clear();
+    for(auto& d : refDeltas)
+    {
+        d.first->refCount += d.second;
+    }
+    refDeltas.clear();
+
+    size_t hostGlobals = si.globalsCount;
+    si.freeGlobals.clear();
+    while(si.globalsCount < globalsCount)
+    {
+        si.newGlobal();
+    }
+    for(size_t i = 0; i < globals.size(); ++i)
+    {
+        si.globals[hostGlobals + i] = globals[i];
+    }
+    globals.clear();
+    si.freeGlobals = std::move(freeGlobals);
+    si.info = std::move(info);
+    for(auto& obj : objects)
+    {
+        vm->unref(obj);
+    }
+    objects.clear();
+    vm->setEntry(entry);
+}
+
+void ModuleLoader::rollback()
+{
+    //content of objects is released first, so that freeing them does not touch classes
+    for(auto& obj : objects)
+    {
+        if(obj.vt != vtObject || !obj.obj->classInfo)
+        {
+            continue;
+        }
+        if(obj.obj->members)
+        {
+            for(size_t i = 0; i < obj.obj->classInfo->membersCount; ++i)
+            {
+                vm->unref(obj.obj->members[i]);
+            }
+            vm->freeVArray(obj.obj->members, obj.obj->classInfo->membersCount);
+        }
+        obj.obj->members = nullptr;
+        obj.obj->classInfo = nullptr;
+    }
+    for(auto& v : globals)
+    {
+        vm->unref(v);
+    }
+    globals.clear();
+    for(auto& v : stack)
+    {
+        vm->unref(v);
+    }
+    stack.clear();
+    for(auto& obj : objects)
+    {
+        vm->unref(obj);
+    }
+    objects.clear();
+
+    //symbols were not added to any scope yet, each is owned by loader
+    for(size_t i = hostCount; i < syms.size(); ++i)
+    {
+        SymInfo* sym = syms[i];
+        if(sym->st == sytFunction || sym->st == sytMethod)
+        {
+            FuncInfo* fi = (FuncInfo*) sym;
+            fi->entry = nullptr;
+            fi->defValEntries.clear();
+            fi->varArgEntry = nullptr;
+            fi->namedArgEntry = nullptr;
+            fi->varArgEntryLast = nullptr;
+            if(sym->st == sytMethod)
+            {
+                ((MethodInfo*) sym)->lastOp = nullptr;
+            }
+        }
+        delete sym;
+    }
+    syms.clear();
+    for(auto op : ops)
+    {
+        delete op;
+    }
+    ops.clear();
+    opFixes.clear();
+    scopes.clear();
+    scopeIdx.clear();
+    refDeltas.clear();
+    entry = nullptr;
+    resumeOp = nullptr;
+}
+
+void ModuleLoader::restoreStack()
+{
+    if(stack.size() > vm->ctx.dataStack.size())
+    {
+        throw std::runtime_error("vm is not initialized");
+    }
+    for(size_t i = 0; i < stack.size(); ++i)
+    {
+        vm->ctx.dataStack.stack[i] = stack[i];
+    }
+    stack.clear();
+}
+
+}
@@ -0,0 +1,249 @@
+#ifndef __ZORRO_CODE_MODULE_HPP__
+#define __ZORRO_CODE_MODULE_HPP__
+
+#include "Symbolic.hpp"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace zorro {
+
+class ZorroVM;
+class OutputBuffer;
+class InputBuffer;
+class FileRegistry;
+
+/*
+  Compiled module is a serialized result of code generation and optimization:
+  symbols, constants and op graphs that compilation added to the vm.
+  Natives (std and everything host registered) are not stored,
+  module can only be loaded into vm with exactly the same set of natives,
+  this is checked by fingerprint of host symbols.
+  Snapshot is a module written while program runs: it also keeps values of globals with everything
+  they reference and temporals of top level code, loaded snapshot continues after the point where it was taken.
+  Header is magic, version, kind, length and checksum of the rest of the file.
+*/
+struct ModuleFormat {
+    static const char magic[4];
+    static const uint16_t version = 4;
+
+    enum Kind : uint8_t {
+        mkModule,
+        mkSnapshot
+    };
+};
+
+/*
+  Maps ids used in module to objects, shared by op encoding of writer and loader.
+  Id 0 is always nullptr.
+*/
+class ModuleRefs {
+public:
+    virtual ~ModuleRefs()
+    {
+    }
+
+    virtual ZString* getString(uint32_t id) = 0;
+
+    virtual SymInfo* getSymbol(uint32_t id) = 0;
+
+    virtual FileReader* getReader(uint32_t id) = 0;
+
+    /* *ptr is set to op with given id when all ops are known */
+    virtual void fixOp(OpBase** ptr, uint32_t id) = 0;
+};
+
+/*
+  Must be created after natives are registered and before compilation starts,
+  remembers host symbols to store only what compilation added.
+*/
+class ModuleWriter : protected ModuleRefs {
+public:
+    explicit ModuleWriter(ZorroVM* argVm);
+
+    ~ModuleWriter() override;
+
+    ModuleWriter(const ModuleWriter&) = delete;
+
+    ModuleWriter& operator=(const ModuleWriter&) = delete;
+
+    /* throws std::runtime_error if program contains something that cannot be stored */
+    void write(OutputBuffer& out);
+
+    void writeFile(const std::string& fileName);
+
+    /*
+      Snapshot of running vm, can only be taken by native called from top level code, not from function or task.
+      Execution of loaded snapshot continues from op that follows the call.
+      Throws std::runtime_error if some value cannot be stored (closures, coroutines, native objects, weak refs).
+    */
+    void writeSnapshot(OutputBuffer& out);
+
+    void writeSnapshotFile(const std::string& fileName);
+
+protected:
+    ZorroVM* vm;
+    std::vector<SymInfo*> hostSyms;
+    std::vector<unsigned> hostRefCounts;
+    std::vector<Value> hostGlobals;
+    uint64_t fingerprint;
+
+    //state of current write
+    std::unordered_map<SymInfo*, uint32_t> symIds;
+    std::vector<SymInfo*> syms;
+    std::unordered_map<OpBase*, uint32_t> opIds;
+    std::vector<OpBase*> ops;
+    std::unordered_map<std::string, uint32_t> stringIds;
+    std::vector<ZString*> strings;
+    std::unordered_map<FileReader*, uint32_t> readerIds;
+    std::vector<FileReader*> readers;
+    std::unordered_map<const void*, uint32_t> objIds;
+
+    ZString* getString(uint32_t id) override;
+
+    SymInfo* getSymbol(uint32_t id) override;
+
+    FileReader* getReader(uint32_t id) override;
+
+    void fixOp(OpBase** ptr, uint32_t id) override;
+
+    uint32_t strId(ZString* str);
+
+    uint32_t readerId(FileReader* rd);
+
+    uint32_t symId(SymInfo* sym);
+
+    uint32_t opId(OpBase* op);
+
+    void writeLoc(OutputBuffer& ob, const FileLocation& loc);
+
+    void writeType(OutputBuffer& ob, const TypeInfo& ti);
+
+    void writeValue(OutputBuffer& ob, const Value& v);
+
+    void writeOpFields(OutputBuffer& ob, OpBase* op);
+
+    void writeOp(OutputBuffer& ob, OpBase* op);
+
+    void writeScope(OutputBuffer& ob, ScopeSym* scope);
+
+    void writeSymBody(OutputBuffer& ob, SymInfo* sym);
+
+    void collectOps();
+
+    void writeImage(OutputBuffer& out, ModuleFormat::Kind kind);
+
+    void writeImageFile(const std::string& fileName, ModuleFormat::Kind kind);
+};
+
+/*
+  Loads module written by ModuleWriter into vm with the same natives,
+  that has not compiled anything yet.
+  File is mapped into memory and decoded from there.
+  Nothing is added to vm until the whole module is read and checked,
+  if load fails, everything it created is released and vm stays as it was.
+*/
+class ModuleLoader : protected ModuleRefs {
+public:
+    ModuleLoader(ZorroVM* argVm, FileRegistry* argFreg);
+
+    /* checks file signature */
+    static bool isModule(const char* fileName);
+
+    void load(const char* fileName);
+
+    void load(InputBuffer& ib);
+
+    bool isSnapshot() const
+    {
+        return kind == ModuleFormat::mkSnapshot;
+    }
+
+    /* Puts temporals of loaded snapshot to stack of vm, must be called after vm.init() */
+    void restoreStack();
+
+    /* Op where loaded snapshot continues, to be passed to vm.run(), nullptr for module */
+    OpBase* getResumeOp() const
+    {
+        return resumeOp;
+    }
+
+protected:
+    /* content of scope as read from module, applied to scope after load is checked */
+    struct ScopeData {
+        ScopeSym* scope;
+        std::vector<std::vector<std::pair<ZString*, SymInfo*>>> maps;
+        std::vector<std::vector<SymInfo*>> lists;
+        ScopeSym* parent = nullptr;
+        FileLocation end;
+        std::vector<OpArg> closedVars;
+        ScopeSym::ClosedFuncVector closedFuncs;
+        bool selfClosed = false;
+    };
+
+    ZorroVM* vm;
+    FileRegistry* freg;
+    std::vector<ZStringRef> strings;
+    std::vector<FileReader*> readers;
+    std::vector<SymInfo*> syms;
+    size_t hostCount = 0;
+    std::vector<OpBase*> ops;
+    std::vector<std::pair<OpBase**, uint32_t>> opFixes;
+    std::vector<ScopeData> scopes;
+    std::unordered_map<ScopeSym*, size_t> scopeIdx;
+    std::vector<std::pair<SymInfo*, int32_t>> refDeltas;
+    //globals that follow host ones
+    std::vector<Value> globals;
+    size_t globalsCount = 0;
+    std::vector<size_t> freeGlobals;
+    std::vector<SymInfo*> info;
+    OpBase* entry = nullptr;
+    std::vector<SymInfo*> listScratch;
+    //shared containers, each holds one reference until load is finished
+    std::vector<Value> objects;
+    ModuleFormat::Kind kind = ModuleFormat::mkModule;
+    //temporals of top level code saved in snapshot
+    std::vector<Value> stack;
+    OpBase* resumeOp = nullptr;
+
+    ZString* getString(uint32_t id) override;
+
+    SymInfo* getSymbol(uint32_t id) override;
+
+    FileReader* getReader(uint32_t id) override;
+
+    void fixOp(OpBase** ptr, uint32_t id) override;
+
+    void readType(InputBuffer& ib, TypeInfo& ti);
+
+    Value readValue(InputBuffer& ib);
+
+    ScopeSym* getScope(uint32_t id);
+
+    ClassInfo* getClass(uint32_t id);
+
+    void readScope(InputBuffer& ib, ScopeSym* scope);
+
+    void readSymBody(InputBuffer& ib, SymInfo* sym);
+
+    void read(InputBuffer& ib);
+
+    /* list of scope as it will be after load */
+    const std::vector<SymInfo*>& getList(ScopeSym* scope, size_t idx);
+
+    /* checks indices that can only be checked when whole module is read */
+    void checkSymbols();
+
+    void checkArg(const OpArg& arg, FuncInfo* f, bool dst);
+
+    /* checks args of ops reachable from roots, f is nullptr for top level code */
+    void checkCode(FuncInfo* f, std::vector<OpBase*> roots, std::unordered_map<OpBase*, FuncInfo*>& owners);
+
+    void commit();
+
+    void rollback();
+};
+
+}
+
+#endif
@@ -0,0 +1,914 @@
+#include "CodeOptimizer.hpp"
+#include "ZorroVM.hpp"
+#include "ZVMOps.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <set>
+#include <unordered_set>
+
+namespace zorro {
+
+static bool isCondJump(const OpBase* op)
+{
+    return op->ot >= otJumpIfInited && op->ot <= otCondJump;
+}
+
+size_t DeadFlowPass::run(IRModule& module)
+{
+    size_t rv = 0;
+    OpsVector ops;
+    for(auto& f : module.funcs)
+    {
+        ops.clear();
+        f->forEachOp(ops);
+        for(auto op : ops)
+        {
+            if((op->ot == otReturn || op->ot == otThrow) && op->next)
+            {
+                op->next = nullptr;
+                f->changed = true;
+                ++rv;
+            }
+        }
+    }
+    return rv;
+}
+
+OpBase* ThreadJumpsPass::skipJumps(IRModule& module, OpBase* op)
+{
+    OpBase* start = op;
+    for(int hops = 0; op && op->ot == otJump && hops < 64; ++hops)
+    {
+        if(((OpJump*) op)->localSize || module.pinned.count(op) || !op->next || op->next == start)
+        {
+            break;
+        }
+        op = op->next;
+    }
+    return op;
+}
+
+size_t ThreadJumpsPass::run(IRModule& module)
+{
+    size_t rv = 0;
+    OpsVector ops;
+    for(auto& f : module.funcs)
+    {
+        ops.clear();
+        f->forEachOp(ops);
+        size_t before = rv;
+        for(auto op : ops)
+        {
+            if(!module.crossJumps.count(op))
+            {
+                OpBase* nxt = skipJumps(module, op->next);
+                if(nxt != op->next)
+                {
+                    op->next = nxt;
+                    ++rv;
+                }
+            }
+            if(isCondJump(op))
+            {
+                auto* jmp = (OpJumpBase*) op;
+                OpBase* elseOp = skipJumps(module, jmp->elseOp);
+                if(elseOp != jmp->elseOp)
+                {
+                    jmp->elseOp = elseOp;
+                    ++rv;
+                }
+            }
+        }
+        if(rv != before)
+        {
+            f->changed = true;
+        }
+    }
+    return rv;
+}
+
+typedef std::vector<bool> SlotSet;
+
+static void orInto(SlotSet& dst, const SlotSet& src)
+{
+    for(size_t i = 0; i < dst.size(); ++i)
+    {
+        if(src[i])
+        {
+            dst[i] = true;
+        }
+    }
+}
+
+//loop and match ops can leave their vars untouched
+static bool isKillingDef(const OpBase* op)
+{
+    switch(op->ot)
+    {
+        case otForInit:
+        case otForInit2:
+        case otForStep:
+        case otForStep2:
+        case otMatch:
+            return false;
+        default:
+            return true;
+    }
+}
+
+//self and closure storage are accessed by the VM by index
+static bool isFixedSymbol(SymInfo* sym)
+{
+    const char* name = sym->name.val.c_str();
+    return !strcmp(name, "self") || !strncmp(name, "closure-storage", 15);
+}
+
+static void liveTransfer(const IRInstr& ins, SlotSet& live)
+{
+    if(isKillingDef(ins.op))
+    {
+        for(auto& def : ins.defs)
+        {
+            live[def.arg->idx] = false;
+        }
+    }
+    for(auto& use : ins.uses)
+    {
+        live[use.arg->idx] = true;
+    }
+}
+
+/*
+  'dirty' slot may hold a value that is released when the slot is overwritten.
+  Temporal reads and assignment of nil release it.
+*/
+static void dirtyTransfer(const IRInstr& ins, SlotSet& dirty, index_type nilIdx)
+{
+    for(auto& use : ins.uses)
+    {
+        if(use.arg->isTemporal)
+        {
+            dirty[use.arg->idx] = false;
+        }
+    }
+    for(auto& def : ins.defs)
+    {
+        dirty[def.arg->idx] = true;
+    }
+    if(ins.op->ot == otAssign)
+    {
+        auto* op = (OpAssign*) ins.op;
+        if(op->left.at == atLocal && op->right.at == atGlobal && op->right.idx == nilIdx)
+        {
+            dirty[op->left.idx] = false;
+        }
+    }
+}
+
+size_t SlotAllocPass::run(IRModule& module)
+{
+    size_t rv = 0;
+    std::unordered_set<FuncInfo*> seen;
+    for(auto& f : module.funcs)
+    {
+        if(f->func && seen.insert(f->func).second)
+        {
+            size_t saved = allocFunction(*f);
+            if(saved)
+            {
+                f->changed = true;
+                rv += saved;
+            }
+        }
+    }
+    return rv;
+}
+
+size_t SlotAllocPass::allocFunction(IRFunction& f)
+{
+    FuncInfo* fi = f.func;
+    size_t argsCount = fi->argsCount;
+    size_t count = argsCount + fi->localsCount;
+    if(!fi->localsCount || count > maxSlots)
+    {
+        return 0;
+    }
+    index_type nilIdx = static_cast<index_type>(f.module->vm->symbols.nilIdx);
+
+    //only plain local vars and temporals can move
+    SlotSet candidate(count), fixed(count);
+    auto classify = [&](SymInfo* sym)
+    {
+        if(sym->index >= count)
+        {
+            return;
+        }
+        if(sym->index >= argsCount && (sym->st == sytTemporal || (sym->st == sytLocalVar && !isFixedSymbol(sym))))
+        {
+            candidate[sym->index] = true;
+        } else
+        {
+            fixed[sym->index] = true;
+        }
+    };
+    for(auto sym : fi->locals)
+    {
+        classify(sym);
+    }
+    {
+        SymMap::Iterator it(fi->symMap);
+        ZString* key;
+        SymInfo** val;
+        while(it.getNext(key, val))
+        {
+            if(*val)
+            {
+                classify(*val);
+            }
+        }
+    }
+
+    SlotSet used(count);
+    std::vector<IRBlock*> catchBlocks;
+    ArgsVector args;
+    for(auto& blk : f.blocks)
+    {
+        for(auto& ins : blk->instrs)
+        {
+            OpBase* op = ins.op;
+            args.clear();
+            op->getArgs(args);
+            op->getDsts(args);
+            bool pinArgs = op->ot == otMakeClosure || op->ot == otMakeConst || op->ot == otJumpIfInited;
+            for(auto arg : args)
+            {
+                if(arg->at != atLocal)
+                {
+                    continue;
+                }
+                if(arg->idx >= count)
+                {
+                    //slot outside of the frame layout we know about
+                    return 0;
+                }
+                used[arg->idx] = true;
+                if(pinArgs)
+                {
+                    fixed[arg->idx] = true;
+                }
+            }
+            if(op->ot == otMakeRef || op->ot == otMakeWeakRef)
+            {
+                OpArg& src = ((OpUnOp*) op)->src;
+                if(src.at == atLocal)
+                {
+                    fixed[src.idx] = true;
+                }
+            } else if(op->ot == otEnterTry)
+            {
+                auto* et = (OpEnterTry*) op;
+                if(et->idx >= count)
+                {
+                    return 0;
+                }
+                fixed[et->idx] = true;
+                auto it = f.blockOf.find(et->catchOp);
+                if(it != f.blockOf.end())
+                {
+                    catchBlocks.push_back(it->second);
+                }
+            }
+        }
+    }
+
+    size_t blocksCount = f.blocks.size();
+    std::vector<SlotSet> liveIn(blocksCount, SlotSet(count)), liveOut(blocksCount, SlotSet(count));
+    for(bool changed = true; changed;)
+    {
+        changed = false;
+        for(size_t i = blocksCount; i-- > 0;)
+        {
+            IRBlock* blk = f.blocks[i].get();
+            SlotSet live(count);
+            for(auto sb : blk->succs)
+            {
+                orInto(live, liveIn[sb->id]);
+            }
+            liveOut[i] = live;
+            for(auto it = blk->instrs.rbegin(), end = blk->instrs.rend(); it != end; ++it)
+            {
+                liveTransfer(*it, live);
+            }
+            if(live != liveIn[i])
+            {
+                liveIn[i].swap(live);
+                changed = true;
+            }
+        }
+    }
+
+    //exception can leave any op of try body, catch sees whatever slots hold at that moment
+    SlotSet catchEntry(blocksCount);
+    for(auto blk : catchBlocks)
+    {
+        orInto(fixed, liveIn[blk->id]);
+        catchEntry[blk->id] = true;
+    }
+
+    std::vector<SlotSet> dirtyIn(blocksCount, SlotSet(count)), dirtyOut(blocksCount, SlotSet(count));
+    for(bool changed = true; changed;)
+    {
+        changed = false;
+        for(size_t i = 1; i < blocksCount; ++i)
+        {
+            IRBlock* blk = f.blocks[i].get();
+            SlotSet dirty(count, catchEntry[i]);
+            for(auto pb : blk->preds)
+            {
+                orInto(dirty, dirtyOut[pb->id]);
+            }
+            dirtyIn[i] = dirty;
+            for(auto& ins : blk->instrs)
+            {
+                dirtyTransfer(ins, dirty, nilIdx);
+            }
+            if(dirty != dirtyOut[i])
+            {
+                dirtyOut[i].swap(dirty);
+                changed = true;
+            }
+        }
+    }
+
+    //slot written while other one is live or still holds a value can't share index with it
+    std::vector<bool> inter(count * count);
+    std::vector<SlotSet> after;
+    for(size_t i = 1; i < blocksCount; ++i)
+    {
+        IRBlock* blk = f.blocks[i].get();
+        size_t n = blk->instrs.size();
+        after.assign(n, SlotSet());
+        SlotSet live = liveOut[i];
+        for(size_t j = n; j-- > 0;)
+        {
+            after[j] = live;
+            liveTransfer(blk->instrs[j], live);
+        }
+        SlotSet dirty = dirtyIn[i];
+        for(size_t j = 0; j < n; ++j)
+        {
+            const IRInstr& ins = blk->instrs[j];
+            dirtyTransfer(ins, dirty, nilIdx);
+            for(auto& def : ins.defs)
+            {
+                index_type a = def.arg->idx;
+                for(size_t b = 0; b < count; ++b)
+                {
+                    if(b != a && (after[j][b] || dirty[b]))
+                    {
+                        inter[a * count + b] = true;
+                        inter[b * count + a] = true;
+                    }
+                }
+                //ops write result before temporal args are released
+                for(auto& use : ins.uses)
+                {
+                    index_type b = use.arg->idx;
+                    if(b != a)
+                    {
+                        inter[a * count + b] = true;
+                        inter[b * count + a] = true;
+                    }
+                }
+            }
+        }
+    }
+
+    //slots get indices in order of first appearance, unused ones are dropped
+    std::vector<index_type> order;
+    SlotSet ordered(count);
+    for(auto& blk : f.blocks)
+    {
+        for(auto& ins : blk->instrs)
+        {
+            for(auto* refs : {&ins.defs, &ins.uses})
+            {
+                for(auto& ref : *refs)
+                {
+                    index_type s = ref.arg->idx;
+                    if(candidate[s] && !fixed[s] && !ordered[s])
+                    {
+                        ordered[s] = true;
+                        order.push_back(s);
+                    }
+                }
+            }
+        }
+    }
+
+    const index_type noSlot = static_cast<index_type>(-1);
+    std::vector<index_type> newIdx(count, noSlot);
+    std::vector<std::vector<index_type>> byIdx(count);
+    SlotSet reserved(count);
+    size_t newCount = argsCount;
+    for(size_t s = 0; s < count; ++s)
+    {
+        if(s < argsCount || fixed[s] || (!candidate[s] && used[s]))
+        {
+            reserved[s] = true;
+            newIdx[s] = static_cast<index_type>(s);
+            newCount = std::max(newCount, s + 1);
+        }
+    }
+    for(auto s : order)
+    {
+        for(size_t c = argsCount; c < count; ++c)
+        {
+            if(reserved[c])
+            {
+                continue;
+            }
+            bool free = true;
+            for(auto t : byIdx[c])
+            {
+                if(inter[s * count + t])
+                {
+                    free = false;
+                    break;
+                }
+            }
+            if(free)
+            {
+                newIdx[s] = static_cast<index_type>(c);
+                byIdx[c].push_back(s);
+                newCount = std::max(newCount, c + 1);
+                break;
+            }
+        }
+        if(newIdx[s] == noSlot)
+        {
+            return 0;
+        }
+    }
+    if(newCount >= count)
+    {
+        return 0;
+    }
+
+    std::unordered_set<OpArg*> renamed;
+    for(auto& blk : f.blocks)
+    {
+        for(auto& ins : blk->instrs)
+        {
+            args.clear();
+            ins.op->getArgs(args);
+            ins.op->getDsts(args);
+            for(auto arg : args)
+            {
+                if(arg->at == atLocal && renamed.insert(arg).second)
+                {
+                    arg->idx = newIdx[arg->idx];
+                }
+            }
+        }
+    }
+    for(auto sym : fi->locals)
+    {
+        if(sym->index < count && candidate[sym->index] && newIdx[sym->index] != noSlot)
+        {
+            sym->index = newIdx[sym->index];
+        }
+    }
+    fi->localsCount = static_cast<index_type>(newCount - argsCount);
+    return count - newCount;
+}
+
+//closed var of function, index in closed values
+typedef std::pair<FuncInfo*, index_type> ClosedVarKey;
+
+static FuncInfo* getClosureFunc(IRModule& module, const OpMakeClosure* mc)
+{
+    SymbolsInfo& si = module.vm->symbols;
+    if(mc->src.at != atGlobal || mc->src.idx >= si.globalsCount)
+    {
+        return nullptr;
+    }
+    const Value& v = si.globals[mc->src.idx];
+    return v.vt == vtFunc || v.vt == vtMethod ? v.func : nullptr;
+}
+
+//arg that op makes reference to, assignments through reference are not visible as defs
+static const OpArg* getRefSource(const OpBase* op)
+{
+    switch(op->ot)
+    {
+        case otMakeRef:
+        case otMakeWeakRef:
+            return &((const OpUnOp*) op)->src;
+        case otReturn:
+            return ((const OpReturn*) op)->refReturn ? &((const OpReturn*) op)->result : nullptr;
+        case otYield:
+            return ((const OpYield*) op)->refYield ? &((const OpYield*) op)->result : nullptr;
+        default:
+            return nullptr;
+    }
+}
+
+static bool dominates(IRBlock* a, IRBlock* b)
+{
+    while(b != a)
+    {
+        if(!b->idom || b->idom == b)
+        {
+            return false;
+        }
+        b = b->idom;
+    }
+    return true;
+}
+
+//control can get from the end of 'from' to the start of 'to'
+static bool canReach(IRFunction& f, IRBlock* from, IRBlock* to)
+{
+    std::vector<bool> visited(f.blocks.size());
+    std::vector<IRBlock*> work(from->succs.begin(), from->succs.end());
+    while(!work.empty())
+    {
+        IRBlock* blk = work.back();
+        work.pop_back();
+        if(blk == to)
+        {
+            return true;
+        }
+        if(visited[blk->id])
+        {
+            continue;
+        }
+        visited[blk->id] = true;
+        work.insert(work.end(), blk->succs.begin(), blk->succs.end());
+    }
+    return false;
+}
+
+size_t CaptureByValuePass::run(IRModule& module)
+{
+    //closed vars assigned by closure itself or by closures it passed them to
+    std::set<ClosedVarKey> written;
+    std::vector<std::pair<ClosedVarKey, ClosedVarKey>> passed;
+    ArgsVector args;
+    for(auto& f : module.funcs)
+    {
+        if(!f->func)
+        {
+            continue;
+        }
+        for(auto& blk : f->blocks)
+        {
+            for(auto& ins : blk->instrs)
+            {
+                args.clear();
+                ins.op->getDsts(args);
+                const OpArg* ref = getRefSource(ins.op);
+                if(ref)
+                {
+                    args.push_back(const_cast<OpArg*>(ref));
+                }
+                for(auto arg : args)
+                {
+                    if(arg->at == atClosed)
+                    {
+                        written.insert(ClosedVarKey(f->func, arg->idx));
+                    }
+                }
+                if(ins.op->ot != otMakeClosure)
+                {
+                    continue;
+                }
+                auto* mc = (OpMakeClosure*) ins.op;
+                FuncInfo* target = getClosureFunc(module, mc);
+                for(index_type i = 0; i < mc->closedCount; ++i)
+                {
+                    if(mc->closedVars[i].at != atClosed)
+                    {
+                        continue;
+                    }
+                    ClosedVarKey key(f->func, mc->closedVars[i].idx);
+                    if(target)
+                    {
+                        passed.emplace_back(key, ClosedVarKey(target, i));
+                    } else
+                    {
+                        written.insert(key);
+                    }
+                }
+            }
+        }
+    }
+    for(bool changed = true; changed;)
+    {
+        changed = false;
+        for(auto& p : passed)
+        {
+            if(written.count(p.second) && written.insert(p.first).second)
+            {
+                changed = true;
+            }
+        }
+    }
+
+    struct SlotInfo {
+        size_t defs = 0;
+        IRBlock* defBlock = nullptr;
+        size_t defPos = 0;
+        //reference taken or some closure assigns it
+        bool shared = false;
+    };
+    struct ClosureSite {
+        OpMakeClosure* op;
+        IRBlock* block;
+        size_t pos;
+    };
+    size_t rv = 0;
+    for(auto& f : module.funcs)
+    {
+        std::vector<SlotInfo> slots(f->slotsCount);
+        std::vector<ClosureSite> sites;
+        for(auto& blk : f->blocks)
+        {
+            for(size_t pos = 0; pos < blk->instrs.size(); ++pos)
+            {
+                IRInstr& ins = blk->instrs[pos];
+                for(auto& def : ins.defs)
+                {
+                    SlotInfo& si = slots[def.arg->idx];
+                    ++si.defs;
+                    si.defBlock = blk.get();
+                    si.defPos = pos;
+                }
+                const OpArg* ref = getRefSource(ins.op);
+                if(ref && ref->at == atLocal && ref->idx < slots.size())
+                {
+                    slots[ref->idx].shared = true;
+                }
+                if(ins.op->ot == otEnterTry)
+                {
+                    index_type idx = ((OpEnterTry*) ins.op)->idx;
+                    if(idx < slots.size())
+                    {
+                        slots[idx].shared = true;
+                    }
+                } else if(ins.op->ot == otMakeClosure)
+                {
+                    auto* mc = (OpMakeClosure*) ins.op;
+                    FuncInfo* target = getClosureFunc(module, mc);
+                    for(index_type i = 0; i < mc->closedCount; ++i)
+                    {
+                        const OpArg& arg = mc->closedVars[i];
+                        if(arg.at == atLocal && (!target || written.count(ClosedVarKey(target, i))))
+                        {
+                            slots[arg.idx].shared = true;
+                        }
+                    }
+                    sites.push_back(ClosureSite{mc, blk.get(), pos});
+                }
+            }
+        }
+        for(auto& site : sites)
+        {
+            OpMakeClosure* mc = site.op;
+            uint64_t mask = 0;
+            for(index_type i = 0; i < mc->closedCount && i < 64; ++i)
+            {
+                const OpArg& arg = mc->closedVars[i];
+                bool byValue = arg.at == atClosed;
+                if(arg.at == atLocal)
+                {
+                    const SlotInfo& si = slots[arg.idx];
+                    if(si.shared || si.defs > 1)
+                    {
+                        continue;
+                    }
+                    byValue = si.defs == 0 ||
+                              (dominates(si.defBlock, site.block) &&
+                               (si.defBlock != site.block || si.defPos < site.pos) &&
+                               !canReach(*f, site.block, si.defBlock));
+                }
+                if(byValue)
+                {
+                    mask |= uint64_t(1) << i;
+                }
+            }
+            if((mc->byValue | mask) != mc->byValue)
+            {
+                mc->byValue |= mask;
+                ++rv;
+            }
+        }
+    }
+    return rv;
+}
+
+size_t DeadStorePass::run(IRModule& module)
+{
+    size_t rv = 0;
+    for(auto& f : module.funcs)
+    {
+        if(!f->func)
+        {
+            continue;
+        }
+        size_t removed = runFunction(*f);
+        if(removed)
+        {
+            f->changed = true;
+            rv += removed;
+        }
+    }
+    return rv;
+}
+
+static bool isScalarConst(SymbolsInfo& si, const OpArg& arg)
+{
+    if(arg.at != atGlobal || arg.idx >= si.globalsCount)
+    {
+        return false;
+    }
+    const Value& v = si.globals[arg.idx];
+    return (v.flags & ValFlagConst) && (v.vt == vtNil || v.vt == vtBool || v.vt == vtInt || v.vt == vtDouble);
+}
+
+size_t DeadStorePass::runFunction(IRFunction& f)
+{
+    FuncInfo* fi = f.func;
+    SymbolsInfo& si = f.module->vm->symbols;
+    size_t count = f.slotsCount;
+    //slots accessed by other means than plain reads and writes
+    SlotSet fixed(count);
+    std::vector<std::vector<IRBlock*>> defBlocks(count);
+    //versions read by ops or flowing into phis
+    std::set<std::pair<index_type, unsigned>> used;
+    ArgsVector args;
+    for(auto& blk : f.blocks)
+    {
+        for(auto& phi : blk->phis)
+        {
+            for(auto v : phi.args)
+            {
+                used.emplace(phi.slot, v);
+            }
+        }
+        for(auto& ins : blk->instrs)
+        {
+            OpBase* op = ins.op;
+            if(op->ot == otEnterTry)
+            {
+                return 0;
+            }
+            for(auto& use : ins.uses)
+            {
+                used.emplace(use.arg->idx, use.version);
+            }
+            for(auto& def : ins.defs)
+            {
+                auto& db = defBlocks[def.arg->idx];
+                if(db.empty() || db.back() != blk.get())
+                {
+                    db.push_back(blk.get());
+                }
+            }
+            if(op->ot == otMakeClosure || op->ot == otMakeConst || op->ot == otJumpIfInited)
+            {
+                args.clear();
+                op->getArgs(args);
+                op->getDsts(args);
+                for(auto arg : args)
+                {
+                    if(arg->at == atLocal)
+                    {
+                        fixed[arg->idx] = true;
+                    }
+                }
+            }
+            const OpArg* ref = getRefSource(op);
+            if(ref && ref->at == atLocal)
+            {
+                fixed[ref->idx] = true;
+            }
+        }
+    }
+    for(auto sym : fi->locals)
+    {
+        if(sym->index < count && (sym->index < fi->argsCount || isFixedSymbol(sym)))
+        {
+            fixed[sym->index] = true;
+        }
+    }
+    for(index_type i = 0; i < fi->argsCount && i < count; ++i)
+    {
+        fixed[i] = true;
+    }
+
+    size_t rv = 0;
+    for(auto& blk : f.blocks)
+    {
+        SlotSet definedBefore(count);
+        //not a leader has only one way in, from the last kept op of the block
+        OpBase* prev = nullptr;
+        for(auto& ins : blk->instrs)
+        {
+            OpBase* op = ins.op;
+            auto* asg = op->ot == otAssign ? static_cast<OpAssign*>(op) : nullptr;
+            bool dead = prev && asg && asg->left.at == atLocal && asg->dst.at == atNul &&
+                        !fixed[asg->left.idx] && !definedBefore[asg->left.idx] && isScalarConst(si, asg->right) &&
+                        !used.count(std::make_pair(asg->left.idx, ins.defs[0].version));
+            if(dead)
+            {
+                //some def reaching this store would leave a value to release here
+                for(auto db : defBlocks[asg->left.idx])
+                {
+                    if(canReach(f, db, blk.get()))
+                    {
+                        dead = false;
+                        break;
+                    }
+                }
+            }
+            for(auto& def : ins.defs)
+            {
+                definedBefore[def.arg->idx] = true;
+            }
+            if(dead)
+            {
+                prev->next = op->next;
+                ++rv;
+            } else
+            {
+                prev = op;
+            }
+        }
+    }
+    return rv;
+}
+
+void PassManager::add(IRPass* pass)
+{
+    passes.emplace_back(pass);
+}
+
+bool PassManager::disable(const std::string& name)
+{
+    for(auto& p : passes)
+    {
+        if(name == p->getName())
+        {
+            disabled.push_back(name);
+            return true;
+        }
+    }
+    return false;
+}
+
+void PassManager::run(IRModule& module)
+{
+    for(auto& p : passes)
+    {
+        if(std::find(disabled.begin(), disabled.end(), p->getName()) != disabled.end())
+        {
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        size_t changes = p->run(module);
+        if(changes)
+        {
+            module.build();
+        }
+        std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - start;
+        stats.push_back(PassStats{p->getName(), changes, d.count()});
+        if(trace)
+        {
+            *trace += "; after ";
+            *trace += p->getName();
+            *trace += "\n";
+            module.dump(*trace);
+        }
+    }
+}
+
+CodeOptimizer::CodeOptimizer(ZorroVM* argVm) : module(argVm)
+{
+    passes.add(new DeadFlowPass);
+    passes.add(new ThreadJumpsPass);
+    passes.add(new DeadStorePass);
+    passes.add(new SlotAllocPass);
+    passes.add(new CaptureByValuePass);
+}
+
+void CodeOptimizer::optimize()
+{
+    module.build();
+    passes.run(module);
+    removedOps += module.releaseDetached();
+}
+
+}
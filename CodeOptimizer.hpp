@@ -0,0 +1,164 @@
+#ifndef __ZORRO_CODE_OPTIMIZER_HPP__
+#define __ZORRO_CODE_OPTIMIZER_HPP__
+
+#include "CodeIR.hpp"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace zorro {
+
+class ZorroVM;
+
+/*
+  Single optimization over IRModule.
+  run returns number of changes and marks functions it modified as changed,
+  only those are rebuilt before the next pass.
+*/
+class IRPass {
+public:
+    virtual ~IRPass()
+    {
+    }
+
+    virtual const char* getName() const = 0;
+
+    virtual size_t run(IRModule& module) = 0;
+};
+
+/*
+  Control never falls through return and throw,
+  ops after them that nothing jumps to become unreachable.
+*/
+class DeadFlowPass : public IRPass {
+public:
+    const char* getName() const override
+    {
+        return "dead-flow";
+    }
+
+    size_t run(IRModule& module) override;
+};
+
+/*
+  Jumps to unconditional jumps are routed directly to the final target.
+*/
+class ThreadJumpsPass : public IRPass {
+public:
+    const char* getName() const override
+    {
+        return "thread-jumps";
+    }
+
+    size_t run(IRModule& module) override;
+
+protected:
+    OpBase* skipJumps(IRModule& module, OpBase* op);
+};
+
+/*
+  Removes assignments of scalar constants to locals whose SSA version is never read.
+  Store is removed only if no other def of the slot can reach it, so the slot holds nil
+  and nothing is released by it. Functions with try blocks are skipped,
+  exception edges are too coarse to see reads in catch.
+*/
+class DeadStorePass : public IRPass {
+public:
+    const char* getName() const override
+    {
+        return "dead-stores";
+    }
+
+    size_t run(IRModule& module) override;
+
+protected:
+    size_t runFunction(IRFunction& f);
+};
+
+/*
+  Liveness based renumbering of function local slots.
+  Slots with disjoint lifetimes share one index and FuncInfo::localsCount shrinks.
+  Slot is handed over only after its value was consumed by temporal read or cleared,
+  so values are released at the same point as before.
+  Args, self, captured, referenced and catch slots keep their indices.
+*/
+class SlotAllocPass : public IRPass {
+public:
+    const char* getName() const override
+    {
+        return "alloc-slots";
+    }
+
+    size_t run(IRModule& module) override;
+
+    //functions with more slots are left as is, interference matrix is quadratic
+    static const size_t maxSlots = 4096;
+
+protected:
+    size_t allocFunction(IRFunction& f);
+};
+
+/*
+  Closed locals that can't change after closure is created are copied into it
+  instead of being boxed into reference shared with the creating frame.
+  Local qualifies if its only def dominates closure creation and can't run again after it,
+  no reference to it is taken and no closure capturing it (directly or through nested closures) assigns it.
+  Closed vars passed to nested closures are always marked, they stay shared if they came boxed.
+*/
+class CaptureByValuePass : public IRPass {
+public:
+    const char* getName() const override
+    {
+        return "capture-values";
+    }
+
+    size_t run(IRModule& module) override;
+};
+
+/*
+  Runs passes in order they were added, measuring each one.
+*/
+class PassManager {
+public:
+    struct PassStats {
+        const char* name;
+        size_t changes;
+        double ms;
+    };
+
+    void add(IRPass* pass);
+
+    /* returns false if there is no pass with this name */
+    bool disable(const std::string& name);
+
+    void run(IRModule& module);
+
+    std::vector<PassStats> stats;
+    //if set, module is dumped here after each pass
+    std::string* trace = nullptr;
+
+protected:
+    std::vector<std::unique_ptr<IRPass>> passes;
+    std::vector<std::string> disabled;
+};
+
+/*
+  Cleans up op graphs produced by CodeGenerator.
+  Builds IRModule for the whole program, runs default pipeline over it
+  and deletes ops that became unreachable.
+  Must be called after code generation and before the first run.
+*/
+class CodeOptimizer {
+public:
+    CodeOptimizer(ZorroVM* argVm);
+
+    void optimize();
+
+    IRModule module;
+    PassManager passes;
+    size_t removedOps = 0;
+};
+
+}
+
+#endif
@@ -94,7 +94,7 @@ public:
             throw ReadBeyondEndException(8, pos, bufSize);
         }
         pos += 8;
-        uint32_t rv = *buf;
+        uint64_t rv = *buf;
         rv <<= 8;
         rv |= *++buf;
         rv <<= 8;
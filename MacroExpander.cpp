@@ -19,7 +19,7 @@ void ZMacroExpander::expandMacro()
         throw SyntaxErrorException("Expected '(' at", fname.pos);
     }
 
-    ZParser::Rule* argsRule = &p->getRule("argList");
+    ZParser::Rule* argsRule = &p->grammar->getRule("argList");
     std::unique_ptr<ExprList> ex (p->parseRule<ExprList*>(argsRule));
     if(p->l.getNext().tt != tCRBr)
     {
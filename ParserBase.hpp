@@ -5,6 +5,7 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <map>
 #include <new>
 #include <assert.h>
 #include "LexerBase.hpp"
@@ -71,6 +72,15 @@ public:
     };
 
 
+    //where result of memoized rule call came from, rule is null for everything else
+    struct MemoInfo {
+        Rule* rule;
+        int ctx;
+        FileLocation start;
+        FileLocation end;
+        Term lastOk;
+    };
+
     struct StackItem {
         ~StackItem()
         {
@@ -92,6 +102,7 @@ public:
         void (* destructor)(void*, char*);
 
         RuleEntry re;
+        MemoInfo memo;
         bool owned;
         bool isPtr;
 
@@ -119,6 +130,7 @@ public:
             static_assert(sizeof(t) <= ImplType::MaxDataSize, "Data too big for a buffer");
             new(buf)T(t);
             destructor = DHelper<T>::destroy;
+            memo.rule = 0;
             owned = true;
             isPtr = false;
         }
@@ -128,6 +140,7 @@ public:
         {
             ptr = (void*) t;
             destructor = DHelper<T*>::destroy;
+            memo.rule = 0;
             owned = true;
             isPtr = true;
         }
@@ -188,8 +201,7 @@ public:
             delete[] (char*) data;
         }
 
-        template<class T>
-        void push_back(T item, RuleEntry re)
+        void grow()
         {
             if(!last)
             {
@@ -210,10 +222,24 @@ public:
                 dataEnd = data + oldSz + 32;
                 last = data + oldSz;
             }
+        }
+
+        template<class T>
+        void push_back(T item, RuleEntry re)
+        {
+            grow();
             last->assign(item);
             last->re = re;
         }
 
+        //takes ownership of item's value
+        void push_item(StackItem& item)
+        {
+            grow();
+            *last = item;
+            item.owned = false;
+        }
+
         template<class T>
         void replace(int count, T item, RuleEntry re)
         {
@@ -260,7 +286,7 @@ public:
         {
         }
 
-        virtual void handleRule(DataStack& stack, RuleEntry re) = 0;
+        virtual void handleRule(ImplType* p, DataStack& stack, RuleEntry re) = 0;
     };
 
     enum ListMode {
@@ -329,8 +355,10 @@ public:
         bool defined;
         bool prepared;
         bool preparing;
+        //results and failures are remembered by position, see ParserBase::recallCall
+        bool memo;
 
-        Rule() : id(-1), listMode(lmNone), emptySeq(-1), defined(false), prepared(false), preparing(false)
+        Rule() : id(-1), listMode(lmNone), emptySeq(-1), defined(false), prepared(false), preparing(false), memo(false)
         {
             for(int i = 0; i < Lexer::MaxTermId; i++)
             {
@@ -366,15 +394,13 @@ public:
 
     template<class P, class RV>
     struct RuleHandler0 : RuleHandlerBase {
-        P* p;
-
         RV (P::*method)();
 
-        RuleHandler0(P* argP, RV (P::*argMethod)()) : p(argP), method(argMethod)
+        explicit RuleHandler0(RV (P::*argMethod)()) : method(argMethod)
         {
         }
 
-        void handleRule(DataStack& stack, RuleEntry re)
+        void handleRule(ImplType* p, DataStack& stack, RuleEntry re)
         {
             stack.push_back((p->*method)(), re);
         }
@@ -382,15 +408,13 @@ public:
 
     template<class P, class RV, class A1>
     struct RuleHandler1 : RuleHandlerBase {
-        P* p;
-
         RV (P::*method)(A1);
 
-        RuleHandler1(P* argP, RV (P::*argMethod)(A1)) : p(argP), method(argMethod)
+        explicit RuleHandler1(RV (P::*argMethod)(A1)) : method(argMethod)
         {
         }
 
-        void handleRule(DataStack& stack, RuleEntry re)
+        void handleRule(ImplType* p, DataStack& stack, RuleEntry re)
         {
             stack.replace(1, (p->*method)(ARG(0, A1)), re);
         }
@@ -398,15 +422,13 @@ public:
 
     template<class P, class RV, class A1, class A2>
     struct RuleHandler2 : RuleHandlerBase {
-        P* p;
-
         RV (P::*method)(A1, A2);
 
-        RuleHandler2(P* argP, RV (P::*argMethod)(A1, A2)) : p(argP), method(argMethod)
+        explicit RuleHandler2(RV (P::*argMethod)(A1, A2)) : method(argMethod)
         {
         }
 
-        void handleRule(DataStack& stack, RuleEntry re)
+        void handleRule(ImplType* p, DataStack& stack, RuleEntry re)
         {
             stack.replace(2, (p->*method)(ARG(-1, A1), ARG(0, A2)), re);
         }
@@ -414,15 +436,13 @@ public:
 
     template<class P, class RV, class A1, class A2, class A3>
     struct RuleHandler3 : RuleHandlerBase {
-        P* p;
-
         RV (P::*method)(A1, A2, A3);
 
-        RuleHandler3(P* argP, RV (P::*argMethod)(A1, A2, A3)) : p(argP), method(argMethod)
+        explicit RuleHandler3(RV (P::*argMethod)(A1, A2, A3)) : method(argMethod)
         {
         }
 
-        void handleRule(DataStack& stack, RuleEntry re)
+        void handleRule(ImplType* p, DataStack& stack, RuleEntry re)
         {
             stack.replace(3, (p->*method)(ARG(-2, A1), ARG(-1, A2), ARG(0, A3)), re);
         }
@@ -430,15 +450,13 @@ public:
 
     template<class P, class RV, class A1, class A2, class A3, class A4>
     struct RuleHandler4 : RuleHandlerBase {
-        P* p;
-
         RV (P::*method)(A1, A2, A3, A4);
 
-        RuleHandler4(P* argP, RV (P::*argMethod)(A1, A2, A3, A4)) : p(argP), method(argMethod)
+        explicit RuleHandler4(RV (P::*argMethod)(A1, A2, A3, A4)) : method(argMethod)
         {
         }
 
-        void handleRule(DataStack& stack, RuleEntry re)
+        void handleRule(ImplType* p, DataStack& stack, RuleEntry re)
         {
             stack.replace(4, (p->*method)(ARG(-3, A1), ARG(-2, A2), ARG(-1, A3), ARG(0, A4)), re);
         }
@@ -446,15 +464,13 @@ public:
 
     template<class P, class RV, class A1, class A2, class A3, class A4, class A5>
     struct RuleHandler5 : RuleHandlerBase {
-        P* p;
-
         RV (P::*method)(A1, A2, A3, A4, A5);
 
-        RuleHandler5(P* argP, RV (P::*argMethod)(A1, A2, A3, A4, A5)) : p(argP), method(argMethod)
+        explicit RuleHandler5(RV (P::*argMethod)(A1, A2, A3, A4, A5)) : method(argMethod)
         {
         }
 
-        void handleRule(DataStack& stack, RuleEntry re)
+        void handleRule(ImplType* p, DataStack& stack, RuleEntry re)
         {
             stack.replace(5, (p->*method)(ARG(-4, A1), ARG(-3, A2), ARG(-2, A3), ARG(-1, A4), ARG(0, A5)), re);
         }
@@ -462,15 +478,13 @@ public:
 
     template<class P, class RV, class A1, class A2, class A3, class A4, class A5, class A6>
     struct RuleHandler6 : RuleHandlerBase {
-        P* p;
-
         RV (P::*method)(A1, A2, A3, A4, A5, A6);
 
-        RuleHandler6(P* argP, RV (P::*argMethod)(A1, A2, A3, A4, A5, A6)) : p(argP), method(argMethod)
+        explicit RuleHandler6(RV (P::*argMethod)(A1, A2, A3, A4, A5, A6)) : method(argMethod)
         {
         }
 
-        void handleRule(DataStack& stack, RuleEntry re)
+        void handleRule(ImplType* p, DataStack& stack, RuleEntry re)
         {
             stack.replace(6, (p->*method)(ARG(-5, A1), ARG(-4, A2), ARG(-3, A3), ARG(-2, A4), ARG(-1, A5), ARG(0, A6)),
                     re);
@@ -479,15 +493,13 @@ public:
 
     template<class P, class RV, class A1, class A2, class A3, class A4, class A5, class A6, class A7>
     struct RuleHandler7 : RuleHandlerBase {
-        P* p;
-
         RV (P::*method)(A1, A2, A3, A4, A5, A6, A7);
 
-        RuleHandler7(P* argP, RV (P::*argMethod)(A1, A2, A3, A4, A5, A6, A7)) : p(argP), method(argMethod)
+        explicit RuleHandler7(RV (P::*argMethod)(A1, A2, A3, A4, A5, A6, A7)) : method(argMethod)
         {
         }
 
-        void handleRule(DataStack& stack, RuleEntry re)
+        void handleRule(ImplType* p, DataStack& stack, RuleEntry re)
         {
             stack.replace(7, (p->*method)(ARG(-6, A1), ARG(-5, A2), ARG(-4, A3), ARG(-3, A4), ARG(-2, A5), ARG(-1, A6),
                     ARG(0, A7)), re);
@@ -498,27 +510,6 @@ public:
 
 
     Lexer l;
-    typedef std::map<std::string, int> TermByNameMap;
-    TermByNameMap termMap;
-    typedef std::map<std::string, Rule> RuleMap;
-    RuleMap ruleMap;
-    int ruleSeq;
-
-    std::list<Rule*> rulesList;
-
-    Rule& getRule(const std::string& name)
-    {
-        typename RuleMap::iterator it = ruleMap.find(name);
-        if(it != ruleMap.end())
-        {
-            return it->second;
-        }
-        Rule& rv = ruleMap[name];
-        rulesList.push_back(&rv);
-        rv.name = name;
-        return rv;
-    }
-
     void pushReader(FileReader* fr, FileLocation parentLoc = FileLocation())
     {
         l.pushReader(fr, parentLoc);
@@ -542,332 +533,610 @@ public:
         }
     };
 
-    void add(const SeqInfo& rule)
-    {
-        parseRule(rule, 0);
-    }
+    /*
+      Grammar prepared by prepare() in flat arrays.
+      Generated at build time by dumpTables from rules built at runtime,
+      so parser can be constructed without parsing rule strings.
+    */
+    enum TableEntryFlags {
+        tefTerm = 1,
+        tefPushed = 2,
+        tefReturnOnError = 4,
+        tefPrioReset = 8,
+        tefPointOfNoReturn = 16,
+        tefOptional = 32
+    };
 
-    template<class RV>
-    void add0(const SeqInfo& rule, RV (ImplType::*method)())
-    {
-        parseRule(rule, 0).handler = new RuleHandler0<ImplType, RV>((ImplType*) this, method);
-    }
+    struct TableEntry {
+        int flags;
+        //term type or rule id
+        int value;
+    };
 
-    template<class RV, class A1>
-    void add1(const SeqInfo& rule, RV (ImplType::*method)(A1))
-    {
-        parseRule(rule, 1).handler = new RuleHandler1<ImplType, RV, A1>((ImplType*) this, method);
-    }
+    struct TableSeq {
+        const char* name;
+        int prio;
+        bool left;
+        bool binary;
+        int alt;
+        int compatibleAlt;
+        int firstEntry;
+        int entriesCount;
+    };
 
-    template<class RV, class A1, class A2>
-    void add2(const SeqInfo& rule, RV (ImplType::*method)(A1, A2))
-    {
-        parseRule(rule, 2).handler = new RuleHandler2<ImplType, RV, A1, A2>((ImplType*) this, method);
-    }
+    //rules are stored in order of ids
+    struct TableRule {
+        const char* name;
+        int listMode;
+        int emptySeq;
+        int firstSeq;
+        int seqsCount;
+    };
 
-    template<class RV, class A1, class A2, class A3>
-    void add3(const SeqInfo& rule, RV (ImplType::*method)(A1, A2, A3))
-    {
-        parseRule(rule, 3).handler = new RuleHandler3<ImplType, RV, A1, A2, A3>((ImplType*) this, method);
-    }
+    struct Tables {
+        int termsCount;
+        int rulesCount;
+        const TableRule* rules;
+        const TableSeq* seqs;
+        const TableEntry* entries;
+        //rulesCount*termsCount each
+        const int* startTerms;
+        const int* binopSeq;
+        //rule id and sequence index for each add call, in order of calls
+        int addsCount;
+        const int* adds;
+        int startRule;
+    };
 
-    template<class RV, class A1, class A2, class A3, class A4>
-    void add4(const SeqInfo& rule, RV (ImplType::*method)(A1, A2, A3, A4))
-    {
-        parseRule(rule, 4).handler = new RuleHandler4<ImplType, RV, A1, A2, A3, A4>((ImplType*) this, method);
-    }
+    /*
+      Rules of the language, prepared once and shared by all parsers of the same type.
+      Handlers get parser they are called for, so nothing here changes while parsing.
+    */
+    struct Grammar {
+        typedef std::map<std::string, int> TermByNameMap;
+        TermByNameMap termMap;
+        typedef std::map<std::string, Rule> RuleMap;
+        RuleMap ruleMap;
+        int ruleSeq;
 
-    template<class RV, class A1, class A2, class A3, class A4, class A5>
-    void add5(const SeqInfo& rule, RV (ImplType::*method)(A1, A2, A3, A4, A5))
-    {
-        parseRule(rule, 5).handler = new RuleHandler5<ImplType, RV, A1, A2, A3, A4, A5>((ImplType*) this, method);
-    }
+        std::list<Rule*> rulesList;
 
-    template<class RV, class A1, class A2, class A3, class A4, class A5, class A6>
-    void add6(const SeqInfo& rule, RV (ImplType::*method)(A1, A2, A3, A4, A5, A6))
-    {
-        parseRule(rule, 6).handler = new RuleHandler6<ImplType, RV, A1, A2, A3, A4, A5, A6>((ImplType*) this, method);
-    }
+        Rule& getRule(const std::string& name)
+        {
+            typename RuleMap::iterator it = ruleMap.find(name);
+            if(it != ruleMap.end())
+            {
+                return it->second;
+            }
+            Rule& rv = ruleMap[name];
+            rulesList.push_back(&rv);
+            rv.name = name;
+            return rv;
+        }
 
-    template<class RV, class A1, class A2, class A3, class A4, class A5, class A6, class A7>
-    void add7(const SeqInfo& rule, RV (ImplType::*method)(A1, A2, A3, A4, A5, A6, A7))
-    {
-        parseRule(rule, 7).handler = new RuleHandler7<ImplType, RV, A1, A2, A3, A4, A5, A6, A7>((ImplType*) this,
-                method);
-    }
+        void add(const SeqInfo& rule)
+        {
+            addRule(rule, 0);
+        }
 
-    bool getNext(const char*& rule, std::string& buf)
-    {
-        buf.clear();
-        while(*rule && !isalnum(*rule))
+        template<class RV>
+        void add0(const SeqInfo& rule, RV (ImplType::*method)())
         {
-            rule++;
+            addRule(rule, 0).handler = new RuleHandler0<ImplType, RV>(method);
         }
-        if(!*rule)
+
+        template<class RV, class A1>
+        void add1(const SeqInfo& rule, RV (ImplType::*method)(A1))
         {
-            return false;
+            addRule(rule, 1).handler = new RuleHandler1<ImplType, RV, A1>(method);
         }
-        while(isalnum(*rule))
+
+        template<class RV, class A1, class A2>
+        void add2(const SeqInfo& rule, RV (ImplType::*method)(A1, A2))
         {
-            buf += *rule++;
+            addRule(rule, 2).handler = new RuleHandler2<ImplType, RV, A1, A2>(method);
         }
-        return true;
-    }
 
-    bool checkFlag(const char*& str, char flag)
-    {
-        if(*str == flag)
+        template<class RV, class A1, class A2, class A3>
+        void add3(const SeqInfo& rule, RV (ImplType::*method)(A1, A2, A3))
         {
-            str++;
-            return true;
+            addRule(rule, 3).handler = new RuleHandler3<ImplType, RV, A1, A2, A3>(method);
         }
-        return false;
-    }
 
-    Sequence& parseRule(const SeqInfo& seq, int args)
-    {
-        const char* rule = seq.rule;
-        std::string str;
-        if(!getNext(rule, str))
+        template<class RV, class A1, class A2, class A3, class A4>
+        void add4(const SeqInfo& rule, RV (ImplType::*method)(A1, A2, A3, A4))
         {
-            //invalid rule;
-            throw InvalidRule(seq.rule);
+            addRule(rule, 4).handler = new RuleHandler4<ImplType, RV, A1, A2, A3, A4>(method);
         }
-        Rule& r = getRule(str);
-        if(!r.defined)
+
+        template<class RV, class A1, class A2, class A3, class A4, class A5>
+        void add5(const SeqInfo& rule, RV (ImplType::*method)(A1, A2, A3, A4, A5))
         {
-            r.name = str;
-            r.defined = true;
-            r.id = ruleSeq++;
+            addRule(rule, 5).handler = new RuleHandler5<ImplType, RV, A1, A2, A3, A4, A5>(method);
         }
-        if(seq.isBinRule)
+
+        template<class RV, class A1, class A2, class A3, class A4, class A5, class A6>
+        void add6(const SeqInfo& rule, RV (ImplType::*method)(A1, A2, A3, A4, A5, A6))
         {
-            r.seqs.push_back(Sequence(seq.name, seq.prio, seq.isLeft));
+            addRule(rule, 6).handler = new RuleHandler6<ImplType, RV, A1, A2, A3, A4, A5, A6>(method);
         }
-        else
+
+        template<class RV, class A1, class A2, class A3, class A4, class A5, class A6, class A7>
+        void add7(const SeqInfo& rule, RV (ImplType::*method)(A1, A2, A3, A4, A5, A6, A7))
         {
-            r.seqs.push_back(Sequence(seq.name));
+            addRule(rule, 7).handler = new RuleHandler7<ImplType, RV, A1, A2, A3, A4, A5, A6, A7>(method);
         }
-        Sequence& s = r.seqs.back();
-        bool pushed = true;
-        bool returnOnError = false;
-        bool prioReset = false;
-        bool pointOfNoReturn = false;
-        bool optional = false;
-        int acnt = 0;
-        while(getNext(rule, str))
+
+        bool getNext(const char*& rule, std::string& buf)
         {
-            optional = checkFlag(rule, '?');
-            pushed = !checkFlag(rule, '-') && !optional;
-            returnOnError = checkFlag(rule, '.');
-            prioReset = checkFlag(rule, '!');
-            pointOfNoReturn = checkFlag(rule, '^');
+            buf.clear();
+            while(*rule && !isalnum(*rule))
+            {
+                rule++;
+            }
+            if(!*rule)
+            {
+                return false;
+            }
+            while(isalnum(*rule))
+            {
+                buf += *rule++;
+            }
+            return true;
+        }
 
-            if(pushed)
+        bool checkFlag(const char*& str, char flag)
+        {
+            if(*str == flag)
             {
-                acnt++;
+                str++;
+                return true;
             }
+            return false;
+        }
 
-            TermByNameMap::iterator it = termMap.find(str);
-            RuleEntry* e;
-            if(it == termMap.end())
+        //set by loadTables, add calls only bind handlers to sequences
+        const Tables* tables;
+        std::vector<std::pair<Rule*, int> > adds;
+
+        Sequence& addRule(const SeqInfo& seq, int args)
+        {
+            if(!tables)
             {
-                e = &s.add(RuleEntry(getRule(str)));
+                return parseRule(seq, args);
             }
-            else
+            if(adds.size() >= static_cast<size_t>(tables->addsCount))
+            {
+                throw std::runtime_error(std::string("parser tables are out of date at ") + seq.name);
+            }
+            const int* add = tables->adds + 2 * adds.size();
+            Rule* r = rulesById[static_cast<size_t>(add[0])];
+            Sequence& rv = r->seqs[static_cast<size_t>(add[1])];
+            if(rv.name != seq.name)
             {
-                e = &s.add(RuleEntry(it->second));
+                throw std::runtime_error(std::string("parser tables are out of date at ") + seq.name);
             }
-            e->isPushed = pushed;
-            e->isReturnOnError = returnOnError;
-            e->isPrioReset = prioReset;
-            e->isPointOfNoReturn = pointOfNoReturn;
-            e->isOptional = optional;
+            adds.push_back(std::make_pair(r, add[1]));
+            return rv;
+        }
+
+        std::vector<Rule*> rulesById;
+        Rule* startRule;
 
+        /* replaces rules with prepared ones from t, must be called before any rule is added */
+        void loadTables(const Tables& t)
+        {
+            if(t.termsCount != Lexer::MaxTermId)
+            {
+                throw std::runtime_error("parser tables were generated for different lexer");
+            }
+            rulesById.resize(static_cast<size_t>(t.rulesCount));
+            for(int i = 0; i < t.rulesCount; ++i)
+            {
+                const TableRule& tr = t.rules[i];
+                Rule& r = getRule(tr.name);
+                rulesById[static_cast<size_t>(i)] = &r;
+                r.id = i;
+                r.listMode = static_cast<ListMode>(tr.listMode);
+                r.emptySeq = tr.emptySeq;
+                r.defined = true;
+                r.prepared = true;
+                r.preparing = true;
+                memcpy(r.startTerms, t.startTerms + i * t.termsCount, sizeof(r.startTerms));
+                memcpy(r.binopSeq, t.binopSeq + i * t.termsCount, sizeof(r.binopSeq));
+            }
+            for(int i = 0; i < t.rulesCount; ++i)
+            {
+                const TableRule& tr = t.rules[i];
+                Rule& r = *rulesById[static_cast<size_t>(i)];
+                r.seqs.reserve(static_cast<size_t>(tr.seqsCount));
+                for(int j = 0; j < tr.seqsCount; ++j)
+                {
+                    const TableSeq& ts = t.seqs[tr.firstSeq + j];
+                    r.seqs.push_back(Sequence(ts.name));
+                    Sequence& s = r.seqs.back();
+                    s.prio = ts.prio;
+                    s.left = ts.left;
+                    s.binary = ts.binary;
+                    s.alt = ts.alt;
+                    s.compatibleAlt = ts.compatibleAlt;
+                    s.seq.reserve(static_cast<size_t>(ts.entriesCount));
+                    for(int k = 0; k < ts.entriesCount; ++k)
+                    {
+                        const TableEntry& te = t.entries[ts.firstEntry + k];
+                        RuleEntry& e = (te.flags & tefTerm) ? s.add(RuleEntry(te.value)) :
+                                       s.add(RuleEntry(rulesById[static_cast<size_t>(te.value)]));
+                        e.isPushed = (te.flags & tefPushed) != 0;
+                        e.isReturnOnError = (te.flags & tefReturnOnError) != 0;
+                        e.isPrioReset = (te.flags & tefPrioReset) != 0;
+                        e.isPointOfNoReturn = (te.flags & tefPointOfNoReturn) != 0;
+                        e.isOptional = (te.flags & tefOptional) != 0;
+                    }
+                }
+            }
+            ruleSeq = t.rulesCount;
+            startRule = rulesById[static_cast<size_t>(t.startRule)];
+            adds.reserve(static_cast<size_t>(t.addsCount));
+            tables = &t;
         }
-        if(acnt != args)
+
+        static void dumpString(std::string& out, const std::string& str)
         {
-            throw std::runtime_error(std::string("arguments number mismatch for seq ") + seq.name);
+            out += '"';
+            for(char c : str)
+            {
+                if(c == '"' || c == '\\')
+                {
+                    out += '\\';
+                }
+                out += c;
+            }
+            out += '"';
         }
-        return s;
-    }
 
-    ParserBase() : ruleSeq(0), startRule(0)
-    {
-    }
+        static void dumpInts(std::string& out, const char* name, const std::vector<int>& v)
+        {
+            out += "static const int ";
+            out += name;
+            out += "[] = {";
+            for(size_t i = 0; i < v.size(); ++i)
+            {
+                out += i % 20 ? " " : "\n    ";
+                out += std::to_string(v[i]);
+                out += ',';
+            }
+            out += "\n};\n\n";
+        }
 
-    void prepare(const char* startRuleName)
-    {
-        //for(RuleMap::iterator it=ruleMap.begin(),end=ruleMap.end();it!=end;++it)
-        for(typename std::list<Rule*>::iterator it = rulesList.begin(), end = rulesList.end(); it != end; ++it)
+        /*
+          Writes prepared grammar as C++ definition of const Tables named varName,
+          type is name of parser class the tables are for.
+          Output is the same for runtime built rules and for rules loaded from these tables.
+        */
+        void dumpTables(std::string& out, const char* type, const char* varName)
         {
-            Rule& r = **it;//it->second;
+            std::vector<Rule*> byId(static_cast<size_t>(ruleSeq));
+            for(Rule* r : rulesList)
+            {
+                if(!r->defined || r->id < 0 || r->id >= ruleSeq)
+                {
+                    throw RuleUndefined(r->name.c_str());
+                }
+                byId[static_cast<size_t>(r->id)] = r;
+            }
+            std::string rules, seqs, entries;
+            std::vector<int> startTerms, binopSeq, addIdx;
+            int seqCount = 0, entryCount = 0;
+            for(Rule* r : byId)
+            {
+                rules += "    {";
+                dumpString(rules, r->name);
+                rules += ", " + std::to_string(r->listMode) + ", " + std::to_string(r->emptySeq) + ", " +
+                         std::to_string(seqCount) + ", " + std::to_string(r->seqs.size()) + "},\n";
+                for(Sequence& s : r->seqs)
+                {
+                    seqs += "    {";
+                    dumpString(seqs, s.name);
+                    seqs += ", " + std::to_string(s.prio) + (s.left ? ", true" : ", false") +
+                            (s.binary ? ", true, " : ", false, ") + std::to_string(s.alt) + ", " +
+                            std::to_string(s.compatibleAlt) + ", " + std::to_string(entryCount) + ", " +
+                            std::to_string(s.seq.size()) + "},\n";
+                    for(RuleEntry& e : s.seq)
+                    {
+                        int flags = (e.isTerm ? tefTerm : 0) | (e.isPushed ? tefPushed : 0) |
+                                    (e.isReturnOnError ? tefReturnOnError : 0) | (e.isPrioReset ? tefPrioReset : 0) |
+                                    (e.isPointOfNoReturn ? tefPointOfNoReturn : 0) | (e.isOptional ? tefOptional : 0);
+                        entries += "    {" + std::to_string(flags) + ", " + std::to_string(e.isTerm ? e.t : e.nt->id) +
+                                   "},\n";
+                        ++entryCount;
+                    }
+                    ++seqCount;
+                }
+                startTerms.insert(startTerms.end(), r->startTerms, r->startTerms + Lexer::MaxTermId);
+                binopSeq.insert(binopSeq.end(), r->binopSeq, r->binopSeq + Lexer::MaxTermId);
+            }
+            for(auto& add : adds)
+            {
+                addIdx.push_back(add.first->id);
+                addIdx.push_back(add.second);
+            }
+            std::string t(type);
+            out += "static const " + t + "::TableRule rules[] = {\n" + rules + "};\n\n";
+            out += "static const " + t + "::TableSeq seqs[] = {\n" + seqs + "};\n\n";
+            out += "static const " + t + "::TableEntry entries[] = {\n" + entries + "};\n\n";
+            dumpInts(out, "startTerms", startTerms);
+            dumpInts(out, "binopSeq", binopSeq);
+            dumpInts(out, "adds", addIdx);
+            out += "extern const " + t + "::Tables " + varName + ";\n\n";
+            out += "const " + t + "::Tables " + varName + " = {\n    " + std::to_string(Lexer::MaxTermId) + ", " +
+                   std::to_string(ruleSeq) + ", rules, seqs, entries, startTerms, binopSeq, " +
+                   std::to_string(adds.size()) + ", adds, " + std::to_string(startRule ? startRule->id : -1) + "\n};\n";
+        }
+
+        Sequence& parseRule(const SeqInfo& seq, int args)
+        {
+            const char* rule = seq.rule;
+            std::string str;
+            if(!getNext(rule, str))
+            {
+                //invalid rule;
+                throw InvalidRule(seq.rule);
+            }
+            Rule& r = getRule(str);
             if(!r.defined)
             {
-                DPRINT("rule not defined:%s\n", r.name.c_str());
-                throw RuleUndefined(r.name.c_str());
+                r.name = str;
+                r.defined = true;
+                r.id = ruleSeq++;
             }
-            if(!r.prepared)
+            if(seq.isBinRule)
             {
-                prepareRule(r);
+                r.seqs.push_back(Sequence(seq.name, seq.prio, seq.isLeft));
             }
-            //for(TermMap::iterator it=r.startTerms.begin(),end=r.startTerms.end();it!=end;++it)
-            for(int i = 0; i < Lexer::MaxTermId; i++)
+            else
             {
-                if(r.startTerms[i] != -1)
+                r.seqs.push_back(Sequence(seq.name));
+            }
+            Sequence& s = r.seqs.back();
+            adds.push_back(std::make_pair(&r, static_cast<int>(r.seqs.size() - 1)));
+            bool pushed = true;
+            bool returnOnError = false;
+            bool prioReset = false;
+            bool pointOfNoReturn = false;
+            bool optional = false;
+            int acnt = 0;
+            while(getNext(rule, str))
+            {
+                optional = checkFlag(rule, '?');
+                pushed = !checkFlag(rule, '-') && !optional;
+                returnOnError = checkFlag(rule, '.');
+                prioReset = checkFlag(rule, '!');
+                pointOfNoReturn = checkFlag(rule, '^');
+
+                if(pushed)
+                {
+                    acnt++;
+                }
+
+                TermByNameMap::iterator it = termMap.find(str);
+                RuleEntry* e;
+                if(it == termMap.end())
                 {
-                    DPRINT("start term for %s:%s\n", r.name.c_str(), Lexer::getTermName(i));
+                    e = &s.add(RuleEntry(getRule(str)));
                 }
+                else
+                {
+                    e = &s.add(RuleEntry(it->second));
+                }
+                e->isPushed = pushed;
+                e->isReturnOnError = returnOnError;
+                e->isPrioReset = prioReset;
+                e->isPointOfNoReturn = pointOfNoReturn;
+                e->isOptional = optional;
+
             }
+            if(acnt != args)
+            {
+                throw std::runtime_error(std::string("arguments number mismatch for seq ") + seq.name);
+            }
+            return s;
         }
-        startRule = &getRule(startRuleName);
-        if(!startRule->defined)
+
+        Grammar() : ruleSeq(0), tables(0), startRule(0)
         {
-            DPRINT("start rule not defined:%s\n", startRuleName);
-            throw RuleUndefined(startRuleName);
         }
-    }
 
-    void prepareRule(Rule& r)
-    {
-        if(r.preparing)
+        Grammar(const Grammar&) = delete;
+
+        Grammar& operator=(const Grammar&) = delete;
+
+        Rule* findRule(const std::string& name)
         {
-            return;
+            typename RuleMap::iterator it = ruleMap.find(name);
+            return it != ruleMap.end() ? &it->second : 0;
         }
-        r.preparing = true;
-        for(size_t idx = 0; idx < r.seqs.size(); ++idx)
+
+        void prepare(const char* startRuleName)
         {
-            Sequence& s = r.seqs[idx];
-            DPRINT("preparing %s:%s\n", r.name.c_str(), s.name.c_str());
-            if(s.seq.empty())
+            if(tables && adds.size() != static_cast<size_t>(tables->addsCount))
             {
-                r.emptySeq = static_cast<int>(idx);
-                continue;
+                throw std::runtime_error("parser tables are out of date");
             }
-            if((s.binary || r.listMode != lmNone) && s.seq.size() >= 2 && s.seq[1].isTerm &&
-               !s.seq.front().isTerm && s.seq.front().nt->id == r.id)
+            //for(RuleMap::iterator it=ruleMap.begin(),end=ruleMap.end();it!=end;++it)
+            for(typename std::list<Rule*>::iterator it = rulesList.begin(), end = rulesList.end(); it != end; ++it)
             {
-                r.binopSeq[s.seq[1].t] = static_cast<int>(idx);
+                Rule& r = **it;//it->second;
+                if(!r.defined)
+                {
+                    DPRINT("rule not defined:%s\n", r.name.c_str());
+                    throw RuleUndefined(r.name.c_str());
+                }
+                if(!r.prepared)
+                {
+                    prepareRule(r);
+                }
+                //for(TermMap::iterator it=r.startTerms.begin(),end=r.startTerms.end();it!=end;++it)
+                for(int i = 0; i < Lexer::MaxTermId; i++)
+                {
+                    if(r.startTerms[i] != -1)
+                    {
+                        DPRINT("start term for %s:%s\n", r.name.c_str(), Lexer::getTermName(i));
+                    }
+                }
+            }
+            startRule = &getRule(startRuleName);
+            if(!startRule->defined)
+            {
+                DPRINT("start rule not defined:%s\n", startRuleName);
+                throw RuleUndefined(startRuleName);
+            }
+        }
+
+        void prepareRule(Rule& r)
+        {
+            if(r.preparing)
+            {
+                return;
             }
-            RuleEntry& e = s.seq.front();
-            if(e.isTerm)
+            r.preparing = true;
+            for(size_t idx = 0; idx < r.seqs.size(); ++idx)
             {
-                if(r.startTerms[e.t] == -1)
+                Sequence& s = r.seqs[idx];
+                DPRINT("preparing %s:%s\n", r.name.c_str(), s.name.c_str());
+                if(s.seq.empty())
                 {
-                    r.startTerms[e.t] = static_cast<int>(idx);
-                    DPRINT("%s is starting with %s\n", s.name.c_str(), Lexer::getTermName(e.t));
+                    r.emptySeq = static_cast<int>(idx);
+                    continue;
                 }
-                else
+                if((s.binary || r.listMode != lmNone) && s.seq.size() >= 2 && s.seq[1].isTerm &&
+                   !s.seq.front().isTerm && s.seq.front().nt->id == r.id)
                 {
-                    int aidx = r.startTerms[e.t];
-                    Sequence& as = r.seqs[static_cast<size_t>(aidx)];
-                    s.alt = aidx;
-                    s.compatibleAlt = -1;
-                    r.startTerms[e.t] = static_cast<int>(idx);
-                    for(size_t i = 0; i < as.seq.size(); ++i)
+                    r.binopSeq[s.seq[1].t] = static_cast<int>(idx);
+                }
+                RuleEntry& e = s.seq.front();
+                if(e.isTerm)
+                {
+                    if(r.startTerms[e.t] == -1)
                     {
-                        if(i >= s.seq.size())
-                        {
-                            DPRINT("fail T1 at %d\n", (int) i);
-                            break;
-                        }
-                        if(s.seq[i].isTerm != as.seq[i].isTerm)
-                        {
-                            DPRINT("fail T2 at %d\n", (int) i);
-                            break;
-                        }
-                        if(s.seq[i].isTerm)
+                        r.startTerms[e.t] = static_cast<int>(idx);
+                        DPRINT("%s is starting with %s\n", s.name.c_str(), Lexer::getTermName(e.t));
+                    }
+                    else
+                    {
+                        int aidx = r.startTerms[e.t];
+                        Sequence& as = r.seqs[static_cast<size_t>(aidx)];
+                        s.alt = aidx;
+                        s.compatibleAlt = -1;
+                        r.startTerms[e.t] = static_cast<int>(idx);
+                        for(size_t i = 0; i < as.seq.size(); ++i)
                         {
-                            if(s.seq[i].t != as.seq[i].t)
+                            if(i >= s.seq.size())
+                            {
+                                DPRINT("fail T1 at %d\n", (int) i);
+                                break;
+                            }
+                            if(s.seq[i].isTerm != as.seq[i].isTerm)
+                            {
+                                DPRINT("fail T2 at %d\n", (int) i);
+                                break;
+                            }
+                            if(s.seq[i].isTerm)
+                            {
+                                if(s.seq[i].t != as.seq[i].t)
+                                {
+                                    DPRINT("marked seq %s as compatible alt of %s at %d\n", s.name.c_str(),
+                                            as.name.c_str(), (int) i);
+                                    s.compatibleAlt = static_cast<int>(i);
+                                    break;
+                                }
+                                continue;
+                            }
+                            if(s.seq[i].nt != as.seq[i].nt)
                             {
                                 DPRINT("marked seq %s as compatible alt of %s at %d\n", s.name.c_str(), as.name.c_str(),
                                         (int) i);
                                 s.compatibleAlt = static_cast<int>(i);
                                 break;
                             }
-                            continue;
-                        }
-                        if(s.seq[i].nt != as.seq[i].nt)
-                        {
-                            DPRINT("marked seq %s as compatible alt of %s at %d\n", s.name.c_str(), as.name.c_str(),
-                                    (int) i);
-                            s.compatibleAlt = static_cast<int>(i);
-                            break;
                         }
                     }
                 }
-            }
-            else
-            {
-                if(e.nt->id != r.id)
+                else
                 {
-                    if(!e.nt->prepared)
+                    if(e.nt->id != r.id)
                     {
-                        prepareRule(*e.nt);
-                    }
-                    for(int i = 0; i < Lexer::MaxTermId; i++)
-                    {
-                        if(e.nt->startTerms[i] != -1)
+                        if(!e.nt->prepared)
                         {
-                            if(r.startTerms[i] == -1)
-                            {
-                                r.startTerms[i] = static_cast<int>(idx);
-                            }
-                            else
+                            prepareRule(*e.nt);
+                        }
+                        for(int i = 0; i < Lexer::MaxTermId; i++)
+                        {
+                            if(e.nt->startTerms[i] != -1)
                             {
-                                int aidx = r.startTerms[i];
-                                Sequence& as = r.seqs[static_cast<size_t>(aidx)];
-                                s.alt = aidx;
-                                s.compatibleAlt = -1;
-                                r.startTerms[i] = static_cast<int>(idx);
-                                bool fail = false;
-                                DPRINT("compare %s and %s\n", s.name.c_str(), as.name.c_str());
-                                for(size_t j = 0; j < as.seq.size(); ++j)
+                                if(r.startTerms[i] == -1)
                                 {
-                                    if(j >= s.seq.size())
-                                    {
-                                        //DPRINT("fail NT1 at %d\n",(int)j);
-                                        DPRINT("alt NT1 at %d\n", (int) j);
-                                        s.compatibleAlt = static_cast<int>(j);
-                                        break;
-                                    }
-                                    if(s.seq[j].isTerm != as.seq[j].isTerm)
-                                    {
-                                        DPRINT("fail NT2 at %d\n", (int) j);
-                                        fail = true;
-                                        break;
-                                    }
-                                    if(s.seq[j].isTerm)
+                                    r.startTerms[i] = static_cast<int>(idx);
+                                }
+                                else
+                                {
+                                    int aidx = r.startTerms[i];
+                                    Sequence& as = r.seqs[static_cast<size_t>(aidx)];
+                                    s.alt = aidx;
+                                    s.compatibleAlt = -1;
+                                    r.startTerms[i] = static_cast<int>(idx);
+                                    bool fail = false;
+                                    DPRINT("compare %s and %s\n", s.name.c_str(), as.name.c_str());
+                                    for(size_t j = 0; j < as.seq.size(); ++j)
                                     {
-                                        if(s.seq[j].t != as.seq[j].t)
+                                        if(j >= s.seq.size())
+                                        {
+                                            //DPRINT("fail NT1 at %d\n",(int)j);
+                                            DPRINT("alt NT1 at %d\n", (int) j);
+                                            s.compatibleAlt = static_cast<int>(j);
+                                            break;
+                                        }
+                                        if(s.seq[j].isTerm != as.seq[j].isTerm)
+                                        {
+                                            DPRINT("fail NT2 at %d\n", (int) j);
+                                            fail = true;
+                                            break;
+                                        }
+                                        if(s.seq[j].isTerm)
+                                        {
+                                            if(s.seq[j].t != as.seq[j].t)
+                                            {
+                                                DPRINT("marked seq %s as compatible alt of %s at %d\n", s.name.c_str(),
+                                                        as.name.c_str(), (int) j);
+                                                s.compatibleAlt = static_cast<int>(j);
+                                                break;
+                                            }
+                                            continue;
+                                        }
+                                        if(s.seq[j].nt != as.seq[j].nt)
                                         {
                                             DPRINT("marked seq %s as compatible alt of %s at %d\n", s.name.c_str(),
                                                     as.name.c_str(), (int) j);
                                             s.compatibleAlt = static_cast<int>(j);
                                             break;
                                         }
-                                        continue;
                                     }
-                                    if(s.seq[j].nt != as.seq[j].nt)
+                                    if(!fail && s.seq.size() > as.seq.size())
                                     {
-                                        DPRINT("marked seq %s as compatible alt of %s at %d\n", s.name.c_str(),
-                                                as.name.c_str(), (int) j);
-                                        s.compatibleAlt = static_cast<int>(j);
-                                        break;
+                                        s.compatibleAlt = static_cast<int>(s.seq.size());
+                                        DPRINT("alt NT3 at end\n");
                                     }
                                 }
-                                if(!fail && s.seq.size() > as.seq.size())
-                                {
-                                    s.compatibleAlt = static_cast<int>(s.seq.size());
-                                    DPRINT("alt NT3 at end\n");
-                                }
                             }
                         }
                     }
                 }
             }
+            r.prepared = true;
         }
-        r.prepared = true;
+    };
+
+    explicit ParserBase(Grammar& argGrammar) : grammar(&argGrammar), memoPruneSize(1024), useMemo(true)
+    {
     }
 
     void dumpstack()
@@ -903,6 +1172,10 @@ public:
         Term saveLast;
         FileLocation callLoc, start, end;
         size_t dataStackSize;
+        //context of memoized call, -1 if call is not memoized
+        int memoCtx;
+        FileLocation memoStart;
+        size_t memoBase;
         //CallFrame(){}
         //CallFrame(Rule* argR,size_t argDataStackSize,FileLocation argCallLoc,bool argResetPrio):r(argR),idx(-1),pos(0),failed(false),resetPrio(argResetPrio),canRecurse(true),callLoc(argCallLoc),dataStackSize(argDataStackSize){}
     };
@@ -956,6 +1229,9 @@ public:
             last->returnOnError = returnOnError;
             last->idx = -1;
             last->pos = 0;
+            last->memoCtx = -1;
+            last->memoStart = argCallLoc;
+            last->memoBase = argDataStackSize;
         }
 
         void pop_back()
@@ -987,32 +1263,209 @@ public:
         }
     };
 
-    Rule* startRule;
+    Grammar* grammar;
     DataStack stack;
     CallStack callStack;
     Term lastFailMatch;
     Term lastOkMatch;
 
+    struct MemoKey {
+        FileReader* fileRd;
+        uint32_t offset;
+        Rule* rule;
+        int ctx;
+
+        MemoKey(const FileLocation& loc, Rule* argRule, int argCtx) :
+                fileRd(loc.fileRd), offset(loc.offset), rule(argRule), ctx(argCtx)
+        {
+        }
+
+        bool operator<(const MemoKey& rhs) const
+        {
+            if(offset != rhs.offset)
+            {
+                return offset < rhs.offset;
+            }
+            if(fileRd != rhs.fileRd)
+            {
+                return fileRd < rhs.fileRd;
+            }
+            if(rule != rhs.rule)
+            {
+                return rule < rhs.rule;
+            }
+            return ctx < rhs.ctx;
+        }
+    };
+
+    struct MemoEntry {
+        bool failed;
+        Term lastFail;
+        //owned if result is waiting to be recalled
+        StackItem value;
+
+        MemoEntry() : failed(false)
+        {
+        }
+    };
+
+    typedef std::map<MemoKey, MemoEntry> MemoMap;
+    MemoMap memo;
+    size_t memoPruneSize;
+    //memoization of rules marked with Rule::memo, can be turned off to compare
+    bool useMemo;
+
     void mkCall(Rule* r, bool resetPrio, bool returnOnError, bool pointOfNoReturn)
     {
         DPRINT("mkcall %s\n", r->name.c_str());
         callStack.push_back(r, stack.size(), l.getLoc(), resetPrio, returnOnError, pointOfNoReturn);
     }
 
+    /*
+      Shrinks data stack to sz.
+      Results of memoized calls are not destroyed, but moved to memo to be recalled
+      when the same rule is called at the same place in the same context.
+    */
+    void dropData(size_t sz)
+    {
+        if(useMemo)
+        {
+            for(StackItem* it = stack.last; it && it >= stack.data + sz; --it)
+            {
+                if(!it->owned || !it->memo.rule)
+                {
+                    continue;
+                }
+                MemoEntry& me = memo[MemoKey(it->memo.start, it->memo.rule, it->memo.ctx)];
+                if(!me.failed && !me.value.owned)
+                {
+                    DPRINT("memo store %s\n", it->memo.rule->name.c_str());
+                    me.value = *it;
+                    it->owned = false;
+                }
+            }
+        }
+        stack.shrink(sz);
+        if(memo.size() > memoPruneSize)
+        {
+            pruneMemo();
+        }
+    }
+
+    /*
+      Input can be parsed again only from the start of a call that has somewhere to go on failure:
+      alternative sequence, enclosing list or return on error.
+      Everything else fails with syntax error, so memo entries before all such places are not needed anymore.
+      Pruning keeps memo small, it never affects results.
+    */
+    bool canReparseFrom(CallFrame* cf)
+    {
+        return cf == callStack.last || cf->returnOnError ||
+               (cf->idx >= 0 && cf->r->seqs[static_cast<size_t>(cf->idx)].alt != -1) ||
+               (cf > callStack.data && cf[-1].r->listMode != lmNone);
+    }
+
+    void pruneMemo()
+    {
+        for(typename MemoMap::iterator it = memo.begin(); it != memo.end();)
+        {
+            bool keep = false;
+            for(CallFrame* cf = callStack.last; cf && cf >= callStack.data; --cf)
+            {
+                if(cf->callLoc.fileRd == it->first.fileRd && cf->callLoc.offset <= it->first.offset &&
+                   canReparseFrom(cf))
+                {
+                    keep = true;
+                    break;
+                }
+            }
+            if(keep)
+            {
+                ++it;
+            }
+            else
+            {
+                it = memo.erase(it);
+            }
+        }
+        memoPruneSize = memo.size() * 2 > 1024 ? memo.size() * 2 : 1024;
+    }
+
+    /*
+      Replaces call of r with its remembered outcome, if there is one.
+      Result is pushed to data stack and input is moved to where the call ended,
+      failure is passed to current frame.
+    */
+    bool recallCall(Rule* r, int ctx)
+    {
+        typename MemoMap::iterator it = memo.find(MemoKey(l.getLoc(), r, ctx));
+        if(it == memo.end())
+        {
+            return false;
+        }
+        MemoEntry& me = it->second;
+        if(me.failed)
+        {
+            DPRINT("memo recall failure of %s\n", r->name.c_str());
+            if(lastFailMatch.pos.offset < me.lastFail.pos.offset)
+            {
+                lastFailMatch = me.lastFail;
+            }
+            callStack.last->failed = true;
+            return true;
+        }
+        if(!me.value.owned)
+        {
+            return false;
+        }
+        DPRINT("memo recall result of %s\n", r->name.c_str());
+        stack.push_item(me.value);
+        l.setLoc(stack.last->memo.end);
+        lastOkMatch = stack.last->memo.lastOk;
+        memo.erase(it);
+        return true;
+    }
+
+    void clearMemo()
+    {
+        memo.clear();
+        memoPruneSize = 1024;
+    }
+
     void rollbackCall()
     {
         DPRINT("call rollback\n");
         CallFrame& cf = *callStack.last;
-        stack.shrink(cf.dataStackSize);
+        dropData(cf.dataStackSize);
         l.setLoc(cf.callLoc);
         callStack.pop_back();
     }
 
+    //rolls back current call and marks caller as failed
+    void failCall()
+    {
+        CallFrame& cf = *callStack.last;
+        if(cf.memoCtx >= 0 && cf.callLoc == cf.memoStart)
+        {
+            MemoEntry& me = memo[MemoKey(cf.memoStart, cf.r, cf.memoCtx)];
+            if(!me.value.owned)
+            {
+                me.failed = true;
+                me.lastFail = lastFailMatch;
+            }
+        }
+        rollbackCall();
+        if(!callStack.empty())
+        {
+            callStack.last->failed = true;
+        }
+    }
+
     void restartCall(int idx)
     {
         DPRINT("call restart\n");
         CallFrame& cf = *callStack.last;
-        stack.shrink(cf.dataStackSize);
+        dropData(cf.dataStackSize);
         l.setLoc(cf.callLoc);
         cf.idx = idx;
         cf.pos = 0;
@@ -1023,6 +1476,7 @@ public:
     {
         stack.shrink(0);
         callStack.clear();
+        clearMemo();
         l.reset();
     }
 
@@ -1059,7 +1513,8 @@ public:
     {
         callStack.clear();
         stack.shrink(0);
-        mkCall(startRule, false, false, false);
+        clearMemo();
+        mkCall(grammar->startRule, false, false, false);
         Term t = l.peekNext();
         while(t.tt != Lexer::EofTerm || !callStack.empty())
         {
@@ -1068,6 +1523,7 @@ public:
                 t = l.peekNext();
             }
         }
+        clearMemo();
     }
 
     bool parseStep(Term t)
@@ -1103,7 +1559,8 @@ public:
                     rollbackCall();
                     if(r.seqs[static_cast<size_t>(r.emptySeq)].handler)
                     {
-                        r.seqs[static_cast<size_t>(r.emptySeq)].handler->handleRule(stack, &r);
+                        r.seqs[static_cast<size_t>(r.emptySeq)].handler->handleRule(static_cast<ImplType*>(this), stack,
+                                                                                    &r);
                     }
                     return true;
                 }
@@ -1155,8 +1612,7 @@ public:
                     }
                     if(cf.returnOnError)
                     {
-                        rollbackCall();
-                        callStack.last->failed = true;
+                        failCall();
                         return true;
                     }
                     if(cf.pos < (int) s.seq.size())
@@ -1181,7 +1637,8 @@ public:
                     if(r.listMode == lmZeroOrMoreTrail && r.emptySeq >= 0 && stack.last && !stack.last->re.isTerm &&
                        stack.last->re.nt != &r)
                     {
-                        r.seqs[static_cast<size_t>(r.emptySeq)].handler->handleRule(stack, &r);
+                        r.seqs[static_cast<size_t>(r.emptySeq)].handler->handleRule(static_cast<ImplType*>(this), stack,
+                                                                                    &r);
                     }
                     if(r.listMode == lmOneOrMoreTrail || r.listMode == lmZeroOrMoreTrail)
                     {
@@ -1203,7 +1660,7 @@ public:
             //dumpstack();
             if(s.handler)
             {
-                s.handler->handleRule(stack, &r);//reduce
+                s.handler->handleRule(static_cast<ImplType*>(this), stack, &r);//reduce
             }
             //DPRINT("after handler:\n");
             //dumpstack();
@@ -1325,6 +1782,15 @@ public:
             }
 
             DPRINT("return from %s\n", r.name.c_str());
+            if(cf.memoCtx >= 0 && stack.size() == cf.memoBase + 1)
+            {
+                MemoInfo& mi = stack.last->memo;
+                mi.rule = &r;
+                mi.ctx = cf.memoCtx;
+                mi.start = cf.memoStart;
+                mi.end = l.getLoc();
+                mi.lastOk = lastOkMatch;
+            }
             callStack.pop_back();
             return false;//return to previous frame
         }
@@ -1392,27 +1858,33 @@ public:
                     cf.canRecurse = false;
                     lastOkMatch = cf.saveLast;
                     l.setLoc(cf.callLoc);
-                    stack.shrink(cf.dataStackSize);
+                    dropData(cf.dataStackSize);
                     callStack.pop_back();
                     dumpstack();
                     return true;
                 }
 
-                rollbackCall();
-                if(!callStack.empty())
-                {
-                    callStack.last->failed = true;
-                }
+                failCall();
                 return true;
             }
         }
         else
         {
 
-            int pos = cf.pos++;
-            mkCall(s.seq[static_cast<size_t>(pos)].nt, s.seq[static_cast<size_t>(pos)].isPrioReset,
-                    cf.returnOnError || s.seq[static_cast<size_t>(pos)].isReturnOnError,
-                    false/*cf.pointOfNoReturn || s.seq[pos].isPointOfNoReturn*/);
+            RuleEntry& re = s.seq[static_cast<size_t>(cf.pos++)];
+            bool returnOnError = cf.returnOnError || re.isReturnOnError;
+            int memoCtx = -1;
+            if(re.nt->memo && useMemo)
+            {
+                //outcome of call depends on priority of enclosing binary rule and on return on error mode
+                memoCtx = (re.isPrioReset || !s.binary ? 0 : s.prio) * 2 + (returnOnError ? 1 : 0);
+                if(recallCall(re.nt, memoCtx))
+                {
+                    return true;
+                }
+            }
+            mkCall(re.nt, re.isPrioReset, returnOnError, false/*cf.pointOfNoReturn || re.isPointOfNoReturn*/);
+            callStack.last->memoCtx = memoCtx;
         }
         return false;
     }
@@ -0,0 +1,71 @@
+#include "ZorroParser.hpp"
+#include <stdio.h>
+#include <string>
+
+/*
+  Build time generator of static grammar tables for ZParser.
+  Grammar is built from rule strings the slow way and written as C++ source,
+  that is compiled into the library instead of this stub.
+*/
+
+namespace zorro {
+
+extern const ZParser::Tables zorroParserTables;
+
+const ZParser::Tables zorroParserTables = {};
+
+}
+
+using namespace zorro;
+
+int main(int argc, char* argv[])
+{
+    if(argc != 2)
+    {
+        fprintf(stderr, "usage: %s <output.cpp>\n", argv[0]);
+        return 1;
+    }
+    std::string out = "//generated by zorro-pgen from grammar in ZorroParser.cpp, do not edit\n"
+                      "#include \"ZorroParser.hpp\"\n\nnamespace zorro {\n\n";
+    try
+    {
+        ZParser::Grammar g;
+        ZParser::buildGrammar(g);
+        g.dumpTables(out, "ZParser", "zorroParserTables");
+    } catch(std::exception& e)
+    {
+        fprintf(stderr, "failed to build grammar: %s\n", e.what());
+        return 1;
+    }
+    out += "\n}\n";
+    //keep file untouched if grammar did not change, to avoid rebuilding dependents
+    FILE* f = fopen(argv[1], "rb");
+    if(f)
+    {
+        std::string old;
+        char buf[4096];
+        size_t n;
+        while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        {
+            old.append(buf, n);
+        }
+        fclose(f);
+        if(old == out)
+        {
+            return 0;
+        }
+    }
+    f = fopen(argv[1], "wb");
+    if(!f)
+    {
+        fprintf(stderr, "failed to open %s for writing\n", argv[1]);
+        return 1;
+    }
+    bool ok = fwrite(out.c_str(), 1, out.length(), f) == out.length();
+    if(fclose(f) != 0 || !ok)
+    {
+        fprintf(stderr, "failed to write %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
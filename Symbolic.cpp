@@ -66,6 +66,10 @@ void SymMap::clear(ZMemory* mem, SymInfo* /*parent*/)
 
 SymInfo* SymbolsInfo::getSymbol(Symbol sym)
 {
+    if(shared)
+    {
+        return shared->getSymbol(sym);
+    }
     if(sym.ns)
     {
         ScopeSym* arr[] = {currentScope, &global};
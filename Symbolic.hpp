@@ -110,7 +110,8 @@ struct ScopeSymSmartRef {
 enum TypeSpec {
     tsUnknown,
     tsDefined,
-    tsOneOf
+    tsOneOf,
+    tsAny      // inference gave up, value can be of any type
 };
 
 struct TypeInfo {
@@ -128,11 +129,11 @@ struct TypeInfo {
 
     void merge(const TypeInfo& other)
     {
-        if(other.ts == tsUnknown)
+        if(other.ts == tsUnknown || ts == tsAny)
         {
             return;
         }
-        if(ts == tsUnknown)
+        if(ts == tsUnknown || other.ts == tsAny)
         {
             *this = other;
             return;
@@ -183,7 +184,7 @@ struct TypeInfo {
         {
             return;
         }
-        if(other.ts == tsDefined)
+        if(other.ts == tsDefined || other.ts == tsAny)
         {
             if(!haveInArr(other))
             {
@@ -201,6 +202,25 @@ struct TypeInfo {
         }
     }
 
+    /* number of known type nodes, every merge that adds information increases it */
+    size_t weight() const
+    {
+        if(ts == tsUnknown)
+        {
+            return 0;
+        }
+        if(ts == tsAny)
+        {
+            return 0xffffffff;
+        }
+        size_t rv = 1;
+        for(auto& ti:arr)
+        {
+            rv += ti.weight();
+        }
+        return rv;
+    }
+
     bool isContainer() const
     {
         return ts == tsDefined && (vt == vtArray || vt == vtSet || vt == vtMap);
@@ -874,6 +894,21 @@ struct ClassInfo : ScopeSym {
     std::vector<ClassMember*> members;
     AttrInfo attrs;
     bool nativeClass = false;
+    //class of shared code, lives as long as program vm and objects don't count references to it
+    bool shared = false;
+
+    void refInstance()
+    {
+        if(!shared)
+        {
+            ref();
+        }
+    }
+
+    bool unrefInstance()
+    {
+        return !shared && unref();
+    }
     //int methods;
     /*
     Value* mArr;
@@ -948,6 +983,8 @@ struct SymbolsInfo {
     std::vector<size_t> freeGlobals;
     SymVector info;
     size_t stdEnd;
+    //symbols of program vm when code is shared, info is borrowed from it and lookups are forwarded to it
+    SymbolsInfo* shared = nullptr;
 
     ScopeSym* currentScope = nullptr;
     ClassInfo* currentClass = nullptr;
@@ -1013,6 +1050,27 @@ struct SymbolsInfo {
         addCsmMap("less", csmLess);
     }
 
+    /* Symbols of vm running shared code, globals are allocated but values are filled by vm */
+    SymbolsInfo(ZMemory* argMem, SymbolsInfo* argShared) : mem(argMem), global(this), shared(argShared)
+    {
+        global.name = mem->mkZString("global");
+        globalsCount = shared->globalsCount;
+        globalsSize = shared->globalsSize;
+        globals = new Value[globalsSize];
+        memset(globals, 0, sizeof(Value) * globalsSize);
+        memcpy(csmNames, shared->csmNames, sizeof(csmNames));
+        init();
+        info = shared->info;
+        stdEnd = shared->stdEnd;
+        nilIdx = shared->nilIdx;
+        trueIdx = shared->trueIdx;
+        falseIdx = shared->falseIdx;
+        nilStr = mem->mkZString("nil");
+        trueStr = mem->mkZString("true");
+        falseStr = mem->mkZString("false");
+        object = mem->mkZString("Object");
+    }
+
     SymbolsInfo(const SymbolsInfo&) = delete;
 
     SymbolsInfo(SymbolsInfo&&) = delete;
@@ -1069,7 +1127,7 @@ struct SymbolsInfo {
 
     size_t getGlobalTemporals()
     {
-        return global.freeTemporals.size();
+        return shared ? shared->getGlobalTemporals() : global.freeTemporals.size();
     }
 
     size_t newGlobal()
@@ -1197,7 +1255,10 @@ struct SymbolsInfo {
     {
         size_t index = newGlobal();
         infoPtr->index = index;
-        info.resize(index + 1);
+        if(index >= info.size())
+        {
+            info.resize(index + 1);
+        }
         info[index] = infoPtr;
         currentScope->getSymbols()->insert(infoPtr->name, infoPtr);
         return index;
@@ -1857,6 +1918,10 @@ struct SymbolsInfo {
 
     SymInfo* getGlobalSymbol(Name name)
     {
+        if(shared)
+        {
+            return shared->getGlobalSymbol(name);
+        }
         return global.getSymbols()->findSymbol(name);
     }
 
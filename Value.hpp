@@ -207,6 +207,8 @@ struct RegExpVal : RefBase {
     size_t marrSize;
     kst::NamedMatch* narr;
     size_t narrSize;
+    //pattern regexp was compiled from
+    ZString* src;
 };
 
 static const Value NilValue = {0, 0, 0, {nullptr}};
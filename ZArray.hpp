@@ -546,9 +546,11 @@ struct ZArray : RefBase {
         {
           lastPage[i]=NilValue();
         }*/
-        if(argSize > pagesSize * pageSize)
+        argSize -= pagesCount * pageSize;
+        size_t needPages = pagesCount + (argSize + pageSize - 1) / pageSize;
+        if(needPages > pagesSize)
         {
-            size_t newSz = (argSize + 1) / pageSize;
+            size_t newSz = needPages;
             size_t m = newSz % pagesIncrement;
             newSz += m ? pagesIncrement - m : 0;
             Value** newPages = mem->allocVPtrArray(newSz);
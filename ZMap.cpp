@@ -35,9 +35,10 @@ uint32_t ZMap::hashFunc(const Value& key) const
             Segment& s = *key.seg;
             if(s.cont.vt == vtString)
             {
-                const char* sdata = s.cont.str->getDataPtr();
-                int cs = s.cont.str->getCharSize();
-                return ZString::calcHash(sdata + s.segStart * cs, sdata + s.segEnd * cs);
+                const ZString* str = s.cont.str;
+                const char* sdata = str->getDataPtr();
+                return ZString::calcHash(sdata + str->getCharOffset(m_mem, static_cast<uint32_t>(s.segStart)),
+                                         sdata + str->getCharOffset(m_mem, static_cast<uint32_t>(s.segEnd)));
             }
         }
             /* no break */
@@ -1,5 +1,6 @@
 #include "ZorroVM.hpp"
 #include <string.h>
+#include "ZStrKernels.hpp"
 #include "kst/RegExp.hpp"
 #include "kst/Format.hpp"
 
@@ -209,8 +210,33 @@ ZString* ZMemory::allocZString()
 
 ZString* ZMemory::allocZString(const char* argStr, uint32_t argLen)
 {
+    if(argLen == (uint32_t) -1)
+    {
+        argLen = argStr ? static_cast<uint32_t>(strlen(argStr)) : 0;
+    }
     ZString* rv = strPool.alloc();
-    rv->assign(this, argStr, argLen);
+    uint32_t valid = ZString::validateUtf8(argStr, argLen);
+    if(valid == argLen)
+    {
+        rv->assign(this, argStr, argLen);
+    } else
+    {
+        //each invalid byte is replaced with U+FFFD
+        std::string tmp(argStr, valid);
+        const char* ptr = argStr + valid;
+        const char* end = argStr + argLen;
+        char rep[4];
+        int repLen = ZString::putUtf8Char(0xfffd, rep);
+        while(ptr < end)
+        {
+            tmp.append(rep, static_cast<size_t>(repLen));
+            ++ptr;
+            valid = ZString::validateUtf8(ptr, static_cast<uint32_t>(end - ptr));
+            tmp.append(ptr, valid);
+            ptr += valid;
+        }
+        rv->assign(this, tmp.c_str(), static_cast<uint32_t>(tmp.length()));
+    }
     rv->refCount = 0;
     rv->weakRefId = 0;
     return rv;
@@ -221,6 +247,7 @@ Coroutine* ZMemory::allocCoroutine()
     Coroutine* rv = corPool.alloc();
     rv->refCount = 0;
     rv->weakRefId = 0;
+    rv->ctx.reserveCoroutineStacks();
     return rv;
 }
 
@@ -234,6 +261,7 @@ RegExpVal* ZMemory::allocRegExp()
     rv->marrSize = 0;
     rv->narr = 0;
     rv->narrSize = 0;
+    rv->src = 0;
     return rv;
 }
 
@@ -241,51 +269,60 @@ void ZMemory::freeRegExp(RegExpVal* val)
 {
     if(val->marr)
     {
-        delete val->marr;
+        delete[] val->marr;
     }
     if(val->narr)
     {
-        delete val->narr;
+        delete[] val->narr;
     }
     delete val->val;
+    if(val->src && val->src->unref())
+    {
+        val->src->clear(this);
+        freeZString(val->src);
+    }
     rxPool.free(val);
 }
 
-
-ZStringRef ZMemory::mkZString(const char* str, size_t len)
+bool ZMemory::compileRegExp(RegExpVal* rxv, ZString* src)
 {
-    if(len == (size_t) -1)
+    kst::RegExp* rx = rxv->val;
+    const char* rxSrc = src->getDataPtr();
+    const char* rxEnd = rxSrc + src->getDataSize();
+    int res;
+    if(src->isAscii())
     {
-        len = strlen(str);
+        res = rx->CompileEx(rxSrc, rxEnd, kst::OP_PERLSTYLE | kst::OP_OPTIMIZE, '`');
+    } else
+    {
+        std::vector<uint16_t> rxSrc2(src->getLength());
+        ZString::toUcs2(rxSrc, rxEnd, &rxSrc2[0]);
+        res = rx->CompileEx(&rxSrc2[0], &rxSrc2[0] + rxSrc2.size(), kst::OP_PERLSTYLE | kst::OP_OPTIMIZE, '`');
     }
-    const char* ptr = str;
-    const char* end = str + len;
-    bool hasHighBit = false;
-    while(ptr < end)
+    if(!res)
     {
-        if((uint8_t) *ptr++ >= 0x80)
-        {
-            hasHighBit = true;
-            break;
-        }
+        return false;
     }
-    if(!hasHighBit)
+    src->ref();
+    rxv->src = src;
+    rxv->marrSize = static_cast<size_t>(rx->getBracketsCount());
+    rxv->marr = new kst::SMatch[rxv->marrSize];
+    rxv->narrSize = static_cast<size_t>(rx->getNamedBracketsCount());
+    if(rxv->narrSize)
     {
-        return ZStringRef(this, allocZString(str, len));
-    } else
+        rxv->narr = new kst::NamedMatch[rxv->narrSize];
+    }
+    return true;
+}
+
+
+ZStringRef ZMemory::mkZString(const char* str, size_t len)
+{
+    if(len == (size_t) -1)
     {
-        uint32_t ulen = ZString::calcU8Symbols(str, len);
-        char* buf = allocStr(ulen * 2);
-        char* bptr = buf;
-        const char* send = str + len;
-        while(str < send)
-        {
-            ZString::utf8ToUcs2(str, bptr);
-        }
-        ZString* zs = allocZString();
-        zs->init(buf, ulen * 2, true);
-        return ZStringRef(this, zs);
+        len = strlen(str);
     }
+    return ZStringRef(this, allocZString(str, static_cast<uint32_t>(len)));
 }
 
 ZStringRef ZMemory::mkZString(const uint16_t* str, size_t len)
@@ -302,34 +339,44 @@ ZStringRef ZMemory::mkZString(const uint16_t* str, size_t len)
     }
     const uint16_t* ptr = str;
     const uint16_t* end = str + len;
-    bool hasHighBit = false;
-    while(ptr < end)
+    size_t sz = 0;
+    for(; ptr < end; ++ptr)
     {
-        if(*ptr >= 128)
+        if(*ptr >= 0xd800 && *ptr <= 0xdbff && ptr + 1 < end && ptr[1] >= 0xdc00 && ptr[1] <= 0xdfff)
         {
-            hasHighBit = true;
-            break;
+            sz += 4;
+            ++ptr;
+        } else
+        {
+            sz += *ptr < 0x80 ? 1 : *ptr < 0x800 ? 2 : 3;
         }
-        ++ptr;
     }
-    ZString* zs = allocZString();
-    if(hasHighBit)
-    {
-        zs->assign(this, str, len * 2);
-    } else
+    char* buf = allocStr(sz + 1);
+    char* dst = buf;
+    const StrKernels& k = getStrKernels();
+    for(ptr = str; ptr < end; ++ptr)
     {
-        char* astr = this->allocStr(len + 1);
-        ptr = str;
-        char* dst = astr;
-        while(ptr < end)
+        uint32_t c = *ptr;
+        if(c < 0x80)
+        {
+            size_t n = k.narrowAscii(ptr, static_cast<size_t>(end - ptr), dst);
+            ptr += n - 1;
+            dst += n;
+            continue;
+        }
+        if(c >= 0xd800 && c <= 0xdbff && ptr + 1 < end && ptr[1] >= 0xdc00 && ptr[1] <= 0xdfff)
         {
-            *dst = static_cast<char>(*ptr);
+            c = 0x10000 + ((c - 0xd800) << 10) + (ptr[1] - 0xdc00);
             ++ptr;
-            ++dst;
+        } else if(c >= 0xd800 && c <= 0xdfff)
+        {
+            c = 0xfffd;
         }
-        *dst = 0;
-        zs->init(astr, len, false);
+        dst += ZString::putUtf8Char(c, dst);
     }
+    *dst = 0;
+    ZString* zs = allocZString();
+    zs->init(buf, static_cast<uint32_t>(sz));
     return ZStringRef(this, zs);
 }
 
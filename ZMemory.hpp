@@ -312,6 +312,7 @@ public:
 
     ZString* allocZString();
 
+    /* invalid utf-8 bytes are replaced with U+FFFD */
     ZString* allocZString(const char* argStr, uint32_t argLen = (uint32_t) -1);
 
     void freeZString(ZString* val)
@@ -407,6 +408,9 @@ public:
 
     void freeRegExp(RegExpVal* val);
 
+    /* compiles src into rxv and keeps reference to src, returns false if src is not a valid regexp */
+    bool compileRegExp(RegExpVal* rxv, ZString* src);
+
     virtual void assign(Value& dst, const Value& src) = 0;
 
     virtual void unref(Value& dst) = 0;
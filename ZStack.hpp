@@ -74,6 +74,30 @@ struct ZStack {
         stackTop = stack - 1;
     }
 
+    /* allocates initial storage of empty stack without notifying owner */
+    void reserve(size_t sz)
+    {
+        if(stack)
+        {
+            return;
+        }
+        stack = new T[sz];
+        memset(stack, 0, sizeof(T) * sz);
+        stackMax = stack + sz;
+        stackTop = stack - 1;
+    }
+
+    /* frees storage of empty stack if it's bigger than maxSize */
+    void release(size_t maxSize)
+    {
+        if(stack && stackTop == stack - 1 && static_cast<size_t>(stackMax - stack) > maxSize)
+        {
+            delete[] stack;
+            stackMax = stackTop = stack = 0;
+            --stackTop;
+        }
+    }
+
     void resize(size_t inc)
     {
         if(inc == 0)
@@ -109,6 +133,11 @@ struct ZStack {
     {
         return static_cast<size_t>(stackTop - stack + 1);
     }
+
+    bool empty() const
+    {
+        return stackTop + 1 == stack;
+    }
 };
 
 
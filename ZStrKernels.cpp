@@ -0,0 +1,486 @@
+#include "ZStrKernels.hpp"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ZSTR_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZSTR_AVX2
+#include <immintrin.h>
+#define ZSTR_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace zorro {
+
+#ifdef ZSTR_SSE2
+#ifdef _MSC_VER
+static inline uint32_t ctz32(uint32_t v)
+{
+    unsigned long idx;
+    _BitScanForward(&idx, v);
+    return idx;
+}
+#else
+static inline uint32_t ctz32(uint32_t v)
+{
+    return static_cast<uint32_t>(__builtin_ctz(v));
+}
+#endif
+#endif
+
+/* scalar */
+
+static const char* scalarFind(const char* hay, size_t hayLen, const char* needle, size_t needleLen)
+{
+    if(needleLen > hayLen)
+    {
+        return 0;
+    }
+    const char* ptr = hay;
+    const char* last = hay + hayLen - needleLen;
+    while(ptr <= last)
+    {
+        ptr = (const char*) memchr(ptr, needle[0], static_cast<size_t>(last - ptr) + 1);
+        if(!ptr)
+        {
+            return 0;
+        }
+        if(memcmp(ptr + 1, needle + 1, needleLen - 1) == 0)
+        {
+            return ptr;
+        }
+        ++ptr;
+    }
+    return 0;
+}
+
+static size_t scalarMismatch(const char* ptr1, const char* ptr2, size_t len)
+{
+    size_t i = 0;
+    for(; i < len && ptr1[i] == ptr2[i]; ++i)
+        ;
+    return i;
+}
+
+static void scalarToUpper(char* dst, const char* src, size_t len)
+{
+    for(size_t i = 0; i < len; ++i)
+    {
+        char c = src[i];
+        dst[i] = c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+    }
+}
+
+static size_t scalarAsciiPrefix(const char* ptr, size_t len)
+{
+    size_t i = 0;
+    for(; i < len && !(ptr[i] & 0x80); ++i)
+        ;
+    return i;
+}
+
+static size_t scalarCountLeadBytes(const char* ptr, size_t len)
+{
+    size_t rv = 0;
+    for(size_t i = 0; i < len; ++i)
+    {
+        if((static_cast<unsigned char>(ptr[i]) & 0xc0) != 0x80)
+        {
+            ++rv;
+        }
+    }
+    return rv;
+}
+
+static size_t scalarWidenAscii(const char* src, size_t len, uint16_t* dst)
+{
+    size_t i = 0;
+    for(; i < len && !(src[i] & 0x80); ++i)
+    {
+        dst[i] = static_cast<uint16_t>(src[i]);
+    }
+    return i;
+}
+
+static size_t scalarNarrowAscii(const uint16_t* src, size_t len, char* dst)
+{
+    size_t i = 0;
+    for(; i < len && src[i] < 0x80; ++i)
+    {
+        dst[i] = static_cast<char>(src[i]);
+    }
+    return i;
+}
+
+static const StrKernels scalarKernels = {
+    "scalar",
+    scalarFind,
+    scalarMismatch,
+    scalarToUpper,
+    scalarAsciiPrefix,
+    scalarCountLeadBytes,
+    scalarWidenAscii,
+    scalarNarrowAscii
+};
+
+#ifdef ZSTR_SSE2
+
+/* sse2 */
+
+//compare first and last byte of the needle at 16 positions at once,
+//full compare only for candidates that match both
+static const char* sse2Find(const char* hay, size_t hayLen, const char* needle, size_t needleLen)
+{
+    if(needleLen > hayLen)
+    {
+        return 0;
+    }
+    if(needleLen == 1)
+    {
+        return (const char*) memchr(hay, needle[0], hayLen);
+    }
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needleLen - 1]);
+    size_t positions = hayLen - needleLen + 1;
+    size_t i = 0;
+    for(; i + 16 <= positions; i += 16)
+    {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i*) (hay + i));
+        __m128i blockLast = _mm_loadu_si128((const __m128i*) (hay + i + needleLen - 1));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first),
+                                                                              _mm_cmpeq_epi8(blockLast, last))));
+        while(mask)
+        {
+            uint32_t bit = ctz32(mask);
+            if(memcmp(hay + i + bit + 1, needle + 1, needleLen - 2) == 0)
+            {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return scalarFind(hay + i, hayLen - i, needle, needleLen);
+}
+
+static size_t sse2Mismatch(const char* ptr1, const char* ptr2, size_t len)
+{
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*) (ptr1 + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (ptr2 + i));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b))) ^ 0xffff;
+        if(mask)
+        {
+            return i + ctz32(mask);
+        }
+    }
+    return i + scalarMismatch(ptr1 + i, ptr2 + i, len - i);
+}
+
+//bytes >= 0x80 are negative as signed and never fall into 'a'..'z'
+static void sse2ToUpper(char* dst, const char* src, size_t len)
+{
+    const __m128i lo = _mm_set1_epi8('a' - 1);
+    const __m128i hi = _mm_set1_epi8('z' + 1);
+    const __m128i diff = _mm_set1_epi8('a' - 'A');
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+        __m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+        v = _mm_sub_epi8(v, _mm_and_si128(isLower, diff));
+        _mm_storeu_si128((__m128i*) (dst + i), v);
+    }
+    scalarToUpper(dst + i, src + i, len - i);
+}
+
+static size_t sse2AsciiPrefix(const char* ptr, size_t len)
+{
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128((const __m128i*) (ptr + i))));
+        if(mask)
+        {
+            return i + ctz32(mask);
+        }
+    }
+    return i + scalarAsciiPrefix(ptr + i, len - i);
+}
+
+//continuation bytes 0x80..0xbf are -128..-65 as signed;
+//lead bytes are counted in 8 bit lanes, flushed before they can overflow
+static size_t sse2CountLeadBytes(const char* ptr, size_t len)
+{
+    const __m128i cont = _mm_set1_epi8(-65);
+    const __m128i zero = _mm_setzero_si128();
+    size_t rv = 0;
+    size_t i = 0;
+    while(i + 16 <= len)
+    {
+        __m128i acc = _mm_setzero_si128();
+        for(int n = 0; n < 255 && i + 16 <= len; ++n, i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*) (ptr + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(v, cont));
+        }
+        __m128i sum = _mm_sad_epu8(acc, zero);
+        rv += static_cast<size_t>(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+    }
+    return rv + scalarCountLeadBytes(ptr + i, len - i);
+}
+
+static size_t sse2WidenAscii(const char* src, size_t len, uint16_t* dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+        if(_mm_movemask_epi8(v))
+        {
+            break;
+        }
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128((__m128i*) (dst + i + 8), _mm_unpackhi_epi8(v, zero));
+    }
+    return i + scalarWidenAscii(src + i, len - i, dst + i);
+}
+
+static size_t sse2NarrowAscii(const uint16_t* src, size_t len, char* dst)
+{
+    const __m128i nonAscii = _mm_set1_epi16(static_cast<short>(0xff80));
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*) (src + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (src + i + 8));
+        __m128i hiBits = _mm_and_si128(_mm_or_si128(a, b), nonAscii);
+        if(_mm_movemask_epi8(_mm_cmpeq_epi16(hiBits, zero)) != 0xffff)
+        {
+            break;
+        }
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(a, b));
+    }
+    return i + scalarNarrowAscii(src + i, len - i, dst + i);
+}
+
+static const StrKernels sse2Kernels = {
+    "sse2",
+    sse2Find,
+    sse2Mismatch,
+    sse2ToUpper,
+    sse2AsciiPrefix,
+    sse2CountLeadBytes,
+    sse2WidenAscii,
+    sse2NarrowAscii
+};
+
+#endif
+
+#ifdef ZSTR_AVX2
+
+/* avx2, same algorithms with 32 byte blocks */
+
+ZSTR_TARGET_AVX2
+static const char* avx2Find(const char* hay, size_t hayLen, const char* needle, size_t needleLen)
+{
+    if(needleLen > hayLen)
+    {
+        return 0;
+    }
+    if(needleLen == 1)
+    {
+        return (const char*) memchr(hay, needle[0], hayLen);
+    }
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needleLen - 1]);
+    size_t positions = hayLen - needleLen + 1;
+    size_t i = 0;
+    for(; i + 32 <= positions; i += 32)
+    {
+        __m256i blockFirst = _mm256_loadu_si256((const __m256i*) (hay + i));
+        __m256i blockLast = _mm256_loadu_si256((const __m256i*) (hay + i + needleLen - 1));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, first), _mm256_cmpeq_epi8(blockLast, last))));
+        while(mask)
+        {
+            uint32_t bit = ctz32(mask);
+            if(memcmp(hay + i + bit + 1, needle + 1, needleLen - 2) == 0)
+            {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return sse2Find(hay + i, hayLen - i, needle, needleLen);
+}
+
+ZSTR_TARGET_AVX2
+static size_t avx2Mismatch(const char* ptr1, const char* ptr2, size_t len)
+{
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (ptr1 + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (ptr2 + i));
+        uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+        if(mask)
+        {
+            return i + ctz32(mask);
+        }
+    }
+    return i + sse2Mismatch(ptr1 + i, ptr2 + i, len - i);
+}
+
+ZSTR_TARGET_AVX2
+static void avx2ToUpper(char* dst, const char* src, size_t len)
+{
+    const __m256i lo = _mm256_set1_epi8('a' - 1);
+    const __m256i hi = _mm256_set1_epi8('z' + 1);
+    const __m256i diff = _mm256_set1_epi8('a' - 'A');
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (src + i));
+        __m256i isLower = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+        v = _mm256_sub_epi8(v, _mm256_and_si256(isLower, diff));
+        _mm256_storeu_si256((__m256i*) (dst + i), v);
+    }
+    sse2ToUpper(dst + i, src + i, len - i);
+}
+
+ZSTR_TARGET_AVX2
+static size_t avx2AsciiPrefix(const char* ptr, size_t len)
+{
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*) (ptr + i))));
+        if(mask)
+        {
+            return i + ctz32(mask);
+        }
+    }
+    return i + sse2AsciiPrefix(ptr + i, len - i);
+}
+
+ZSTR_TARGET_AVX2
+static size_t avx2CountLeadBytes(const char* ptr, size_t len)
+{
+    const __m256i cont = _mm256_set1_epi8(-65);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t rv = 0;
+    size_t i = 0;
+    while(i + 32 <= len)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        for(int n = 0; n < 255 && i + 32 <= len; ++n, i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*) (ptr + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpgt_epi8(v, cont));
+        }
+        __m256i sum = _mm256_sad_epu8(acc, zero);
+        rv += static_cast<size_t>(_mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) +
+                                  _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3));
+    }
+    return rv + sse2CountLeadBytes(ptr + i, len - i);
+}
+
+ZSTR_TARGET_AVX2
+static size_t avx2WidenAscii(const char* src, size_t len, uint16_t* dst)
+{
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+        if(_mm_movemask_epi8(v))
+        {
+            break;
+        }
+        _mm256_storeu_si256((__m256i*) (dst + i), _mm256_cvtepu8_epi16(v));
+    }
+    return i + scalarWidenAscii(src + i, len - i, dst + i);
+}
+
+ZSTR_TARGET_AVX2
+static size_t avx2NarrowAscii(const uint16_t* src, size_t len, char* dst)
+{
+    const __m256i nonAscii = _mm256_set1_epi16(static_cast<short>(0xff80));
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (src + i + 16));
+        if(!_mm256_testz_si256(_mm256_or_si256(a, b), nonAscii))
+        {
+            break;
+        }
+        //packus works within 128 bit lanes, restore the order of quad words
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i*) (dst + i), packed);
+    }
+    return i + sse2NarrowAscii(src + i, len - i, dst + i);
+}
+
+static const StrKernels avx2Kernels = {
+    "avx2",
+    avx2Find,
+    avx2Mismatch,
+    avx2ToUpper,
+    avx2AsciiPrefix,
+    avx2CountLeadBytes,
+    avx2WidenAscii,
+    avx2NarrowAscii
+};
+
+static bool haveAvx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+}
+
+#endif
+
+size_t getAvailableStrKernels(const StrKernels** list, size_t maxCount)
+{
+    size_t rv = 0;
+    if(rv < maxCount)
+    {
+        list[rv++] = &scalarKernels;
+    }
+#ifdef ZSTR_SSE2
+    if(rv < maxCount)
+    {
+        list[rv++] = &sse2Kernels;
+    }
+#endif
+#ifdef ZSTR_AVX2
+    if(rv < maxCount && haveAvx2())
+    {
+        list[rv++] = &avx2Kernels;
+    }
+#endif
+    return rv;
+}
+
+static const StrKernels* selectStrKernels()
+{
+    const StrKernels* list[4];
+    size_t cnt = getAvailableStrKernels(list, 4);
+    return list[cnt - 1];
+}
+
+const StrKernels& getStrKernels()
+{
+    static const StrKernels* kernels = selectStrKernels();
+    return *kernels;
+}
+
+}
@@ -0,0 +1,45 @@
+#ifndef __ZORRO_ZSTRKERNELS_HPP__
+#define __ZORRO_ZSTRKERNELS_HPP__
+
+#include <stddef.h>
+#ifdef __SunOS_5_9
+#include <inttypes.h>
+#else
+#include <stdint.h>
+#endif
+
+namespace zorro{
+
+/*
+ Byte level string primitives used by ZString and the string methods.
+ Every implementation processes the head of the buffer in vector sized
+ blocks and finishes the tail with scalar code, so any alignment and
+ any length is accepted. The best implementation supported by the cpu
+ is selected once, on the first call of getStrKernels.
+*/
+struct StrKernels{
+  const char* name;
+  //first occurrence of needle in hay, 0 if not found; needleLen must be > 0
+  const char* (*find)(const char* hay,size_t hayLen,const char* needle,size_t needleLen);
+  //index of the first differing byte or len if buffers are equal
+  size_t (*mismatch)(const char* ptr1,const char* ptr2,size_t len);
+  //ascii a-z to A-Z, all other bytes are copied as is; dst may be equal to src
+  void (*toUpper)(char* dst,const char* src,size_t len);
+  //length of leading run of bytes < 0x80
+  size_t (*asciiPrefix)(const char* ptr,size_t len);
+  //number of utf-8 lead bytes, i.e. number of chars
+  size_t (*countLeadBytes)(const char* ptr,size_t len);
+  //converts leading run of ascii bytes to utf-16, returns number of converted chars
+  size_t (*widenAscii)(const char* src,size_t len,uint16_t* dst);
+  //converts leading run of utf-16 units < 0x80 to bytes, returns number of converted units
+  size_t (*narrowAscii)(const uint16_t* src,size_t len,char* dst);
+};
+
+const StrKernels& getStrKernels();
+
+//all implementations usable on this cpu, scalar first; for tests and benchmarks
+size_t getAvailableStrKernels(const StrKernels** list,size_t maxCount);
+
+}
+
+#endif
@@ -1,53 +1,24 @@
 #include "ZString.hpp"
+#include "ZStrKernels.hpp"
+#include <charconv>
+#include <stdlib.h>
 
 namespace zorro {
 
-int ZString::compare(const char* ptr1, int cs1, uint32_t sz1, const char* ptr2, int cs2, uint32_t sz2)
+int ZString::compare(const char* ptr1, uint32_t sz1, const char* ptr2, uint32_t sz2)
 {
-    if(cs1 == 1 && cs2 == 1)
+    uint32_t minSize = sz1 < sz2 ? sz1 : sz2;
+    size_t idx = getStrKernels().mismatch(ptr1, ptr2, minSize);
+    if(idx < minSize)
     {
-        int rv = memcmp(ptr1, ptr2, sz1 < sz2 ? sz1 : sz2);
-        if(rv == 0)
-        {
-            if(sz1 < sz2)
-            {
-                rv = -1;
-            } else if(sz1 > sz2)
-            {
-                rv = 1;
-            }
-        }
-        return rv;
-    }
-    const char* end1 = ptr1 + sz1;
-    const char* end2 = ptr2 + sz2;
-    while(ptr1 != end1 && ptr2 != end2)
-    {
-        uint16_t c1 = getNextChar(ptr1, cs1);
-        uint16_t c2 = getNextChar(ptr2, cs2);
-        if(c1 < c2)
-        {
-            return -1;
-        }
-        if(c1 > c2)
-        {
-            return 1;
-        }
+        return static_cast<unsigned char>(ptr1[idx]) < static_cast<unsigned char>(ptr2[idx]) ? -1 : 1;
     }
-    if(ptr1 != end1)
-    {
-        return 1;
-    }
-    if(ptr2 != end2)
-    {
-        return -1;
-    }
-    return 0;
+    return sz1 < sz2 ? -1 : sz1 > sz2 ? 1 : 0;
 }
 
 int64_t ZString::parseInt(const char* ptr)
 {
-    int64_t val = 0;
+    uint64_t val = 0;
     bool neg = false;
     if(*ptr == '-')
     {
@@ -58,29 +29,38 @@ int64_t ZString::parseInt(const char* ptr)
     {
         ptr++;
     }
-    if(ptr[1] == 'x' || ptr[1] == 'X')
+    if(ptr[0] && (ptr[1] == 'x' || ptr[1] == 'X'))
     {
         ptr += 2;
-        while(*ptr)
+        for(;; ++ptr)
         {
-            val <<= 4;
-            val |= *ptr <= '9' ? *ptr - '0' : *ptr <= 'F' ? *ptr + 10 - 'A' : *ptr + 10 - 'a';
-            ptr++;
+            unsigned d;
+            if(*ptr >= '0' && *ptr <= '9')
+            {
+                d = static_cast<unsigned>(*ptr - '0');
+            } else if((*ptr | 0x20) >= 'a' && (*ptr | 0x20) <= 'f')
+            {
+                d = static_cast<unsigned>((*ptr | 0x20) - 'a' + 10);
+            } else
+            {
+                break;
+            }
+            val = (val << 4) | d;
         }
     } else
     {
-        while(*ptr)
+        for(unsigned d; (d = static_cast<unsigned>(*ptr - '0')) <= 9; ++ptr)
         {
-            val *= 10;
-            val += *ptr - '0';
-            ptr++;
+            val = val * 10 + d;
         }
     }
-    return neg ? -val : val;
+    //unsigned arithmetic so that INT64_MIN parses without overflow
+    return static_cast<int64_t>(neg ? 0 - val : val);
 }
 
 double ZString::parseDouble(const char* ptr)
 {
+    //from_chars is correctly rounded, but doesn't take the sign
     bool neg = false;
     if(*ptr == '-')
     {
@@ -88,43 +68,109 @@ double ZString::parseDouble(const char* ptr)
         neg = true;
     }
     double val = 0;
-    while(*ptr >= '0' && *ptr <= '9')
+    const char* end = ptr + strlen(ptr);
+    std::from_chars_result res = std::from_chars(ptr, end, val);
+    if(res.ec == std::errc::result_out_of_range)
     {
-        val *= 10.0;
-        val += 1.0 * (*ptr - '0');
-        ptr++;
+        val = strtod(ptr, 0);
+    }
+    return neg ? -val : val;
+}
+
+static const char digitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+uint32_t ZString::countDigits(uint64_t val)
+{
+    uint32_t rv = 1;
+    for(;;)
+    {
+        if(val < 10)
+        {
+            return rv;
+        }
+        if(val < 100)
+        {
+            return rv + 1;
+        }
+        if(val < 1000)
+        {
+            return rv + 2;
+        }
+        if(val < 10000)
+        {
+            return rv + 3;
+        }
+        val /= 10000;
+        rv += 4;
     }
-    if(!*ptr || *ptr != '.')
+}
+
+void ZString::writeDigits(uint64_t val, char* end)
+{
+    while(val >= 100)
     {
-        return neg ? -val : val;
+        const char* pair = digitPairs + (val % 100) * 2;
+        val /= 100;
+        *--end = pair[1];
+        *--end = pair[0];
     }
-    ptr++;
-    double fract = 10.0;
-    while(*ptr >= '0' && *ptr <= '9')
+    if(val >= 10)
     {
-        val += (*ptr - '0') / fract;
-        fract *= 10.0;
-        ptr++;
+        const char* pair = digitPairs + val * 2;
+        *--end = pair[1];
+        *--end = pair[0];
+    } else
+    {
+        *--end = static_cast<char>('0' + val);
     }
-    if(*ptr == 'e' || *ptr == 'E')
+}
+
+uint32_t ZString::formatInt(int64_t val, char* buf)
+{
+    uint64_t uval = static_cast<uint64_t>(val);
+    uint32_t neg = 0;
+    if(val < 0)
     {
-        ptr++;
-        int64_t mnt = parseInt(ptr);
-        if(mnt > 0)
-        {
-            while(mnt--)
-            {
-                val *= 10.0;
-            }
-        } else
+        uval = 0 - uval;
+        *buf = '-';
+        neg = 1;
+    }
+    uint32_t len = countDigits(uval) + neg;
+    writeDigits(uval, buf + len);
+    return len;
+}
+
+uint32_t ZString::formatDouble(double val, int precision, char* buf)
+{
+    char* end = buf + maxDoubleChars;
+    std::to_chars_result res;
+    if(precision < 0)
+    {
+        res = std::to_chars(buf, end, val);
+    } else
+    {
+        res = std::to_chars(buf, end, val, std::chars_format::fixed, precision);
+        if(res.ec != std::errc())
         {
-            while(mnt++)
-            {
-                val /= 10.0;
-            }
+            //too many digits for fixed point
+            res = std::to_chars(buf, end, val, std::chars_format::scientific, precision);
         }
     }
-    return neg ? -val : val;
+    if(res.ec != std::errc())
+    {
+        res = std::to_chars(buf, end, val);
+    }
+    return static_cast<uint32_t>(res.ptr - buf);
 }
 
 ZString* ZString::copy(ZMemory* mem)
@@ -134,466 +180,332 @@ ZString* ZString::copy(ZMemory* mem)
     {
         return rv;
     }
-    uint32_t sz = getSize();
-    rv->size = size;
+    rv->allocData(mem, size, length);
     rv->hashCode = hashCode;
-    rv->data = mem->allocStr(sz);
-    memcpy(rv->data, data, sz);
+    memcpy(rv->data, data, size);
     return rv;
 }
 
-int ZString::find(const ZString& argStr, uint32_t startPos) const
+uint32_t ZString::getUnicodeCharOffset(ZMemory* mem, uint32_t idx) const
 {
-    if(startPos >= getLength())
+    if(length <= charIdxStep)
     {
-        return -1;
+        return static_cast<uint32_t>(skipChars(data, idx) - data);
     }
-    if(getCharSize() == 1 && argStr.getCharSize() == 1)
+    if(!charIdx)
     {
-        char* ptr = strstr(data + startPos, argStr.data);
-        return ptr ? ptr - data : -1;
-    } else
-    {
-        int cs1 = getCharSize();
-        const char* ptr1 = data + startPos * cs1;
-        const char* end1 = ptr1 + getDataSize();
-        const char* ptr2 = argStr.data;
-        int cs2 = argStr.getCharSize();
-        const char* end2 = ptr2 + argStr.getDataSize();
-        while(ptr1 != end1)
+        charIdx = (uint32_t*) mem->allocStr(getCharIndexSize());
+        const char* ptr = data;
+        const char* end = data + size;
+        uint32_t cnt = 0;
+        for(; ptr != end; ++ptr)
         {
-            const char* p1 = ptr1;
-            const char* p2 = ptr2;
-            while(p2 != end2 && getNextChar(p1, cs1) == getNextChar(p2, cs2))
-            {
-            }
-            if(p2 == end2)
+            if(isLeadByte(*ptr))
             {
-                return (p1 - data) / cs1;
+                if((cnt & (charIdxStep - 1)) == 0)
+                {
+                    charIdx[cnt >> charIdxShift] = static_cast<uint32_t>(ptr - data);
+                }
+                ++cnt;
             }
-            ptr1 += cs1;
         }
-        return -1;
     }
+    const char* ptr = data + charIdx[idx >> charIdxShift];
+    return static_cast<uint32_t>(skipChars(ptr, idx & (charIdxStep - 1)) - data);
 }
 
-ZString* ZString::concat(ZMemory* mem, const ZString* s1, const ZString* s2)
+const char* ZString::skipChars(const char* ptr, uint32_t count)
 {
-    ZString* rv = mem->allocZString();
-    if(s1->getCharSize() == 1 && s2->getCharSize() == 1)
-    {
-        rv->size = s1->size + s2->size;
-        rv->data = mem->allocStr(rv->size + 1);
-        memcpy(rv->data, s1->data, s1->size);
-        memcpy(rv->data + s1->size, s2->data, s2->size);
-        rv->data[rv->size] = 0;
-        rv->hashCode = calcHash(rv->data, rv->data + rv->size);
-    } else
+    while(count--)
     {
-        rv->size = 2 * s1->getLength() + 2 * s2->getLength();
-        char* ptr = rv->data = mem->allocStr(rv->size);
-        rv->size |= unicodeFlag;
-        if(s1->getCharSize() == 1)
+        ++ptr;
+        while(!isLeadByte(*ptr))
         {
-            char* s1ptr = s1->data;
-            char* s1end = s1->data + s1->size;
-            while(s1ptr < s1end)
-            {
-                uint16_t c = *((unsigned char*) s1ptr++);
-                char* cp = (char*) &c;
-                *ptr++ = cp[0];
-                *ptr++ = cp[1];
-            }
-        } else
-        {
-            memcpy(ptr, s1->data, s1->getDataSize());
-            ptr += s1->getSize();
-        }
-        if(s2->getCharSize() == 1)
-        {
-            char* s2ptr = s2->data;
-            char* s2end = s2->data + s2->size;
-            while(s2ptr < s2end)
-            {
-                uint16_t c = *((unsigned char*) s2ptr++);
-                char* cp = (char*) &c;
-                *ptr++ = cp[0];
-                *ptr++ = cp[1];
-            }
-        } else
-        {
-            memcpy(ptr, s2->data, s2->getDataSize());
+            ++ptr;
         }
     }
-    return rv;
+    return ptr;
 }
 
-void ZString::uappend(char*& dst) const
+int ZString::find(ZMemory* mem, const ZString& argStr, uint32_t startPos) const
 {
-    if(getCharSize() == 2)
+    if(startPos >= length)
     {
-        uint32_t sz = getDataSize();
-        memcpy(dst, data, sz);
-        dst += sz;
-        return;
+        return -1;
     }
-    char* ptr = data;
-    char* end = ptr + getDataSize();
-    while(ptr < end)
+    uint32_t startOff = getCharOffset(mem, startPos);
+    if(argStr.size == 0)
     {
-        uint16_t c = *((unsigned char*) ptr++);
-        char* cp = (char*) &c;
-        *dst++ = cp[0];
-        *dst++ = cp[1];
+        return static_cast<int>(startPos);
     }
-}
-
-const char* ZString::c_str(ZMemory* mem, const CStringWrap& wrap) const
-{
-    if(size == 0)
+    if(argStr.size > size - startOff)
     {
-        return "";
+        return -1;
     }
-    int cs;
-    if((cs = getCharSize()) == 1)
+    const char* ptr = getStrKernels().find(data + startOff, size - startOff, argStr.data, argStr.size);
+    if(!ptr)
     {
-        wrap.assign(0, data, getLength());
-        return data;
+        return -1;
     }
-    uint32_t rvSize = calcUtf8Length();
-    char* rv = mem->allocStr(rvSize + 1);
-    wrap.assign(mem, rv, rvSize);
-    const char* ptr = data;
-    const char* end = ptr + getDataSize();
-
-    while(ptr != end)
+    if(isAscii())
     {
-        uint16_t symbol = getNextChar(ptr, cs);
-        rv += ucs2ToUtf8(symbol, rv);
+        return static_cast<int>(ptr - data);
     }
-    *rv = 0;
-    return wrap.c_str();
+    return static_cast<int>(startPos + calcLength(data + startOff, static_cast<uint32_t>(ptr - data - startOff)));
 }
 
-const char* ZString::c_substr(ZMemory* mem, uint32_t offset, uint32_t len, const CStringWrap& wrap) const
+ZString* ZString::concat(ZMemory* mem, const ZString* s1, const ZString* s2)
 {
-    if(offset >= getLength())
-    {
-        return "";
-    }
-    if(offset + len > getLength())
-    {
-        len = getLength() - offset;
-    }
-    int cs;
-    if((cs = getCharSize()) == 1)
-    {
-        char* dst = mem->allocStr(len + 1);
-        memcpy(dst, data + offset, len);
-        dst[len] = 0;
-        wrap.assign(mem, dst, len);
-        return dst;
-    }
-    const char* ptr = data + offset * cs;
-    const char* end = ptr + len * cs;
-    uint32_t rvSize = calcUtf8Length(ptr, end, cs);
-    char* rv = mem->allocStr(rvSize + 1);
-    wrap.assign(mem, rv, rvSize);
-
-    while(ptr != end)
-    {
-        uint16_t symbol = getNextChar(ptr, cs);
-        rv += ucs2ToUtf8(symbol, rv);
-    }
-    *rv = 0;
-    return wrap.c_str();
-
+    ZString* rv = mem->allocZString();
+    rv->allocData(mem, s1->size + s2->size, s1->length + s2->length);
+    memcpy(rv->data, s1->data, s1->size);
+    memcpy(rv->data + s1->size, s2->data, s2->size);
+    return rv;
 }
 
-bool ZString::operator==(const ZString& argStr) const
+void ZString::append(ZMemory* mem, const char* argStr, uint32_t argSize, uint32_t argLength)
 {
-    if(getLength() != argStr.getLength())
-    {
-        return false;
-    }
-    if(!(size & unicodeFlag) && !(argStr.size & unicodeFlag))
+    dropCharIndex(mem);
+    uint32_t newSize = size + argSize;
+    if(newSize + 1 > capacity)
     {
-        return memcmp(data, argStr.data, size) == 0;
-    } else
-    {
-        int cs1 = getCharSize();
-        int cs2 = argStr.getCharSize();
-        const char* ptr1 = data;
-        const char* ptr2 = argStr.data;
-        const char* end1 = ptr1 + (size & unicodeMask);
-        while(ptr1 != end1)
+        uint32_t newCapacity = capacity < 16 ? 16 : capacity;
+        while(newCapacity < newSize + 1)
         {
-            if(getNextChar(ptr1, cs1) != getNextChar(ptr2, cs2))
-            {
-                return false;
-            }
+            newCapacity *= 2;
         }
-        return true;
+        char* newData = mem->allocStr(newCapacity);
+        memcpy(newData, data, size);
+        //argStr can point to own data, so old buffer is released after copy
+        memcpy(newData + size, argStr, argSize);
+        if(data)
+        {
+            mem->freeStr(data, capacity);
+        }
+        data = newData;
+        capacity = newCapacity;
+    } else
+    {
+        memcpy(data + size, argStr, argSize);
     }
+    size = newSize;
+    length += argLength;
+    data[size] = 0;
+    hashCode = 0xffffffff;
 }
 
-ZString* ZString::substr(ZMemory* mem, uint32_t startPos, uint32_t len)
+const char* ZString::c_str(ZMemory* mem, const CStringWrap& wrap) const
 {
-    ZString* rv = mem->allocZString();
-    int cs = getCharSize();
-    if(!data || !size || startPos * cs >= getDataSize())
+    if(size == 0)
     {
-        return rv;
+        return "";
     }
-    if((startPos + len) > getLength())
+    if(parent)
     {
-        len = getLength() - startPos;
+        char* rv = mem->allocStr(size + 1);
+        memcpy(rv, data, size);
+        rv[size] = 0;
+        wrap.assign(mem, rv, size);
+        return rv;
     }
-    len *= cs;
-    startPos *= cs;
-    bool hasUnicode = false;
-    if(cs != 1)
+    wrap.assign(0, data, size);
+    return data;
+}
+
+const char* ZString::c_substr(ZMemory* mem, uint32_t offset, uint32_t len, const CStringWrap& wrap) const
+{
+    if(offset >= length)
     {
-        const char* ptr = data + startPos;
-        const char* end = ptr + len;
-        uint16_t symbol;
-        while(ptr < end)
-        {
-            symbol = getNextChar(ptr, cs);
-            if(symbol > 127)
-            {
-                hasUnicode = true;
-                break;
-            }
-        }
+        return "";
     }
-    if(cs != 1 && !hasUnicode)
+    if(offset + len > length)
     {
-        rv->size = len / cs;
-        char* dst = rv->data = mem->allocStr(rv->size + 1);
-        const char* ptr = data + startPos;
-        const char* end = ptr + len;
-        uint16_t symbol;
+        len = length - offset;
+    }
+    uint32_t startOff = getCharOffset(mem, offset);
+    uint32_t endOff = getCharOffset(mem, offset + len);
+    uint32_t sz = endOff - startOff;
+    char* dst = mem->allocStr(sz + 1);
+    memcpy(dst, data + startOff, sz);
+    dst[sz] = 0;
+    wrap.assign(mem, dst, sz);
+    return dst;
+}
 
-        while(ptr < end)
-        {
-            symbol = getNextChar(ptr, cs);
-            *dst++ = static_cast<char>(symbol);
-        }
-        *dst = 0;
-    } else
+bool ZString::operator==(const ZString& argStr) const
+{
+    return size == argStr.size && getStrKernels().mismatch(data, argStr.data, size) == size;
+}
+
+ZString* ZString::substr(ZMemory* mem, uint32_t startPos, uint32_t len)
+{
+    if(!data || !size || startPos >= length)
     {
-        rv->size = len | (cs != 1 ? unicodeFlag : 0);
-        rv->data = mem->allocStr(len + (cs == 1 ? 1 : 0));
-        memcpy(rv->data, data + startPos, len);
+        return mem->allocZString();
     }
-    if(cs == 1)
+    if(len > length - startPos)
     {
-        rv->data[rv->size] = 0;
+        len = length - startPos;
     }
-    rv->hashCode = 0xffffffff;//calcHash(rv->data,rv->data+rv->getDataSize());
-    return rv;
+    uint32_t startOff = getCharOffset(mem, startPos);
+    uint32_t endOff = getCharOffset(mem, startPos + len);
+    return makeSubstr(mem, startOff, endOff, len);
 }
 
-ZString* ZString::erase(ZMemory* mem, uint32_t startPos, uint32_t len)
+ZString* ZString::makeSubstr(ZMemory* mem, uint32_t startOff, uint32_t endOff, uint32_t len)
 {
     ZString* rv = mem->allocZString();
-    int cs = getCharSize();
-    if(!data || !size || startPos * cs >= getDataSize())
-    {
+    uint32_t sz = endOff - startOff;
+    ZString* root = parent ? parent : this;
+    if(sz >= sharedMinSize && sz * sharedMaxRatio >= root->size)
+    {
+        root->ref();
+        rv->parent = root;
+        rv->data = data + startOff;
+        rv->size = sz;
+        rv->length = len;
         return rv;
     }
-    uint32_t tail;
-    if((startPos + len) > getLength())
-    {
-        len = getLength() - startPos;
-        tail = 0;
-    } else
-    {
-        tail = getLength() - (startPos + len);
-    }
-    len *= cs;
-    startPos *= cs;
-    tail *= cs;
-    uint32_t newLen = startPos + tail;
+    rv->allocData(mem, sz, len);
+    memcpy(rv->data, data + startOff, sz);
+    return rv;
+}
+
+void ZString::releaseParent(ZMemory* mem)
+{
+    Value v;
+    v.vt = vtString;
+    v.flags = ValFlagNone;
+    v.str = parent;
+    parent = 0;
+    data = 0;
+    mem->unref(v);
+}
 
-    bool hasUnicode = false;
-    if(cs != 1)
+ZString* ZString::erase(ZMemory* mem, uint32_t startPos, uint32_t len)
+{
+    if(!data || !size || startPos >= length)
     {
-        const char* ptr = data;
-        const char* end = ptr + startPos;
-        uint16_t symbol;
-        while(ptr < end)
-        {
-            symbol = getNextChar(ptr, cs);
-            if(symbol > 127)
-            {
-                hasUnicode = true;
-                break;
-            }
-        }
-        if(!hasUnicode && tail)
-        {
-            ptr = data + startPos + len;
-            end = ptr + tail;
-            while(ptr < end)
-            {
-                symbol = getNextChar(ptr, cs);
-                if(symbol > 127)
-                {
-                    hasUnicode = true;
-                    break;
-                }
-            }
-        }
+        return mem->allocZString();
     }
-    if(cs != 1 && !hasUnicode)
-    {
-        rv->size = newLen / cs;
-        char* dst = rv->data = mem->allocStr(rv->size + 1);
-        const char* ptr = data;
-        const char* end = ptr + startPos;
-        uint16_t symbol;
-
-        while(ptr < end)
-        {
-            symbol = getNextChar(ptr, cs);
-            *dst++ = static_cast<char>(symbol);
-        }
-        if(tail)
-        {
-            ptr = data + startPos + len;
-            end = ptr + tail;
-            while(ptr < end)
-            {
-                symbol = getNextChar(ptr, cs);
-                *dst++ = static_cast<char>(symbol);
-            }
-        }
-        *dst = 0;
-    } else
+    if(len > length - startPos)
     {
-        rv->size = newLen | (cs != 1 ? unicodeFlag : 0);
-        rv->data = mem->allocStr(newLen + (cs == 1 ? 1 : 0));
-        memcpy(rv->data, data, startPos);
-        memcpy(rv->data + startPos, data + startPos + len, tail);
+        len = length - startPos;
     }
-    if(cs == 1)
+    uint32_t startOff = getCharOffset(mem, startPos);
+    uint32_t endOff = getCharOffset(mem, startPos + len);
+    uint32_t tail = size - endOff;
+    if(startOff == 0 || tail == 0)
     {
-        rv->data[rv->size] = 0;
+        //what is left is a single piece
+        return startOff == 0 ? makeSubstr(mem, endOff, size, length - len) : makeSubstr(mem, 0, startOff, startPos);
     }
-    rv->hashCode = 0xffffffff;//calcHash(rv->data,rv->data+rv->getDataSize());
+    ZString* rv = mem->allocZString();
+    rv->allocData(mem, startOff + tail, length - len);
+    memcpy(rv->data, data, startOff);
+    memcpy(rv->data + startOff, data + endOff, tail);
     return rv;
 }
 
 ZString* ZString::insert(ZMemory* mem, uint32_t pos, ZString* str)
 {
     ZString* rv = mem->allocZString();
-    int cs = getCharSize();
-    int scs = str->getCharSize();
-    pos *= cs;
-    if(pos > size)
-    {
-        pos = size;
-    }
-    if(cs == scs)
-    {
-        rv->size = getDataSize() + str->getDataSize();
-        rv->data = mem->allocStr(rv->size + (cs == 1 ? 1 : 0));
-        char* ptr = rv->data;
-        memcpy(ptr, data, pos);
-        ptr += pos;
-        memcpy(ptr, str->data, str->getDataSize());
-        ptr += str->getDataSize();
-        memcpy(ptr, data + pos, getDataSize() - pos);
-        if(cs == 1)
-        {
-            rv->data[rv->size] = 0;
-        } else
+    uint32_t off = getCharOffset(mem, pos);
+    rv->allocData(mem, size + str->size, length + str->length);
+    char* ptr = rv->data;
+    memcpy(ptr, data, off);
+    ptr += off;
+    memcpy(ptr, str->data, str->size);
+    ptr += str->size;
+    memcpy(ptr, data + off, size - off);
+    return rv;
+}
+
+uint32_t ZString::calcLength(const char* ptr, uint32_t len)
+{
+    return static_cast<uint32_t>(getStrKernels().countLeadBytes(ptr, len));
+}
+
+uint32_t ZString::validateUtf8(const char* ptr, uint32_t len)
+{
+    const unsigned char* start = (const unsigned char*) ptr;
+    const unsigned char* p = start;
+    const unsigned char* end = p + len;
+    const StrKernels& k = getStrKernels();
+    while(p < end)
+    {
+        unsigned char c = *p;
+        if(c < 0x80)
         {
-            rv->size |= unicodeFlag;
+            p += k.asciiPrefix((const char*) p, static_cast<size_t>(end - p));
+            continue;
         }
-    } else
-    {
-        rv->size = getLength() * 2 + str->getLength() * 2;
-        rv->data = mem->allocStr(rv->size);
-        rv->size |= unicodeFlag;
-        char* dst = rv->data;
-        if(cs == 1)
+        int cnt;
+        uint32_t cp;
+        if((c >> 5) == 0x06)
         {
-            char* ptr = data;
-            char* end = data + pos;
-            while(ptr < end)
-            {
-                putUcs2Char(dst, static_cast<char_type>(*ptr));
-                ++ptr;
-            }
-        } else
+            cnt = 1;
+            cp = c & 0x1f;
+        } else if((c >> 4) == 0x0e)
         {
-            memcpy(dst, data, pos);
-            dst += pos;
-        }
-        if(scs == 1)
+            cnt = 2;
+            cp = c & 0x0f;
+        } else if((c >> 3) == 0x1e)
         {
-            char* ptr = str->data;
-            char* end = str->data + str->size;
-            while(ptr < end)
-            {
-                putUcs2Char(dst, static_cast<char_type>(*ptr));
-                ++ptr;
-            }
+            cnt = 3;
+            cp = c & 0x07;
         } else
         {
-            memcpy(dst, str->data, str->getDataSize());
-            dst += str->getDataSize();
+            break;
+        }
+        if(end - p <= cnt)
+        {
+            break;
         }
-        if(cs == 1)
+        int i = 1;
+        for(; i <= cnt; ++i)
         {
-            char* ptr = data + pos;
-            char* end = data + size;
-            while(ptr < end)
+            if((p[i] & 0xc0) != 0x80)
             {
-                putUcs2Char(dst, static_cast<char_type>(*ptr));
-                ++ptr;
+                break;
             }
-        } else
+            cp = (cp << 6) | (p[i] & 0x3f);
+        }
+        if(i <= cnt)
+        {
+            break;
+        }
+        //overlong forms, surrogates and values above U+10FFFF
+        if((cnt == 1 && cp < 0x80) || (cnt == 2 && cp < 0x800) || (cnt == 3 && cp < 0x10000) ||
+           (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
         {
-            memcpy(dst, data + pos, getDataSize() - pos);
+            break;
         }
+        p += cnt + 1;
     }
-    return rv;
+    return static_cast<uint32_t>(p - start);
 }
 
-uint32_t ZString::calcU8Symbols(const char* ptr, uint32_t len)
+uint32_t ZString::toUcs2(const char* ptr, const char* end, uint16_t* dst)
 {
-    uint32_t rv = 0;
-    const char* end = ptr + len;
+    uint16_t* start = dst;
+    const StrKernels& k = getStrKernels();
     while(ptr < end)
     {
-        unsigned char c = static_cast<unsigned char>(*ptr);
-        if(c < 0x80)
-        {
-            ptr += 1;
-        } else if((c >> 5) == 0x06)
-        {
-            ptr += 2;
-        } else if((c >> 4) == 0x0e)
-        {
-            ptr += 3;
-        } else if((c >> 3) == 0x1e)
+        if(!(*ptr & 0x80))
         {
-            ptr += 4;
-        } else
-        {
-            //error?
-            ptr += 1;
+            size_t n = k.widenAscii(ptr, static_cast<size_t>(end - ptr), dst);
+            ptr += n;
+            dst += n;
+            continue;
         }
-        ++rv;
+        uint32_t c = getNextChar(ptr);
+        *dst++ = c > 0xffff ? 0xfffd : static_cast<uint16_t>(c);
     }
-    return rv;
+    return static_cast<uint32_t>(dst - start);
 }
 
-int ZString::ucs2ToUtf8(uint16_t symbol, char* buf)
+int ZString::putUtf8Char(uint32_t symbol, char* buf)
 {
     int rv = 0;
     if(symbol < 0x80)
@@ -603,46 +515,19 @@ int ZString::ucs2ToUtf8(uint16_t symbol, char* buf)
     {
         buf[rv++] = ((symbol >> 6) | 0xc0) & 0xff;
         buf[rv++] = (symbol & 0x3f) | 0x80;
-    } else
+    } else if(symbol < 0x10000)
     {
         buf[rv++] = ((symbol >> 12) | 0xe0) & 0xff;
         buf[rv++] = ((symbol >> 6) & 0x3f) | 0x80;
         buf[rv++] = (symbol & 0x3f) | 0x80;
-    }
-    return rv;
-}
-
-uint32_t ZString::calcUtf8Length(const char* ptr, const char* end, int cs)
-{
-    uint16_t symbol;
-    uint32_t rv = 0;
-    while(ptr < end)
+    } else
     {
-        symbol = getNextChar(ptr, cs);
-        if(symbol < 0x80)
-        {
-            ++rv;
-        } else if(symbol < 0x800)
-        {
-            rv += 2;
-        } else
-        {
-            rv += 3;
-        }
+        buf[rv++] = ((symbol >> 18) | 0xf0) & 0xff;
+        buf[rv++] = ((symbol >> 12) & 0x3f) | 0x80;
+        buf[rv++] = ((symbol >> 6) & 0x3f) | 0x80;
+        buf[rv++] = (symbol & 0x3f) | 0x80;
     }
     return rv;
 }
 
-uint32_t ZString::calcUtf8Length() const
-{
-    int cs;
-    if((cs = getCharSize()) == 1)
-    {
-        return getLength();
-    }
-    const char* ptr = data;
-    const char* end = ptr + getDataSize();
-    return calcUtf8Length(ptr, end, cs);
-}
-
 }
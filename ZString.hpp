@@ -55,20 +55,31 @@ public:
 
 class ZString:public RefBase{
 public:
-  typedef uint16_t char_type;
-  ZString():data(0),size(0),hashCode(0xffffffff){}
+  ZString():data(0),size(0),length(0),capacity(0),hashCode(0xffffffff),charIdx(0),parent(0){}
   void init()
   {
     data=0;
     size=0;
+    length=0;
+    capacity=0;
     hashCode=0xffffffff;
+    charIdx=0;
+    parent=0;
   }
-  void init(char* argStr,uint32_t argLength,bool argUnicode)
+  /* argStr must be allocated with allocStr(argSize+1) and zero terminated */
+  void init(char* argStr,uint32_t argSize)
+  {
+    init(argStr,argSize,calcLength(argStr,argSize));
+  }
+  void init(char* argStr,uint32_t argSize,uint32_t argLength)
   {
     data=argStr;
-    size=argLength;
-    if(argUnicode)size|=unicodeFlag;
-    hashCode=0xffffffff;//calcHash(data,data+argLength);
+    size=argSize;
+    length=argLength;
+    capacity=argSize+1;
+    hashCode=0xffffffff;
+    charIdx=0;
+    parent=0;
   }
   void assignConst(const char* argStr,uint32_t argLength=(uint32_t)-1)
   {
@@ -80,7 +91,11 @@ public:
       size=argLength;
     }
     data=(char*)argStr;
-    hashCode=0xffffffff;//calcHash(data,data+size);
+    length=calcLength(data,size);
+    capacity=size+1;
+    hashCode=0xffffffff;
+    charIdx=0;
+    parent=0;
   }
 
   void assign(ZMemory* mem,const char* argStr,uint32_t argLength=(uint32_t)-1)
@@ -92,124 +107,113 @@ public:
     {
       size=argLength;
     }
-    data=mem->allocStr(size+1);
+    capacity=size+1;
+    data=mem->allocStr(capacity);
     memcpy(data,argStr,size);
     data[size]=0;
-    hashCode=0xffffffff;//calcHash(data,data+size);
+    length=calcLength(data,size);
+    hashCode=0xffffffff;
+    charIdx=0;
+    parent=0;
   }
 
-  void assign(ZMemory* mem,const uint16_t* argStr,uint32_t argLengthInBytes)
-  {
-    size=argLengthInBytes;
-    data=mem->allocStr(size);
-    memcpy(data,argStr,size);
-    hashCode=0xffffffff;//calcHash(data,data+size);
-    size|=unicodeFlag;
-  }
   bool operator==(const ZString& argStr)const;
 
-  static int compare(const char* ptr1,int cs1,uint32_t sz1,const char* ptr2,int cs2,uint32_t sz2);
+  /* utf-8 byte order is the same as code point order */
+  static int compare(const char* ptr1,uint32_t sz1,const char* ptr2,uint32_t sz2);
 
-  static uint16_t getNextChar(const char*& ptr,int charSize)
-  {
-    if(charSize==1)return (unsigned char)*ptr++;
-    uint16_t rv;
-    unsigned char* rvptr=(unsigned char*)&rv;
-    rvptr[0]=(unsigned char)*ptr++;
-    rvptr[1]=(unsigned char)*ptr++;
-    return rv;
-  }
-  static void putUcs2Char(char*& ptr,uint16_t symbol)
+  static bool isLeadByte(char c)
   {
-    char* srcptr=(char*)&symbol;
-    *ptr=srcptr[0];++ptr;
-    *ptr=srcptr[1];++ptr;
+    return (static_cast<unsigned char>(c)&0xc0)!=0x80;
   }
-  static void utf8ToUcs2(const char*& ptr,char*& dst)
+  static uint32_t getNextChar(const char*& ptr)
   {
     uint32_t c=(unsigned char)*ptr++;
-    if(c>=0x80)
+    if(c<0x80)
+    {
+      return c;
+    }
+    if((c>>5)==0x06)
+    {
+      c=(c&0x1f)<<6;
+      c|=(unsigned char)*ptr++&0x3f;
+    }else if((c>>4)==0x0e)
+    {
+      c=(c&0x0f)<<12;
+      c|=((unsigned char)*ptr++&0x3f)<<6;
+      c|=(unsigned char)*ptr++&0x3f;
+    }else if((c>>3)==0x1e)
     {
-      if((c>>5)==0x06)
-      {
-        c=((c<<6)&0x7ff)+(*ptr++ & 0x3f);
-      }else if ((c>>4)==0x0e)
-      {
-        c=((c<<12)&0xffff)|((((uint32_t)(uint8_t)*ptr++)<<6)&0x0fff);
-        c|=(*ptr++&0x3f);
-      }else if ((c>>3)==0x1e)
-      {
-        c=((c<<18)&0x1fffff)+((((uint32_t)(uint8_t)*ptr++)<<12)&0x0003ffff);
-        c|=(((uint32_t)(uint8_t)*ptr++)<<6)&0x0fff;
-        c|=((uint32_t)(uint8_t)*ptr++)&0x3f;
-      }
-      else
-      {
-        c=' ';
-      }
+      c=(c&0x07)<<18;
+      c|=((unsigned char)*ptr++&0x3f)<<12;
+      c|=((unsigned char)*ptr++&0x3f)<<6;
+      c|=(unsigned char)*ptr++&0x3f;
     }
-    uint16_t v=(uint16_t)c;
-    char* buf=(char*)&v;
-    *dst++=*buf++;
-    *dst++=*buf++;
+    return c;
   }
-  static uint32_t calcU8Symbols(const char* ptr,uint32_t len);
-  static int ucs2ToUtf8(uint16_t symbol,char* buf);
-
-  uint32_t calcUtf8Length()const;
-
-  static uint32_t calcUtf8Length(const char* ptr,const char* end,int cs);
-
+  static int putUtf8Char(uint32_t symbol,char* buf);
+  static uint32_t calcLength(const char* ptr,uint32_t len);
+  /* returns size of valid utf-8 prefix */
+  static uint32_t validateUtf8(const char* ptr,uint32_t len);
+  static const char* skipChars(const char* ptr,uint32_t count);
+  /* one uint16_t per char, chars outside of BMP are replaced with U+FFFD */
+  static uint32_t toUcs2(const char* ptr,const char* end,uint16_t* dst);
 
   bool operator==(const char* str)const
   {
     return equalsTo(str,strlen(str));
   }
-  int getCharSize()const
+  bool isAscii()const
   {
-    return size&unicodeFlag?2:1;
+    return size==length;
   }
-  bool equalsTo(const char* str,size_t length)const
+  bool equalsTo(const char* str,size_t argSize)const
   {
-    /*if(size!=length+1)return false;
-    return memcmp(data,str,length)==0;*/
-    return compare(data,getCharSize(),getLength(),str,1,length)==0;
+    return size==argSize && memcmp(data,str,size)==0;
   }
 
   int compare(const ZString& argStr)const
   {
-    return compare(data,getCharSize(),getDataSize(),argStr.data,argStr.getCharSize(),argStr.getDataSize());
+    return compare(data,size,argStr.data,argStr.size);
   }
   int compare(const char* argStr,size_t argLength)const
   {
-    return compare(data,getCharSize(),getDataSize(),argStr,1,argLength);
+    return compare(data,size,argStr,argLength);
   }
 
   void clear(ZMemory* mem)
   {
-    if(data)
+    dropCharIndex(mem);
+    if(parent)
+    {
+      releaseParent(mem);
+    }else if(data)
     {
-      mem->freeStr(data,size&unicodeMask);
+      mem->freeStr(data,capacity);
     }
     data=0;
     size=0;
+    length=0;
+    capacity=0;
   }
 
   static int64_t parseInt(const char* ptr);
 
   static double parseDouble(const char* ptr);
 
-  /*static uint32_t calcHash(const char* data)
-  {
-    unsigned char* ptr=(unsigned char*)data;
-    uint32_t hashCode=0x7654321**ptr;
-    while(*ptr)
-    {
-      hashCode+=37*hashCode+*ptr;
-      ptr++;
-    }
-    return hashCode;
-  }*/
+  enum{
+    maxIntChars=20,
+    maxDoubleChars=384
+  };
+  //number of decimal digits, 1 for zero
+  static uint32_t countDigits(uint64_t val);
+  //writes decimal digits of val backwards, ending just before end
+  static void writeDigits(uint64_t val,char* end);
+  //writes val into buf of at least maxIntChars bytes, returns length; no terminating zero
+  static uint32_t formatInt(int64_t val,char* buf);
+  //fixed point with given precision, or shortest round-trip form if precision<0;
+  //buf must have at least maxDoubleChars bytes, no terminating zero
+  static uint32_t formatDouble(double val,int precision,char* buf);
 
   static uint32_t calcHash(const char* data,const char* end)
   {
@@ -223,20 +227,14 @@ public:
     return hashCode;
   }
 
-  uint32_t getSize()const
-  {
-    return size&unicodeFlag?size&unicodeMask:size+1;
-  }
-
   uint32_t getDataSize()const
   {
-    return size&unicodeFlag?size&unicodeMask:size;
+    return size;
   }
 
-
   uint32_t getLength()const
   {
-    return size&unicodeFlag?(size&unicodeMask)/2:size;
+    return length;
   }
 
   bool isEmpty()
@@ -248,11 +246,25 @@ public:
   {
     if(hashCode==0xffffffff && data)
     {
-      hashCode=calcHash(data,data+getDataSize());
+      hashCode=calcHash(data,data+size);
     }
     return hashCode;
   }
 
+  /* byte offset of char with index idx, idx>=length gives size */
+  uint32_t getCharOffset(ZMemory* mem,uint32_t idx)const
+  {
+    if(isAscii())
+    {
+      return idx<size?idx:size;
+    }
+    if(idx>=length)
+    {
+      return size;
+    }
+    return getUnicodeCharOffset(mem,idx);
+  }
+
   ZString* copy(ZMemory* mem);
 
   ZString* substr(ZMemory* mem,uint32_t startPos,uint32_t len);
@@ -263,42 +275,84 @@ public:
 
   static ZString* concat(ZMemory* mem,const ZString* s1,const ZString* s2);
 
-  /* append to dst as unicode */
-  void uappend(char*& dst)const;
+  /* in place append, only valid when caller holds the only reference */
+  void append(ZMemory* mem,const char* argStr,uint32_t argSize,uint32_t argLength);
+  void append(ZMemory* mem,const ZString* str)
+  {
+    append(mem,str->data,str->size,str->length);
+  }
+  bool canAppendInPlace()const
+  {
+    return refCount==1 && !weakRefId && !parent;
+  }
+  /* substring referencing buffer of other string, data is not zero terminated */
+  bool isShared()const
+  {
+    return parent!=0;
+  }
 
   const char* getDataPtr()const
   {
     return data;
   }
 
-  int find(const ZString& argStr,uint32_t startPos=0)const;
+  int find(ZMemory* mem,const ZString& argStr,uint32_t startPos=0)const;
   const char* c_str(ZMemory* mem,const CStringWrap& wrap=CStringWrap(0,0,0))const;
 
   const char* c_substr(ZMemory* mem,uint32_t offset,uint32_t len,const CStringWrap& wrap=CStringWrap(0,0,0))const;
 
-  uint16_t getCharAt(uint32_t idx)
+  uint32_t getCharAt(ZMemory* mem,uint32_t idx)const
   {
-    if(idx>=getLength())
+    if(idx>=length)
     {
       return 0;
     }
-    if(getCharSize()==1)
-    {
-      return static_cast<uint8_t>(data[idx]);
-    }else
-    {
-      return (reinterpret_cast<uint16_t*>(data))[idx];
-    }
+    const char* ptr=data+getCharOffset(mem,idx);
+    return getNextChar(ptr);
   }
 
 protected:
   enum{
-    unicodeFlag=0x80000000,
-    unicodeMask=0x7fffffff
+    charIdxShift=5,
+    charIdxStep=1<<charIdxShift,
+    /* substrings shorter than this are cheaper to copy */
+    sharedMinSize=32,
+    /* substring must be at least 1/sharedMaxRatio of the buffer it pins */
+    sharedMaxRatio=8
   };
   char* data;
   uint32_t size;
+  uint32_t length;
+  /* allocated size of data, at least size+1 */
+  uint32_t capacity;
   mutable uint32_t hashCode;
+  /* byte offsets of every charIdxStep-th char, built on demand for non ascii strings */
+  mutable uint32_t* charIdx;
+  /* owner of data for shared substrings */
+  ZString* parent;
+  uint32_t getCharIndexSize()const
+  {
+    return ((length>>charIdxShift)+1)*sizeof(uint32_t);
+  }
+  uint32_t getUnicodeCharOffset(ZMemory* mem,uint32_t idx)const;
+  void releaseParent(ZMemory* mem);
+  ZString* makeSubstr(ZMemory* mem,uint32_t startOff,uint32_t endOff,uint32_t len);
+  void allocData(ZMemory* mem,uint32_t argSize,uint32_t argLength)
+  {
+    size=argSize;
+    length=argLength;
+    capacity=argSize+1;
+    data=mem->allocStr(capacity);
+    data[size]=0;
+  }
+  void dropCharIndex(ZMemory* mem)const
+  {
+    if(charIdx)
+    {
+      mem->freeStr((char*)charIdx,getCharIndexSize());
+      charIdx=0;
+    }
+  }
   void operator=(const ZString&);
   ZString(const ZString&);
 };
@@ -0,0 +1,713 @@
+#include "ZVMSched.hpp"
+#include "ZBuilder.hpp"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace zorro {
+
+/*
+  io:: namespace, non-blocking I/O on fds, pipes and unix/tcp sockets.
+  Operation is tried right away, if fd is not ready the caller blocks like in sched::,
+  epoll of the scheduler reports readiness and the operation is completed for blocked task.
+  OS errors are thrown as string exceptions so scripts can catch them.
+*/
+
+enum IOStatus {
+    iosDone,
+    iosAgain,
+    iosFailed
+};
+
+static const size_t ioDefaultReadSize = 65536;
+
+static Value ioErrorValue(ZorroVM* vm, const char* func, int err)
+{
+    std::string msg = FORMAT("%{}: %{}", func, strerror(err));
+    return StringValue(vm->allocZString(msg.c_str(), static_cast<uint32_t>(msg.length())));
+}
+
+/* Size of incomplete utf-8 char at the end of buffer */
+static size_t utf8TailSize(const char* ptr, size_t len)
+{
+    for(size_t i = 1; i <= 3 && i <= len; ++i)
+    {
+        unsigned char c = static_cast<unsigned char>(ptr[len - i]);
+        if(c < 0x80)
+        {
+            return 0;
+        }
+        if(!ZString::isLeadByte(static_cast<char>(c)))
+        {
+            continue;
+        }
+        size_t need = (c >> 5) == 0x06 ? 2 : (c >> 4) == 0x0e ? 3 : (c >> 3) == 0x1e ? 4 : 0;
+        return need > i ? i : 0;
+    }
+    return 0;
+}
+
+static const char* ioFuncName(SchedIOOp op)
+{
+    switch(op)
+    {
+        case sioRead:
+            return "io::read";
+        case sioWrite:
+            return "io::write";
+        case sioAccept:
+            return "io::accept";
+        case sioConnect:
+            return "io::connect";
+        default:
+            return "io";
+    }
+}
+
+/*
+  Makes one attempt of operation.
+  Result is set when operation is done, err when it failed.
+*/
+static IOStatus ioAttempt(ZorroVM* vm, int fd, SchedIOWait& w, Value& result, int& err)
+{
+    switch(w.op)
+    {
+        case sioRead:
+        {
+            ZScheduler& s = *vm->scheduler;
+            std::vector<char>& buf = s.ioBuf;
+            if(buf.size() < w.size + 3)
+            {
+                buf.resize(w.size + 3);
+            }
+            //incomplete char from the end of previous read goes first
+            size_t carry = 0;
+            auto tail = s.readTails.find(fd);
+            if(tail != s.readTails.end())
+            {
+                carry = tail->second.length();
+                memcpy(buf.data(), tail->second.data(), carry);
+                s.readTails.erase(tail);
+            }
+            for(;;)
+            {
+                ssize_t n = ::read(fd, buf.data() + carry, w.size);
+                if(n > 0)
+                {
+                    size_t len = carry + static_cast<size_t>(n);
+                    size_t part = utf8TailSize(buf.data(), len);
+                    carry = len;
+                    if(part == len)
+                    {
+                        //nothing but a part of a char, empty result would look like eof
+                        continue;
+                    }
+                    if(part)
+                    {
+                        s.readTails[fd].assign(buf.data() + len - part, part);
+                    }
+                    result = StringValue(vm->allocZString(buf.data(), static_cast<uint32_t>(len - part)));
+                    return iosDone;
+                }
+                if(n == 0)
+                {
+                    //at eof incomplete char is returned as is and replaced with U+FFFD
+                    result = StringValue(vm->allocZString(buf.data(), static_cast<uint32_t>(carry)));
+                    return iosDone;
+                }
+                if(errno != EINTR)
+                {
+                    break;
+                }
+            }
+            if(carry)
+            {
+                int e = errno;
+                s.readTails[fd].assign(buf.data(), carry);
+                errno = e;
+            }
+            break;
+        }
+        case sioWrite:
+        {
+            ZString* str = w.data.str;
+            const char* ptr = str->getDataPtr();
+            size_t len = str->getDataSize();
+            while(w.size < len)
+            {
+                ssize_t n = ::write(fd, ptr + w.size, len - w.size);
+                if(n < 0)
+                {
+                    if(errno == EINTR)
+                    {
+                        continue;
+                    }
+                    break;
+                }
+                w.size += static_cast<size_t>(n);
+            }
+            if(w.size == len)
+            {
+                result = IntValue(static_cast<int64_t>(len));
+                return iosDone;
+            }
+            break;
+        }
+        case sioAccept:
+        {
+            for(;;)
+            {
+                int afd = ::accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if(afd >= 0)
+                {
+                    result = IntValue(afd);
+                    return iosDone;
+                }
+                if(errno != EINTR)
+                {
+                    break;
+                }
+            }
+            break;
+        }
+        case sioConnect:
+        {
+            //called when connecting socket became writable
+            int soErr = 0;
+            socklen_t soLen = sizeof(soErr);
+            if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &soErr, &soLen) < 0)
+            {
+                soErr = errno;
+            }
+            if(soErr == 0)
+            {
+                result = IntValue(fd);
+                return iosDone;
+            }
+            ::close(fd);
+            err = soErr;
+            return iosFailed;
+        }
+        default:
+            break;
+    }
+    if(errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+        return iosAgain;
+    }
+    err = errno;
+    return iosFailed;
+}
+
+void ZScheduler::waitIO(SchedTask* t, int fd, SchedIOOp op, size_t size, const Value& data)
+{
+    if(epollFd < 0)
+    {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if(epollFd < 0)
+        {
+            throw std::runtime_error(FORMAT("epoll_create1 failed: %{}", strerror(errno)));
+        }
+    }
+    SchedFd& f = fds[fd];
+    bool write = op == sioWrite || op == sioConnect;
+    SchedIOWait& w = write ? f.wr : f.rd;
+    if(w.task)
+    {
+        ZTHROWR(RuntimeException, vm, "Another task is already waiting to %{} fd %{}", write ? "write" : "read", fd);
+    }
+    w.task = t;
+    w.op = op;
+    w.size = size;
+    vm->assign(w.data, data);
+    ++ioWaiters;
+    uint32_t events = (f.rd.task ? EPOLLIN : 0) | (f.wr.task ? EPOLLOUT : 0);
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if(epoll_ctl(epollFd, f.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        int err = errno;
+        --ioWaiters;
+        vm->unref(w.data);
+        w = SchedIOWait();
+        if(!f.events)
+        {
+            fds.erase(fd);
+        }
+        ZTHROWR(RuntimeException, vm, "Failed to wait for fd %{}: %{}", fd, strerror(err));
+    }
+    f.events = events;
+}
+
+/* Wakes task of finished operation, returns false if operation needs to wait more */
+static bool ioComplete(ZScheduler& s, int fd, SchedIOWait& w)
+{
+    Value result = NilValue;
+    int err = 0;
+    IOStatus st = ioAttempt(s.vm, fd, w, result, err);
+    if(st == iosAgain)
+    {
+        return false;
+    }
+    SchedTask* t = w.task;
+    SchedIOOp op = w.op;
+    w.task = nullptr;
+    w.op = sioNone;
+    s.vm->unref(w.data);
+    --s.ioWaiters;
+    if(st == iosDone)
+    {
+        s.wake(t, result, false);
+    } else
+    {
+        s.wake(t, ioErrorValue(s.vm, ioFuncName(op), err), true);
+    }
+    return true;
+}
+
+void ZScheduler::pollIO(int timeout)
+{
+    epoll_event evs[64];
+    int n = epoll_wait(epollFd, evs, 64, timeout);
+    if(n < 0)
+    {
+        if(errno == EINTR)
+        {
+            return;
+        }
+        throw std::runtime_error(FORMAT("epoll_wait failed: %{}", strerror(errno)));
+    }
+    for(int i = 0; i < n; ++i)
+    {
+        int fd = evs[i].data.fd;
+        auto it = fds.find(fd);
+        if(it == fds.end())
+        {
+            continue;
+        }
+        SchedFd& f = it->second;
+        uint32_t ev = evs[i].events;
+        bool changed = false;
+        if(f.rd.task && (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        {
+            changed |= ioComplete(*this, fd, f.rd);
+        }
+        if(f.wr.task && (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        {
+            changed |= ioComplete(*this, fd, f.wr);
+        }
+        if(!changed)
+        {
+            continue;
+        }
+        uint32_t events = (f.rd.task ? EPOLLIN : 0) | (f.wr.task ? EPOLLOUT : 0);
+        if(!events)
+        {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            fds.erase(it);
+            continue;
+        }
+        epoll_event mev = {};
+        mev.events = events;
+        mev.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &mev);
+        f.events = events;
+    }
+}
+
+/* Fd is going to be closed, tasks waiting for it get EBADF */
+void ZScheduler::cancelIO(int fd)
+{
+    readTails.erase(fd);
+    auto it = fds.find(fd);
+    if(it == fds.end())
+    {
+        return;
+    }
+    SchedFd& f = it->second;
+    SchedIOWait* waits[2] = {&f.rd, &f.wr};
+    for(auto w : waits)
+    {
+        if(w->task)
+        {
+            wake(w->task, ioErrorValue(vm, ioFuncName(w->op), EBADF), true);
+            vm->unref(w->data);
+            --ioWaiters;
+        }
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    fds.erase(it);
+}
+
+void ZScheduler::clearIO()
+{
+    for(auto& it : fds)
+    {
+        vm->unref(it.second.wr.data);
+    }
+    fds.clear();
+    readTails.clear();
+    ioWaiters = 0;
+    if(epollFd >= 0)
+    {
+        ::close(epollFd);
+        epollFd = -1;
+    }
+}
+
+static int getFdArg(ZorroVM* vm, int idx, const char* func)
+{
+    Value& v = vm->getLocalValue(idx);
+    if(v.vt != vtInt || v.iValue < 0)
+    {
+        throw std::runtime_error(FORMAT("Expected fd as argument %{} of %{}", idx + 1, func));
+    }
+    return static_cast<int>(v.iValue);
+}
+
+/*
+  Starts operation, returns immediately if it could be done without waiting,
+  otherwise blocks the caller until scheduler completes it.
+*/
+static void ioStart(ZorroVM* vm, int fd, SchedIOOp op, size_t size, const Value& data)
+{
+    ZScheduler& s = *vm->scheduler;
+    SchedTask* w = s.waiter();
+    SchedIOWait tmp;
+    tmp.op = op;
+    tmp.size = size;
+    tmp.data = data;
+    Value result = NilValue;
+    int err = 0;
+    switch(ioAttempt(vm, fd, tmp, result, err))
+    {
+        case iosDone:
+            vm->setResult(result);
+            return;
+        case iosFailed:
+        {
+            Value ex = ioErrorValue(vm, ioFuncName(op), err);
+            vm->throwValue(&ex);
+            return;
+        }
+        default:
+            break;
+    }
+    s.waitIO(w, fd, op, tmp.size, data);
+    s.block();
+}
+
+static void ioRead(ZorroVM* vm)
+{
+    index_type argc = vm->getArgsCount();
+    if(argc < 1 || argc > 2)
+    {
+        throw std::runtime_error("Unexpected number of arguments for io::read");
+    }
+    int fd = getFdArg(vm, 0, "io::read");
+    size_t size = ioDefaultReadSize;
+    if(argc == 2)
+    {
+        Value& sz = vm->getLocalValue(1);
+        if(sz.vt != vtInt || sz.iValue <= 0)
+        {
+            throw std::runtime_error("Expected positive integer as size for io::read");
+        }
+        size = static_cast<size_t>(sz.iValue);
+    }
+    ioStart(vm, fd, sioRead, size, NilValue);
+}
+
+static void ioWrite(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 2)
+    {
+        throw std::runtime_error("Expected exactly 2 arguments for io::write");
+    }
+    int fd = getFdArg(vm, 0, "io::write");
+    Value& data = vm->getLocalValue(1);
+    if(data.vt != vtString)
+    {
+        throw std::runtime_error("Expected string as second argument for io::write");
+    }
+    ioStart(vm, fd, sioWrite, 0, data);
+}
+
+static void ioAccept(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 1)
+    {
+        throw std::runtime_error("Expected exactly 1 argument for io::accept");
+    }
+    ioStart(vm, getFdArg(vm, 0, "io::accept"), sioAccept, 0, NilValue);
+}
+
+/*
+  Socket address is either unix:path, unix:@name for abstract unix socket,
+  or host:port for tcp.
+*/
+struct IOAddr {
+    sockaddr_storage addr;
+    socklen_t len;
+    int family;
+};
+
+static void parseAddr(ZorroVM* vm, const char* func, IOAddr& a)
+{
+    Value& v = vm->getLocalValue(0);
+    if(v.vt != vtString)
+    {
+        throw std::runtime_error(FORMAT("Expected address string as first argument of %{}", func));
+    }
+    std::string str(v.str->getDataPtr(), v.str->getDataSize());
+    memset(&a.addr, 0, sizeof(a.addr));
+    if(str.compare(0, 5, "unix:") == 0)
+    {
+        sockaddr_un& un = reinterpret_cast<sockaddr_un&>(a.addr);
+        std::string path = str.substr(5);
+        if(path.empty() || path.length() >= sizeof(un.sun_path))
+        {
+            throw std::runtime_error(FORMAT("Invalid unix socket path in %{}: %{}", func, str));
+        }
+        un.sun_family = AF_UNIX;
+        memcpy(un.sun_path, path.c_str(), path.length());
+        if(path[0] == '@')
+        {
+            un.sun_path[0] = 0;
+        }
+        a.len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.length() + (path[0] == '@' ? 0 : 1));
+        a.family = AF_UNIX;
+        return;
+    }
+    size_t col = str.rfind(':');
+    if(col == std::string::npos)
+    {
+        throw std::runtime_error(FORMAT("Expected host:port in %{}: %{}", func, str));
+    }
+    std::string host = str.substr(0, col);
+    std::string port = str.substr(col + 1);
+    if(host.length() > 2 && host.front() == '[' && host.back() == ']')
+    {
+        host = host.substr(1, host.length() - 2);
+    }
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    addrinfo* res = nullptr;
+    int rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+    if(rc != 0 || !res)
+    {
+        throw std::runtime_error(FORMAT("Failed to resolve %{} in %{}: %{}", str, func, gai_strerror(rc)));
+    }
+    memcpy(&a.addr, res->ai_addr, res->ai_addrlen);
+    a.len = res->ai_addrlen;
+    a.family = res->ai_family;
+    freeaddrinfo(res);
+}
+
+static void ioListen(ZorroVM* vm)
+{
+    index_type argc = vm->getArgsCount();
+    if(argc < 1 || argc > 2)
+    {
+        throw std::runtime_error("Unexpected number of arguments for io::listen");
+    }
+    IOAddr a;
+    parseAddr(vm, "io::listen", a);
+    int backlog = 128;
+    if(argc == 2)
+    {
+        Value& b = vm->getLocalValue(1);
+        if(b.vt != vtInt)
+        {
+            throw std::runtime_error("Expected integer as backlog for io::listen");
+        }
+        backlog = static_cast<int>(b.iValue);
+    }
+    int fd = socket(a.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd >= 0 && a.family != AF_UNIX)
+    {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if(fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&a.addr), a.len) < 0 || listen(fd, backlog) < 0)
+    {
+        int err = errno;
+        if(fd >= 0)
+        {
+            ::close(fd);
+        }
+        Value ex = ioErrorValue(vm, "io::listen", err);
+        vm->throwValue(&ex);
+        return;
+    }
+    vm->setResult(IntValue(fd));
+}
+
+static void ioConnect(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 1)
+    {
+        throw std::runtime_error("Expected exactly 1 argument for io::connect");
+    }
+    IOAddr a;
+    parseAddr(vm, "io::connect", a);
+    ZScheduler& s = *vm->scheduler;
+    SchedTask* w = s.waiter();
+    int fd = socket(a.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int rc = fd < 0 ? -1 : connect(fd, reinterpret_cast<sockaddr*>(&a.addr), a.len);
+    if(rc == 0)
+    {
+        vm->setResult(IntValue(fd));
+        return;
+    }
+    if(fd < 0 || (errno != EINPROGRESS && errno != EAGAIN))
+    {
+        int err = errno;
+        if(fd >= 0)
+        {
+            ::close(fd);
+        }
+        Value ex = ioErrorValue(vm, "io::connect", err);
+        vm->throwValue(&ex);
+        return;
+    }
+    s.waitIO(w, fd, sioConnect, 0, NilValue);
+    s.block();
+}
+
+static void ioPipe(ZorroVM* vm)
+{
+    int p[2];
+    if(pipe2(p, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        Value ex = ioErrorValue(vm, "io::pipe", errno);
+        vm->throwValue(&ex);
+        return;
+    }
+    Value rv;
+    rv.vt = vtArray;
+    rv.flags = 0;
+    ZArray* za = rv.arr = vm->allocZArray();
+    za->resize(2);
+    za->getItemRef(0) = IntValue(p[0]);
+    za->getItemRef(1) = IntValue(p[1]);
+    vm->setResult(rv);
+}
+
+static void ioClose(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 1)
+    {
+        throw std::runtime_error("Expected exactly 1 argument for io::close");
+    }
+    int fd = getFdArg(vm, 0, "io::close");
+    vm->scheduler->cancelIO(fd);
+    if(::close(fd) < 0)
+    {
+        Value ex = ioErrorValue(vm, "io::close", errno);
+        vm->throwValue(&ex);
+    }
+}
+
+/* For fds not created by io::, like stdin */
+static void ioNonBlock(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 1)
+    {
+        throw std::runtime_error("Expected exactly 1 argument for io::nonblock");
+    }
+    int fd = getFdArg(vm, 0, "io::nonblock");
+    int fl = fcntl(fd, F_GETFL);
+    if(fl < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0)
+    {
+        Value ex = ioErrorValue(vm, "io::nonblock", errno);
+        vm->throwValue(&ex);
+    }
+}
+
+/* Port of bound tcp socket, useful after listen on port 0 */
+static void ioPort(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 1)
+    {
+        throw std::runtime_error("Expected exactly 1 argument for io::port");
+    }
+    int fd = getFdArg(vm, 0, "io::port");
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0)
+    {
+        Value ex = ioErrorValue(vm, "io::port", errno);
+        vm->throwValue(&ex);
+        return;
+    }
+    int port = 0;
+    if(addr.ss_family == AF_INET)
+    {
+        port = ntohs(reinterpret_cast<sockaddr_in&>(addr).sin_port);
+    } else if(addr.ss_family == AF_INET6)
+    {
+        port = ntohs(reinterpret_cast<sockaddr_in6&>(addr).sin6_port);
+    }
+    vm->setResult(IntValue(port));
+}
+
+void ZorroVM::initIO()
+{
+    ZBuilder b(this);
+    b.enterNamespace("io");
+    b.registerCFunc("read", ioRead);
+    b.registerCFunc("write", ioWrite);
+    b.registerCFunc("accept", ioAccept);
+    b.registerCFunc("connect", ioConnect);
+    b.registerCFunc("listen", ioListen);
+    b.registerCFunc("pipe", ioPipe);
+    b.registerCFunc("close", ioClose);
+    b.registerCFunc("nonblock", ioNonBlock);
+    b.registerCFunc("port", ioPort);
+    b.leaveNamespace();
+}
+
+}
+
+#else
+
+namespace zorro {
+
+//no epoll, io:: is not available and nothing ever waits for fds
+
+void ZScheduler::waitIO(SchedTask*, int, SchedIOOp, size_t, const Value&)
+{
+}
+
+void ZScheduler::pollIO(int)
+{
+}
+
+void ZScheduler::cancelIO(int)
+{
+}
+
+void ZScheduler::clearIO()
+{
+}
+
+void ZorroVM::initIO()
+{
+}
+
+}
+
+#endif
@@ -2,6 +2,7 @@
 #include "ZorroVM.hpp"
 #include <stdexcept>
 #include <stdlib.h>
+#include <math.h>
 
 namespace zorro {
 
@@ -479,7 +480,7 @@ static void Match(ZorroVM* vm, OpMatch* op)
 }
 
 OpMatch::OpMatch(const OpArg& argLeft, const OpArg& argRight, const OpArg& argDst) :
-    OpBinOp(argLeft, argRight, argDst), vars(0)
+    OpBinOp(argLeft, argRight, argDst), vars(0), varsCount(0)
 {
     ot = otMatch;
     op = (OpFunc) Match;
@@ -1242,6 +1243,248 @@ JUMPIFBINOP(In);
 JUMPIFBINOP(Is);
 JUMPIFBINOP(Not);
 
+static inline bool isNumPair(const Value* l, const Value* r, bool isDouble)
+{
+    if(!isDouble)
+    {
+        return l->vt == vtInt && r->vt == vtInt;
+    }
+    return (l->vt == vtDouble || l->vt == vtInt) && (r->vt == vtDouble || r->vt == vtInt) &&
+           (l->vt == vtDouble || r->vt == vtDouble);
+}
+
+static inline double numAsDouble(const Value* v)
+{
+    return v->vt == vtInt ? static_cast<double>(v->iValue) : v->dValue;
+}
+
+template<OpType opType, bool isDouble, bool isLeftTemp, bool isRightTemp, bool isDstStack>
+static void numBinopFunc(ZorroVM* vm, OpBinOp* op)
+{
+    Value* l = GETARG(op->left);
+    Value* r = GETARG(op->right);
+    if(!isNumPair(l, r, isDouble) ||
+       ((opType == otDiv || opType == otMod) && (isDouble ? numAsDouble(r) == 0 : r->iValue == 0)))
+    {
+        //unexpected types or division by zero, generic version handles them
+        binopFunc<opType, isLeftTemp, isRightTemp, isDstStack>(vm, op);
+        return;
+    }
+    int64_t ires = 0;
+    double dres = 0;
+    if(isDouble)
+    {
+        double lv = numAsDouble(l);
+        double rv = numAsDouble(r);
+        switch(opType)
+        {
+            case otAdd:
+                dres = lv + rv;
+                break;
+            case otSub:
+                dres = lv - rv;
+                break;
+            case otMul:
+                dres = lv * rv;
+                break;
+            case otDiv:
+                dres = lv / rv;
+                break;
+            case otMod:
+                dres = fmod(lv, rv);
+                break;
+            default:
+                abort();
+                break;
+        }
+    } else
+    {
+        switch(opType)
+        {
+            case otAdd:
+                ires = l->iValue + r->iValue;
+                break;
+            case otSub:
+                ires = l->iValue - r->iValue;
+                break;
+            case otMul:
+                ires = l->iValue * r->iValue;
+                break;
+            case otDiv:
+                ires = l->iValue / r->iValue;
+                break;
+            case otMod:
+                ires = l->iValue % r->iValue;
+                break;
+            default:
+                abort();
+                break;
+        }
+    }
+    //operands are not reference counted, so only dst needs cleanup
+    Value* d = GETDST(isDstStack, op->dst);
+    if(!d)
+    {
+        return;
+    }
+    if(d->vt == vtRef)
+    {
+        d = &d->valueRef->value;
+    }
+    ZUNREF(vm, d);
+    d->flags = 0;
+    if(isDouble)
+    {
+        d->vt = vtDouble;
+        d->dValue = dres;
+    } else
+    {
+        d->vt = vtInt;
+        d->iValue = ires;
+    }
+}
+
+template<OpType ot, bool isDouble, bool leftTmp, bool rightTmp>
+static void numJumpIfBinOp(ZorroVM* vm, OpJumpIfBinOp* op)
+{
+    Value* l = GETARG(op->left);
+    Value* r = GETARG(op->right);
+    if(!isNumPair(l, r, isDouble))
+    {
+        JumpIfBinOp<ot, leftTmp, rightTmp>(vm, op);
+        return;
+    }
+    bool val;
+    if(isDouble)
+    {
+        double lv = numAsDouble(l);
+        double rv = numAsDouble(r);
+        switch(ot)
+        {
+            case otLess:
+                val = lv < rv;
+                break;
+            case otGreater:
+                val = lv > rv;
+                break;
+            case otLessEq:
+                val = lv <= rv;
+                break;
+            case otGreaterEq:
+                val = lv >= rv;
+                break;
+            case otEqual:
+                val = lv == rv;
+                break;
+            case otNotEqual:
+                val = lv != rv;
+                break;
+            default:
+                abort();
+                break;
+        }
+    } else
+    {
+        switch(ot)
+        {
+            case otLess:
+                val = l->iValue < r->iValue;
+                break;
+            case otGreater:
+                val = l->iValue > r->iValue;
+                break;
+            case otLessEq:
+                val = l->iValue <= r->iValue;
+                break;
+            case otGreaterEq:
+                val = l->iValue >= r->iValue;
+                break;
+            case otEqual:
+                val = l->iValue == r->iValue;
+                break;
+            case otNotEqual:
+                val = l->iValue != r->iValue;
+                break;
+            default:
+                abort();
+                break;
+        }
+    }
+    if(!val)
+    {
+        vm->ctx.nextOp = op->elseOp;
+    }
+}
+
+#define NUMBINOPFUNC(tl, tr, ds) (OpFunc)(void(*)(ZorroVM*,OpBinOp*))(&numBinopFunc<opType,isDouble,tl,tr,ds>)
+
+template<OpType opType, bool isDouble>
+static OpFunc getNumBinopFunc(const OpBinOp* op)
+{
+    bool tl = op->left.isTemporal;
+    bool tr = op->right.isTemporal;
+    if(op->dst.at == atStack)
+    {
+        if(tl)
+        {
+            return tr ? NUMBINOPFUNC(true, true, true) : NUMBINOPFUNC(true, false, true);
+        }
+        return tr ? NUMBINOPFUNC(false, true, true) : NUMBINOPFUNC(false, false, true);
+    }
+    if(tl)
+    {
+        return tr ? NUMBINOPFUNC(true, true, false) : NUMBINOPFUNC(true, false, false);
+    }
+    return tr ? NUMBINOPFUNC(false, true, false) : NUMBINOPFUNC(false, false, false);
+}
+
+#undef NUMBINOPFUNC
+
+#define NUMJUMPFUNC(tl, tr) (OpFunc)(void(*)(ZorroVM*,OpJumpIfBinOp*))(&numJumpIfBinOp<opType,isDouble,tl,tr>)
+
+template<OpType opType, bool isDouble>
+static OpFunc getNumJumpFunc(const OpJumpIfBinOp* op)
+{
+    if(op->left.isTemporal)
+    {
+        return op->right.isTemporal ? NUMJUMPFUNC(true, true) : NUMJUMPFUNC(true, false);
+    }
+    return op->right.isTemporal ? NUMJUMPFUNC(false, true) : NUMJUMPFUNC(false, false);
+}
+
+#undef NUMJUMPFUNC
+
+#define NUMBINOPCASE(name) case ot##name:\
+  op->op=isDouble?getNumBinopFunc<ot##name,true>((OpBinOp*)op):getNumBinopFunc<ot##name,false>((OpBinOp*)op);\
+  break
+#define NUMJUMPCASE(name) case otJumpIf##name:\
+  op->op=isDouble?getNumJumpFunc<ot##name,true>((OpJumpIfBinOp*)op):getNumJumpFunc<ot##name,false>((OpJumpIfBinOp*)op);\
+  break
+
+bool specializeNumOp(OpBase* op, bool isDouble)
+{
+    switch(op->ot)
+    {
+        NUMBINOPCASE(Add);
+        NUMBINOPCASE(Sub);
+        NUMBINOPCASE(Mul);
+        NUMBINOPCASE(Div);
+        NUMBINOPCASE(Mod);
+        NUMJUMPCASE(Less);
+        NUMJUMPCASE(Greater);
+        NUMJUMPCASE(LessEq);
+        NUMJUMPCASE(GreaterEq);
+        NUMJUMPCASE(Equal);
+        NUMJUMPCASE(NotEqual);
+        default:
+            return false;
+    }
+    return true;
+}
+
+#undef NUMBINOPCASE
+#undef NUMJUMPCASE
+
 template<bool refReturn, bool noReturn>
 static void Return(ZorroVM* vm, OpReturn* op)
 {
@@ -1906,7 +2149,7 @@ static void FinalDestroy(ZorroVM* vm, OpFinalDestroy* /*op*/)
         {
             vm->freeVArray(zo.members, zo.classInfo->membersCount);
         }
-        if(zo.classInfo->unref())
+        if(zo.classInfo->unrefInstance())
         {
             delete zo.classInfo;
         }
@@ -1998,16 +2241,21 @@ static void MakeClosure(ZorroVM* vm, OpMakeClosure* op)
     }
     memset(val->closedValues, 0, sizeof(Value) * op->closedCount);
     Value* dstVal = val->closedValues;
-    for(OpArg* ptr = op->closedVars, * end = op->closedVars + op->closedCount; ptr != end; ++ptr, ++dstVal)
+    for(index_type i = 0; i < op->closedCount; ++i, ++dstVal)
     {
+        OpArg* ptr = op->closedVars + i;
+        Value* srcVal = GETARG(*ptr);
+        //already boxed var is shared even if it is never written
+        if(op->isByValue(i) && srcVal->vt != vtRef)
+        {
+            ZASSIGN(vm, dstVal, srcVal);
+            continue;
+        }
         Value var;
         var.vt = vtLvalue;
         var.atLvalue = ptr->at;
         var.idx = ptr->idx;
         vm->refOps[vtLvalue](vm, &var, dstVal);
-
-        //Value* srcVal=GETARG(*ptr);
-        //ZASSIGN(vm,dstVal,srcVal);
     }
     Value res;
     res.vt = vtClosure;
@@ -2018,7 +2266,8 @@ static void MakeClosure(ZorroVM* vm, OpMakeClosure* op)
 
 OpMakeClosure::OpMakeClosure(OpArg argSrc, OpArg argDst, OpArg argSelf, index_type argClosedCount,
                              OpArg* argClosedVars) : OpDstBase(argDst),
-    src(argSrc), self(argSelf), closedVars(argClosedVars), closedCount(argClosedCount)
+    src(argSrc), self(argSelf), closedVars(argClosedVars), closedCount(argClosedCount),
+    ownClosedVars(false), byValue(0)
 {
     ot = otMakeClosure;
     op = (OpFunc) MakeClosure;
@@ -2284,10 +2533,10 @@ static void Combine(ZorroVM* vm, OpCombine* op)
     {
         return;
     }
+    size_t size = 0;
     size_t len = 0;
     OpArg* arr = op->args;
     OpArg* end = arr + op->count;
-    bool hasUnicode = false;
     for(; arr != end; ++arr)
     {
         Value* val = GETARG(*arr);
@@ -2295,14 +2544,11 @@ static void Combine(ZorroVM* vm, OpCombine* op)
         {
             val = &val->valueRef->value;
         }
+        size += val->str->getDataSize();
         len += val->str->getLength();
-        if(val->str->getCharSize() == 2)
-        {
-            hasUnicode = true;
-        }
     }
     ZString* str = vm->allocZString();
-    char* strBuf = vm->allocStr(hasUnicode ? len * 2 : len + 1);
+    char* strBuf = vm->allocStr(size + 1);
     char* ptr = strBuf;
     arr = op->args;
     for(; arr != end; ++arr)
@@ -2313,21 +2559,15 @@ static void Combine(ZorroVM* vm, OpCombine* op)
             val = &val->valueRef->value;
         }
         ZString* s = val->str;
-        if(hasUnicode)
-        {
-            s->uappend(ptr);
-        } else
-        {
-            memcpy(ptr, s->getDataPtr(), s->getLength());
-            ptr += s->getLength();
-        }
+        memcpy(ptr, s->getDataPtr(), s->getDataSize());
+        ptr += s->getDataSize();
         if(arr->isTemporal)
         {
             ZUNREF(vm, val);
         }
     }
     *ptr = 0;
-    str->init(strBuf, hasUnicode ? len * 2 : len, hasUnicode);
+    str->init(strBuf, static_cast<uint32_t>(size), static_cast<uint32_t>(len));
     Value res;
     res.vt = vtString;
     res.flags = 0;
@@ -32,6 +32,11 @@ struct OpDstBase : OpBase {
     OpDstBase(const OpArg& argDst) : dst(argDst)
     {
     }
+
+    void getDsts(ArgsVector& args)
+    {
+        args.push_back(&dst);
+    }
 };
 
 struct OpBinOp : OpDstBase {
@@ -52,6 +57,24 @@ struct OpBinOp : OpDstBase {
 
     }
 
+    void getDsts(ArgsVector& args)
+    {
+        switch(ot)
+        {
+            case otAssign:
+            case otSAdd:
+            case otSSub:
+            case otSMul:
+            case otSDiv:
+            case otSMod:
+                args.push_back(&left);
+                break;
+            default:
+                break;
+        }
+        args.push_back(&dst);
+    }
+
     virtual ~OpBinOp()
     {
     }
@@ -162,7 +185,9 @@ struct OpGetPropOpt : OpBinOp {
 };
 
 struct OpMatch : OpBinOp {
+    //variables assigned from named groups
     OpArg* vars;
+    index_type varsCount;
 
     OpMatch(const OpArg& argLeft, const OpArg& argRight, const OpArg& argDst);
 
@@ -173,6 +198,15 @@ struct OpMatch : OpBinOp {
             delete[]vars;
         }
     }
+
+    void getDsts(ArgsVector& args)
+    {
+        OpBinOp::getDsts(args);
+        for(index_type i = 0; i < varsCount; ++i)
+        {
+            args.push_back(vars + i);
+        }
+    }
 };
 
 struct OpUnOp : OpDstBase {
@@ -191,6 +225,25 @@ struct OpUnOp : OpDstBase {
         args.push_back(&src);
     }
 
+    void getDsts(ArgsVector& args)
+    {
+        switch(ot)
+        {
+            case otPreInc:
+            case otPostInc:
+            case otPreDec:
+            case otPostDec:
+            //lvalue becomes a ref
+            case otMakeRef:
+            case otMakeWeakRef:
+                args.push_back(&src);
+                break;
+            default:
+                break;
+        }
+        args.push_back(&dst);
+    }
+
     void dump(std::string& out)
     {
         out = getOpName(ot);
@@ -359,6 +412,11 @@ struct OpMakeRange : OpBase {
         args.push_back(&step);
     }
 
+    void getDsts(ArgsVector& args)
+    {
+        args.push_back(&dst);
+    }
+
     void dump(std::string& out)
     {
         out = "makerange:";
@@ -591,6 +649,11 @@ struct OpCallMethod : OpDstBase {
     {
     }
 
+    void getArgs(ArgsVector& argsv)
+    {
+        argsv.push_back(&self);
+    }
+
     void dump(std::string& out)
     {
         char buf[256];
@@ -620,6 +683,11 @@ struct OpReturn : OpBase {
     {
     }
 
+    void getArgs(ArgsVector& args)
+    {
+        args.push_back(&result);
+    }
+
     void dump(std::string& out)
     {
         out = "return " + result.toStr();
@@ -642,6 +710,12 @@ struct OpForInit : OpDstBase {
         args.push_back(&target);
     }
 
+    void getDsts(ArgsVector& args)
+    {
+        args.push_back(&dst);
+        args.push_back(&temp);
+    }
+
     virtual void getBranches(OpsVector& branches)
     {
         branches.push_back(endOp);
@@ -667,6 +741,12 @@ struct OpForInit2 : OpForInit {
     {
     }
 
+    void getDsts(ArgsVector& args)
+    {
+        OpForInit::getDsts(args);
+        args.push_back(&var2);
+    }
+
     void dump(std::string& out)
     {
         out = "init for ";
@@ -684,6 +764,11 @@ struct OpForCheckCoroutine : OpBase {
 
     OpForCheckCoroutine(OpArg argTemp);
 
+    void getArgs(ArgsVector& args)
+    {
+        args.push_back(&temp);
+    }
+
     virtual void getBranches(OpsVector& branches)
     {
         branches.push_back(endOp);
@@ -706,6 +791,17 @@ struct OpForStep : OpBase {
     {
     }
 
+    void getArgs(ArgsVector& args)
+    {
+        args.push_back(&temp);
+    }
+
+    void getDsts(ArgsVector& args)
+    {
+        args.push_back(&var);
+        args.push_back(&temp);
+    }
+
     virtual void getBranches(OpsVector& branches)
     {
         branches.push_back(endOp);
@@ -730,6 +826,12 @@ struct OpForStep2 : OpForStep {
     {
     }
 
+    void getDsts(ArgsVector& args)
+    {
+        OpForStep::getDsts(args);
+        args.push_back(&var2);
+    }
+
     void dump(std::string& out)
     {
         out = "for ";
@@ -813,14 +915,35 @@ struct OpThrow : OpBase {
 struct OpMakeClosure : OpDstBase {
     OpArg src;
     OpArg self;
+    //points to scope storage when generated from source, owned when loaded from module
     OpArg* closedVars;
     index_type closedCount;
+    bool ownClosedVars;
+    //bit per closed var that is copied instead of boxed, vars past 64th are always boxed
+    uint64_t byValue;
 
     OpMakeClosure(OpArg argSrc, OpArg argDst, OpArg argSelf, index_type argClosedCount, OpArg* argClosedVars);
 
+    ~OpMakeClosure()
+    {
+        if(ownClosedVars)
+        {
+            delete[] closedVars;
+        }
+    }
+
+    bool isByValue(index_type i) const
+    {
+        return i < 64 && (byValue & (uint64_t(1) << i));
+    }
+
     void getArgs(ArgsVector& args)
     {
         args.push_back(&src);
+        for(index_type i = 0; i < closedCount; ++i)
+        {
+            args.push_back(closedVars + i);
+        }
     }
 
     void dump(std::string& out)
@@ -853,6 +976,11 @@ struct OpYield : OpBase {
 
     OpYield();
 
+    void getArgs(ArgsVector& args)
+    {
+        args.push_back(&result);
+    }
+
     void dump(std::string& out)
     {
         out = FORMAT("yield %{}", result.toStr());
@@ -1003,6 +1131,11 @@ struct OpCombine : OpBase {
         out += " -> ";
         out += dst.toStr();
     }
+
+    void getDsts(ArgsVector& argsv)
+    {
+        argsv.push_back(&dst);
+    }
 };
 
 struct OpGetAttr : OpDstBase {
@@ -1010,6 +1143,13 @@ struct OpGetAttr : OpDstBase {
 
     OpGetAttr(OpArg argObj, OpArg argMem, OpArg argAtt, OpArg argDst);
 
+    void getArgs(ArgsVector& args)
+    {
+        args.push_back(&obj);
+        args.push_back(&mem);
+        args.push_back(&att);
+    }
+
     void dump(std::string& out)
     {
         out = "getattr ";
@@ -1023,6 +1163,14 @@ struct OpGetAttr : OpDstBase {
     }
 };
 
+/*
+  Replaces implementation of arithmetic op or comparison jump with one that
+  computes int (or double, if isDouble) operands inline and falls back to
+  generic matrix dispatch for any other operand types.
+  Returns false if op is not one of the supported kinds.
+*/
+bool specializeNumOp(OpBase* op, bool isDouble);
+
 }
 
 #endif
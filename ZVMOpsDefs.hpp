@@ -196,10 +196,16 @@ struct OpBase {
 
     virtual void dump(std::string& out) = 0;
 
+    /* args read by op */
     virtual void getArgs(ArgsVector&)
     {
     }
 
+    /* args written by op, some of them can also be returned by getArgs */
+    virtual void getDsts(ArgsVector&)
+    {
+    }
+
     virtual void getBranches(OpsVector&)
     {
     }
@@ -0,0 +1,482 @@
+#include "ZorroVM.hpp"
+#include "ZVMOps.hpp"
+#include "ZBuilder.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace zorro {
+
+/*
+  par:: namespace, map and grep of arrays with pure function on pool of worker threads.
+  Each worker runs its own instance of shared code, pool is created by the first call and kept by calling vm.
+  Caller waits while workers take chunks of input, so they can read its heap without copying it up front.
+  Scalars are transferred as is, strings, containers and objects are copied into memory of vm that uses them,
+  since refcounts and memory pools are per vm.
+  Function sees constants, functions and classes of the caller and scalar globals at the moment of call,
+  other globals are nil in workers and changes made by function are not seen by the caller.
+*/
+
+struct ParJob {
+    const ZArray* src;
+    size_t count;
+    size_t chunk;
+    Value func;
+    bool grep;
+    const Value* globals;  // of calling vm
+    std::atomic<size_t> next;
+    std::atomic<bool> failed;
+    std::vector<Value> out;  // map results, owned by workers that made them
+    std::vector<char> keep;  // grep results
+    std::mutex errorMtx;
+    //first failure, either exception thrown by function or error of native code
+    Value exception;
+    ZorroVM* exceptionOwner;
+    std::string error;
+
+    ParJob() : src(nullptr), count(0), chunk(0), func(NilValue), grep(false), globals(nullptr), next(0), failed(false),
+        exception(NilValue), exceptionOwner(nullptr)
+    {
+    }
+};
+
+/*
+  Catch handler of exceptions not caught by function, stops the worker.
+*/
+struct OpParCaught : OpBase {
+    bool caught;
+
+    OpParCaught();
+
+    void dump(std::string& out)
+    {
+        out = "par caught";
+    }
+};
+
+static void ParCaught(ZorroVM* vm, OpParCaught* op)
+{
+    op->caught = true;
+    vm->ctx.nextOp = nullptr;
+}
+
+OpParCaught::OpParCaught() : caught(false)
+{
+    ot = otEndCoroutine;
+    op = (OpFunc) ParCaught;
+}
+
+struct ParWorker {
+    ZorroVM* vm;
+    std::thread thread;
+    size_t base;          // stack index of called function
+    OpCall call;
+    OpParCaught caught;
+    std::vector<size_t> chunks;  // starts of chunks processed in current job
+
+    ParWorker(ZorroVM* argVm, size_t argBase) :
+        vm(argVm), base(argBase), call(1, OpArg(atLocal, argBase), OpArg(atLocal, argBase + 1))
+    {
+    }
+};
+
+struct ZParPool {
+    ZorroVM* vm;
+    std::vector<ParWorker*> workers;
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    uint64_t jobSeq;
+    size_t busy;
+    bool stop;
+    ParJob* job;
+
+    explicit ZParPool(ZorroVM* argVm) : vm(argVm), jobSeq(0), busy(0), stop(false), job(nullptr)
+    {
+    }
+};
+
+static const size_t parMaxWorkers = 32;
+//smaller chunks are not worth fetching, larger ones balance worse
+static const size_t parMinChunk = 64;
+static const size_t parChunksPerWorker = 4;
+
+static bool parIsTrue(ZorroVM* vm, const Value& v)
+{
+    if(v.vt == vtObject)
+    {
+        if(v.obj->classInfo->specialMethods[csmBoolCheck])
+        {
+            ZTHROWR(RuntimeException, vm, "Object with boolCheck method cannot be checked by par::grep");
+        }
+        return true;
+    }
+    return vm->boolOps[v.vt](vm, &v);
+}
+
+static bool parIsConstant(ZorroVM* vm, size_t idx)
+{
+    auto& info = vm->symbols.info;
+    return idx < info.size() && info[idx] && info[idx]->st == sytConstant;
+}
+
+/*
+  Globals that are not constants get scalar values of caller, so workers don't keep anything from previous job.
+*/
+static void parSyncGlobals(ZorroVM* vm, const Value* src)
+{
+    Value* dst = vm->symbols.globals;
+    for(size_t i = 0; i < vm->symbols.globalsCount; ++i)
+    {
+        if(parIsConstant(vm, i))
+        {
+            continue;
+        }
+        vm->unref(dst[i]);
+        dst[i] = ZISREFTYPE(&src[i]) ? NilValue : src[i];
+    }
+}
+
+static void parFail(ParJob& job, ZorroVM* vm, const Value& ex, const char* error)
+{
+    std::lock_guard<std::mutex> lock(job.errorMtx);
+    if(job.failed.load())
+    {
+        return;
+    }
+    if(ex.vt != vtNil)
+    {
+        vm->assign(job.exception, ex);
+        job.exceptionOwner = vm;
+    } else
+    {
+        job.error = error;
+    }
+    job.failed = true;
+}
+
+/*
+  Stack of worker holds function, its result, slot of caught exception and argument.
+  Exceptions not caught by function are caught by handler of the job.
+*/
+static void parRunJob(ParWorker& w, ParJob& job)
+{
+    ZorroVM* vm = w.vm;
+    ZVMContext& ctx = vm->ctx;
+    w.chunks.clear();
+    parSyncGlobals(vm, job.globals);
+    vm->running = true;
+    try
+    {
+        vm->pushValue(job.func);
+        vm->pushValue(NilValue);
+        vm->pushValue(NilValue);
+        w.caught.caught = false;
+        ctx.catchStack.push(CatchInfo(nullptr, 0, w.base + 2, w.base + 3, ctx.callStack.size(), &w.caught));
+        for(;;)
+        {
+            size_t from = job.next.fetch_add(job.chunk);
+            if(from >= job.count || job.failed.load())
+            {
+                break;
+            }
+            size_t till = std::min(from + job.chunk, job.count);
+            w.chunks.push_back(from);
+            for(size_t i = from; i < till; ++i)
+            {
+                ctx.dataStack.push(vm->importValue(job.src->getItem(i)));
+                ctx.nextOp = &w.call;
+                vm->resume();
+                if(w.caught.caught)
+                {
+                    parFail(job, vm, ctx.dataStack.stack[w.base + 2], nullptr);
+                    break;
+                }
+                Value& rv = ctx.dataStack.stack[w.base + 1];
+                if(job.grep)
+                {
+                    job.keep[i] = parIsTrue(vm, rv);
+                    vm->unref(rv);
+                    rv = NilValue;
+                } else
+                {
+                    //reference moves to output
+                    job.out[i] = rv;
+                    rv = NilValue;
+                }
+            }
+            if(w.caught.caught)
+            {
+                break;
+            }
+        }
+        if(!w.caught.caught)
+        {
+            ctx.catchStack.pop();
+        }
+        vm->cleanStack(w.base);
+    } catch(std::exception& e)
+    {
+        parFail(job, vm, NilValue, e.what());
+        vm->reset();
+    }
+    vm->running = false;
+}
+
+static void parWorkerLoop(ZParPool* pool, ParWorker* w)
+{
+    std::unique_lock<std::mutex> lock(pool->mtx);
+    uint64_t seen = 0;
+    for(;;)
+    {
+        pool->wake.wait(lock, [&] { return pool->stop || pool->jobSeq != seen; });
+        if(pool->stop)
+        {
+            return;
+        }
+        seen = pool->jobSeq;
+        ParJob* job = pool->job;
+        lock.unlock();
+        parRunJob(*w, *job);
+        lock.lock();
+        if(--pool->busy == 0)
+        {
+            pool->idle.notify_one();
+        }
+    }
+}
+
+static ZParPool* parGetPool(ZorroVM* vm)
+{
+    if(vm->parPool)
+    {
+        return vm->parPool;
+    }
+    ZorroVM* prog = vm->program ? vm->program : vm;
+    prog->shareCode();
+    size_t count = std::thread::hardware_concurrency();
+    count = std::min(std::max(count, size_t(2)), parMaxWorkers);
+    ZParPool* pool = new ZParPool(vm);
+    vm->parPool = pool;
+    for(size_t i = 0; i < count; ++i)
+    {
+        auto* wvm = new ZorroVM(prog, false);
+        //constants are copied once, the rest is synced on every job
+        const Value* src = vm->symbols.globals;
+        for(size_t g = 0; g < wvm->symbols.globalsCount; ++g)
+        {
+            if(parIsConstant(wvm, g))
+            {
+                wvm->symbols.globals[g] = wvm->importValue(src[g]);
+            }
+        }
+        wvm->init();
+        wvm->markResetPoint();
+        wvm->parPool = pool;
+        pool->workers.push_back(new ParWorker(wvm, wvm->ctx.dataStack.size()));
+    }
+    for(ParWorker* w : pool->workers)
+    {
+        w->thread = std::thread(parWorkerLoop, pool, w);
+    }
+    return pool;
+}
+
+void ZorroVM::clearPar()
+{
+    if(!parPool || parPool->vm != this)
+    {
+        return;
+    }
+    ZParPool* pool = parPool;
+    {
+        std::lock_guard<std::mutex> lock(pool->mtx);
+        pool->stop = true;
+    }
+    pool->wake.notify_all();
+    for(ParWorker* w : pool->workers)
+    {
+        w->thread.join();
+        w->vm->deinit();
+        delete w->vm;
+        delete w;
+    }
+    delete pool;
+    parPool = nullptr;
+}
+
+/*
+  Exception of function is rethrown in caller, errors of native code are thrown as strings.
+*/
+static void parRaise(ZorroVM* vm, ParJob& job, const char* name)
+{
+    Value ex = NilValue;
+    std::string error = job.error;
+    if(job.exceptionOwner)
+    {
+        try
+        {
+            ex = vm->importValue(job.exception);
+        } catch(std::exception& e)
+        {
+            error = e.what();
+        }
+        job.exceptionOwner->unref(job.exception);
+        job.exception = NilValue;
+    }
+    if(ex.vt == vtNil)
+    {
+        //stack trace of worker is not useful to the caller
+        error = error.substr(0, error.find(" at\n"));
+        error = FORMAT("%{}: %{}", name, error);
+        ex = StringValue(vm->allocZString(error.c_str(), static_cast<uint32_t>(error.length())));
+        ex.str->ref();
+    }
+    vm->throwValue(&ex);
+    vm->unref(ex);
+}
+
+static void parRun(ZorroVM* vm, bool grep)
+{
+    const char* name = grep ? "par::grep" : "par::map";
+    if(vm->getArgsCount() != 2)
+    {
+        throw std::runtime_error(FORMAT("Expected exactly 2 arguments for %{}", name));
+    }
+    Value& src = vm->getLocalValue(0);
+    Value& func = vm->getLocalValue(1);
+    if(src.vt != vtArray)
+    {
+        ZTHROWR(TypeException, vm, "Expected array as first argument of %{}", name);
+    }
+    if(func.vt != vtFunc)
+    {
+        ZTHROWR(TypeException, vm, "Expected function as second argument of %{}", name);
+    }
+    if(vm->parPool && vm->parPool->vm != vm)
+    {
+        ZTHROWR(RuntimeException, vm, "%{} cannot be called from worker", name);
+    }
+    size_t count = src.arr->getCount();
+    Value rv;
+    rv.vt = vtArray;
+    rv.flags = 0;
+    if(!count)
+    {
+        rv.arr = vm->allocZArray();
+        vm->setResult(rv);
+        return;
+    }
+    ZParPool* pool = parGetPool(vm);
+    ParJob job;
+    job.src = src.arr;
+    job.count = count;
+    job.chunk = std::max(count / (pool->workers.size() * parChunksPerWorker), parMinChunk);
+    job.func = func;
+    job.grep = grep;
+    job.globals = vm->symbols.globals;
+    if(grep)
+    {
+        job.keep.resize(count);
+    } else
+    {
+        job.out.resize(count, NilValue);
+    }
+    {
+        std::unique_lock<std::mutex> lock(pool->mtx);
+        pool->job = &job;
+        pool->busy = pool->workers.size();
+        ++pool->jobSeq;
+        pool->wake.notify_all();
+        pool->idle.wait(lock, [pool] { return pool->busy == 0; });
+        pool->job = nullptr;
+    }
+    bool simple = true;
+    if(!grep)
+    {
+        //workers are idle, values they made are copied and released from here
+        for(ParWorker* w : pool->workers)
+        {
+            for(size_t from : w->chunks)
+            {
+                for(size_t i = from, till = std::min(from + job.chunk, count); i < till; ++i)
+                {
+                    Value& v = job.out[i];
+                    if(!ZISREFTYPE(&v))
+                    {
+                        continue;
+                    }
+                    Value copy = NilValue;
+                    if(!job.failed.load())
+                    {
+                        try
+                        {
+                            copy = vm->importValue(v);
+                        } catch(std::exception& e)
+                        {
+                            job.error = e.what();
+                            job.failed = true;
+                        }
+                    }
+                    w->vm->unref(v);
+                    v = copy;
+                    simple = false;
+                }
+            }
+        }
+    }
+    if(job.failed.load())
+    {
+        for(auto& v : job.out)
+        {
+            vm->unref(v);
+        }
+        parRaise(vm, job, name);
+        return;
+    }
+    ZArray* za = rv.arr = vm->allocZArray();
+    if(grep)
+    {
+        for(size_t i = 0; i < count; ++i)
+        {
+            if(job.keep[i])
+            {
+                za->pushAndRef(src.arr->getItem(i));
+            }
+        }
+    } else
+    {
+        za->resize(count);
+        for(size_t i = 0; i < count; ++i)
+        {
+            za->getItemRef(i) = job.out[i];
+        }
+        za->isSimpleContent = simple;
+    }
+    vm->setResult(rv);
+}
+
+static void parMap(ZorroVM* vm)
+{
+    parRun(vm, false);
+}
+
+static void parGrep(ZorroVM* vm)
+{
+    parRun(vm, true);
+}
+
+void ZorroVM::initPar()
+{
+    ZBuilder b(this);
+    b.enterNamespace("par");
+    b.registerCFunc("map", parMap);
+    b.registerCFunc("grep", parGrep);
+    b.leaveNamespace();
+}
+
+}
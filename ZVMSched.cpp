@@ -0,0 +1,506 @@
+#include "ZVMSched.hpp"
+#include "ZBuilder.hpp"
+
+#include <algorithm>
+
+namespace zorro {
+
+ZScheduler::ZScheduler(ZorroVM* argVm) :
+    vm(argVm), taskClass(nullptr), channelClass(nullptr), timerSeq(0), current(nullptr), caught(false),
+    taskCallOp(0, OpArg(), OpArg(atStack)), epollFd(-1), ioWaiters(0), sinceIOPoll(0)
+{
+}
+
+SchedTask* ZScheduler::waiter()
+{
+    if(!current)
+    {
+        return &root;
+    }
+    if(vm->ctx.coroutine != current->cor.cor)
+    {
+        ZTHROWR(RuntimeException, vm, "Task cannot block inside of nested coroutine");
+    }
+    return current;
+}
+
+/*
+  Suspends current task until it is woken.
+  Task leaves native call unfinished, it is completed by resumeTask.
+  Outside of tasks runs other tasks until root is woken and sets result of native call.
+*/
+void ZScheduler::block()
+{
+    if(current)
+    {
+        current->blocked = true;
+        current->cor.cor->ctx.swap(vm->ctx);
+        return;
+    }
+    root.ready = false;
+    if(!drive([this] { return root.ready; }))
+    {
+        deadlock();
+        return;
+    }
+    root.chanQueue = nullptr;
+    Value val = root.transfer;
+    root.transfer = NilValue;
+    if(root.raise)
+    {
+        root.raise = false;
+        vm->throwValue(&val);
+    } else
+    {
+        vm->setResult(val);
+    }
+    vm->unref(val);
+}
+
+void ZScheduler::deadlock()
+{
+    if(root.chanQueue)
+    {
+        auto& q = *root.chanQueue;
+        q.erase(std::remove(q.begin(), q.end(), &root), q.end());
+        root.chanQueue = nullptr;
+    }
+    for(auto t : live)
+    {
+        t->joiners.erase(std::remove(t->joiners.begin(), t->joiners.end(), &root), t->joiners.end());
+    }
+    //value of unfinished send
+    vm->unref(root.transfer);
+    root.transfer = NilValue;
+    Value ex = StringValue(vm->allocZString("Deadlock, all tasks are blocked"));
+    vm->throwValue(&ex);
+}
+
+void ZScheduler::fireTimers()
+{
+    SchedClock::time_point now = SchedClock::now();
+    while(!timers.empty() && timers.top().when <= now)
+    {
+        SchedTask* t = timers.top().task;
+        timers.pop();
+        wake(t, NilValue, false);
+    }
+}
+
+int ZScheduler::msUntil(SchedClock::time_point when)
+{
+    SchedClock::duration d = when - SchedClock::now();
+    if(d <= SchedClock::duration::zero())
+    {
+        return 0;
+    }
+    //round up, waking before deadline would spin until it is reached
+    return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(d).count());
+}
+
+/*
+  Runs task until it blocks, yields or ends.
+  Catch handler pushed before the switch receives exceptions not caught by the task.
+*/
+void ZScheduler::resumeTask(SchedTask* t)
+{
+    ZVMContext& ctx = vm->ctx;
+    OpBase* saveNext = ctx.nextOp;
+    OpBase* saveLast = ctx.lastOp;
+    size_t localOff = ctx.dataPtrs[atLocal] - ctx.dataStack.stack;
+    Value* saveMember = ctx.dataPtrs[atMember];
+    Value* saveClosed = ctx.dataPtrs[atClosed];
+    index_type slot = ctx.dataStack.size();
+    vm->pushData();
+    ctx.catchStack.push(CatchInfo(nullptr, 0, slot - ctx.callStack.stackTop->localBase, slot + 1,
+                                  ctx.callStack.size(), &taskFailedOp));
+    Coroutine* cor = t->cor.cor;
+    cor->result = OpArg(atStack);
+    current = t;
+    caught = false;
+    ctx.nextOp = nullptr;
+    ctx.swap(cor->ctx);
+    if(t->blocked)
+    {
+        t->blocked = false;
+        Value val = t->transfer;
+        t->transfer = NilValue;
+        if(t->raise)
+        {
+            t->raise = false;
+            vm->throwValue(&val);
+            vm->resume();
+        } else
+        {
+            vm->returnAndResume(ctx.nextOp, val);
+        }
+        vm->unref(val);
+    } else
+    {
+        vm->resume();
+    }
+    current = nullptr;
+    if(caught)
+    {
+        vm->assign(t->result, ctx.dataStack.stack[slot]);
+        t->failed = true;
+        t->done = true;
+    } else
+    {
+        ctx.catchStack.pop();
+        if(!t->done && !t->blocked)
+        {
+            runQueue.push_back(t);
+        }
+    }
+    vm->cleanStack(slot);
+    ctx.nextOp = saveNext;
+    ctx.lastOp = saveLast;
+    ctx.dataPtrs[atLocal] = ctx.dataStack.stack + localOff;
+    ctx.dataPtrs[atMember] = saveMember;
+    ctx.dataPtrs[atClosed] = saveClosed;
+    if(t->done)
+    {
+        finishTask(t);
+    }
+}
+
+void ZScheduler::finishTask(SchedTask* t)
+{
+    live.erase(t);
+    vm->unref(t->cor);
+    for(auto j : t->joiners)
+    {
+        wake(j, t->result, t->failed);
+    }
+    t->joiners.clear();
+    releaseSelf(t);
+}
+
+/* Drops scheduler reference to task object, task can be deleted */
+void ZScheduler::releaseSelf(SchedTask* t)
+{
+    Value self = t->self;
+    t->self = NilValue;
+    vm->unref(self);
+}
+
+void ZScheduler::clear()
+{
+    std::vector<SchedTask*> tasks(live.begin(), live.end());
+    live.clear();
+    runQueue.clear();
+    timers = decltype(timers)();
+    clearIO();
+    for(auto t : tasks)
+    {
+        t->joiners.clear();
+        vm->unref(t->cor);
+        vm->unref(t->transfer);
+    }
+    for(auto t : tasks)
+    {
+        releaseSelf(t);
+    }
+    vm->unref(root.transfer);
+    root = SchedTask();
+    current = nullptr;
+    caught = false;
+}
+
+static void EndTask(ZorroVM* vm, OpBase*)
+{
+    SchedTask* t = vm->scheduler->current;
+    vm->assign(t->result, *vm->ctx.dataStack.stackTop);
+    t->done = true;
+    vm->corRetOp->op(vm, vm->corRetOp);
+}
+
+OpEndTask::OpEndTask()
+{
+    ot = otEndCoroutine;
+    op = (OpFunc) EndTask;
+}
+
+static void TaskFailed(ZorroVM* vm, OpBase*)
+{
+    vm->scheduler->caught = true;
+    vm->ctx.nextOp = nullptr;
+}
+
+OpTaskFailed::OpTaskFailed()
+{
+    ot = otEndCoroutine;
+    op = (OpFunc) TaskFailed;
+}
+
+static SchedTask& getTaskArg(ZorroVM* vm, int idx, const char* func)
+{
+    Value& v = vm->getLocalValue(idx);
+    if(v.vt != vtNativeObject || v.nobj->classInfo != vm->scheduler->taskClass)
+    {
+        ZTHROWR(RuntimeException, vm, "Expected task as argument %{} of %{}", idx + 1, func);
+    }
+    return v.nobj->as<SchedTask>();
+}
+
+static SchedChannel& getChannelArg(ZorroVM* vm, const char* func)
+{
+    Value& v = vm->getLocalValue(0);
+    if(v.vt != vtNativeObject || v.nobj->classInfo != vm->scheduler->channelClass)
+    {
+        ZTHROWR(RuntimeException, vm, "Expected channel as first argument of %{}", func);
+    }
+    return v.nobj->as<SchedChannel>();
+}
+
+static void schedSpawn(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 1)
+    {
+        throw std::runtime_error("Expected exactly 1 argument for sched::spawn");
+    }
+    Value& f = vm->getLocalValue(0);
+    if(f.vt != vtFunc && f.vt != vtClosure && f.vt != vtDelegate)
+    {
+        throw std::runtime_error("Expected function, closure or delegate as argument for sched::spawn");
+    }
+    ZScheduler& s = *vm->scheduler;
+    SchedTask* t = new SchedTask;
+    vm->corOps[f.vt](vm, &f, &t->cor);
+    CallFrame* cf = t->cor.cor->ctx.callStack.stackTop;
+    cf->callerOp = &s.taskCallOp;
+    cf->retOp = &s.taskEndOp;
+    s.taskClass->refInstance();
+    vm->assign(t->self, NObjValue(vm, s.taskClass, t));
+    s.live.insert(t);
+    s.runQueue.push_back(t);
+    vm->setResult(t->self);
+}
+
+static void schedJoin(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 1)
+    {
+        throw std::runtime_error("Expected exactly 1 argument for sched::join");
+    }
+    ZScheduler& s = *vm->scheduler;
+    SchedTask& t = getTaskArg(vm, 0, "sched::join");
+    SchedTask* w = s.waiter();
+    if(t.done)
+    {
+        if(t.failed)
+        {
+            Value ex = t.result;
+            vm->throwValue(&ex);
+        } else
+        {
+            vm->setResult(t.result);
+        }
+        return;
+    }
+    if(w == &t)
+    {
+        ZTHROWR(RuntimeException, vm, "Task cannot join itself");
+    }
+    t.joiners.push_back(w);
+    s.block();
+}
+
+static void schedSleep(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 1)
+    {
+        throw std::runtime_error("Expected exactly 1 argument for sched::sleep");
+    }
+    Value& ms = vm->getLocalValue(0);
+    if(ms.vt != vtInt && ms.vt != vtDouble)
+    {
+        throw std::runtime_error("Expected number of milliseconds as argument for sched::sleep");
+    }
+    ZScheduler& s = *vm->scheduler;
+    SchedTask* w = s.waiter();
+    std::chrono::duration<double, std::milli> d(ms.vt == vtInt ? static_cast<double>(ms.iValue) : ms.dValue);
+    SchedTimer tm;
+    tm.when = SchedClock::now() + std::chrono::duration_cast<SchedClock::duration>(d);
+    tm.seq = s.timerSeq++;
+    tm.task = w;
+    s.timers.push(tm);
+    s.block();
+}
+
+static void schedRun(ZorroVM* vm)
+{
+    ZScheduler& s = *vm->scheduler;
+    if(s.current)
+    {
+        ZTHROWR(RuntimeException, vm, "sched::run cannot be called from task");
+    }
+    if(!s.drive([&s] { return s.live.empty(); }))
+    {
+        s.deadlock();
+    }
+}
+
+static void schedSend(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 2)
+    {
+        throw std::runtime_error("Expected exactly 2 arguments for sched::send");
+    }
+    ZScheduler& s = *vm->scheduler;
+    SchedChannel& ch = getChannelArg(vm, "sched::send");
+    SchedTask* w = s.waiter();
+    Value& val = vm->getLocalValue(1);
+    if(!ch.receivers.empty())
+    {
+        SchedTask* r = ch.receivers.front();
+        ch.receivers.pop_front();
+        s.wake(r, val, false);
+        return;
+    }
+    if(ch.items.size() < ch.capacity)
+    {
+        ch.items.push_back(NilValue);
+        vm->assign(ch.items.back(), val);
+        return;
+    }
+    vm->assign(w->transfer, val);
+    ch.senders.push_back(w);
+    w->chanQueue = &ch.senders;
+    s.block();
+}
+
+static void schedRecv(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 1)
+    {
+        throw std::runtime_error("Expected exactly 1 argument for sched::recv");
+    }
+    ZScheduler& s = *vm->scheduler;
+    SchedChannel& ch = getChannelArg(vm, "sched::recv");
+    SchedTask* w = s.waiter();
+    Value val;
+    if(!ch.items.empty())
+    {
+        val = ch.items.front();
+        ch.items.pop_front();
+        if(!ch.senders.empty())
+        {
+            SchedTask* snd = ch.senders.front();
+            ch.senders.pop_front();
+            ch.items.push_back(snd->transfer);
+            snd->transfer = NilValue;
+            s.wake(snd, NilValue, false);
+        }
+    } else if(!ch.senders.empty())
+    {
+        SchedTask* snd = ch.senders.front();
+        ch.senders.pop_front();
+        val = snd->transfer;
+        snd->transfer = NilValue;
+        s.wake(snd, NilValue, false);
+    } else
+    {
+        ch.receivers.push_back(w);
+        w->chanQueue = &ch.receivers;
+        s.block();
+        return;
+    }
+    vm->setResult(val);
+    vm->unref(val);
+}
+
+static void taskIsDone(ZorroVM* vm, Value* self)
+{
+    vm->setResult(BoolValue(self->nobj->as<SchedTask>().done));
+}
+
+static void taskDtor(ZorroVM* vm, Value* self)
+{
+    SchedTask* t = &self->nobj->as<SchedTask>();
+    vm->unref(t->result);
+    delete t;
+}
+
+static void channelCtor(ZorroVM* vm, Value* cls)
+{
+    size_t capacity = 0;
+    if(vm->getArgsCount() > 1)
+    {
+        throw std::runtime_error("Unexpected number of arguments for Channel constructor");
+    }
+    if(vm->getArgsCount() == 1)
+    {
+        Value& cap = vm->getLocalValue(0);
+        if(cap.vt != vtInt || cap.iValue < 0)
+        {
+            throw std::runtime_error("Expected non negative integer as capacity of Channel");
+        }
+        capacity = static_cast<size_t>(cap.iValue);
+    }
+    cls->classInfo->refInstance();
+    vm->setResult(NObjValue(vm, cls->classInfo, new SchedChannel(capacity)));
+}
+
+static void channelDtor(ZorroVM* vm, Value* self)
+{
+    SchedChannel* ch = &self->nobj->as<SchedChannel>();
+    for(auto& v : ch->items)
+    {
+        vm->unref(v);
+    }
+    delete ch;
+}
+
+static void channelCount(ZorroVM* vm, Value* self)
+{
+    vm->setResult(IntValue(static_cast<int64_t>(self->nobj->as<SchedChannel>().items.size())));
+}
+
+void ZorroVM::initSched()
+{
+    scheduler = new ZScheduler(this);
+    ZBuilder b(this);
+    b.enterNamespace("sched");
+    scheduler->taskClass = b.enterNClass("Task", 0, taskDtor);
+    b.registerCMethod("isDone", taskIsDone);
+    b.leaveClass();
+    scheduler->channelClass = b.enterNClass("Channel", channelCtor, channelDtor);
+    b.registerCMethod("count", channelCount);
+    b.leaveClass();
+    b.registerCFunc("spawn", schedSpawn);
+    b.registerCFunc("join", schedJoin);
+    b.registerCFunc("sleep", schedSleep);
+    b.registerCFunc("run", schedRun);
+    b.registerCFunc("send", schedSend);
+    b.registerCFunc("recv", schedRecv);
+    b.leaveNamespace();
+}
+
+void ZorroVM::initSchedInstance()
+{
+    scheduler = new ZScheduler(this);
+    scheduler->taskClass = program->scheduler->taskClass;
+    scheduler->channelClass = program->scheduler->channelClass;
+}
+
+void ZorroVM::resetSched()
+{
+    if(scheduler)
+    {
+        scheduler->clear();
+    }
+}
+
+void ZorroVM::clearSched()
+{
+    if(scheduler)
+    {
+        scheduler->clear();
+        delete scheduler;
+        scheduler = nullptr;
+    }
+}
+
+}
@@ -0,0 +1,250 @@
+#ifndef __ZORRO_ZVMSCHED_HPP__
+#define __ZORRO_ZVMSCHED_HPP__
+
+#include "ZorroVM.hpp"
+#include "ZVMOps.hpp"
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace zorro {
+
+/*
+  Cooperative scheduler of tasks, each task is a coroutine.
+  Task runs until it blocks in one of sched:: or io:: functions, yields or ends.
+  Blocked tasks wait in wait queues of channels and tasks, in timers heap or for fd readiness,
+  so picking next task is O(1) and sleep is O(log n), nothing is polled.
+  Code outside of tasks that blocks drives the scheduler until it can continue.
+*/
+
+typedef std::chrono::steady_clock SchedClock;
+
+struct SchedTask {
+    Value self;      // task native object, held while task is not done
+    Value cor;
+    Value result;    // return value or exception of done task
+    Value transfer;  // value to send or value passed to blocked task on wake up
+    std::vector<SchedTask*> joiners;
+    std::deque<SchedTask*>* chanQueue;  // channel queue blocked task waits in
+    bool done;
+    bool failed;
+    bool blocked;
+    bool raise;      // transfer is exception that should be thrown in woken task
+    bool ready;      // used for root only, tasks are queued instead
+
+    SchedTask() :
+        self(NilValue), cor(NilValue), result(NilValue), transfer(NilValue), chanQueue(nullptr), done(false),
+        failed(false), blocked(false), raise(false), ready(false)
+    {
+    }
+};
+
+struct SchedChannel {
+    std::deque<Value> items;
+    std::deque<SchedTask*> senders;
+    std::deque<SchedTask*> receivers;
+    size_t capacity;
+
+    explicit SchedChannel(size_t argCapacity) : capacity(argCapacity)
+    {
+    }
+};
+
+struct SchedTimer {
+    SchedClock::time_point when;
+    uint64_t seq;  // keeps timers with the same deadline in order
+    SchedTask* task;
+
+    bool operator>(const SchedTimer& rhs) const
+    {
+        return when != rhs.when ? when > rhs.when : seq > rhs.seq;
+    }
+};
+
+enum SchedIOOp {
+    sioNone,
+    sioRead,
+    sioWrite,
+    sioAccept,
+    sioConnect
+};
+
+/*
+  I/O operation of blocked task, completed by the scheduler when fd is ready.
+*/
+struct SchedIOWait {
+    SchedTask* task;
+    SchedIOOp op;
+    size_t size;  // max bytes to read or bytes already written
+    Value data;   // string being written
+
+    SchedIOWait() : task(nullptr), op(sioNone), size(0), data(NilValue)
+    {
+    }
+};
+
+struct SchedFd {
+    SchedIOWait rd;  // read and accept
+    SchedIOWait wr;  // write and connect
+    uint32_t events; // registered in epoll
+
+    SchedFd() : events(0)
+    {
+    }
+};
+
+/*
+  Return op of task function.
+  Keeps returned value as task result and ends coroutine.
+*/
+struct OpEndTask : OpBase {
+    OpEndTask();
+
+    void dump(std::string& out)
+    {
+        out = "end task";
+    }
+};
+
+/*
+  Catch handler of exceptions not caught by task.
+  Stops nested resume of the scheduler.
+*/
+struct OpTaskFailed : OpBase {
+    OpTaskFailed();
+
+    void dump(std::string& out)
+    {
+        out = "task failed";
+    }
+};
+
+struct ZScheduler {
+    ZorroVM* vm;
+    ClassInfo* taskClass;
+    ClassInfo* channelClass;
+    std::deque<SchedTask*> runQueue;
+    std::priority_queue<SchedTimer, std::vector<SchedTimer>, std::greater<SchedTimer>> timers;
+    uint64_t timerSeq;
+    std::unordered_set<SchedTask*> live;
+    SchedTask root;
+    SchedTask* current;
+    bool caught;
+    OpCall taskCallOp;
+    OpEndTask taskEndOp;
+    OpTaskFailed taskFailedOp;
+
+    int epollFd;
+    std::unordered_map<int, SchedFd> fds;
+    size_t ioWaiters;
+    size_t sinceIOPoll;
+    std::vector<char> ioBuf;
+    //incomplete utf-8 chars at the end of last read of fd
+    std::unordered_map<int, std::string> readTails;
+    //tasks that keep yielding don't starve ready fds
+    static const size_t ioPollInterval = 64;
+
+    explicit ZScheduler(ZorroVM* argVm);
+
+    /* Task that will wait if caller blocks */
+    SchedTask* waiter();
+
+    void makeReady(SchedTask* t)
+    {
+        if(t == &root)
+        {
+            root.ready = true;
+        } else
+        {
+            runQueue.push_back(t);
+        }
+    }
+
+    void wake(SchedTask* t, const Value& val, bool raise)
+    {
+        vm->assign(t->transfer, val);
+        t->raise = raise;
+        makeReady(t);
+    }
+
+    void block();
+
+    void fireTimers();
+
+    /* Runs tasks until cond is true, returns false if all tasks are blocked and nothing can wake them */
+    template<class Cond>
+    bool drive(Cond cond)
+    {
+        for(;;)
+        {
+            if(!timers.empty())
+            {
+                fireTimers();
+            }
+            if(cond())
+            {
+                return true;
+            }
+            if(!runQueue.empty())
+            {
+                if(ioWaiters && ++sinceIOPoll >= ioPollInterval)
+                {
+                    sinceIOPoll = 0;
+                    pollIO(0);
+                }
+                SchedTask* t = runQueue.front();
+                runQueue.pop_front();
+                resumeTask(t);
+                continue;
+            }
+            if(ioWaiters)
+            {
+                pollIO(timers.empty() ? -1 : msUntil(timers.top().when));
+                continue;
+            }
+            if(timers.empty())
+            {
+                return false;
+            }
+            std::this_thread::sleep_until(timers.top().when);
+        }
+    }
+
+    /* Removes root from wait queues and throws deadlock error as script exception */
+    void deadlock();
+
+    static int msUntil(SchedClock::time_point when);
+
+    void resumeTask(SchedTask* t);
+
+    void finishTask(SchedTask* t);
+
+    void releaseSelf(SchedTask* t);
+
+    /*
+      I/O part, implemented in ZVMIO.cpp.
+      waitIO registers pending operation of task that is going to block,
+      pollIO waits for fd readiness no longer than timeout ms and completes ready operations.
+    */
+    void waitIO(SchedTask* t, int fd, SchedIOOp op, size_t size, const Value& data);
+
+    void pollIO(int timeout);
+
+    void cancelIO(int fd);
+
+    void clearIO();
+
+    /* releases all tasks, scheduler can be used again after that */
+    void clear();
+};
+
+}
+
+#endif
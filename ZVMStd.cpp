@@ -1,6 +1,7 @@
 #include "ZorroVM.hpp"
 #include "ZBuilder.hpp"
 #include "ZVMOps.hpp"
+#include "ZStrKernels.hpp"
 
 #include <wctype.h>
 
@@ -111,29 +112,46 @@ static void stringFind(ZorroVM* vm,Value* self)
     }
     from=static_cast<uint32_t>(idx.iValue);
   }
-  vm->setResult(IntValue(self->str->find(*substr.str,from)));
+  vm->setResult(IntValue(self->str->find(vm,*substr.str,from)));
 }
 
 static void stringToUpper(ZorroVM* vm,Value* self)
 {
-  ZString& rv=*self->str->copy(vm);
-  if(rv.getCharSize()==1)
+  ZString* src=self->str;
+  if(src->isAscii())
   {
-    size_t len=rv.getLength();
+    ZString& rv=*src->copy(vm);
     char* ptr=(char*)rv.getDataPtr();
-    for(size_t i=0;i<len;++i)
+    getStrKernels().toUpper(ptr,ptr,rv.getDataSize());
+    vm->setResult(StringValue(&rv));
+    return;
+  }
+  //upper case char can have different utf-8 length
+  std::string buf;
+  buf.reserve(src->getDataSize());
+  const char* ptr=src->getDataPtr();
+  const char* end=ptr+src->getDataSize();
+  char tmp[4];
+  const StrKernels& k=getStrKernels();
+  while(ptr<end)
+  {
+    size_t n=k.asciiPrefix(ptr,end-ptr);
+    if(n)
     {
-      ptr[i]=static_cast<char>(toupper(static_cast<unsigned char>(ptr[i])));
+      size_t pos=buf.length();
+      buf.append(ptr,n);
+      k.toUpper(&buf[pos],&buf[pos],n);
+      ptr+=n;
+      continue;
     }
-  }else
-  {
-    size_t len=rv.getLength();
-    uint16_t* ptr=(uint16_t*)rv.getDataPtr();
-    for(size_t i=0;i<len;++i)
+    uint32_t c=ZString::getNextChar(ptr);
+    if(c<=0xffff)
     {
-      ptr[i]=towupper(ptr[i]);
+      c=towupper(c);
     }
+    buf.append(tmp,ZString::putUtf8Char(c,tmp));
   }
+  ZString& rv=*vm->allocZString(buf.c_str(),static_cast<uint32_t>(buf.length()));
   vm->setResult(StringValue(&rv));
 }
 
@@ -171,7 +189,8 @@ static void classGetDataMembers(ZorroVM* vm,Value* self)
     Value& val=za->getItemRef(idx++);
     val.vt=vtString;
     val.flags=0;
-    val.str=cm->name.val.get();
+    //names belong to symbols that can be shared by vms, result gets own copy
+    val.str=vm->allocZString(cm->name.val->getDataPtr(),cm->name.val->getDataSize());
     val.str->ref();
   }
   vm->setResult(rv);
@@ -182,7 +201,8 @@ static void classGetName(ZorroVM* vm,Value* self)
   Value rv;
   rv.vt=vtString;
   rv.flags=0;
-  rv.str=self->classInfo->name.val.get();
+  ZString* name=self->classInfo->name.val.get();
+  rv.str=vm->allocZString(name->getDataPtr(),name->getDataSize());
   rv.str->ref();
   vm->setResult(rv);
 }
@@ -320,7 +340,7 @@ static Value mkObject(ZorroVM* vm,const char* name)
   rv.vt=vtObject;
   Object& obj=*(rv.obj=vm->allocObj());
   obj.classInfo=ci;
-  ci->ref();
+  ci->refInstance();
   obj.members=vm->allocVArray(ci->membersCount);
   for(size_t i=0;i<ci->membersCount;++i)
   {
@@ -576,6 +596,9 @@ void ZorroVM::initStd()
   b.leaveClass();
   b.registerCFunc("stacktrace",getStackTraceFunc);
   b.leaveNamespace();
+  initSched();
+  initIO();
+  initPar();
   symbols.stdEnd=symbols.info.size();
 }
 
@@ -466,7 +466,7 @@ void ZLexer::matchDollar()
     }
     FileLocation saved = fr->getLoc();
     unsigned int savedLength = last.length;
-    while((c = fr->peek()) == 'l' || c == 'r' || c == 'x' || c == 'X' || c == 'z')
+    while((c = fr->peek()) == 'l' || c == 'r' || c == 'x' || c == 'X' || c == 'z' || c == 's')
     {
         fr->getNextChar();
         last.length++;
@@ -8,50 +8,93 @@ namespace zorro {
 static ExprType binopMap[TermsCount];
 static ExprType valMap[TermsCount];
 
-ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
+//generated by zorro-pgen, empty if grammar is built at runtime
+extern const ZParser::Tables zorroParserTables;
+
+namespace {
+
+/* Filled before main, parsers only read them and can work in parallel threads */
+struct ExprMapsInit {
+    ExprMapsInit()
+    {
+        for(int i = FirstTerm; i < TermsCount; i++)
+        {
+            binopMap[i] = (ExprType) -1;
+            valMap[i] = (ExprType) -1;
+        }
+
+        binopMap[tPlus] = etPlus;
+        binopMap[tPlusEq] = etSPlus;
+        binopMap[tMinus] = etMinus;
+        binopMap[tMinusEq] = etSMinus;
+        binopMap[tMul] = etMul;
+        binopMap[tMulEq] = etSMul;
+        binopMap[tDiv] = etDiv;
+        binopMap[tDivEq] = etSDiv;
+        binopMap[tEq] = etAssign;
+        binopMap[tEqual] = etEqual;
+        binopMap[tNotEqual] = etNotEqual;
+        binopMap[tMatch] = etMatch;
+        binopMap[tLess] = etLess;
+        binopMap[tGreater] = etGreater;
+        binopMap[tLessEq] = etLessEq;
+        binopMap[tGreaterEq] = etGreaterEq;
+        binopMap[tOr] = etOr;
+        binopMap[tAnd] = etAnd;
+        binopMap[tIn] = etIn;
+        binopMap[tIs] = etIs;
+        binopMap[tPipe] = etBitOr;
+        binopMap[tAmp] = etBitAnd;
+        binopMap[tMod] = etMod;
+        binopMap[tModEq] = etSMod;
+
+        valMap[tInt] = etInt;
+        valMap[tDouble] = etDouble;
+        valMap[tString] = etString;
+        valMap[tRawString] = etString;
+        valMap[tNil] = etNil;
+        valMap[tTrue] = etTrue;
+        valMap[tFalse] = etFalse;
+        valMap[tRegExp] = etRegExp;
+    }
+} zparserExprMapsInit;
+
+struct SharedGrammar {
+    ZParser::Grammar g;
+
+    SharedGrammar()
+    {
+        if(zorroParserTables.rulesCount)
+        {
+            g.loadTables(zorroParserTables);
+        }
+        ZParser::buildGrammar(g);
+    }
+};
+
+}
+
+ZParser::Grammar& ZParser::getGrammar()
+{
+    static SharedGrammar sg;
+    return sg.g;
+}
+
+ZParser::ZParser(ZMemory* argMem) : ParserBase(getGrammar()), mem(argMem), result(0)
+{
+}
+
+void ZParser::buildGrammar(Grammar& g)
 {
     for(int i = FirstTerm; i < TermsCount; i++)
     {
-        termMap[ZLexer::getTermName((TermType) i)] = (TermType) i;
-        binopMap[i] = (ExprType) -1;
-        valMap[i] = (ExprType) -1;
+        if(!g.tables)
+        {
+            g.termMap[ZLexer::getTermName((TermType) i)] = (TermType) i;
+        }
     }
 
-    binopMap[tPlus] = etPlus;
-    binopMap[tPlusEq] = etSPlus;
-    binopMap[tMinus] = etMinus;
-    binopMap[tMinusEq] = etSMinus;
-    binopMap[tMul] = etMul;
-    binopMap[tMulEq] = etSMul;
-    binopMap[tDiv] = etDiv;
-    binopMap[tDivEq] = etSDiv;
-    binopMap[tEq] = etAssign;
-    binopMap[tEqual] = etEqual;
-    binopMap[tNotEqual] = etNotEqual;
-    binopMap[tMatch] = etMatch;
-    binopMap[tLess] = etLess;
-    binopMap[tGreater] = etGreater;
-    binopMap[tLessEq] = etLessEq;
-    binopMap[tGreaterEq] = etGreaterEq;
-    binopMap[tOr] = etOr;
-    binopMap[tAnd] = etAnd;
-    binopMap[tIn] = etIn;
-    binopMap[tIs] = etIs;
-    binopMap[tPipe] = etBitOr;
-    binopMap[tAmp] = etBitAnd;
-    binopMap[tMod] = etMod;
-    binopMap[tModEq] = etSMod;
-
-    valMap[tInt] = etInt;
-    valMap[tDouble] = etDouble;
-    valMap[tString] = etString;
-    valMap[tRawString] = etString;
-    valMap[tNil] = etNil;
-    valMap[tTrue] = etTrue;
-    valMap[tFalse] = etFalse;
-    valMap[tRegExp] = etRegExp;
-
-#define ADDRULE(n, rule, hnd) add##n(SeqInfo rule,&ZParser::hnd)
+#define ADDRULE(n, rule, hnd) g.add##n(SeqInfo rule,&ZParser::hnd)
 
     /*
    ? - optional
@@ -143,7 +186,7 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
 
     ADDRULE(1, ("seqopLst first", "seqopLst: seqop"), handleSeqOpLstFirst);
     ADDRULE(2, ("seqopLst first", "seqopLst: seqopLst seqop"), handleSeqOpLstNext);
-    getRule("seqopLst").listMode = lmOneOrMore;
+    g.getRule("seqopLst").listMode = lmOneOrMore;
 
     ADDRULE(1, ("seqop map", "seqop: tMapOp- expr"), handleSeqOpMap);
     ADDRULE(1, ("seqop grp", "seqop: tGrepOp- expr"), handleSeqOpGrep);
@@ -155,7 +198,7 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
     ADDRULE(2, ("pairList next2", "pairList: pairList tEol- tEol? pair"), handleExprListNext);
     //ADDRULE(1,("pairList skip","pairList: pairList tEol-"),handleExprListSkip);
     //ADDRULE(2,("pairList next2","pairList: pairList pair"),handleExprListNext);
-    getRule("pairList").listMode = lmZeroOrMoreTrail;
+    g.getRule("pairList").listMode = lmZeroOrMoreTrail;
 
     ADDRULE(2, ("pair", "pair: expr tArrow- tEol? expr"), handlePair);
 
@@ -170,7 +213,7 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
     ADDRULE(2, ("argList next", "argList: argList tEol- tEol? pairOrExpr"), handleExprListNext);
     //ADDRULE(3,("argList next pair","argList: argList tComma- tEol? expr tArrow- tEol? expr"),handleExprListNextPair);
     //ADDRULE(3,("argList next pair","argList: argList tEol- tEol? expr tArrow- tEol? expr"),handleExprListNextPair);
-    getRule("argList").listMode = lmZeroOrMoreTrail;
+    g.getRule("argList").listMode = lmZeroOrMoreTrail;
 
     ADDRULE(0, ("exprList empty", "exprList:"), handleExprListEmpty);
     ADDRULE(1, ("exprList first", "exprList: expr"), handleExprListOne);
@@ -178,7 +221,7 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
     ADDRULE(2, ("exprList next", "exprList: exprList tEol- tEol? expr"), handleExprListNext);
     //ADDRULE(2,("exprList next","exprList: exprList expr"),handleExprListNext);
     //ADDRULE(1,("exprList skip","exprList: exprList tEol-"),handleExprListSkip);
-    getRule("exprList").listMode = lmZeroOrMoreTrail;
+    g.getRule("exprList").listMode = lmZeroOrMoreTrail;
 
     ADDRULE(1, ("func param simple", "funcParam: tIdent"), handleFuncParamSimple);
     ADDRULE(2, ("func param defVal", "funcParam: tIdent tEq- tEol? expr", 21), handleFuncParamDefVal);
@@ -189,11 +232,11 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
     ADDRULE(1, ("param lst first", "paramList: funcParam"), handleParamListOne);
     ADDRULE(2, ("param lst next", "paramList: paramList tComma- tEol? funcParam"), handleParamListNext);
     ADDRULE(2, ("param lst next", "paramList: paramList tEol- tEol? funcParam"), handleParamListNext);
-    getRule("paramList").listMode = lmZeroOrMoreTrail;
+    g.getRule("paramList").listMode = lmZeroOrMoreTrail;
 
     ADDRULE(1, ("nameList1 first", "nameList1: tIdent"), handleNameListOne);
     ADDRULE(2, ("nameList1 next", "nameList1: nameList1 tComma- tEol? tIdent"), handleNameList);
-    getRule("nameList1").listMode = lmOneOrMore;
+    g.getRule("nameList1").listMode = lmOneOrMore;
 
     ADDRULE(2, ("stmt enum", "stmt: tEnum- tIdent tEol- exprList tEnd- tEol-"), handleEnum);
     ADDRULE(2, ("stmt bitenum", "stmt: tBitEnum- tIdent tEol- exprList tEnd- tEol-"), handleBitEnum);
@@ -205,17 +248,17 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
     ADDRULE(2, ("stmtList next", "stmtList: stmtList stmt"), handleStmtList);
     ADDRULE(2, ("include", "stmtList: stmtList tInclude- expr tEol-"), handleInclude);
     ADDRULE(1, ("include", "stmtList: tInclude- expr tEol-"), handleInclude1);
-    getRule("stmtList").listMode = lmZeroOrMoreTrail;
+    g.getRule("stmtList").listMode = lmZeroOrMoreTrail;
 
     ADDRULE(2, ("exprList2 pair", "exprList2: expr tComma- expr", 30), handleExprListTwo);
     ADDRULE(2, ("exprList2 next", "exprList2: exprList2 tComma- expr", 30), handleExprListNext);
     //ADDRULE(2,("exprList2 next","exprList2: exprList2 tEol- tEol? expr",30),handleExprListNext);
-    getRule("exprList2").listMode = lmOneOrMore;
+    g.getRule("exprList2").listMode = lmOneOrMore;
 
     ADDRULE(0, ("eslif list empty", "elsiflist:"), handleElsifEmpty);
     ADDRULE(2, ("eslif list empty", "elsiflist: tElsif- expr tEol- stmtList"), handleElsifFirst);
     ADDRULE(3, ("eslif list first", "elsiflist: elsiflist tElsif- expr tEol- stmtList"), handleElsifNext);
-    getRule("elsiflist").listMode = lmZeroOrMore;
+    g.getRule("elsiflist").listMode = lmZeroOrMore;
 
     ADDRULE(0, ("else empty", "else: "), handleElseEmpty);
     ADDRULE(1, ("else empty", "else: tElse- stmtList"), handleElse);
@@ -275,7 +318,7 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
     ADDRULE(2, ("liter arg list last int", "literArgList: tIdent tFormat- tIdent"), handleLiterArgListStr);
     ADDRULE(1, ("liter arg list first str", "literArgList2: literArg"), handleLiterArgListFirst);
     ADDRULE(2, ("liter arg list first str", "literArgList2: literArgList2 literArg"), handleLiterArgListNext);
-    getRule("literArgList2").listMode = lmOneOrMoreTrail;
+    g.getRule("literArgList2").listMode = lmOneOrMoreTrail;
     ADDRULE(3, ("stmt liter", "stmt: tLiter- tIdent literArgList tEol- stmtList tEnd- tEol-"), handleLiterDecl);
 
     ADDRULE(0, ("casesList empty", "casesList:"), handleCasesListEmpty);
@@ -284,7 +327,7 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
     ADDRULE(2, ("casesList first", "casesList: exprList tColon-^ stmtList"), handleCasesListFirst);
     ADDRULE(3, ("casesList next", "casesList: casesList exprList tColon-^ stmtList"), handleCasesListNext);
     ADDRULE(3, ("casesList next", "casesList: casesList tStarColon^ stmtList"), handleCasesListNextWild);
-    getRule("casesList").listMode = lmZeroOrMoreTrail;
+    g.getRule("casesList").listMode = lmZeroOrMoreTrail;
 
     ADDRULE(0, ("opt expr empty", "optexpr:"), handleEmptyExpr);
     ADDRULE(1, ("opt expr", "optexpr: expr"), handleAtom);
@@ -297,7 +340,7 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
     ADDRULE(0, ("classStmtList empty", "classStmtList:"), handleStmtListEmpty);
     ADDRULE(1, ("classStmtList first", "classStmtList: classStmt"), handleStmtListOne);
     ADDRULE(2, ("class stmtList next", "classStmtList: classStmtList classStmt"), handleStmtList);
-    getRule("classStmtList").listMode = lmZeroOrMoreTrail;
+    g.getRule("classStmtList").listMode = lmZeroOrMoreTrail;
 
     ADDRULE(0, ("calssstmt empty", "classStmt: tEol-"), handleEmptyLine);
     ADDRULE(1, ("classStmt func", "classStmt: func^"), handleStmt);
@@ -320,7 +363,7 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
     ADDRULE(1, ("attr list first", "attrList: attr"), handleAttrListFirst);
     ADDRULE(2, ("attr list next", "attrList: attrList tComma- tEol? attr"), handleAttrListNext);
     ADDRULE(2, ("attr list next", "attrList: attrList tEol- tEol? attr"), handleAttrListNext);
-    getRule("attrList").listMode = lmZeroOrMoreTrail;
+    g.getRule("attrList").listMode = lmZeroOrMoreTrail;
 
     ADDRULE(0, ("propAccDecl empty", "propAccDecl: tEol-"), handleEmptyPropAcc);
     ADDRULE(2, ("propAccDecl name", "propAccDecl: tIdent tEq- tIdent tEol-"), handlePropAccName);
@@ -330,21 +373,21 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
     ADDRULE(0, ("propAccDeclList empty", "propAccDeclList:"), handlePropAccListEmpty);
     ADDRULE(1, ("propAccDeclList first", "propAccDeclList: propAccDecl"), handlePropAccListFirst);
     ADDRULE(2, ("propAccDeclList next", "propAccDeclList: propAccDeclList^ propAccDecl"), handlePropAccListNext);
-    getRule("propAccDeclList").listMode = lmZeroOrMore;
+    g.getRule("propAccDeclList").listMode = lmZeroOrMore;
 
     ADDRULE(2, ("classStmt prop", "classStmt: tProp- tIdent tEol-^ propAccDeclList tEnd- tEol-"), handlePropDecl);
 
     ADDRULE(0, ("namespace empty", "nsdecl:"), handleNsEmpty);
     ADDRULE(1, ("namespace first", "nsdecl: tIdent"), handleNsFirst);
     ADDRULE(2, ("namespace next", "nsdecl: nsdecl tDoubleColon- tIdent"), handleNsNext);
-    getRule("nsdecl").listMode = lmZeroOrMore;
+    g.getRule("nsdecl").listMode = lmZeroOrMore;
 
     ADDRULE(2, ("namespace stmt", "stmt: tNamespace- nsdecl tEol- stmtList tEnd- tEol-"), handleNamespace);
 
     ADDRULE(0, ("nm list empty", "nmlist:"), handleExprListEmpty);
     ADDRULE(1, ("nm list one", "nmlist: nsdecl"), handleNmListOne);
     ADDRULE(2, ("nm list next", "nmlist: nmlist tComma- tEol? nsdecl"), handleNmListNext);
-    getRule("nmlist").listMode = lmZeroOrMore;
+    g.getRule("nmlist").listMode = lmZeroOrMore;
 
     ADDRULE(4, ("try catch stmt", "stmt: tTry- tEol- stmtList tCatch- nmlist tIn- tIdent tEol- stmtList tEnd- tEol-"),
             handleTryCatch);
@@ -359,6 +402,10 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
 
     ADDRULE(1, ("goal", "goal: stmtList tEof-"), handleGoal);
 
+    //short statement forms and argument lists try several alternatives starting with the same rule
+    g.getRule("expr").memo = true;
+    g.getRule("simpleStmt").memo = true;
+
 /*
   add1(SeqInfo("brk","expr: tORBr- expr tCRBr-",0),&ZParser::handleBr);
   add3(SeqInfo("assign","expr: expr tEq expr",5,false),&ZParser::handleBinOp);
@@ -512,7 +559,7 @@ ZParser::ZParser(ZMemory* argMem) : mem(argMem), result(0)
 */
 
 
-    prepare("goal");
+    g.prepare("goal");
 
 }
 
@@ -918,7 +965,7 @@ Expr* ZParser::handleStr(Term t)
             l.setLoc(strLoc);
             l.fr->setSize(static_cast<size_t>(strLoc.offset + end - ptr));
             l.termOnUnknown = true;
-            Expr* res = parseRule<Expr*>(&getRule("fmt"));
+            Expr* res = parseRule<Expr*>(grammar->findRule("fmt"));
             dumpstack();
             //l.popReader();
             l.setLoc(save);
@@ -1505,7 +1552,7 @@ StmtList* ZParser::handleInclude(StmtList* lst, Expr* fileName)
     }
     FileReader* fr = l.fr->getOwner()->newReader(e);
     pushReader(fr, fileName->pos);
-    StmtList* lst2 = parseRule<StmtList*>(&getRule("goal"));
+    StmtList* lst2 = parseRule<StmtList*>(grammar->findRule("goal"));
     delete fileName;
     //l.popReader();
     if(!lst)
@@ -1531,7 +1578,7 @@ StmtList* ZParser::handleInclude1(Expr* fileName)
     }
     FileReader* fr = l.fr->getOwner()->newReader(e);
     pushReader(fr, fileName->pos);
-    StmtList* lst2 = parseRule<StmtList*>(&getRule("goal"));
+    StmtList* lst2 = parseRule<StmtList*>(grammar->findRule("goal"));
     delete fileName;
     //l.popReader();
     //StmtList* rv=new StmtList;
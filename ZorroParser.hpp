@@ -11,7 +11,13 @@ namespace zorro {
 
 class ZParser : public ParserBase<ZParser, ZLexer> {
 public:
-    ZParser(ZMemory* argMem);
+    explicit ZParser(ZMemory* argMem);
+
+    /* grammar shared by all parsers, loaded from tables generated at build time on first use */
+    static Grammar& getGrammar();
+
+    /* registers rules and handlers, also used to generate tables */
+    static void buildGrammar(Grammar& g);
 
     void setMem(ZMemory* argMem)
     {
@@ -6,6 +6,8 @@
 #include "ZVMOps.hpp"
 #include "ZBuilder.hpp"
 #include <math.h>
+#include <mutex>
+#include <unordered_map>
 
 #ifdef _MSC_VER
 #define snprintf _snprintf
@@ -63,13 +65,15 @@ std::string ValueToString(ZorroVM* vm, const Value& v)
         case vtBool:
             return v.bValue ? "true" : "false";
         case vtInt:
-            return FORMAT("%{}", v.iValue);
+            return std::string(buf, ZString::formatInt(v.iValue, buf));
         case vtDouble:
-            snprintf(buf, 64, "%lf", v.dValue);
-            return buf;
+        {
+            char dbuf[ZString::maxDoubleChars];
+            return std::string(dbuf, ZString::formatDouble(v.dValue, 6, dbuf));
+        }
         case vtString:
         {
-            std::string rv = v.str->c_str(vm);
+            std::string rv(v.str->getDataPtr(), v.str->getDataSize());
             return rv;
         }
             break;
@@ -153,13 +157,16 @@ std::string ValueToString(ZorroVM* vm, const Value& v)
                     {
                         std::string tmp = str.c_substr(vm, static_cast<uint32_t>(start),
                                                        static_cast<uint32_t>(end - start));
-                        if(!tmp.empty())
+                        //reverse order of utf-8 chars, not bytes
+                        size_t pos = tmp.length();
+                        while(pos > 0)
                         {
-                            //i will wrap after reaching 0
-                            for(size_t i = tmp.length() - 1; i < tmp.length(); --i)
+                            size_t charEnd = pos;
+                            do
                             {
-                                rv += tmp[i];
-                            }
+                                --pos;
+                            } while(pos > 0 && !ZString::isLeadByte(tmp[pos]));
+                            rv.append(tmp, pos, charEnd - pos);
                         }
                     }
                 }
@@ -257,7 +264,7 @@ std::string ValueToString(ZorroVM* vm, const Value& v)
             {
                 std::string rv;
                 size_t sz = idx.getCount();
-                const char* str = cnt.str->c_str(vm);
+                const char* str = cnt.str->getDataPtr();
                 size_t l = cnt.str->getLength();
                 for(size_t i = 0; i < sz; ++i)
                 {
@@ -275,7 +282,9 @@ std::string ValueToString(ZorroVM* vm, const Value& v)
                     {
                         ZTHROW0(ZorroException, "ValueToString: string index is out of bounds: %{} >= ${} ", rIdx, l);
                     }
-                    rv += str[rIdx];
+                    uint32_t from = cnt.str->getCharOffset(vm, static_cast<uint32_t>(rIdx));
+                    uint32_t to = cnt.str->getCharOffset(vm, static_cast<uint32_t>(rIdx + 1));
+                    rv.append(str + from, to - from);
                 }
                 return rv;
             } else if(cnt.vt == vtMap)
@@ -769,7 +778,7 @@ static void mulStrInt(ZorroVM* vm, Value* l, const Value* r, Value* dst)
     }
     uint32_t sl = str.getDataSize();
     auto dataSize = static_cast<size_t>(sl * cnt);
-    char* data = vm->allocStr(dataSize + (str.getCharSize() == 1 ? 1 : 0));
+    char* data = vm->allocStr(dataSize + 1);
     if(!data)
     {
         ZTHROWR(RuntimeException, vm, "Attempt to allocate %{} bytes for string failed", dataSize);
@@ -781,15 +790,12 @@ static void mulStrInt(ZorroVM* vm, Value* l, const Value* r, Value* dst)
         memcpy(ptr, srcData, sl);
         ptr += sl;
     }
-    if(str.getCharSize() == 1)
-    {
-        *ptr = 0;
-    }
+    *ptr = 0;
     Value v;
     v.vt = vtString;
     v.flags = ValFlagNone;
     v.str = vm->allocZString();
-    v.str->init(data, dataSize, str.getCharSize() != 1);
+    v.str->init(data, static_cast<uint32_t>(dataSize), static_cast<uint32_t>(str.getLength() * cnt));
     ZASSIGN(vm, dst, &v);
 }
 
@@ -803,7 +809,7 @@ static void divStrStr(ZorroVM* vm, Value* l, const Value* r, Value* dst)
     ZArray& za = *(v.arr = vm->allocZArray());
     uint32_t lastPos = 0;
     int pos;
-    while((pos = str.find(str2, lastPos)) != -1)
+    while((pos = str.find(vm, str2, lastPos)) != -1)
     {
         za.pushAndRef(StringValue(str.substr(vm, lastPos, pos - lastPos)));
         lastPos = pos + str2.getLength();
@@ -815,14 +821,13 @@ static void divStrStr(ZorroVM* vm, Value* l, const Value* r, Value* dst)
 static void divStrRegExp(ZorroVM* vm, Value* l, const Value* r, Value* dst)
 {
     ZString& str = *l->str;
-    int cs = str.getCharSize();
     kst::RegExp& rx = *r->regexp->val;
     Value v;
     v.vt = vtArray;
     v.flags = ValFlagNone;
     ZArray& za = *(v.arr = vm->allocZArray());
     size_t lastPos = 0;
-    if(cs == 1)
+    if(str.isAscii())
     {
         const char* start = str.getDataPtr();
         const char* end = start + str.getLength();
@@ -840,8 +845,10 @@ static void divStrRegExp(ZorroVM* vm, Value* l, const Value* r, Value* dst)
         za.pushAndRef(StringValue(str.substr(vm, lastPos, str.getLength() - lastPos)));
     } else
     {
-        const uint16_t* start = (uint16_t*) str.getDataPtr();
-        const uint16_t* end = start + str.getLength();
+        std::vector<uint16_t> buf(str.getLength());
+        ZString::toUcs2(str.getDataPtr(), str.getDataPtr() + str.getDataSize(), &buf[0]);
+        const uint16_t* start = &buf[0];
+        const uint16_t* end = start + buf.size();
         kst::MatchInfo sm(r->regexp->marr, r->regexp->marrSize, r->regexp->narr, r->regexp->narrSize);
         while(rx.SearchEx(start, start + lastPos, end, sm))
         {
@@ -885,6 +892,15 @@ static void addStrStr(ZorroVM* vm, Value* l, const Value* r, Value* dst)
 
 static void saddStrStr(ZorroVM* vm, Value* l, const Value* r, Value* dst)
 {
+    if(l->str->canAppendInPlace())
+    {
+        l->str->append(vm, r->str);
+        if(dst)
+        {
+            ZASSIGN(vm, dst, l);
+        }
+        return;
+    }
     Value v;
     v.vt = vtString;
     v.flags = ValFlagNone;
@@ -905,6 +921,15 @@ static void saddStrSegment(ZorroVM* vm, Value* l, const Value* r, Value* dst)
     }
     ZStringRef ss(vm, r->seg->cont.str->substr(vm, static_cast<uint32_t>(r->seg->segStart),
                                                static_cast<uint32_t>(r->seg->segEnd - r->seg->segStart)));
+    if(l->str->canAppendInPlace())
+    {
+        l->str->append(vm, ss.get());
+        if(dst)
+        {
+            ZASSIGN(vm, dst, l);
+        }
+        return;
+    }
     Value v;
     v.vt = vtString;
     v.flags = ValFlagNone;
@@ -932,13 +957,11 @@ static void addSegmentSegment(ZorroVM* vm, Value* l, const Value* r, Value* dst)
         Value v;
         v.vt = vtString;
         v.flags = ValFlagNone;
-        ZString* s1 = lv->str->substr(vm, static_cast<uint32_t>(ls.segStart),
-                                      static_cast<uint32_t>(ls.segEnd - ls.segStart));
-        ZString* s2 = rv->str->substr(vm, static_cast<uint32_t>(rs.segStart),
-                                      static_cast<uint32_t>(rs.segEnd - rs.segStart));
-        v.str = ZString::concat(vm, s1, s2);
-        vm->freeZString(s1);
-        vm->freeZString(s2);
+        ZStringRef s1(vm, lv->str->substr(vm, static_cast<uint32_t>(ls.segStart),
+                                          static_cast<uint32_t>(ls.segEnd - ls.segStart)));
+        ZStringRef s2(vm, rv->str->substr(vm, static_cast<uint32_t>(rs.segStart),
+                                          static_cast<uint32_t>(rs.segEnd - rs.segStart)));
+        v.str = ZString::concat(vm, s1.get(), s2.get());
         ZASSIGN(vm, dst, &v);
     } else if(lv->vt == vtArray && rv->vt == vtArray)
     {
@@ -964,13 +987,12 @@ static void addSegmentStr(ZorroVM* vm, Value* l, const Value* r, Value* dst)
     {
         ZTHROWR(TypeException, vm, "attempt to add segment with base type {} to string", getValueTypeName(lv->vt));
     }
-    ZString* s1 = lv->str->substr(vm, static_cast<uint32_t>(ls.segStart),
-                                  static_cast<uint32_t>(ls.segEnd - ls.segStart));
+    ZStringRef s1(vm, lv->str->substr(vm, static_cast<uint32_t>(ls.segStart),
+                                      static_cast<uint32_t>(ls.segEnd - ls.segStart)));
     Value v;
     v.vt = vtString;
     v.flags = ValFlagNone;
-    v.str = ZString::concat(vm, s1, r->str);
-    vm->freeZString(s1);
+    v.str = ZString::concat(vm, s1.get(), r->str);
     ZASSIGN(vm, dst, &v);
 }
 
@@ -982,13 +1004,12 @@ static void addStrSegment(ZorroVM* vm, Value* l, const Value* r, Value* dst)
     {
         ZTHROWR(TypeException, vm, "attempt to add segment with base type {} to string", getValueTypeName(rv->vt));
     }
-    ZString* s1 = rv->str->substr(vm, static_cast<uint32_t>(rs.segStart),
-                                  static_cast<uint32_t>(rs.segEnd - rs.segStart));
+    ZStringRef s1(vm, rv->str->substr(vm, static_cast<uint32_t>(rs.segStart),
+                                      static_cast<uint32_t>(rs.segEnd - rs.segStart)));
     Value v;
     v.vt = vtString;
     v.flags = ValFlagNone;
-    v.str = ZString::concat(vm, l->str, s1);
-    vm->freeZString(s1);
+    v.str = ZString::concat(vm, l->str, s1.get());
     ZASSIGN(vm, dst, &v);
 }
 
@@ -2117,21 +2138,36 @@ static bool inIntRange(ZorroVM* vm, const Value* l, const Value* r)
            (r->range->step == 0 || ((l->iValue - r->range->start) % r->range->step) == 0);
 }
 
+static bool getStrSegmentData(ZorroVM* vm, const Segment& seg, const char*& ptr, uint32_t& size)
+{
+    int64_t start = seg.segStart;
+    int64_t len = seg.segEnd - start;
+    ZString* str = seg.cont.str;
+    auto strLen = (int64_t) str->getLength();
+    if(start < 0 || start >= strLen || start + len > strLen)
+    {
+        return false;
+    }
+    uint32_t startOff = str->getCharOffset(vm, static_cast<uint32_t>(start));
+    uint32_t endOff = str->getCharOffset(vm, static_cast<uint32_t>(start + len));
+    ptr = str->getDataPtr() + startOff;
+    size = endOff - startOff;
+    return true;
+}
+
 static bool eqStrSegment(ZorroVM* vm, const Value* l, const Value* r)
 {
     if(r->seg->cont.vt != vtString)
     {
         return false;
     }
-    int64_t start = r->seg->segStart;
-    int64_t len = r->seg->segEnd - start;
-    ZString* str = r->seg->cont.str;
-    auto strLen = (int64_t) str->getLength();
-    if(start < 0 || start >= strLen || start + len > strLen)
+    const char* ptr;
+    uint32_t size;
+    if(!getStrSegmentData(vm, *r->seg, ptr, size))
     {
         return false;
     }
-    return l->str->equalsTo(str->c_str(vm) + start, static_cast<size_t>(len));//!!todo fix this!
+    return l->str->equalsTo(ptr, size);
 }
 
 static bool eqSegmentStr(ZorroVM* vm, const Value* l, const Value* r)
@@ -2140,47 +2176,34 @@ static bool eqSegmentStr(ZorroVM* vm, const Value* l, const Value* r)
     {
         return false;
     }
-    int64_t start = l->seg->segStart;
-    int64_t len = l->seg->segEnd - start;
-    ZString* str = l->seg->cont.str;
-    auto strLen = (int64_t) str->getLength();
-    if(start < 0 || start >= strLen || start + len > strLen)
+    const char* ptr;
+    uint32_t size;
+    if(!getStrSegmentData(vm, *l->seg, ptr, size))
     {
         return false;
     }
-    return r->str->equalsTo(str->c_str(vm) + start, static_cast<size_t>(len));//!!todo fix this!
+    return r->str->equalsTo(ptr, size);
 }
 
-static bool eqSegmentSegment(ZorroVM* /*vm*/, const Value* l, const Value* r)
+static bool eqSegmentSegment(ZorroVM* vm, const Value* l, const Value* r)
 {
     if(l->seg->cont.vt != vtString || r->seg->cont.vt != vtString)
     {
         return false;
     }
-    int64_t start1 = l->seg->segStart;
-    int64_t len1 = l->seg->segEnd - start1;
-    ZString* str1 = l->seg->cont.str;
-    auto strLen1 = (int64_t) str1->getLength();
-    if(start1 < 0 || start1 >= strLen1 || start1 + len1 > strLen1)
+    const char* ptr1;
+    uint32_t size1;
+    if(!getStrSegmentData(vm, *l->seg, ptr1, size1))
     {
         return false;
     }
-
-    int64_t start2 = r->seg->segStart;
-    int64_t len2 = r->seg->segEnd - start1;
-    ZString* str2 = r->seg->cont.str;
-    auto strLen2 = (int64_t) str2->getLength();
-    if(start2 < 0 || start2 >= strLen2 || start2 + len2 > strLen2)
+    const char* ptr2;
+    uint32_t size2;
+    if(!getStrSegmentData(vm, *r->seg, ptr2, size2))
     {
         return false;
     }
-    if(len1 != len2)
-    {
-        return false;
-    }
-
-    return ZString::compare(str1->getDataPtr() + start1, str1->getCharSize(), static_cast<uint32_t>(len1),
-                            str2->getDataPtr(), str2->getCharSize(), static_cast<uint32_t>(len2)) == 0;//!!todo fix this!
+    return ZString::compare(ptr1, size1, ptr2, size2) == 0;
 }
 
 
@@ -2882,8 +2905,9 @@ struct FormatFlags {
     bool left;
     bool right;
     bool zero;
+    bool shortest;
 
-    FormatFlags() : hex(false), uchex(false), left(false), right(false), zero(false)
+    FormatFlags() : hex(false), uchex(false), left(false), right(false), zero(false), shortest(false)
     {
 
     }
@@ -2917,6 +2941,9 @@ static void parseFlags(ZorroVM* vm, ZString* flags, FormatFlags& ff)
             case 'z':
                 ff.zero = true;
                 break;
+            case 's':
+                ff.shortest = true;
+                break;
         }
         ++begin;
     }
@@ -2952,50 +2979,68 @@ static void formatInt(ZorroVM* vm, Value* v, int w, int /*p*/, ZString* flags, V
     {
         return;
     }
-    kst::FormatBuffer buf;
     FormatFlags ff;
     parseFlags(vm, flags, ff);
+    uint64_t uval = static_cast<uint64_t>(v->iValue);
+    size_t sign = 0;
+    size_t len;
     if(ff.hex)
     {
-        if(ff.uchex)
-        {
-            kst::format((buf.getArgList(), "%{X}", v->iValue));
-            //len=snprintf(buf, sizeof(buf), "%" PRIx64,v->iValue);
-        } else
+        len = 1;
+        while(len < 16 && uval >> (len * 4))
         {
-            //len=snprintf(buf, sizeof(buf), "%" PRIx64,v->iValue);
-            kst::format((buf.getArgList(), "%{x}", v->iValue));
+            ++len;
         }
     } else
     {
-        //len=snprintf(buf, sizeof(buf), "%" PRId64,v->iValue);
-        kst::format((buf.getArgList(), "%{}", v->iValue));
+        if(v->iValue < 0)
+        {
+            uval = 0 - uval;
+            sign = 1;
+        }
+        len = ZString::countDigits(uval);
     }
-    size_t len = buf.Length();
-    ZString* res = vm->allocZString();
-    size_t slen = len;
+    size_t slen = len + sign;
     if(w > static_cast<int>(slen))
     {
         slen = static_cast<size_t>(w);
     }
+    //digits are written directly into the string buffer
     char* strbuf = vm->allocStr(slen + 1);
-    if(w > static_cast<int>(len))
+    char* end;
+    if(ff.left)
     {
-        if(ff.left)
+        end = strbuf + sign + len;
+        memset(end, ' ', slen - sign - len);
+    } else
+    {
+        end = strbuf + slen;
+        if(ff.zero)
         {
-            memcpy(strbuf, buf.Str(), buf.Length());
-            memset(strbuf + len, ' ', w - len);
+            memset(strbuf + sign, '0', slen - sign - len);
         } else
         {
-            memset(strbuf, ff.zero ? '0' : ' ', w - len);
-            memcpy(strbuf + w - len, buf.Str(), buf.Length());
+            memset(strbuf, ' ', slen - sign - len);
+        }
+    }
+    if(sign)
+    {
+        *(ff.zero && !ff.left ? strbuf : end - len - 1) = '-';
+    }
+    if(ff.hex)
+    {
+        const char* sym = ff.uchex ? "0123456789ABCDEF" : "0123456789abcdef";
+        for(size_t i = 0; i < len; ++i, uval >>= 4)
+        {
+            *--end = sym[uval & 0xf];
         }
     } else
     {
-        memcpy(strbuf, buf.Str(), buf.Length());
+        ZString::writeDigits(uval, end);
     }
     strbuf[slen] = 0;
-    res->init(strbuf, slen, false);
+    ZString* res = vm->allocZString();
+    res->init(strbuf, static_cast<uint32_t>(slen), static_cast<uint32_t>(slen));
     Value val;
     val.vt = vtString;
     val.flags = ValFlagNone;
@@ -3009,10 +3054,10 @@ static void formatDouble(ZorroVM* vm, Value* v, int w, int p, ZString* flags, Va
     {
         return;
     }
-    char buf[64];
+    char buf[ZString::maxDoubleChars];
     FormatFlags ff;
     parseFlags(vm, flags, ff);
-    auto len = static_cast<size_t>(snprintf(buf, 64, "%.*lf", p, v->dValue));
+    size_t len = ZString::formatDouble(v->dValue, ff.shortest ? -1 : p < 0 ? 6 : p, buf);
     ZString* res = vm->allocZString();
     size_t slen = len;
     if(w > static_cast<int>(slen))
@@ -3036,7 +3081,7 @@ static void formatDouble(ZorroVM* vm, Value* v, int w, int p, ZString* flags, Va
         memcpy(strbuf, buf, len);
     }
     strbuf[slen] = 0;
-    res->init(strbuf, slen, false);
+    res->init(strbuf, static_cast<uint32_t>(slen), static_cast<uint32_t>(slen));
     Value val;
     val.vt = vtString;
     val.flags = ValFlagNone;
@@ -3060,7 +3105,6 @@ static void formatStr(ZorroVM* vm, Value* v, int w, int p, ZString* flags, Value
     parseFlags(vm, flags, ff);
     ZString* src = v->str;
     size_t len = src->getLength();
-    int cs = src->getCharSize();
     if(p > 0 && static_cast<int>(len) > p)
     {
         len = static_cast<size_t>(p);
@@ -3070,56 +3114,24 @@ static void formatStr(ZorroVM* vm, Value* v, int w, int p, ZString* flags, Value
     {
         slen = static_cast<size_t>(w);
     }
-    if(slen < len)
-    {
-        slen = len;
-    }
-    char* strbuf = vm->allocStr(cs == 1 ? slen + 1 : slen * 2);
-    if(slen > len)
+    //right aligned string without padding is truncated from the left
+    bool tail = ff.right && slen == len;
+    uint32_t from = tail ? src->getCharOffset(vm, static_cast<uint32_t>(src->getLength() - len)) : 0;
+    uint32_t to = tail ? src->getDataSize() : src->getCharOffset(vm, static_cast<uint32_t>(len));
+    size_t size = to - from + slen - len;
+    char* strbuf = vm->allocStr(size + 1);
+    if(ff.right)
     {
-        if(ff.right)
-        {
-            if(cs == 1)
-            {
-                memset(strbuf, ' ', slen - len);
-                memcpy(strbuf + slen - len, src->getDataPtr(), len);
-            } else
-            {
-                char* ptr = strbuf;
-                for(size_t i = 0; i < slen - len; ++i)
-                {
-                    ZString::putUcs2Char(ptr, ' ');
-                }
-                memcpy(ptr, src->getDataPtr(), len * cs);
-            }
-        } else
-        {
-            memcpy(strbuf, src->getDataPtr(), len * cs);
-            if(cs == 1)
-            {
-                memset(strbuf + len, ' ', slen - len);
-            } else
-            {
-                char* ptr = strbuf + (slen - len) * cs;
-                for(size_t i = 0; i < slen - len; ++i)
-                {
-                    ZString::putUcs2Char(ptr, ' ');
-                }
-            }
-        }
+        memset(strbuf, ' ', slen - len);
+        memcpy(strbuf + slen - len, src->getDataPtr() + from, to - from);
     } else
     {
-        if(ff.right)
-        {
-            memcpy(strbuf, src->getDataPtr() + src->getLength() * cs - slen * cs, slen * cs);
-        } else
-        {
-            memcpy(strbuf, src->getDataPtr(), slen * cs);
-        }
+        memcpy(strbuf, src->getDataPtr() + from, to - from);
+        memset(strbuf + to - from, ' ', slen - len);
     }
-    strbuf[slen] = 0;
+    strbuf[size] = 0;
     ZString* str = vm->allocZString();
-    str->init(strbuf, cs == 1 ? slen : slen * 2, cs != 1);
+    str->init(strbuf, static_cast<uint32_t>(size), static_cast<uint32_t>(slen));
     Value res;
     res.vt = vtString;
     res.flags = ValFlagNone;
@@ -3136,13 +3148,14 @@ formatArrEx(ZorroVM* vm, Value* v, int w, int p, ZString* flags, Value* extra, V
         return;
     }
     ZString* delim = nullptr;
+    size_t delimSize = 0;
     size_t delimLength = 0;
-    CStringWrap wrap(nullptr, nullptr, 0);
     if(extra)
     {
         if(extra->vt == vtString)
         {
             delim = extra->str;
+            delimSize = delim->getDataSize();
             delimLength = delim->getLength();
         }
     }
@@ -3151,8 +3164,8 @@ formatArrEx(ZorroVM* vm, Value* v, int w, int p, ZString* flags, Value* extra, V
     Value arr16[16];
     Value* arr = sz <= 16 ? arr16 : new Value[sz];
     Value tmp = NilValue;
+    size_t size = 0;
     size_t len = 0;
-    int cs = 1;
     for(size_t idx = from; idx < till; ++idx)
     {
         Value& item = src->getItem(idx);
@@ -3170,60 +3183,42 @@ formatArrEx(ZorroVM* vm, Value* v, int w, int p, ZString* flags, Value* extra, V
             }
             ZASSIGN(vm, &tmp, dst);
         }
-        arr[idx] = tmp;
+        arr[idx - from] = tmp;
         tmp.str->ref();
+        size += tmp.str->getDataSize();
         len += tmp.str->getLength();
-        if(tmp.str->getCharSize() != 1)
-        {
-            cs = 2;
-        }
-        if(idx < sz - 1)
+        if(idx < till - 1)
         {
+            size += delimSize;
             len += delimLength;
         }
         ZUNREF(vm, &tmp);
     }
     ZString* str = vm->allocZString();
-    char* strBuf = vm->allocStr(cs * len + (cs & 1));
+    char* strBuf = vm->allocStr(size + 1);
     char* ptr = strBuf;
     Value res;
     res.vt = vtString;
     res.flags = ValFlagNone;
     res.str = str;
-    for(size_t idx = from; idx < till; ++idx)
+    for(size_t idx = 0; idx < sz; ++idx)
     {
         ZString& astr = *arr[idx].str;
-        if(cs == 2)
-        {
-            astr.uappend(ptr);
-        } else
-        {
-            size_t l = arr[idx].str->getLength();
-            memcpy(ptr, arr[idx].str->c_str(vm), l);
-            ptr += l;
-        }
+        memcpy(ptr, astr.getDataPtr(), astr.getDataSize());
+        ptr += astr.getDataSize();
         ZUNREF(vm, arr + idx);
         if(delim && idx < sz - 1)
         {
-            if(cs == 2)
-            {
-                delim->uappend(ptr);
-            } else
-            {
-                memcpy(ptr, delim->getDataPtr(), delimLength);
-                ptr += delimLength;
-            }
+            memcpy(ptr, delim->getDataPtr(), delimSize);
+            ptr += delimSize;
         }
     }
     if(sz > 16)
     {
         delete[] arr;
     }
-    if(cs == 1)
-    {
-        *ptr = 0;
-    }
-    str->init(strBuf, len * cs, cs == 2);
+    *ptr = 0;
+    str->init(strBuf, static_cast<uint32_t>(size), static_cast<uint32_t>(len));
 
     ZASSIGN(vm, dst, &res);
 }
@@ -3500,81 +3495,39 @@ static void copySlice(ZorroVM* vm, Value* val, Value* dst)
     if(sv->vt == vtString)
     {
         ZString* str = sv->str;
-        Value res;
-        res.vt = vtString;
-        res.flags = ValFlagNone;
-        res.str = vm->allocZString();
         ZArray& za = *val->slice->indeces.arr;
         const char* strData = str->getDataPtr();
-        int cs = str->getCharSize();
-        int dcs = cs;
-        if(cs != 1)
+        size_t size = 0;
+        for(size_t i = 0; i < za.getCount(); ++i)
         {
-            dcs = 1;
-            for(size_t i = 0; i < za.getCount(); ++i)
+            Value& idx = za.getItem(i);
+            if(idx.vt != vtInt)
             {
-                Value& idx = za.getItem(i);
-                if(idx.vt != vtInt)
-                {
-                    ZTHROWR(TypeException, vm, "Invalid type for slice index:%{}", getValueTypeName(idx.vt));
-                }
-                ZString::char_type wc;
-                memcpy(&wc, strData + idx.iValue * cs, static_cast<size_t>(cs));
-                if(wc > 255)
-                {
-                    dcs = cs;
-                    break;
-                }
+                ZTHROWR(TypeException, vm, "Invalid type for slice index:%{}", getValueTypeName(idx.vt));
             }
-        }
-        char* newStr;
-        if(dcs == 1)
-        {
-            newStr = vm->allocStr(za.getCount() + 1);
-            for(size_t i = 0; i < za.getCount(); ++i)
+            if(idx.iValue < 0 || idx.iValue >= str->getLength())
             {
-                Value& idx = za.getItem(i);
-                if(idx.vt != vtInt)
-                {
-                    vm->freeStr(newStr, za.getCount() + 1);
-                    ZTHROWR(TypeException, vm, "Invalid type for slice index:%{}", getValueTypeName(idx.vt));
-                }
-                if(idx.iValue < 0 || idx.iValue >= str->getLength())
-                {
-                    vm->freeStr(newStr, za.getCount() + 1);
-                    throwOutOfBounds(vm, "Slice of string index out of bounds", idx.iValue, str->getLength());
-                }
-                ZString::char_type wc;
-                memcpy(&wc, strData + idx.iValue * cs, static_cast<size_t>(cs));
-                newStr[i] = static_cast<char>(wc);
-            }
-            newStr[za.getCount()] = 0;
-        } else
-        {
-            newStr = vm->allocStr(za.getCount() * dcs);
-            for(size_t i = 0; i < za.getCount(); ++i)
-            {
-                Value& idx = za.getItem(i);
-                if(idx.vt != vtInt)
-                {
-                    vm->freeStr(newStr, za.getCount() * dcs);
-                    ZTHROWR(TypeException, vm, "Invalid type for slice index:%{}", getValueTypeName(idx.vt));
-                }
-                if(idx.iValue < 0 || idx.iValue >= str->getLength())
-                {
-                    vm->freeStr(newStr, za.getCount() * dcs);
-                    throwOutOfBounds(vm, "Slice of string index out of bounds", idx.iValue, str->getLength());
-                }
-                memcpy(newStr + i * dcs, strData + idx.iValue * cs, static_cast<size_t>(dcs));
+                throwOutOfBounds(vm, "Slice of string index out of bounds", idx.iValue, str->getLength());
             }
+            auto ci = static_cast<uint32_t>(idx.iValue);
+            size += str->getCharOffset(vm, ci + 1) - str->getCharOffset(vm, ci);
         }
-        if(dcs == 1)
-        {
-            res.str->init(newStr, za.getCount(), false);
-        } else
-        {
-            res.str->init(newStr, za.getCount() * dcs, true);
+        char* newStr = vm->allocStr(size + 1);
+        char* ptr = newStr;
+        for(size_t i = 0; i < za.getCount(); ++i)
+        {
+            auto ci = static_cast<uint32_t>(za.getItem(i).iValue);
+            uint32_t from = str->getCharOffset(vm, ci);
+            uint32_t to = str->getCharOffset(vm, ci + 1);
+            memcpy(ptr, strData + from, to - from);
+            ptr += to - from;
         }
+        *ptr = 0;
+        Value res;
+        res.vt = vtString;
+        res.flags = ValFlagNone;
+        res.str = vm->allocZString();
+        res.str->init(newStr, static_cast<uint32_t>(size), static_cast<uint32_t>(za.getCount()));
         ZASSIGN(vm, dst, &res);
     } else if(sv->vt == vtArray)
     {
@@ -3914,7 +3867,7 @@ static void callClass(ZorroVM* vm, Value* val)
         res.obj->members = nullptr;
     }
     res.obj->classInfo = classInfo;
-    classInfo->ref();
+    classInfo->refInstance();
 
     if(ctor)
     {
@@ -4276,7 +4229,7 @@ static bool initForClosure(ZorroVM* vm, Value* val, Value* /*var*/, Value* tmp)
     vm->pushFrame(vm->dummyCallOp, vm->corRetOp, 0, cls.func->index);
     vm->ctx.nextOp = cls.func->entry;
     vm->ctx.dataStack.pushBulk(cls.func->localsCount);
-    Value* clsVal = ctx.dataStack.stackTop;
+    Value* clsVal = vm->ctx.dataStack.stackTop;
     ZASSIGN(vm, clsVal, val);
     if(selfCls)
     {
@@ -4753,7 +4706,7 @@ static void unrefObj(ZorroVM* vm, Value* val)
                     ZUNREF(vm, &zo.members[i]);
                 }
                 vm->freeVArray(zo.members, zo.classInfo->membersCount);
-                if(zo.classInfo->unref())
+                if(zo.classInfo->unrefInstance())
                 {
                     delete zo.classInfo;
                 }
@@ -4766,16 +4719,20 @@ static void unrefObj(ZorroVM* vm, Value* val)
     } else
     {
         CLEARWEAK;
-        for(size_t i = 0; i < zo.classInfo->membersCount; i++)
-        {
-            ZUNREF(vm, &zo.members[i]);
-        }
-        vm->freeVArray(zo.members, zo.classInfo->membersCount);
-        if(zo.classInfo->unref())
+        //object that was not completely loaded from module has no class
+        if(zo.classInfo)
         {
-            delete zo.classInfo;
+            for(size_t i = 0; i < zo.classInfo->membersCount; i++)
+            {
+                ZUNREF(vm, &zo.members[i]);
+            }
+            vm->freeVArray(zo.members, zo.classInfo->membersCount);
+            if(zo.classInfo->unrefInstance())
+            {
+                delete zo.classInfo;
+            }
+            zo.classInfo = nullptr;
         }
-        zo.classInfo = nullptr;
     }
 
     vm->ZorroVM::freeObj(val->obj);
@@ -4789,7 +4746,7 @@ static void unrefNObj(ZorroVM* vm, Value* val)
     {
         vm->symbols.globals[didx].cmethod->cmethod(vm, val);
     }
-    val->nobj->classInfo->unref();
+    val->nobj->classInfo->unrefInstance();
     vm->freeNObj(val->nobj);
 }
 
@@ -4831,6 +4788,7 @@ static void unrefCor(ZorroVM* vm, Value* val)
     ctx.dataStack.reset();
     ctx.callStack.reset();
     ctx.catchStack.reset();
+    ctx.trimCoroutineStacks();
     vm->freeCoroutine(val->cor);
 }
 
@@ -5464,9 +5422,6 @@ void ZorroVM::rxMatch(Value* l, Value* r, Value* d, OpArg* vars)
     {
         r = &r->valueRef->value;
     }
-    int cs;
-    const char* start;
-    const char* end;
     size_t startOff = 0;
     size_t endOff = 0;
     if(l->vt != vtString || r->vt != vtRegExp)
@@ -5483,15 +5438,12 @@ void ZorroVM::rxMatch(Value* l, Value* r, Value* d, OpArg* vars)
     if(l->vt == vtString)
     {
         s = l->str;
-        cs = s->getCharSize();
-        start = s->getDataPtr();
-        end = start + s->getDataSize();
+        endOff = s->getLength();
     } else
     {
         const Segment& seg = *l->seg;
         sval = &seg.cont;
         s = seg.cont.str;
-        cs = s->getCharSize();
         if(seg.segStart >= 0)
         {
             startOff = static_cast<size_t>(seg.segStart);
@@ -5509,16 +5461,20 @@ void ZorroVM::rxMatch(Value* l, Value* r, Value* d, OpArg* vars)
         {
             endOff = s->getLength();
         }
-        start = s->getDataPtr() + startOff * cs;
-        end = s->getDataPtr() + endOff * cs;
     }
     int res;
-    if(cs == 1)
+    if(s->isAscii())
     {
-        res = rxv->val->Search(start, end, mi);
+        const char* start = s->getDataPtr() + startOff;
+        res = rxv->val->Search(start, s->getDataPtr() + endOff, mi);
     } else
     {
-        res = rxv->val->Search((uint16_t*) start, (uint16_t*) end, mi);
+        //regexp works with fixed size chars
+        const char* start = s->getDataPtr() + s->getCharOffset(this, static_cast<uint32_t>(startOff));
+        const char* end = s->getDataPtr() + s->getCharOffset(this, static_cast<uint32_t>(endOff));
+        std::vector<uint16_t> buf(endOff - startOff + 1);
+        ZString::toUcs2(start, end, &buf[0]);
+        res = rxv->val->Search(&buf[0], &buf[0] + (endOff - startOff), mi);
     }
     if(!res)
     {
@@ -5575,7 +5531,266 @@ void ZorroVM::rxMatch(Value* l, Value* r, Value* d, OpArg* vars)
     }
 }
 
-ZorroVM::ZorroVM() : symbols(this)/*,ctx(*(new ZVMContext))*/, entry(nullptr)
+#ifdef ZVM_STATIC_MATRIX
+static std::once_flag matricesOnce;
+#endif
+
+static void fillMatrices(ZorroVM* vm)
+{
+#ifdef ZVM_STATIC_MATRIX
+    //matrices are shared, vms can be created in parallel threads
+    std::call_once(matricesOnce, &ZorroVM::initMatrices, vm);
+#else
+    vm->initMatrices();
+#endif
+}
+
+ZorroVM::ZorroVM() : symbols(this)/*,ctx(*(new ZVMContext))*/, entry(nullptr), running(false), scheduler(nullptr),
+    parPool(nullptr), program(nullptr), codeShared(false), instances(0)
+{
+    fillMatrices(this);
+
+    initStd();
+
+    result = NilValue;
+
+    dummyCallOp = new OpCall(0, OpArg(atLocal, 0), atNul);
+    corRetOp = new OpEndCoroutine();
+}
+
+static SymbolsInfo* getSharedSymbols(ZorroVM* program)
+{
+    if(!program->codeShared)
+    {
+        throw std::runtime_error("Code of program vm is not shared");
+    }
+    return &program->symbols;
+}
+
+typedef std::unordered_map<RefBase*, Value> ClonedValues;
+
+/*
+  Copy of global value in memory of vm, containers shared by globals stay shared.
+  Value of the same vm is copied for reset point, immutable strings and regexps are not copied in this case.
+*/
+static Value cloneGlobal(ZorroVM* vm, const Value& v, ClonedValues& cloned, bool sameMemory)
+{
+    if(!ZISREFTYPE(&v))
+    {
+        return v;
+    }
+    if(sameMemory && (v.vt == vtString || v.vt == vtRegExp))
+    {
+        v.refBase->ref();
+        return v;
+    }
+    auto it = cloned.find(v.refBase);
+    if(it != cloned.end())
+    {
+        it->second.refBase->ref();
+        return it->second;
+    }
+    Value rv = v;
+    switch(v.vt)
+    {
+        case vtString:
+            rv.str = vm->allocZString(v.str->getDataPtr(), v.str->getDataSize());
+            break;
+        case vtArray:
+            rv.arr = vm->allocZArray();
+            break;
+        case vtMap:
+            rv.map = vm->allocZMap();
+            break;
+        case vtSet:
+            rv.set = vm->allocZSet();
+            break;
+        case vtRange:
+            rv.range = vm->allocRange();
+            break;
+        case vtRegExp:
+            rv.regexp = vm->allocRegExp();
+            break;
+        case vtObject:
+            rv.obj = vm->allocObj();
+            rv.obj->classInfo = v.obj->classInfo;
+            rv.obj->members = nullptr;
+            rv.obj->classInfo->refInstance();
+            break;
+        default:
+            throw std::runtime_error(FORMAT("Value of type %{} cannot be copied", getValueTypeName(v.vt)));
+    }
+    //one reference is kept by map of cloned values until instance is created
+    rv.refBase->ref();
+    cloned.emplace(v.refBase, rv);
+    rv.refBase->ref();
+    switch(v.vt)
+    {
+        case vtArray:
+            for(size_t i = 0; i < v.arr->getCount(); ++i)
+            {
+                rv.arr->push(cloneGlobal(vm, v.arr->getItem(i), cloned, sameMemory));
+            }
+            rv.arr->isSimpleContent = v.arr->isSimpleContent;
+            break;
+        case vtMap:
+            for(auto& kv : *v.map)
+            {
+                Value key = cloneGlobal(vm, kv.m_key, cloned, sameMemory);
+                Value val = cloneGlobal(vm, kv.m_value, cloned, sameMemory);
+                rv.map->insert(key, val);
+                vm->unref(key);
+                vm->unref(val);
+            }
+            break;
+        case vtSet:
+            for(auto& item : *v.set)
+            {
+                Value val = cloneGlobal(vm, item, cloned, sameMemory);
+                rv.set->insert(val);
+                vm->unref(val);
+            }
+            break;
+        case vtRange:
+            rv.range->start = v.range->start;
+            rv.range->end = v.range->end;
+            rv.range->step = v.range->step;
+            break;
+        case vtRegExp:
+        {
+            ZString* src = v.regexp->src;
+            if(!src || !vm->compileRegExp(rv.regexp, vm->allocZString(src->getDataPtr(), src->getDataSize())))
+            {
+                throw std::runtime_error("Regexp without source cannot be copied");
+            }
+        }
+            break;
+        case vtObject:
+        {
+            size_t count = v.obj->classInfo->membersCount;
+            if(count)
+            {
+                rv.obj->members = vm->allocVArray(count);
+                memset(rv.obj->members, 0, sizeof(Value) * count);
+                for(size_t i = 0; i < count; ++i)
+                {
+                    rv.obj->members[i] = cloneGlobal(vm, v.obj->members[i], cloned, sameMemory);
+                }
+            }
+        }
+            break;
+        default:
+            break;
+    }
+    return rv;
+}
+
+static void copyGlobals(ZorroVM* vm, Value* dst, const Value* src, size_t count, bool sameMemory)
+{
+    ClonedValues cloned;
+    for(size_t i = 0; i < count; ++i)
+    {
+        dst[i] = cloneGlobal(vm, src[i], cloned, sameMemory);
+    }
+    for(auto& it : cloned)
+    {
+        vm->unref(it.second);
+    }
+}
+
+ZorroVM::ZorroVM(ZorroVM* argProgram, bool argCopyGlobals) : symbols(this, getSharedSymbols(argProgram)), entry(nullptr),
+    running(false), scheduler(nullptr), parPool(nullptr), program(argProgram), codeShared(false), instances(0)
+{
+    fillMatrices(this);
+
+    objectClass = program->objectClass;
+    nilClass = program->nilClass;
+    boolClass = program->boolClass;
+    intClass = program->intClass;
+    doubleClass = program->doubleClass;
+    classClass = program->classClass;
+    stringClass = program->stringClass;
+    arrayClass = program->arrayClass;
+    mapClass = program->mapClass;
+    setClass = program->setClass;
+    rangeClass = program->rangeClass;
+    corClass = program->corClass;
+    funcClass = program->funcClass;
+    clsClass = program->clsClass;
+    dlgClass = program->dlgClass;
+
+    if(argCopyGlobals)
+    {
+        copyGlobals(this, symbols.globals, program->symbols.globals, symbols.globalsCount, false);
+    }
+
+    initSchedInstance();
+
+    result = NilValue;
+
+    dummyCallOp = new OpCall(0, OpArg(atLocal, 0), atNul);
+    corRetOp = new OpEndCoroutine();
+    ++program->instances;
+}
+
+Value ZorroVM::importValue(const Value& v)
+{
+    if(!ZISREFTYPE(&v))
+    {
+        return v;
+    }
+    //strings can't refer to other values, map of cloned values is not needed
+    if(v.vt == vtString)
+    {
+        Value rv = v;
+        rv.str = allocZString(v.str->getDataPtr(), v.str->getDataSize());
+        rv.str->ref();
+        return rv;
+    }
+    ClonedValues cloned;
+    Value rv = cloneGlobal(this, v, cloned, false);
+    for(auto& it : cloned)
+    {
+        unref(it.second);
+    }
+    return rv;
+}
+
+void ZorroVM::shareCode()
+{
+    if(codeShared)
+    {
+        return;
+    }
+    symbols.init();
+    for(size_t i = 0; i < symbols.globalsCount; ++i)
+    {
+        Value& v = symbols.globals[i];
+        if(v.vt == vtClass)
+        {
+            v.classInfo->shared = true;
+        }
+    }
+    //hash codes of names are calculated on first use, do it now while nothing else reads them
+    for(SymInfo* sym : symbols.info)
+    {
+        if(!sym)
+        {
+            continue;
+        }
+        sym->name.val->getHashCode();
+        if(sym->st == sytFunction || sym->st == sytMethod)
+        {
+            for(SymInfo* local : static_cast<FuncInfo*>(sym)->locals)
+            {
+                local->name.val->getHashCode();
+            }
+        }
+    }
+    codeShared = true;
+}
+
+void ZorroVM::initMatrices()
 {
     for(int l = 0; l < vtCount; l++)
     {
@@ -6136,18 +6351,18 @@ ZorroVM::ZorroVM() : symbols(this)/*,ctx(*(new ZVMContext))*/, entry(nullptr)
     getTypeOps[vtFunc] = getTypeFunc;
     getTypeOps[vtClosure] = getTypeClosure;
     getTypeOps[vtRef] = getTypeRef;
-
-    initStd();
-
-    result = NilValue;
-
-    dummyCallOp = new OpCall(0, OpArg(atLocal, 0), atNul);
-    corRetOp = new OpEndCoroutine();
 }
 
 
 ZorroVM::~ZorroVM()
 {
+    if(program)
+    {
+        --program->instances;
+    }
+    clearPar();
+    clearResetPoint();
+    clearSched();
     delete corRetOp;
     delete dummyCallOp;
     if(ctx.callStack.size() > 0)
@@ -6156,6 +6371,69 @@ ZorroVM::~ZorroVM()
     }
 }
 
+void ZorroVM::markResetPoint()
+{
+    clearResetPoint();
+    resetGlobals.resize(symbols.globalsCount);
+    copyGlobals(this, resetGlobals.data(), symbols.globals, symbols.globalsCount, true);
+}
+
+void ZorroVM::clearResetPoint()
+{
+    for(auto& v : resetGlobals)
+    {
+        unref(v);
+    }
+    resetGlobals.clear();
+}
+
+void ZorroVM::reset()
+{
+    if(resetGlobals.empty() && !program)
+    {
+        throw std::runtime_error("Reset point is not marked");
+    }
+    //native exception can leave vm in context of coroutine
+    while(ctx.coroutine)
+    {
+        ctx.swap(ctx.coroutine->ctx);
+    }
+    //destructors are not called for released values, as in deinit
+    running = false;
+    resetSched();
+    if(ctx.dataStack.stack)
+    {
+        cleanStack(0);
+    }
+    while(!ctx.destructorStack.empty())
+    {
+        unref(*ctx.destructorStack.stackTop);
+        ctx.destructorStack.pop();
+    }
+    ctx.catchStack.reset();
+    if(ctx.callStack.stack)
+    {
+        ctx.callStack.setSize(1);
+    }
+    ctx.nextOp = nullptr;
+    ctx.lastOp = nullptr;
+    clearResult();
+    //values of globals can refer to each other, all are released before copies are made
+    size_t count = resetGlobals.empty() ? symbols.globalsCount : resetGlobals.size();
+    for(size_t i = 0; i < count; ++i)
+    {
+        unref(symbols.globals[i]);
+    }
+    if(resetGlobals.empty())
+    {
+        copyGlobals(this, symbols.globals, program->symbols.globals, count, false);
+    } else
+    {
+        copyGlobals(this, symbols.globals, resetGlobals.data(), count, true);
+    }
+    init();
+}
+
 void ZorroVM::setEntry(OpBase* argEntry)
 {
     entry = new ZCode(this, argEntry);
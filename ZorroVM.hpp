@@ -1,6 +1,7 @@
 #ifndef __ZORRO_ZORROVM_HPP__
 #define __ZORRO_ZORROVM_HPP__
 
+#include <atomic>
 #include <map>
 #include <string>
 #include "Exceptions.hpp"
@@ -79,14 +80,26 @@ struct ZVMContext {
 
     }
 
+    /*
+      Switches coroutine and context that resumed it.
+      Null and global data pointers are the same in all contexts and stay in place.
+      Destructor and catch stacks are empty most of the time,
+      there is no need to exchange their storage in this case.
+    */
     void swap(ZVMContext& other)
     {
-        destructorStack.swap(other.destructorStack);
         dataStack.swap(other.dataStack);
         callStack.swap(other.callStack);
-        catchStack.swap(other.catchStack);
+        if(!destructorStack.empty() || !other.destructorStack.empty())
+        {
+            destructorStack.swap(other.destructorStack);
+        }
+        if(!catchStack.empty() || !other.catchStack.empty())
+        {
+            catchStack.swap(other.catchStack);
+        }
         Value* ptr;
-        for(size_t i = 0; i < atStack; ++i)
+        for(size_t i = atLocal; i < atStack; ++i)
         {
             ptr = dataPtrs[i];
             dataPtrs[i] = other.dataPtrs[i];
@@ -102,6 +115,28 @@ struct ZVMContext {
         coroutine = other.coroutine;
         other.coroutine = c;
     }
+
+    /*
+      Coroutine contexts start with small stacks that grow on demand.
+      Contexts are pooled with coroutines, stacks that grew too big are released on free.
+    */
+    static const size_t corDataStackSize = 32;
+    static const size_t corCallStackSize = 8;
+    static const size_t corMaxPooledSize = 1024;
+
+    void reserveCoroutineStacks()
+    {
+        dataStack.reserve(corDataStackSize);
+        callStack.reserve(corCallStackSize);
+    }
+
+    void trimCoroutineStacks()
+    {
+        dataStack.release(corMaxPooledSize);
+        callStack.release(corMaxPooledSize);
+        destructorStack.release(corMaxPooledSize);
+        catchStack.release(corMaxPooledSize);
+    }
 };
 
 struct Coroutine : RefBase {
@@ -109,6 +144,9 @@ struct Coroutine : RefBase {
     OpArg result;
 };
 
+struct ZScheduler;
+struct ZParPool;
+
 
 std::string ValueToString(ZorroVM* vm, const Value& v);
 
@@ -143,11 +181,25 @@ if((za_dst)->flags&ValFlagConst)\
 #define ZCLOSED(vm, idx) vm->ctx.dataPtrs[atClosed][idx]
 
 
+/*
+  Each vm is independent and can run in its own thread, one thread per vm at a time.
+  State shared by all vms is filled once and read-only after that:
+  operator matrices (under ZVM_STATIC_MATRIX), lexer keywords, parser grammar and string kernels.
+  kst::Logger is not thread safe, it is not used by the vm and should be set up before threads start.
+*/
 class ZorroVM : public ZMemory {
 public:
 
     ZorroVM();
 
+    /*
+      Instance of code compiled in program vm, program must call shareCode() first and outlive instance.
+      Ops and symbols are shared, globals are copied and heap is own, so instances can run in parallel threads.
+      Natives are taken from program too, nothing can be registered or compiled in instance.
+      Without argCopyGlobals globals are left nil for the caller to fill.
+    */
+    explicit ZorroVM(ZorroVM* argProgram, bool argCopyGlobals = true);
+
     virtual ~ZorroVM();
 
     ZorroVM(const ZorroVM&) = delete;
@@ -160,8 +212,70 @@ public:
 
     void initStd();
 
+    /* Fills operator matrices, once per process if they are static */
+    void initMatrices();
+
+    /*
+      Freezes compiled code so it can be used by instances.
+      Nothing can be compiled or registered after that, vm itself can still run.
+    */
+    void shareCode();
+
+    /*
+      sched:: namespace, cooperative tasks on top of coroutines.
+      Implemented in ZVMSched.cpp.
+    */
+    void initSched();
+
+    /* scheduler of instance, native classes are taken from program */
+    void initSchedInstance();
+
+    void clearSched();
+
+    /* releases tasks but keeps scheduler */
+    void resetSched();
+
+    /* io:: namespace, non-blocking I/O for tasks. Implemented in ZVMIO.cpp. */
+    void initIO();
+
+    /*
+      par:: namespace, map and grep of arrays on pool of worker instances.
+      Implemented in ZVMPar.cpp.
+    */
+    void initPar();
+
+    /* stops worker threads of pool created by this vm */
+    void clearPar();
+
+    /*
+      Copy of value of other vm in memory of this vm, containers are copied deeply.
+      Other vm must not run meanwhile.
+    */
+    Value importValue(const Value& v);
+
+    /*
+      Remembers values of globals as state that reset() returns to, usually right after init().
+      Values are copied, so later runs can't change remembered state.
+    */
+    void markResetPoint();
+
+    /*
+      Returns vm to the state of reset point, as if init() was just called, so entry can run again.
+      Stacks, tasks and result are released and globals get copies of remembered values.
+      Instance without reset point gets copies of program globals.
+      Symbols, code, natives and pages of memory pools are kept.
+    */
+    void reset();
+
     void deinit()
     {
+        clearPar();
+        if(instances.load())
+        {
+            throw std::runtime_error("Shared code is still used by instances");
+        }
+        clearResetPoint();
+        clearSched();
         running = false;
         entry = 0;
         unref(symbols.globals[objectClass->index]);
@@ -183,14 +297,16 @@ public:
 
 #endif
 
-    void run()
+    /* runs entry code from the start or from given op of it */
+    void run(OpBase* from = nullptr)
     {
-        if(!entry.get()->code)
+        ZCode* code = program ? program->entry.get() : entry.get();
+        if(!code->code)
         {
             return;
         }
         running = true;
-        ctx.nextOp = entry.get()->code;
+        ctx.nextOp = from ? from : code->code;
         resume();
     }
 
@@ -562,6 +678,14 @@ public:
 
     ZCodeRef entry;
     bool running;
+    ZScheduler* scheduler;
+    ZParPool* parPool;  // workers of par:: calls, shared with workers themselves
+    ZorroVM* program;  // owner of shared code for instance, nullptr otherwise
+    bool codeShared;
+    std::atomic<int> instances;
+    std::vector<Value> resetGlobals;
+
+    void clearResetPoint();
 };
 
 }
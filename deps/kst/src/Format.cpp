@@ -201,7 +201,7 @@ FormatBuffer& format(const ArgsList& a)
               case ArgsList::vtLong:
               {
                 hex?fmtinthex((unsigned long)arg->l,buf,w,lz,hex==2):
-                fmtintunsign(arg->l,buf,w,lz);
+                fmtintsign(arg->l,buf,w,lz);
               }break;
               case ArgsList::vtULong:
               {
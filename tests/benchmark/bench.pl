@@ -38,6 +38,11 @@ my $tests={
     lua=>'join.lua',
     python=>'join.py'
   },
+  strappend=>{
+    zorro=>'strappend.zs',
+    lua=>'strappend.lua',
+    python=>'strappend.py'
+  },
   methods=>{
     zorro=>'methods.zs',
     lua=>'methods.lua',
@@ -47,6 +52,24 @@ my $tests={
     zorro=>'hashswap.zs',
     lua=>'hashswap.lua',
     python=>'hashswap.py'
+  },
+  numfmt=>{
+    zorro=>'numfmt.zs',
+    lua=>'numfmt.lua',
+    python=>'numfmt.py'
+  },
+  generators=>{
+    zorro=>'generators.zs',
+    lua=>'generators.lua',
+    python=>'generators.py'
+  },
+  tasks=>{
+    zorro=>'tasks.zs',
+    python=>'tasks.py'
+  },
+  pipes=>{
+    zorro=>'pipes.zs',
+    python=>'pipes.py'
   }
 };
 
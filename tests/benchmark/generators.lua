@@ -0,0 +1,14 @@
+local function pair(n)
+  return coroutine.wrap(function()
+    coroutine.yield(n)
+    coroutine.yield(n + 1)
+  end)
+end
+
+local s = 0
+for i = 0, 999999 do
+  for x in pair(i) do
+    s = s + x
+  end
+end
+print(s)
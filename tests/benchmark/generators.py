@@ -0,0 +1,11 @@
+def pair(n):
+  yield n
+  yield n + 1
+
+def t():
+  s = 0
+  for i in range(1000000):
+    for x in pair(i):
+      s += x
+  print(s)
+t()
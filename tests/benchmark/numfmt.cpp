@@ -0,0 +1,93 @@
+/*
+ Microbenchmark for number formatting and parsing.
+ Compares ZString::formatInt/formatDouble/parseInt/parseDouble with the
+ printf/kst::format/strtod based code they replaced and checks that
+ shortest double representation parses back to the same value.
+ Build with -DZORRO_BENCHMARKS=ON, run as zorro-numbench [count].
+*/
+#include "ZString.hpp"
+#include <kst/Format.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include <chrono>
+
+using namespace zorro;
+
+static volatile size_t sink;
+
+template<class F>
+static double measure(size_t count, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < count; ++i)
+    {
+        sink = sink + f(i);
+    }
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return d.count() * 1e9 / static_cast<double>(count);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t count = argc > 1 ? static_cast<size_t>(atol(argv[1])) : 1000000;
+    std::vector<int64_t> ints(count);
+    std::vector<double> doubles(count);
+    uint64_t seed = 88172645463325252ull;
+    for(size_t i = 0; i < count; ++i)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        ints[i] = static_cast<int64_t>(seed) >> (seed % 60);
+        doubles[i] = static_cast<double>(static_cast<int64_t>(seed >> 11)) / static_cast<double>(1 + (seed % 100000));
+    }
+    std::vector<std::string> intStr(count), dblStr(count);
+    char buf[ZString::maxDoubleChars + 1];
+    for(size_t i = 0; i < count; ++i)
+    {
+        intStr[i].assign(buf, ZString::formatInt(ints[i], buf));
+        dblStr[i].assign(buf, ZString::formatDouble(doubles[i], -1, buf));
+        if(ZString::parseInt(intStr[i].c_str()) != ints[i] || ZString::parseDouble(dblStr[i].c_str()) != doubles[i])
+        {
+            printf("round trip failed for %s or %s\n", intStr[i].c_str(), dblStr[i].c_str());
+            return 1;
+        }
+    }
+
+    printf("%-24s %10s\n", "", "ns/number");
+    printf("%-24s %10.1f\n", "int kst::format", measure(count, [&](size_t i) {
+        kst::FormatBuffer fb;
+        kst::format((fb.getArgList(), "%{}", ints[i]));
+        return fb.Length();
+    }));
+    printf("%-24s %10.1f\n", "int formatInt", measure(count, [&](size_t i) {
+        return (size_t) ZString::formatInt(ints[i], buf);
+    }));
+    printf("%-24s %10.1f\n", "double snprintf %lf", measure(count, [&](size_t i) {
+        return (size_t) snprintf(buf, sizeof(buf), "%lf", doubles[i]);
+    }));
+    printf("%-24s %10.1f\n", "double formatDouble 6", measure(count, [&](size_t i) {
+        return (size_t) ZString::formatDouble(doubles[i], 6, buf);
+    }));
+    printf("%-24s %10.1f\n", "double snprintf %.17g", measure(count, [&](size_t i) {
+        return (size_t) snprintf(buf, sizeof(buf), "%.17g", doubles[i]);
+    }));
+    printf("%-24s %10.1f\n", "double formatDouble -1", measure(count, [&](size_t i) {
+        return (size_t) ZString::formatDouble(doubles[i], -1, buf);
+    }));
+    printf("%-24s %10.1f\n", "int strtoll", measure(count, [&](size_t i) {
+        return (size_t) strtoll(intStr[i].c_str(), 0, 10);
+    }));
+    printf("%-24s %10.1f\n", "int parseInt", measure(count, [&](size_t i) {
+        return (size_t) ZString::parseInt(intStr[i].c_str());
+    }));
+    printf("%-24s %10.1f\n", "double strtod", measure(count, [&](size_t i) {
+        return (size_t) strtod(dblStr[i].c_str(), 0);
+    }));
+    printf("%-24s %10.1f\n", "double parseDouble", measure(count, [&](size_t i) {
+        return (size_t) ZString::parseDouble(dblStr[i].c_str());
+    }));
+    return 0;
+}
@@ -0,0 +1,9 @@
+local x=0
+local d=0.5
+local sf=string.format
+for i=1,1000000 do
+  local s=sf("%d:%8d:%.3f",i,i,d)
+  x=x+#s
+  d=d+1.25
+end
+print(x)
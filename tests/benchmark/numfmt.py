@@ -0,0 +1,10 @@
+def f():
+  x=0
+  d=0.5
+  for i in range(1,1000001):
+    s="%d:%8d:%.3f"%(i,i,d)
+    x+=len(s)
+    d+=1.25
+  print(x)
+
+f()
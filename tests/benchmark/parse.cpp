@@ -0,0 +1,168 @@
+/*
+ Parser throughput benchmark.
+ Generates source with long expression-heavy lines: list assignments, nested calls,
+ ternaries and literals, that make parser try several alternatives at the same place.
+ Parses it with and without memoization of rule results, checks that syntax trees
+ are the same and prints time and MB/s.
+ Build with -DZORRO_BENCHMARKS=ON, run as zorro-parsebench [lines] [iterations].
+*/
+#include "ZorroParser.hpp"
+#include "ZorroVM.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <chrono>
+
+using namespace zorro;
+
+static uint32_t seed = 12345;
+
+static uint32_t rnd(uint32_t n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+static void genExpr(std::string& out, int depth, bool cmp)
+{
+    static const char* atoms[] = {"a", "b", "c", "1", "2.5", "\"s\"", "x.y", "f(a)", "arr[i]"};
+    static const char* ops[] = {" + ", " * ", " - ", " / ", " < ", " == ", " and ", " or "};
+    if(depth == 0)
+    {
+        out += atoms[rnd(9)];
+        return;
+    }
+    switch(rnd(9))
+    {
+        case 0:
+        case 1:
+        case 2:
+            genExpr(out, depth - 1, cmp);
+            out += ops[rnd(cmp ? 8 : 4)];
+            genExpr(out, depth - 1, cmp);
+            break;
+        case 3:
+            out += '(';
+            genExpr(out, depth - 1, cmp);
+            out += ')';
+            break;
+        case 4:
+            out += "f(";
+            genExpr(out, depth - 1, cmp);
+            out += ", ";
+            genExpr(out, depth - 1, cmp);
+            out += ')';
+            break;
+        case 5:
+            out += '[';
+            genExpr(out, depth - 1, cmp);
+            out += ", ";
+            genExpr(out, depth - 1, cmp);
+            out += ']';
+            break;
+        case 6:
+            out += "m{";
+            genExpr(out, depth - 1, cmp);
+            out += '}';
+            break;
+        case 7:
+            out += rnd(2) ? "o.p(" : "o.q(";
+            genExpr(out, depth - 1, cmp);
+            out += ')';
+            break;
+        default:
+            out += '(';
+            genExpr(out, depth - 1, cmp);
+            out += " ? ";
+            genExpr(out, depth - 1, cmp);
+            out += " : ";
+            genExpr(out, depth - 1, cmp);
+            out += ')';
+            break;
+    }
+}
+
+static std::string genSource(int lines)
+{
+    std::string out;
+    for(int i = 0; i < lines; ++i)
+    {
+        switch(rnd(4))
+        {
+            case 0:
+                out += "x = ";
+                genExpr(out, 4, true);
+                break;
+            case 1:
+                out += "a, b = ";
+                genExpr(out, 3, false);
+                out += ", ";
+                genExpr(out, 3, false);
+                break;
+            case 2:
+                out += "f(";
+                genExpr(out, 4, true);
+                out += ')';
+                break;
+            default:
+                out += "if ";
+                genExpr(out, 3, true);
+                out += "\n  y = ";
+                genExpr(out, 3, true);
+                out += "\nend";
+                break;
+        }
+        out += '\n';
+    }
+    return out;
+}
+
+static double parse(ZorroVM& vm, const std::string& src, bool useMemo, int iterations, std::string& dump)
+{
+    FileRegistry freg;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < iterations; ++i)
+    {
+        ZParser p(&vm);
+        p.useMemo = useMemo;
+        p.pushReader(freg.newReader(freg.addEntry("bench.zs", src.c_str(), src.length())));
+        p.parse();
+        if(i == 0)
+        {
+            //result is owned by parser
+            dump.clear();
+            p.getResult()->dump(dump);
+        }
+    }
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return d.count() / iterations;
+}
+
+int main(int argc, char* argv[])
+{
+    int lines = argc > 1 ? atoi(argv[1]) : 10000;
+    int iterations = argc > 2 ? atoi(argv[2]) : 5;
+    std::string src = genSource(lines);
+    double mb = static_cast<double>(src.length()) / (1024.0 * 1024.0);
+    ZorroVM vm;
+    std::string plainDump, memoDump;
+    try
+    {
+        printf("%d lines, %.2f MB\n", lines, mb);
+        printf("%-10s %10s %10s\n", "", "ms", "MB/s");
+        double t = parse(vm, src, false, iterations, plainDump);
+        printf("%-10s %10.1f %10.2f\n", "plain", t * 1000.0, mb / t);
+        t = parse(vm, src, true, iterations, memoDump);
+        printf("%-10s %10.1f %10.2f\n", "memo", t * 1000.0, mb / t);
+    } catch(std::exception& e)
+    {
+        printf("exception: %s\n", e.what());
+        return 1;
+    }
+    if(plainDump != memoDump)
+    {
+        printf("syntax trees differ\n");
+        return 1;
+    }
+    return 0;
+}
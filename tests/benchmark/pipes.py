@@ -0,0 +1,38 @@
+import asyncio
+import os
+
+line = b"0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz\n"
+
+async def writer(fd, n):
+  loop = asyncio.get_running_loop()
+  tr, pr = await loop.connect_write_pipe(asyncio.Protocol, os.fdopen(fd, 'wb'))
+  for i in range(n):
+    tr.write(line)
+    if i % 100 == 0:
+      await asyncio.sleep(0.001)
+  tr.close()
+
+async def reader(fd):
+  loop = asyncio.get_running_loop()
+  r = asyncio.StreamReader()
+  await loop.connect_read_pipe(lambda: asyncio.StreamReaderProtocol(r), os.fdopen(fd, 'rb'))
+  cnt = 0
+  while True:
+    d = await r.read(65536)
+    if not d:
+      break
+    cnt += len(d)
+  return cnt
+
+async def main():
+  readers = []
+  writers = []
+  for i in range(200):
+    rfd, wfd = os.pipe()
+    readers.append(asyncio.ensure_future(reader(rfd)))
+    writers.append(asyncio.ensure_future(writer(wfd, 500)))
+  total = sum(await asyncio.gather(*readers))
+  await asyncio.gather(*writers)
+  print(total)
+
+asyncio.run(main())
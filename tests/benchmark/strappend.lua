@@ -0,0 +1,9 @@
+local x=0
+for i=1,100 do
+  local s=""
+  for j=1,100000 do
+    s=s.."hello"
+  end
+  x=x+#s
+end
+print(x)
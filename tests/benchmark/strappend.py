@@ -0,0 +1,10 @@
+def f():
+  x=0
+  for i in range(100):
+    s=""
+    for j in range(100000):
+      s+="hello"
+    x+=len(s)
+  print(x)
+
+f()
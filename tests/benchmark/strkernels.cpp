@@ -0,0 +1,90 @@
+/*
+ Microbenchmark for string kernels.
+ Runs every kernel implementation available on this cpu over the same data,
+ checks that results match the scalar implementation and prints MB/s.
+ Build with -DZORRO_BENCHMARKS=ON, run as zorro-strbench [size] [iterations].
+*/
+#include "ZStrKernels.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <chrono>
+
+using namespace zorro;
+
+static volatile size_t sink;
+
+template<class F>
+static double measure(size_t bytes, int iterations, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < iterations; ++i)
+    {
+        sink = sink + f();
+    }
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(bytes) * iterations / d.count() / (1024.0 * 1024.0);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t size = argc > 1 ? static_cast<size_t>(atol(argv[1])) : 64 * 1024;
+    int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+
+    std::string ascii(size, ' ');
+    uint32_t seed = 12345;
+    for(size_t i = 0; i < size; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        ascii[i] = static_cast<char>('a' + (seed >> 16) % 26);
+    }
+    //the only occurrence of the needle is near the end
+    ascii[size - 20] = '#';
+    std::string needle = ascii.substr(size - 40, 32);
+    std::string other = ascii;
+    other[size - 1] = '!';
+    //two byte cyrillic chars mixed with ascii
+    std::string utf8;
+    while(utf8.size() + 3 <= size)
+    {
+        utf8 += "\xd0\xb6z";
+    }
+    std::vector<uint16_t> wide(size);
+    std::vector<char> narrow(size);
+    std::string upper(size, 0);
+
+    const StrKernels* list[4];
+    size_t cnt = getAvailableStrKernels(list, 4);
+    const StrKernels& ref = *list[0];
+    printf("%-8s %10s %10s %10s %10s %10s %10s %10s\n", "kernels", "find", "mismatch", "toupper", "ascii", "count",
+           "widen", "narrow");
+    for(size_t i = 0; i < cnt; ++i)
+    {
+        const StrKernels& k = *list[i];
+        if(k.find(ascii.data(), size, needle.data(), needle.size()) !=
+           ref.find(ascii.data(), size, needle.data(), needle.size()) ||
+           k.mismatch(ascii.data(), other.data(), size) != size - 1 ||
+           k.countLeadBytes(utf8.data(), utf8.size()) != ref.countLeadBytes(utf8.data(), utf8.size()) ||
+           k.asciiPrefix(ascii.data(), size) != size)
+        {
+            printf("%s: results differ from scalar\n", k.name);
+            return 1;
+        }
+        double find = measure(size, iterations, [&] {
+            return (size_t) k.find(ascii.data(), size, needle.data(), needle.size());
+        });
+        double mismatch = measure(size, iterations, [&] { return k.mismatch(ascii.data(), other.data(), size); });
+        double toUpper = measure(size, iterations, [&] {
+            k.toUpper(&upper[0], ascii.data(), size);
+            return (size_t) upper[0];
+        });
+        double asciiPrefix = measure(size, iterations, [&] { return k.asciiPrefix(ascii.data(), size); });
+        double count = measure(utf8.size(), iterations, [&] { return k.countLeadBytes(utf8.data(), utf8.size()); });
+        double widen = measure(size, iterations, [&] { return k.widenAscii(ascii.data(), size, &wide[0]); });
+        double narrowRate = measure(size, iterations, [&] { return k.narrowAscii(&wide[0], size, &narrow[0]); });
+        printf("%-8s %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f\n", k.name, find, mismatch, toUpper, asciiPrefix,
+               count, widen, narrowRate);
+    }
+    return 0;
+}
@@ -0,0 +1,41 @@
+import asyncio
+
+async def worker(i, out):
+  await asyncio.sleep((i % 10) / 1000)
+  await out.put(i)
+
+async def relay(src, dst):
+  while True:
+    v = await src.get()
+    await dst.put(v + 1)
+    if v < 0:
+      break
+
+async def main():
+  n = 50000
+  out = asyncio.Queue(64)
+  tasks = [asyncio.ensure_future(worker(i, out)) for i in range(n)]
+  s = 0
+  for i in range(n):
+    s += await out.get()
+  print(s)
+  await asyncio.gather(*tasks)
+
+  size = 1000
+  first = asyncio.Queue(1)
+  c = first
+  relays = []
+  for i in range(size):
+    nxt = asyncio.Queue(1)
+    relays.append(asyncio.ensure_future(relay(c, nxt)))
+    c = nxt
+  v = 0
+  for r in range(100):
+    await first.put(v)
+    v = await c.get()
+  await first.put(-size - 1)
+  await c.get()
+  await asyncio.gather(*relays)
+  print(v)
+
+asyncio.run(main())
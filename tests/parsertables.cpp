@@ -0,0 +1,46 @@
+#include "ZorroParser.hpp"
+#include <stdio.h>
+#include <string>
+
+/*
+  Checks that grammar tables compiled into the library
+  match the grammar built from rule strings at runtime.
+*/
+
+using namespace zorro;
+
+int main()
+{
+    std::string runtime, loaded;
+    try
+    {
+        ZParser::Grammar rg;
+        ZParser::buildGrammar(rg);
+        rg.dumpTables(runtime, "ZParser", "zorroParserTables");
+        ZParser::Grammar& tg = ZParser::getGrammar();
+        if(!tg.tables)
+        {
+            fprintf(stderr, "parser tables are not compiled in\n");
+            return 1;
+        }
+        tg.dumpTables(loaded, "ZParser", "zorroParserTables");
+    } catch(std::exception& e)
+    {
+        fprintf(stderr, "exception: %s\n", e.what());
+        return 1;
+    }
+    if(runtime != loaded)
+    {
+        size_t pos = 0;
+        while(pos < runtime.length() && pos < loaded.length() && runtime[pos] == loaded[pos])
+        {
+            ++pos;
+        }
+        size_t start = pos > 80 ? pos - 80 : 0;
+        fprintf(stderr, "parser tables differ from runtime grammar at:\n%s\n---\n%s\n",
+                runtime.substr(start, 160).c_str(), loaded.substr(start, 160).c_str());
+        return 1;
+    }
+    printf("parser tables ok\n");
+    return 0;
+}
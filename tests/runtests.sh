@@ -10,12 +10,63 @@ function run()
   else 
     echo $1.zs ok
   fi
+  runerr $1
+}
+
+#compiler diagnostics printed to stderr, checked only if test has .err file
+function runerr()
+{
+  if [ ! -f $1.err ];then
+    return
+  fi
+  ../build/zorro $1.zs 2>last.txt >/dev/null
+  diff -q $1.err last.txt
+  if [ $? != 0 ];then
+    echo $1.err fail
+    exit
+  else
+    echo $1.err ok
+  fi
+}
+
+#same test compiled by zorroc and loaded from module
+function runmodule()
+{
+  ../build/zorroc -o$1.zc $1.zs 2>/dev/null
+  ../build/zorro $1.zc >last.txt
+  rm -f $1.zc $1.snap
+  diff -q $1.ok last.txt
+  if [ $? != 0 ];then
+    echo $1.zc fail
+    exit
+  else
+    echo $1.zc ok
+  fi
+}
+
+#test that takes snapshot, restored program should print the same
+function runsnapshot()
+{
+  if [ ! -f $1.snap ];then
+    return
+  fi
+  ../build/zorro $1.snap >last.txt
+  rm -f $1.snap
+  diff -q $1.ok last.txt
+  if [ $? != 0 ];then
+    echo $1.snap fail
+    exit
+  else
+    echo $1.snap ok
+  fi
 }
 
 for i in \
   `ls -1 test*.zs|sort`
 do
   run `basename $i .zs`
+  runsnapshot `basename $i .zs`
+  runmodule `basename $i .zs`
 done
 rm -f zorro.log
 rm -f last.txt
@@ -0,0 +1,376 @@
+#include "ZorroVM.hpp"
+#include "ZorroParser.hpp"
+#include "CodeGenerator.hpp"
+#include "CodeOptimizer.hpp"
+#include "MacroExpander.hpp"
+#include "ZBuilder.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+  Runs independent vms in parallel threads.
+  All threads start together, so first vms are created concurrently
+  and race for shared operator matrices and parser grammar.
+  First each vm parses, compiles and runs its own copy of script,
+  then script is compiled once and threads run instances of it,
+  each instance runs several times with reset() in between.
+  Every vm reports result for its own parameter, that is checked here.
+  Run as zorro-vmthreads [threads] [iterations].
+*/
+
+using namespace zorro;
+
+static std::mutex reportsMtx;
+static std::map<ZorroVM*, int64_t> params;
+static std::map<ZorroVM*, int64_t> reports;
+
+static void param(ZorroVM* vm)
+{
+    std::lock_guard<std::mutex> lock(reportsMtx);
+    vm->setResult(IntValue(params[vm]));
+}
+
+static void report(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 1 || vm->getLocalValue(0).vt != vtInt)
+    {
+        throw std::runtime_error("Expected one int argument for report");
+    }
+    std::lock_guard<std::mutex> lock(reportsMtx);
+    reports[vm] = vm->getLocalValue(0).iValue;
+}
+
+static const char* script =
+    "n = param()\n"
+    "func fib(k)\n"
+    "  return k < 2 ? k : fib(k - 1) + fib(k - 2)\n"
+    "end\n"
+    "class Acc(total)\n"
+    "  total\n"
+    "  func add(x)\n"
+    "    total += x\n"
+    "  end\n"
+    "end\n"
+    "acc = Acc(n)\n"
+    "for i in 0..<100\n"
+    "  acc.add(i)\n"
+    "end\n"
+    "m = {=>}\n"
+    "for i in 0..<50\n"
+    "  m{\"k$i\"} = i * n\n"
+    "end\n"
+    "s = 0\n"
+    "for i in 0..<50\n"
+    "  s += m{\"k$i\"}\n"
+    "end\n"
+    "str = \"\"\n"
+    "for i in 0..<20\n"
+    "  str += \"w$i\"\n"
+    "end\n"
+    "func gen()\n"
+    "  for i in 0..<10\n"
+    "    yield i\n"
+    "  end\n"
+    "end\n"
+    "g = 0\n"
+    "for x in gen\n"
+    "  g += x\n"
+    "end\n"
+    "func twice(v)\n"
+    "  return func()\n"
+    "    sched::sleep(1)\n"
+    "    return v * 2\n"
+    "  end\n"
+    "end\n"
+    "t = sched::spawn(twice(n))\n"
+    "class Boom(code)\n"
+    "  code\n"
+    "end\n"
+    "func risky(v)\n"
+    "  throw Boom(v)\n"
+    "end\n"
+    "caught = 0\n"
+    "try\n"
+    "  risky(n + 1)\n"
+    "catch in e\n"
+    "  caught = e.code\n"
+    "end\n"
+    "mt = \"ab42cd\" =~ `([0-9]+)`\n"
+    "ch = sched::Channel(4)\n"
+    "sched::send(ch, n)\n"
+    "report(fib(15) + acc.total + s + g + #str + sched::join(t) + caught + #Acc.getName() + #mt[1] +\n"
+    "       sched::recv(ch))\n";
+
+static int64_t expected(int64_t n)
+{
+    //fib(15) + acc + map sum + generator sum + string length + task result + exception + class name + match + channel
+    int64_t strLen = 10 * 2 + 10 * 3;
+    return 610 + (n + 4950) + 1225 * n + 45 + strLen + n * 2 + (n + 1) + 3 + 2 + n;
+}
+
+static void compile(ZorroVM& vm, FileRegistry& freg)
+{
+    ZBuilder zb(&vm);
+    zb.registerCFunc("param", param);
+    zb.registerCFunc("report", report);
+    ZParser p(&vm);
+    ZMacroExpander mex;
+    mex.init(&vm, &p);
+    p.l.macroExpander = &mex;
+    p.pushReader(freg.newReader(freg.addEntry("thread.zs", script, strlen(script))));
+    p.parse();
+    CodeGenerator cg(&vm);
+    cg.generate(p.getResult());
+    cg.inferTypes(p.getResult());
+    cg.hoistInvariants();
+    cg.specializeNumOps();
+    CodeOptimizer opt(&vm);
+    opt.optimize();
+}
+
+static bool check(ZorroVM& vm, int64_t n, std::string& err)
+{
+    int64_t res;
+    {
+        std::lock_guard<std::mutex> lock(reportsMtx);
+        params.erase(&vm);
+        auto it = reports.find(&vm);
+        if(it == reports.end())
+        {
+            err = "no result reported";
+            return false;
+        }
+        res = it->second;
+        reports.erase(it);
+    }
+    if(res != expected(n))
+    {
+        err = "result " + std::to_string(res) + " expected " + std::to_string(expected(n));
+        return false;
+    }
+    return true;
+}
+
+static void setParam(ZorroVM& vm, int64_t n)
+{
+    std::lock_guard<std::mutex> lock(reportsMtx);
+    params[&vm] = n;
+}
+
+static bool run(ZorroVM& vm, int64_t n, std::string& err)
+{
+    setParam(vm, n);
+    try
+    {
+        vm.init();
+        vm.run();
+        vm.deinit();
+    } catch(std::exception& e)
+    {
+        err = e.what();
+        return false;
+    }
+    return check(vm, n, err);
+}
+
+static bool compileAndRun(int64_t n, std::string& err)
+{
+    FileRegistry freg;
+    ZorroVM vm;
+    try
+    {
+        compile(vm, freg);
+    } catch(std::exception& e)
+    {
+        err = e.what();
+        return false;
+    }
+    return run(vm, n, err);
+}
+
+static ZorroVM* program;
+
+static bool runInstance(int64_t n, std::string& err)
+{
+    ZorroVM vm(program);
+    return run(vm, n, err);
+}
+
+static bool runInstanceWithReset(int64_t n, std::string& err)
+{
+    ZorroVM vm(program);
+    try
+    {
+        vm.init();
+        for(int64_t k = n; k < n + 3; ++k)
+        {
+            setParam(vm, k);
+            vm.run();
+            if(!check(vm, k, err))
+            {
+                return false;
+            }
+            vm.reset();
+        }
+        vm.deinit();
+    } catch(std::exception& e)
+    {
+        err = e.what();
+        return false;
+    }
+    return true;
+}
+
+//first run with parameter 7 builds table and reset point is marked after it, following runs must start from that state
+static const char* resetScript =
+    "if param() == 7\n"
+    "  table = [1, 2, 3]\n"
+    "  index = {=>}\n"
+    "  index{\"t\"} = table\n"
+    "  name = \"tbl\"\n"
+    "end\n"
+    "table[#table] = param()\n"
+    "index{name} = table\n"
+    "report(#table * 1000 + table[3] * 10 + #index{\"t\"} + #index)\n";
+
+static int64_t takeReport(ZorroVM& vm)
+{
+    std::lock_guard<std::mutex> lock(reportsMtx);
+    int64_t rv = reports[&vm];
+    reports.erase(&vm);
+    return rv;
+}
+
+static bool checkReset()
+{
+    FileRegistry freg;
+    ZorroVM vm;
+    ZBuilder zb(&vm);
+    zb.registerCFunc("param", param);
+    zb.registerCFunc("report", report);
+    try
+    {
+        ZParser p(&vm);
+        p.pushReader(freg.newReader(freg.addEntry("reset.zs", resetScript, strlen(resetScript))));
+        p.parse();
+        CodeGenerator cg(&vm);
+        cg.generate(p.getResult());
+        CodeOptimizer opt(&vm);
+        opt.optimize();
+        vm.init();
+        setParam(vm, 7);
+        vm.run();
+        //table is [1, 2, 3, 7] and two keys of index refer to it
+        int64_t res = takeReport(vm);
+        if(res != 4000 + 70 + 4 + 2)
+        {
+            fprintf(stderr, "reset: first run result %lld\n", (long long) res);
+            return false;
+        }
+        vm.markResetPoint();
+        vm.reset();
+        for(int64_t n = 20; n < 23; ++n)
+        {
+            setParam(vm, n);
+            vm.run();
+            res = takeReport(vm);
+            //one item is added to marked table every time, it's still shared by index
+            if(res != 5000 + 70 + 5 + 2)
+            {
+                fprintf(stderr, "reset: run %lld result %lld\n", (long long) n, (long long) res);
+                return false;
+            }
+            vm.reset();
+        }
+        vm.deinit();
+    } catch(std::exception& e)
+    {
+        fprintf(stderr, "reset: %s\n", e.what());
+        return false;
+    }
+    printf("reset to marked state ok\n");
+    return true;
+}
+
+static bool runThreads(const char* mode, bool (* func)(int64_t, std::string&), int threadsCount, int iterations)
+{
+    std::atomic<int> waiting(threadsCount);
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < threadsCount; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            --waiting;
+            while(waiting.load())
+            {
+                std::this_thread::yield();
+            }
+            for(int j = 0; j < iterations; ++j)
+            {
+                std::string err;
+                if(!func(i * 100 + j, err))
+                {
+                    fprintf(stderr, "%s, thread %d iteration %d: %s\n", mode, i, j, err.c_str());
+                    ++failures;
+                    return;
+                }
+            }
+        });
+    }
+    for(auto& t : threads)
+    {
+        t.join();
+    }
+    if(failures.load())
+    {
+        return false;
+    }
+    printf("%s: %d vms on %d threads ok\n", mode, threadsCount * iterations, threadsCount);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    int threadsCount = argc > 1 ? atoi(argv[1]) : 8;
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+    if(!runThreads("compiled by each vm", compileAndRun, threadsCount, iterations))
+    {
+        return 1;
+    }
+    FileRegistry freg;
+    ZorroVM prog;
+    try
+    {
+        compile(prog, freg);
+    } catch(std::exception& e)
+    {
+        fprintf(stderr, "exception: %s\n", e.what());
+        return 1;
+    }
+    prog.shareCode();
+    program = &prog;
+    if(!runThreads("shared code", runInstance, threadsCount, iterations))
+    {
+        return 1;
+    }
+    if(!runThreads("reset instances", runInstanceWithReset, threadsCount, iterations))
+    {
+        return 1;
+    }
+    //program vm can run its code too
+    std::string err;
+    if(!run(prog, 1, err))
+    {
+        fprintf(stderr, "program vm: %s\n", err.c_str());
+        return 1;
+    }
+    return checkReset() ? 0 : 1;
+}
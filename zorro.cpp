@@ -7,9 +7,12 @@
 #include "ZorroParser.hpp"
 #include "ZorroVM.hpp"
 #include "CodeGenerator.hpp"
+#include "CodeOptimizer.hpp"
+#include "CodeModule.hpp"
 #include "Debug.hpp"
 #include "ZBuilder.hpp"
 #include <clocale>
+#include <chrono>
 
 #include "Debugger.hpp"
 #include "ZVMOps.hpp"
@@ -162,18 +165,27 @@ static void input(ZorroVM* vm)
     {
         fflush(stdout);
     }
+    //whole line is read, so multibyte chars are never split between chunks
+    std::string line;
     char buf[256];
-    if(!fgets(buf, sizeof(buf) - 1, stdin))
+    while(fgets(buf, sizeof(buf), stdin))
+    {
+        line += buf;
+        if(line.back() == 0x0a)
+        {
+            break;
+        }
+    }
+    if(line.empty())
     {
         return;
     }
-    int l = strlen(buf);
-    while(l > 0 && (buf[l - 1] == 0x0a || buf[l - 1] == 0x0d))
+    size_t l = line.length();
+    while(l > 0 && (line[l - 1] == 0x0a || line[l - 1] == 0x0d))
     {
         --l;
     }
-    buf[l] = 0;
-    vm->setResult(StringValue(vm->allocZString(buf, l)));
+    vm->setResult(StringValue(vm->allocZString(line.c_str(), static_cast<uint32_t>(l))));
 }
 
 static void memreport(ZorroVM* vm)
@@ -366,6 +378,9 @@ std::string dumpTypeInfo(TypeInfo& ti)
     if(ti.ts == tsUnknown)
     {
         return "Unknown";
+    } else if(ti.ts == tsAny)
+    {
+        return "Any";
     } else if(ti.ts == tsDefined)
     {
         if(ti.vt == vtObject)
@@ -450,6 +465,39 @@ static void ShowTypeInfo(ZorroVM* vm)
     }
 }
 
+static ModuleWriter* snapshotWriter;
+
+/* snapshot(fileName) saves state of running program, loaded snapshot continues after this call */
+static void snapshot(ZorroVM* vm)
+{
+    if(vm->getArgsCount() != 1 || vm->getLocalValue(0).vt != vtString)
+    {
+        throw std::runtime_error("snapshot:file name expected");
+    }
+    snapshotWriter->writeSnapshotFile(ZStringRef(vm, vm->getLocalValue(0).str).c_str());
+}
+
+/* wall time of compile phases, printed to stderr with -s */
+struct PhaseTimer {
+    bool enabled;
+    std::chrono::steady_clock::time_point start;
+
+    explicit PhaseTimer(bool argEnabled) : enabled(argEnabled), start(std::chrono::steady_clock::now())
+    {
+    }
+
+    void done(const char* phase)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if(enabled)
+        {
+            std::chrono::duration<double, std::milli> d = now - start;
+            fprintf(stderr, "%-16s %10.3f ms\n", phase, d.count());
+        }
+        start = now;
+    }
+};
+
 int main(int argc, char* argv[])
 {
     std::setlocale(LC_CTYPE, "");
@@ -489,6 +537,10 @@ int main(int argc, char* argv[])
         zb.registerCFunc("input", input);
         zb.registerCFunc("memreport", memreport);
         zb.registerCFunc("showTypeInfo", ShowTypeInfo);
+        zb.registerCFunc("snapshot", snapshot);
+        //remembers natives, only what compilation or loading adds is written
+        ModuleWriter writer(&vm);
+        snapshotWriter = &writer;
 
         ZParser p(&vm);
         ZMacroExpander mex;
@@ -496,13 +548,45 @@ int main(int argc, char* argv[])
         p.l.macroExpander = &mex;
         const char* fileName = "test.zs";
         bool debugMode = false;
+        bool showStats = false;
+        bool dumpIR = false;
+        std::vector<std::string> skipPasses;
+#ifdef ZORRO_COMPILER
+        std::string outFileName;
+#endif
         for(int i = 1; i < argc; ++i)
         {
             if(argv[i][0] == '-')
             {
+#ifdef ZORRO_COMPILER
+                if(argv[i][1] == 'o')
+                {
+                    if(argv[i][2])
+                    {
+                        outFileName = argv[i] + 2;
+                    } else if(i + 1 < argc)
+                    {
+                        outFileName = argv[++i];
+                    } else
+                    {
+                        fprintf(stderr, "Output file name expected after -o\n");
+                        return 1;
+                    }
+                    continue;
+                }
+#endif
                 if(argv[i][1] == 'd')
                 {
                     debugMode = true;
+                } else if(argv[i][1] == 's')
+                {
+                    showStats = true;
+                } else if(argv[i][1] == 'i')
+                {
+                    dumpIR = true;
+                } else if(argv[i][1] == 'n')
+                {
+                    skipPasses.push_back(argv[i] + 2);
                 } else
                 {
                     fprintf(stderr, "Unknown option %s", argv[i]);
@@ -513,6 +597,37 @@ int main(int argc, char* argv[])
                 fileName = argv[i];
             }
         }
+        PhaseTimer timer(showStats);
+#ifdef ZORRO_COMPILER
+        if(outFileName.empty())
+        {
+            outFileName = fileName;
+            size_t ext = outFileName.rfind(".zs");
+            if(ext != std::string::npos && ext == outFileName.length() - 3)
+            {
+                outFileName.erase(ext);
+            }
+            outFileName += ".zc";
+        }
+#else
+        if(ModuleLoader::isModule(fileName))
+        {
+            if(debugMode)
+            {
+                fprintf(stderr, "Debugger requires source file, %s is compiled module.\n", fileName);
+                return 1;
+            }
+            ModuleLoader loader(&vm, &freg);
+            loader.load(fileName);
+            timer.done("load");
+            vm.init();
+            loader.restoreStack();
+            vm.run(loader.getResumeOp());
+            timer.done("run");
+            vm.deinit();
+            return 0;
+        }
+#endif
         FileRegistry::Entry* e = freg.openFile(fileName);
         if(!e)
         {
@@ -522,19 +637,60 @@ int main(int argc, char* argv[])
         auto* fr = freg.newReader(e);
         p.pushReader(fr);
         p.parse();
+        timer.done("parse");
         CodeGenerator cg(&vm);
         cg.generate(p.getResult());
-        cg.fillTypes(p.getResult());
-        cg.fillTypes(p.getResult());
+        timer.done("generate");
+        cg.inferTypes(p.getResult());
+        timer.done("infer types");
+        cg.hoistInvariants();
+        timer.done("hoist");
+        cg.specializeNumOps();
+        timer.done("specialize");
+        CodeOptimizer opt(&vm);
+        for(auto& name : skipPasses)
+        {
+            if(!opt.passes.disable(name))
+            {
+                fprintf(stderr, "Unknown pass %s\n", name.c_str());
+                return 1;
+            }
+        }
+        opt.optimize();
+        timer.done("optimize");
+        if(dumpIR)
+        {
+            std::string out;
+            opt.module.dump(out);
+            fputs(out.c_str(), stderr);
+        }
+        if(showStats)
+        {
+            fprintf(stderr, "Type inference unit passes: %u\n", (unsigned) cg.typePasses);
+            fprintf(stderr, "Specialized numeric ops: %u of %u\n", (unsigned) cg.numOpsSpecialized,
+                    (unsigned) cg.numOpsTotal);
+            fprintf(stderr, "Hoisted loop invariants: %u of %u\n", (unsigned) cg.invariantsHoisted,
+                    (unsigned) cg.invariantsTotal);
+            for(auto& ps : opt.passes.stats)
+            {
+                fprintf(stderr, "Pass %-14s %6u changes %10.3f ms\n", ps.name, (unsigned) ps.changes, ps.ms);
+            }
+            fprintf(stderr, "Removed ops: %u\n", (unsigned) opt.removedOps);
+        }
         for(CodeGenerator::WarnVector::iterator it = cg.warnings.begin(), end = cg.warnings.end(); it != end; ++it)
         {
             fprintf(stderr, "%s Warning: %s\n", it->pos.backTrace().c_str(), it->msg.c_str());
         }
+#ifdef ZORRO_COMPILER
+        writer.writeFile(outFileName);
+        timer.done("write");
+#else
         vm.init();
         //try{
         if(!debugMode)
         {
             vm.run();
+            timer.done("run");
         } else
         {
             Debugger dbg(&vm, p.getResult());
@@ -577,6 +733,7 @@ int main(int argc, char* argv[])
                 }
             }
         }
+#endif
         /*}catch(...)
         {
           ZorroVM::StackTraceVector trace;